@@ -0,0 +1,143 @@
+# Throughput benchmarks for mruby-onig-regexp.
+#
+# Run with the mruby binary of a build that includes this gem plus
+# mruby-time (and optionally mruby-objectspace for allocation counts):
+#
+#   mruby bench/bench.rb [--time SECONDS] [--filter SUBSTRING] [--text]
+#
+# Results are printed as JSON (one object per benchmark and input) so they
+# can be stored and compared between revisions; --text prints a table.
+
+class OnigRegexpBench
+  INPUTS = {
+    'small' => 'user: alice@example.com id=42 time=2016-04-01T12:34:56',
+    'large' => ('user: alice@example.com id=42 time=2016-04-01T12:34:56 ' +
+                'lorem ipsum dolor sit amet, consectetur adipiscing elit ') * 512,
+    'utf8'  => ('ユーザー: 山田太郎 <yamada@example.jp> 番号=42 ' +
+                'ÅÄÖ ñandú ελληνικά 한국어 ') * 256,
+  }
+
+  WORD = OnigRegexp.new('\w+')
+  DIGITS = OnigRegexp.new('\d+')
+  EMAIL = OnigRegexp.new('(?<user>[a-z]+)@(?<host>[a-z.]+)')
+  SPACE = OnigRegexp.new('\s+')
+  MISSING = OnigRegexp.new('zzz[0-9]+')
+  VOWEL = OnigRegexp.new('[aeiou]')
+  VOWEL_MAP = { 'a' => '4', 'e' => '3', 'i' => '1', 'o' => '0', 'u' => 'v' }
+
+  BENCHMARKS = [
+    ['match',            lambda { |s| EMAIL.match(s) }],
+    ['match (miss)',     lambda { |s| MISSING.match(s) }],
+    ['match?',           lambda { |s| EMAIL.match?(s) }],
+    ['=~',               lambda { |s| DIGITS =~ s }],
+    ['gsub (string)',    lambda { |s| s.gsub(DIGITS, '#') }],
+    ['gsub (backref)',   lambda { |s| s.gsub(EMAIL, '\k<host>') }],
+    ['gsub (hash)',      lambda { |s| s.gsub(VOWEL, VOWEL_MAP) }],
+    ['gsub (block)',     lambda { |s| s.gsub(DIGITS) { |m| m } }],
+    ['sub',              lambda { |s| s.sub(DIGITS, '#') }],
+    ['scan',             lambda { |s| s.scan(WORD) }],
+    ['split (regexp)',   lambda { |s| s.split(SPACE) }],
+    ['split (empty)',    lambda { |s| s.split(OnigRegexp.new('')) }],
+    ['split (literal)',  lambda { |s| s.split(' ') }],
+    ['String#[]',        lambda { |s| s[DIGITS] }],
+    ['String#index',     lambda { |s| s.index(DIGITS) }],
+    ['named captures',   lambda { |s| m = EMAIL.match(s); m && m['host'] }],
+    ['escape',           lambda { |s| OnigRegexp.escape(s) }],
+  ]
+
+  def initialize(args)
+    @seconds = 0.5
+    @filter = nil
+    @text = false
+    until args.empty?
+      case arg = args.shift
+      when '--time' then @seconds = args.shift.to_f
+      when '--filter' then @filter = args.shift
+      when '--text' then @text = true
+      else raise ArgumentError, "unknown option: #{arg}"
+      end
+    end
+  end
+
+  def allocated_objects
+    return nil unless Object.const_defined?(:ObjectSpace) && ObjectSpace.respond_to?(:count_objects)
+    counts = ObjectSpace.count_objects
+    counts[:TOTAL] - counts[:FREE]
+  end
+
+  # Objects allocated by a single call, measured with the GC disabled so
+  # that nothing is reclaimed while counting.
+  def allocations_per_op(body, input)
+    GC.start
+    GC.disable
+    before = allocated_objects
+    return nil unless before
+    body.call(input)
+    allocated_objects - before
+  ensure
+    GC.enable
+  end
+
+  def ops_per_second(body, input)
+    iterations = 1
+    loop do
+      started = Time.now
+      i = 0
+      while i < iterations
+        body.call(input)
+        i += 1
+      end
+      elapsed = Time.now - started
+      if elapsed >= @seconds
+        return [iterations / elapsed, iterations]
+      end
+      iterations *= elapsed > 0 ? [(@seconds / elapsed * 1.2).ceil, 2].max : 10
+    end
+  end
+
+  def run
+    results = []
+    BENCHMARKS.each do |name, body|
+      next if @filter && !name.include?(@filter)
+      INPUTS.each do |input_name, input|
+        body.call(input) # warm up (lazy compilation, caches)
+        ops, iterations = ops_per_second(body, input)
+        results << {
+          'name' => name, 'input' => input_name, 'input_bytes' => input.bytesize,
+          'iterations' => iterations, 'ops_per_sec' => ops,
+          'allocations_per_op' => allocations_per_op(body, input),
+        }
+      end
+    end
+    @text ? print_text(results) : print_json(results)
+  end
+
+  def print_text(results)
+    results.each do |r|
+      puts "#{r['name'].ljust(18)} #{r['input'].ljust(6)} " +
+           "#{format('%14.1f', r['ops_per_sec'])} ops/s " +
+           "#{r['allocations_per_op'].nil? ? '-' : r['allocations_per_op']} allocs/op"
+    end
+  end
+
+  def print_json(results)
+    puts '['
+    results.each_with_index do |r, i|
+      fields = r.map { |k, v| "#{json(k)}: #{json(v)}" }
+      puts "  {#{fields.join(', ')}}#{i + 1 < results.size ? ',' : ''}"
+    end
+    puts ']'
+  end
+
+  def json(v)
+    case v
+    when nil then 'null'
+    when Float then format('%.3f', v)
+    when Integer then v.to_s
+    else
+      '"' + v.to_s.gsub(OnigRegexp.new('["\\\\]')) { |c| "\\#{c}" } + '"'
+    end
+  end
+end
+
+OnigRegexpBench.new(ARGV.dup).run
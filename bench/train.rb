@@ -0,0 +1,113 @@
+# Profile training run for MRUBY_ONIG_REGEXP_PGO=generate builds.
+#
+#   mruby bench/train.rb [ROUNDS]
+#
+# Runs a fixed mix of patterns over a small corpus of log lines, CSV,
+# source code and multilingual text, so that the recorded profile covers
+# the paths typical programs take through Onigmo and this gem (literal
+# scans, character classes, alternations, captures, backtracking,
+# case-insensitive and UTF-8 matching) in proportions close to the
+# benchmarks of bench.rb. It prints a checksum and needs no other gems.
+
+class OnigRegexpTraining
+  CORPUS = {
+    'log' => (<<-'LOG') * 64,
+2016-04-01T12:34:56Z INFO  web.1 GET /users/42/profile?tab=activity 200 12.3ms ip=10.0.3.17 ua="Mozilla/5.0"
+2016-04-01T12:34:57Z WARN  web.2 POST /api/v1/orders 422 48.0ms ip=192.168.1.9 error="invalid quantity"
+2016-04-01T12:34:58Z ERROR worker.3 job=MailerJob id=9f3c2a attempts=3 exception=Net::ReadTimeout
+2016-04-01T12:35:01Z DEBUG cache hit key=session:alice@example.com ttl=3600
+    LOG
+    'csv' => (<<-'CSV') * 64,
+id,name,email,amount,created_at
+1,"Smith, John",john.smith@example.com,1234.50,2016-03-31
+2,Jane Doe,jane@example.org,-17.00,2016-04-01
+3,"O""Brien, Pat",pat@example.net,0.99,2016-04-02
+    CSV
+    'code' => (<<-'CODE') * 32,
+def parse(source, pos = 0)
+  # skip leading whitespace and comments
+  while pos < source.size && source[pos] =~ /\s/
+    pos += 1
+  end
+  token = source[pos, 16].to_s.match(/\A(?:[A-Za-z_]\w*|\d+(?:\.\d+)?|"(?:\\.|[^"])*"|[-+*\/=<>!]=?)/)
+  return [:eof, nil] unless token
+  [classify(token[0]), token[0]]
+end
+    CODE
+    'utf8' => (<<-'TEXT') * 64,
+ユーザー: 山田太郎 <yamada@example.jp> 番号=42 東京都千代田区
+Ελληνικά: Καλημέρα κόσμε — ñandú, façade, Ångström, Straße, Œuvre
+한국어 문장입니다. Привет, мир! Zürich 8001, Москва 101000
+    TEXT
+  }
+
+  PATTERNS = [
+    ['\d+',                                    0],
+    ['\w+',                                    0],
+    ['\s+',                                    0],
+    ['[aeiou]',                                0],
+    ['(?<user>[a-z.]+)@(?<host>[a-z.]+)',      0],
+    ['\d{4}-\d{2}-\d{2}(?:T\d{2}:\d{2}:\d{2}Z)?', 0],
+    ['(GET|POST|PUT|DELETE) (\S+) (\d{3})',    0],
+    ['ERROR|WARN|exception',                   0],
+    ['error',                                  OnigRegexp::IGNORECASE],
+    ['"(?:[^"]|"")*"|[^,\n]*',                 0],
+    ['^\s*#.*$',                               0],
+    ['\b(def|return|while|unless|end)\b',      0],
+    ['(\w+)\s*=\s*\1',                         0],
+    ['(?<=ip=)\d+(?:\.\d+){3}',                0],
+    ['\p{Han}+|\p{Hiragana}+|\p{Katakana}+',   0],
+    ['[[:upper:]][[:lower:]]+',                0],
+    ['zzz[0-9]+',                              0],
+    ['(a|b|c|d|e)+x',                          0],
+  ]
+
+  def initialize(rounds)
+    @rounds = rounds
+    @regexps = PATTERNS.map { |src, opts| OnigRegexp.new(src, opts) }
+    @keywords = OnigRegexp::LiteralSet.new(%w(error warn timeout example invalid), ignorecase: true)
+    @checksum = 0
+  end
+
+  def run
+    @rounds.times do
+      CORPUS.each_value do |text|
+        lines = text.split("\n")
+        @regexps.each do |re|
+          @checksum += re.match?(text) ? 1 : 0
+          @checksum += text.scan(re).size
+          @checksum += text.gsub(re, '#').size
+          @checksum += re.count(text)
+          lines.each do |line|
+            m = re.match(line)
+            @checksum += m.begin(0) if m
+          end
+        end
+        @checksum += text.split(@regexps[2]).size
+        @checksum += text.sub(@regexps[0]) { |d| d * 2 }.size
+        @checksum += @keywords.scan(text).size
+        tokenize(text)
+      end
+    end
+    puts "checksum #{@checksum}"
+  end
+
+  TOKEN = OnigRegexp.new('\w+')
+  SPACE = OnigRegexp.new('\s+')
+  OTHER = OnigRegexp.new('.', OnigRegexp::MULTILINE)
+
+  def tokenize(text)
+    s = OnigStringScanner.new(text)
+    until s.eos?
+      if s.skip(SPACE)
+        next
+      elsif s.scan(TOKEN)
+        @checksum += 1
+      else
+        s.skip(OTHER)
+      end
+    end
+  end
+end
+
+OnigRegexpTraining.new(ARGV.empty? ? 20 : ARGV[0].to_i).run
@@ -81,8 +81,19 @@ class String
   end
 
   # ISO 15.2.10.5.27
-  def match(re, pos=0, &block)
-    re.match(self, pos, &block)
+  def match(re, pos=0, stop=nil, **opts, &block)
+    re.match(self, pos, stop, **opts, &block)
+  end
+
+  # The first +n+ results of scan, without searching further.
+  def first_matches(re, n)
+    onig_regexp_scan(re, limit: n)
+  end
+
+  # Yields the fields of split(pattern, limit) as they are found instead of
+  # collecting them, or with offsets: true their begin and end byte offsets.
+  def each_split(pattern=nil, limit=0, offsets: false, intern: nil, &block)
+    onig_regexp_split(pattern, limit, offsets: offsets, intern: intern, &block)
   end
 
 
@@ -22,6 +22,11 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <memory.h>
@@ -34,6 +39,9 @@ THE SOFTWARE.
 #include <mruby/data.h>
 #include <mruby/variable.h>
 #include <mruby/presym.h>
+#ifdef MRB_ONIG_REGEXP_STATS
+#include <mruby/gc.h>
+#endif
 #ifdef _MSC_VER
 #define ONIG_EXTERN extern
 #endif
@@ -44,6 +52,34 @@ THE SOFTWARE.
 #else
 #include "oniguruma.h"
 #endif
+#include "onig_regexp_ast.h"
+#include "onig_regexp_ac.h"
+#include "onig_regexp_file.h"
+#ifdef MRB_ONIG_REGEXP_COUNTING_ALLOC
+#include "onig_regexp_alloc.h"
+#endif
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+#include "onig_regexp_dfa.h"
+#endif
+#ifdef MRB_ONIG_REGEXP_PCRE2
+#include "onig_regexp_pcre2.h"
+#endif
+#ifndef MRB_ONIG_REGEXP_NO_SHARED_REGISTRY
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+#ifdef MRB_ONIG_REGEXP_STATS
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#endif
 
 #ifdef MRUBY_VERSION
 #define mrb_args_int mrb_int
@@ -53,10 +89,13 @@ THE SOFTWARE.
 
 // Symbol and class lookups.
 //
-// By default everything is resolved per call against the mrb_state actually in
-// use: the special $-variable symbols via mrb_intern_lit(), and the OnigRegexp /
-// OnigMatchData classes via mrb_class_get_id() (an O(1) hash lookup). This is
-// the only multi-mrb_state-safe option:
+// The special $-variable symbols, the OnigRegexp / OnigMatchData classes and
+// the set_global_variables flag are kept in an onig_regexp_state. By default
+// there is one per mrb_state, created by gem_init and hung off the Object
+// class under a hidden (non-@) instance variable, so fetching it is a single
+// iv lookup per call instead of a mrb_intern() for every symbol and a
+// mrb_class_get_id() for every class. This is safe with any number of
+// mrb_states:
 //   - An RClass* is a per-mrb_state heap pointer, so caching it in a process
 //     global means another VM's gem_init overwrites it and every other VM then
 //     reads the wrong (or freed) class object.
@@ -65,48 +104,45 @@ THE SOFTWARE.
 //     write-write data race when several VMs run mrb_open() concurrently.
 // See issue #129.
 //
-// Defining MRB_ONIG_REGEXP_CACHE caches both in process globals to shave off the
-// per-call lookups. This is ONLY safe when the whole process uses a single
-// mrb_state (no mruby-thread, sandboxing, snapshotting, etc.).
+// The Regexp constant is still looked up per match since scripts may rebind
+// it at any time.
+//
+// Defining MRB_ONIG_REGEXP_CACHE uses a single process-global state instead to
+// shave off the remaining lookup. This is ONLY safe when the whole process
+// uses a single mrb_state (no mruby-thread, sandboxing, snapshotting, etc.).
+typedef struct onig_regexp_state {
+  mrb_sym sym_dollar_tilde;       // $~
+  mrb_sym sym_dollar_ampersand;   // $&
+  mrb_sym sym_dollar_backtick;    // $`
+  mrb_sym sym_dollar_quote;       // $'
+  mrb_sym sym_dollar_plus;        // $+
+  mrb_sym sym_dollar_semicolon;   // $;
+  mrb_sym sym_dollar_numbers[10]; // $0 to $9
+  struct RClass* cls_onig_regexp;
+  struct RClass* cls_onig_match_data;
+  mrb_bool set_global_variables;
+  mrb_bool strict;                // reject patterns onig_ast_analyze() flags
+} onig_regexp_state;
+
 #ifdef MRB_ONIG_REGEXP_CACHE
-static mrb_sym sym_dollar_tilde;       // $~
-static mrb_sym sym_dollar_ampersand;   // $&
-static mrb_sym sym_dollar_backtick;    // $`
-static mrb_sym sym_dollar_quote;       // $'
-static mrb_sym sym_dollar_plus;        // $+
-static mrb_sym sym_dollar_semicolon;   // $;
-static mrb_sym sym_dollar_numbers[10]; // $0 to $9
-static struct RClass* cls_onig_regexp_cache;
-static struct RClass* cls_onig_match_data_cache;
-#define ONIG_SYM_TILDE(mrb)            sym_dollar_tilde
-#define ONIG_SYM_AMPERSAND(mrb)        sym_dollar_ampersand
-#define ONIG_SYM_BACKTICK(mrb)         sym_dollar_backtick
-#define ONIG_SYM_QUOTE(mrb)            sym_dollar_quote
-#define ONIG_SYM_PLUS(mrb)             sym_dollar_plus
-#define ONIG_SYM_SEMICOLON(mrb)        sym_dollar_semicolon
-#define ONIG_SYM_NUMBER(mrb, idx)      sym_dollar_numbers[(idx)]
-#define ONIG_REGEXP_CLASS(mrb)         cls_onig_regexp_cache
-#define ONIG_MATCH_DATA_CLASS(mrb)     cls_onig_match_data_cache
-#define ONIG_CACHE_REGEXP_CLASS(c)     (cls_onig_regexp_cache = (c))
-#define ONIG_CACHE_MATCH_DATA_CLASS(c) (cls_onig_match_data_cache = (c))
+static onig_regexp_state onig_regexp_global_state;
+#define ONIG_STATE(mrb) (&onig_regexp_global_state)
 #else
-#define ONIG_SYM_TILDE(mrb)            mrb_intern_lit((mrb), "$~")
-#define ONIG_SYM_AMPERSAND(mrb)        mrb_intern_lit((mrb), "$&")
-#define ONIG_SYM_BACKTICK(mrb)         mrb_intern_lit((mrb), "$`")
-#define ONIG_SYM_QUOTE(mrb)            mrb_intern_lit((mrb), "$'")
-#define ONIG_SYM_PLUS(mrb)             mrb_intern_lit((mrb), "$+")
-#define ONIG_SYM_SEMICOLON(mrb)        mrb_intern_lit((mrb), "$;")
-#define ONIG_SYM_NUMBER(mrb, idx)      onig_dollar_number_sym((mrb), (idx))
-#define ONIG_REGEXP_CLASS(mrb)         mrb_class_get_id((mrb), MRB_SYM(OnigRegexp))
-#define ONIG_MATCH_DATA_CLASS(mrb)     mrb_class_get_id((mrb), MRB_SYM(OnigMatchData))
-#define ONIG_CACHE_REGEXP_CLASS(c)     ((void)0)
-#define ONIG_CACHE_MATCH_DATA_CLASS(c) ((void)0)
+static void
+onig_regexp_state_free(mrb_state* mrb, void* p) {
+  mrb_free(mrb, p);
+}
+
+static struct mrb_data_type mrb_onig_regexp_state_type = {
+  "OnigRegexpState", onig_regexp_state_free
+};
 
-static mrb_sym
-onig_dollar_number_sym(mrb_state* mrb, int idx) {
-  char const n[] = { '$', (char)('0' + idx) };
-  return mrb_intern(mrb, n, 2);
+static onig_regexp_state*
+onig_regexp_state_get(mrb_state* mrb) {
+  mrb_value const st = mrb_obj_iv_get(mrb, (struct RObject*)mrb->object_class, MRB_SYM(onig_regexp_state));
+  return (onig_regexp_state*)mrb_data_get_ptr(mrb, st, &mrb_onig_regexp_state_type);
 }
+#define ONIG_STATE(mrb) onig_regexp_state_get(mrb)
 #endif
 
 static const char utf8len_codepage[256] =
@@ -139,505 +175,2254 @@ utf8len(const char* p, const char* e)
   return len;
 }
 
-static void
-onig_regexp_free(mrb_state *mrb, void *p) {
-  onig_free((OnigRegex) p);
-}
-
-static struct mrb_data_type mrb_onig_regexp_type = {
-  "PosixRegexp", onig_regexp_free
+// Alternative compilations of a pattern, combined as bit flags. Each is
+// only made for patterns where it finds exactly what the primary one does.
+enum {
+  ONIG_VARIANT_ASCII = 1,      // ASCII-8BIT, for subjects of 7-bit bytes
+  ONIG_VARIANT_NO_CAPTURE = 2, // ONIG_OPTION_DONT_CAPTURE_GROUP, for yes/no searches
+  ONIG_VARIANT_COUNT = 4
 };
 
-#define ONIG_REGEXP_P(obj) \
-  ((mrb_type(obj) == MRB_TT_DATA) && (DATA_TYPE(obj) == &mrb_onig_regexp_type))
-
-static void
-match_data_free(mrb_state* mrb, void* p) {
-  (void)mrb;
-  onig_region_free((OnigRegion*)p, 1);
-}
-
-static struct mrb_data_type mrb_onig_region_type = {
-  "OnigRegion", match_data_free
-};
+// Shared compiled-pattern registry.
+//
+// A compiled OnigRegex is never modified after onig_new() returns, so every
+// OnigRegexp with the same (source, options, encoding, syntax) can use the
+// same program, even across mrb_states. Entries live in a process-wide hash
+// table, are reference counted by the OnigRegexp objects using them and are
+// freed when the last one is garbage collected. The table is guarded by a
+// process-wide lock; since onig_new() is only called with the lock held this
+// also serializes Onigmo's lazy global initialization between VMs.
+//
+// Entries are allocated with plain malloc() because they can outlive the
+// mrb_state that created them. Defining MRB_ONIG_REGEXP_NO_SHARED_REGISTRY
+// gives every OnigRegexp a private entry instead (e.g. for targets without
+// threads).
+typedef struct onig_regexp_entry {
+  struct onig_regexp_entry* next;
+  uint32_t hash;
+  unsigned long refcount;
+  OnigRegex reg;
+  OnigRegex variants[ONIG_VARIANT_COUNT - 1]; // see onig_regexp_entry_variant
+  unsigned variant_mask;
+  signed char no_capture; // -1 until first needed; see onig_regexp_entry_variant
+  OnigOptionType options;
+  OnigEncoding enc;
+  OnigSyntaxType const* syntax;
+  size_t source_len;
+  char source[1];
+} onig_regexp_entry;
+
+#ifndef MRB_ONIG_REGEXP_NO_SHARED_REGISTRY
+#ifdef _WIN32
+static SRWLOCK onig_registry_lock = SRWLOCK_INIT;
+#define ONIG_REGISTRY_LOCK()   AcquireSRWLockExclusive(&onig_registry_lock)
+#define ONIG_REGISTRY_UNLOCK() ReleaseSRWLockExclusive(&onig_registry_lock)
+#else
+static pthread_mutex_t onig_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+#define ONIG_REGISTRY_LOCK()   pthread_mutex_lock(&onig_registry_lock)
+#define ONIG_REGISTRY_UNLOCK() pthread_mutex_unlock(&onig_registry_lock)
+#endif
 
-static mrb_value
-onig_str_substr(mrb_state *mrb, mrb_value str, mrb_int beg, mrb_int len)
-{
-#ifdef MRB_UTF8_STRING
-  if (len > 0) {
-    return mrb_str_new(mrb, RSTRING_PTR(str) + beg, len);
-  } else {
-    return mrb_str_new(mrb, NULL, 0);
-  }
+static onig_regexp_entry** onig_registry_buckets;
+static size_t onig_registry_bucket_count;
+static size_t onig_registry_entry_count;
 #else
-  return mrb_str_substr(mrb, str, beg, len);
+#define ONIG_REGISTRY_LOCK()   ((void)0)
+#define ONIG_REGISTRY_UNLOCK() ((void)0)
 #endif
+
+static uint32_t
+onig_source_hash(char const* p, size_t len, OnigOptionType options) {
+  // FNV-1a over the source, then the options. mrbgem.rake computes the same
+  // value for the build-time literal table.
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    h = (h ^ (unsigned char)p[i]) * 16777619u;
+  }
+  return (h ^ (uint32_t)options) * 16777619u;
 }
 
-static mrb_value
-onig_regexp_initialize(mrb_state *mrb, mrb_value self) {
-  mrb_value str, flag = mrb_nil_value(), code = mrb_nil_value();
-  mrb_get_args(mrb, "S|oo", &str, &flag, &code);
+static uint32_t
+onig_registry_hash(char const* p, size_t len, OnigOptionType options,
+                   OnigEncoding enc, OnigSyntaxType const* syntax) {
+  uint32_t h = onig_source_hash(p, len, options);
+  h = (h ^ (uint32_t)(uintptr_t)enc) * 16777619u;
+  h = (h ^ (uint32_t)(uintptr_t)syntax) * 16777619u;
+  return h;
+}
 
-  int cflag = 0;
-  OnigEncoding enc = ONIG_ENCODING_UTF8;
-  if(mrb_string_p(code)) {
-    char const* str_code = mrb_string_value_ptr(mrb, code);
-    if(strchr(str_code, 'n') || strchr(str_code, 'N')) {
-      enc = ONIG_ENCODING_ASCII;
+#ifdef MRB_ONIG_REGEXP_LITERALS
+// Regexp literals found in the mrblib sources of this build, validated when
+// the gem was built (see spec.precompile_regexp_literals in mrbgem.rake).
+// The generated table is sorted by hash. Patterns found here skip the
+// eager compile in OnigRegexp#initialize and are compiled on first use.
+typedef struct onig_regexp_literal {
+  uint32_t hash;
+  OnigOptionType options;
+  size_t source_len;
+  char const* source;
+} onig_regexp_literal;
+
+#include "onig_regexp_literals.h"
+
+static mrb_bool
+onig_regexp_literal_p(char const* src, size_t len, OnigOptionType options) {
+  uint32_t const hash = onig_source_hash(src, len, options);
+  size_t lo = 0, hi = ONIG_REGEXP_LITERAL_COUNT;
+  while (lo < hi) {
+    size_t const mid = lo + (hi - lo) / 2;
+    if (onig_regexp_literals[mid].hash < hash) { lo = mid + 1; }
+    else { hi = mid; }
+  }
+  for (; lo < ONIG_REGEXP_LITERAL_COUNT && onig_regexp_literals[lo].hash == hash; ++lo) {
+    onig_regexp_literal const* const lit = &onig_regexp_literals[lo];
+    if (lit->options == options && lit->source_len == len && memcmp(lit->source, src, len) == 0) {
+      return TRUE;
     }
   }
-  if(mrb_nil_p(flag)) {
-  } else if(mrb_type(flag) == MRB_TT_TRUE) {
-    cflag |= ONIG_OPTION_IGNORECASE;
-  } else if(mrb_fixnum_p(flag)) {
-    int int_flags = mrb_fixnum(flag);
-    if(int_flags & 0x1) { cflag |= ONIG_OPTION_IGNORECASE; }
-    if(int_flags & 0x2) { cflag |= ONIG_OPTION_EXTEND; }
-    if(int_flags & 0x4) { cflag |= ONIG_OPTION_MULTILINE; }
-  } else if(mrb_string_p(flag)) {
-    char const* str_flags = mrb_string_value_ptr(mrb, flag);
-    if(strchr(str_flags, 'i')) { cflag |= ONIG_OPTION_IGNORECASE; }
-    if(strchr(str_flags, 'x')) { cflag |= ONIG_OPTION_EXTEND; }
-    if(strchr(str_flags, 'm')) { cflag |= ONIG_OPTION_MULTILINE; }
-  } else {
-    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown regexp flag: %S", flag);
+  return FALSE;
+}
+#endif
+
+#ifndef MRB_ONIG_REGEXP_NO_SHARED_REGISTRY
+static void
+onig_registry_grow(void) {
+  size_t const count = onig_registry_bucket_count ? onig_registry_bucket_count * 2 : 64;
+  onig_regexp_entry** const buckets = (onig_regexp_entry**)calloc(count, sizeof(onig_regexp_entry*));
+  size_t i;
+  if (!buckets) { return; } // keep the old table; chains just get longer
+
+  for (i = 0; i < onig_registry_bucket_count; ++i) {
+    onig_regexp_entry* e = onig_registry_buckets[i];
+    while (e) {
+      onig_regexp_entry* const next = e->next;
+      e->next = buckets[e->hash & (count - 1)];
+      buckets[e->hash & (count - 1)] = e;
+      e = next;
+    }
   }
+  free(onig_registry_buckets);
+  onig_registry_buckets = buckets;
+  onig_registry_bucket_count = count;
+}
+#endif
+
+// entry->reg is NULL until the pattern is compiled, which happens lazily for
+// patterns restored from a trusted blob (see OnigRegexp.load) and for
+// build-time validated literals. It is only written with the registry lock
+// held but read without it. The same holds for entry->variants.
+#if defined(MRB_ONIG_REGEXP_NO_SHARED_REGISTRY)
+#define ONIG_ENTRY_LOAD(e, f)     ((e)->f)
+#define ONIG_ENTRY_STORE(e, f, r) ((e)->f = (r))
+#elif defined(__GNUC__) || defined(__clang__)
+#define ONIG_ENTRY_LOAD(e, f)     __atomic_load_n(&(e)->f, __ATOMIC_ACQUIRE)
+#define ONIG_ENTRY_STORE(e, f, r) __atomic_store_n(&(e)->f, (r), __ATOMIC_RELEASE)
+#elif defined(_MSC_VER)
+#define ONIG_ENTRY_LOAD(e, f)     (*(OnigRegex volatile*)&(e)->f)
+#define ONIG_ENTRY_STORE(e, f, r) (*(OnigRegex volatile*)&(e)->f = (r))
+#else
+#define ONIG_ENTRY_LOAD(e, f)     ((e)->f)
+#define ONIG_ENTRY_STORE(e, f, r) ((e)->f = (r))
+#endif
+#define ONIG_ENTRY_REG(e)        ONIG_ENTRY_LOAD(e, reg)
+#define ONIG_ENTRY_SET_REG(e, r) ONIG_ENTRY_STORE(e, reg, r)
 
+// Compiles the entry's pattern. Must be called with the registry lock held.
+// On failure the Onigmo error message is written to err.
+static int
+onig_regexp_entry_compile(onig_regexp_entry* entry, char err[ONIG_MAX_ERROR_MESSAGE_LEN]) {
   OnigErrorInfo einfo;
   OnigRegex reg;
-  int result = onig_new(&reg, (OnigUChar*)RSTRING_PTR(str), (OnigUChar*) RSTRING_PTR(str) + RSTRING_LEN(str),
-                        cflag, enc, ONIG_SYNTAX_RUBY, &einfo);
+  int const result = onig_new(&reg, (OnigUChar const*)entry->source,
+                              (OnigUChar const*)entry->source + entry->source_len,
+                              entry->options, entry->enc, entry->syntax, &einfo);
   if (result != ONIG_NORMAL) {
-    char err[ONIG_MAX_ERROR_MESSAGE_LEN] = "";
     onig_error_code_to_str((OnigUChar*)err, result, &einfo);
-    mrb_raisef(mrb, E_REGEXP_ERROR, "'%S' is an invalid regular expression because %S.",
-               str, mrb_str_new_cstr(mrb, err));
+    return result;
   }
-  mrb_iv_set(mrb, self, MRB_IVSYM(source), str);
-
-  DATA_PTR(self) = reg;
-  DATA_TYPE(self) = &mrb_onig_regexp_type;
-
-  return self;
-}
-
-static mrb_value
-create_onig_region(mrb_state* mrb, mrb_value const str, mrb_value rex) {
-  mrb_assert(mrb_string_p(str));
-  mrb_assert(mrb_type(rex) == MRB_TT_DATA && DATA_TYPE(rex) == &mrb_onig_regexp_type);
-  mrb_value const c = mrb_obj_value(mrb_data_object_alloc(
-      mrb, ONIG_MATCH_DATA_CLASS(mrb), onig_region_new(), &mrb_onig_region_type));
-  mrb_iv_set(mrb, c, MRB_SYM(string), mrb_str_dup(mrb, str));
-  mrb_iv_set(mrb, c, MRB_SYM(regexp), rex);
-  return c;
+  ONIG_ENTRY_SET_REG(entry, reg);
+  return ONIG_NORMAL;
 }
 
-#define MATCH_VALUE_NIL_OR(v) (mrb_nil_p(match_value) ? mrb_nil_value() : (v))
-
 static void
-onig_gv_set(mrb_state* mrb, mrb_value match_value) {
-
-  mrb_gv_set(mrb, ONIG_SYM_TILDE(mrb), match_value);
-  mrb_gv_set(mrb, ONIG_SYM_AMPERSAND(mrb),
-             MATCH_VALUE_NIL_OR(mrb_ary_entry(match_data_to_a(mrb, match_value), 0)));
-  mrb_gv_set(mrb, ONIG_SYM_BACKTICK(mrb),
-             MATCH_VALUE_NIL_OR(match_data_pre_match(mrb, match_value)));
-  mrb_gv_set(mrb, ONIG_SYM_QUOTE(mrb),
-             MATCH_VALUE_NIL_OR(match_data_post_match(mrb, match_value)));
-  mrb_gv_set(mrb, ONIG_SYM_PLUS(mrb),
-             MATCH_VALUE_NIL_OR(mrb_ary_entry(match_data_to_a(mrb, match_value), -1)));
-
-  // $1 to $9
-  int idx = 1;
-  if (mrb_nil_p(match_value)) {
-    for (; idx < 10; ++idx) {
-      mrb_gv_remove(mrb, ONIG_SYM_NUMBER(mrb, idx));
-    }
-  } else {
-    OnigRegion* const match = (OnigRegion*)DATA_PTR(match_value);
-
-    // Set $1 to $9 based on match->num_regs
-    int const idx_max = match->num_regs > 10? 10 : match->num_regs;
+onig_regexp_raise_invalid(mrb_state* mrb, mrb_value source, char const* err) {
+  mrb_raisef(mrb, E_REGEXP_ERROR, "'%S' is an invalid regular expression because %S.",
+             source, mrb_str_new_cstr(mrb, err));
+}
 
-    // Set available capture groups ($1 to $9)
-    for (; idx < 10; ++idx) {
-      if (idx_max > idx) {
-        mrb_gv_set(mrb, ONIG_SYM_NUMBER(mrb, idx), mrb_funcall_id(mrb, match_value, MRB_OPSYM(aref), 1, mrb_fixnum_value(idx)));
-      } else {
-        mrb_gv_remove(mrb, ONIG_SYM_NUMBER(mrb, idx));
+static void onig_regexp_entry_release(onig_regexp_entry* entry);
+
+// Whether an ASCII-8BIT compilation of a UTF-8 pattern finds exactly the
+// same matches in subjects made of 7-bit bytes only. That needs a 7-bit
+// source without escapes for code points or Unicode properties, and no
+// case folding: under /i Onigmo lets UTF-8 classes match multi-character
+// folds such as "ss" (for U+00DF) even in ASCII text.
+static mrb_bool
+onig_regexp_ascii_variant_p(char const* src, size_t len, OnigOptionType options) {
+  size_t i;
+  if (options & ONIG_OPTION_IGNORECASE) { return FALSE; }
+  for (i = 0; i < len; ++i) {
+    unsigned char const c = (unsigned char)src[i];
+    if (c >= 0x80) { return FALSE; }
+    if (c == '\\' && i + 1 < len) {
+      ++i;
+      if (src[i] == '\0' || strchr("uxpPXNMCc01234567", src[i])) { return FALSE; }
+    } else if (c == '(' && i + 1 < len && src[i + 1] == '?') {
+      size_t j;
+      for (j = i + 2; j < len && src[j] != '\0' && strchr("imx-", src[j]); ++j) {
+        if (src[j] == 'i') { return FALSE; }
       }
     }
   }
+  return TRUE;
 }
 
-#define MISMATCH_NIL_OR(v) (result == ONIG_MISMATCH ? mrb_nil_value() : (v))
-
-static int
-onig_match_common(mrb_state* mrb, OnigRegex reg, mrb_value match_value, mrb_value str, int pos) {
-  mrb_assert(mrb_string_p(str));
-  mrb_assert(DATA_TYPE(match_value) == &mrb_onig_region_type);
-  OnigRegion* const match = (OnigRegion*)DATA_PTR(match_value);
-  OnigUChar const* str_ptr = (OnigUChar const*)RSTRING_PTR(str);
-  int const result = onig_search(reg, str_ptr, str_ptr + RSTRING_LEN(str),
-                                 str_ptr + pos, str_ptr + RSTRING_LEN(str), match, 0);
-  if (result != ONIG_MISMATCH && result < 0) {
-    char err[ONIG_MAX_ERROR_MESSAGE_LEN] = "";
-    onig_error_code_to_str((OnigUChar*)err, result);
-    mrb_raise(mrb, E_REGEXP_ERROR, err);
+// Whether compiling with ONIG_OPTION_DONT_CAPTURE_GROUP may be worth it and
+// safe: the pattern has plain groups, whose capture bookkeeping the option
+// saves, and nothing refers to groups (backreferences, calls, conditions).
+// Whether Onigmo treats the groups specially is left to
+// onig_regexp_no_capture_safe_p, which parses the pattern.
+static mrb_bool
+onig_regexp_no_capture_variant_p(char const* src, size_t len) {
+  mrb_bool groups = FALSE;
+  size_t i;
+  for (i = 0; i < len; ++i) {
+    if (src[i] == '\\' && i + 1 < len) {
+      ++i;
+      if (src[i] == 'k' || src[i] == 'g' || (src[i] >= '1' && src[i] <= '9')) { return FALSE; }
+    } else if (src[i] == '(') {
+      if (i + 1 == len || src[i + 1] != '?') { groups = TRUE; }
+      else if (i + 2 < len && src[i + 2] == '(') { return FALSE; }
+    }
   }
+  return groups;
+}
 
-  mrb_obj_iv_set(mrb, (struct RObject*)ONIG_REGEXP_CLASS(mrb), MRB_IVSYM(last_match), MISMATCH_NIL_OR(match_value));
+static mrb_bool
+onig_regexp_no_capture_safe_p(char const* src, size_t len, OnigOptionType options, OnigEncoding enc) {
+  onig_ast* const ast = onig_ast_parse(src, len, (unsigned)options, enc == ONIG_ENCODING_UTF8);
+  if (!ast) { return FALSE; }
+  mrb_bool const safe = !onig_ast_capture_sensitive(onig_ast_root(ast));
+  onig_ast_free(ast);
+  return safe;
+}
 
-  if (mrb_class_get_id(mrb, MRB_SYM(Regexp)) == ONIG_REGEXP_CLASS(mrb) &&
-    mrb_bool(mrb_obj_iv_get(mrb, (struct RObject*)ONIG_REGEXP_CLASS(mrb), MRB_IVSYM(set_global_variables))))
-  {
-    onig_gv_set(mrb, MISMATCH_NIL_OR(match_value));
+// Whether the pattern may use \G, which matches where the search started:
+// a search for it cannot be split into several starting later.
+static mrb_bool
+onig_regexp_search_start_p(char const* src, size_t len) {
+  size_t i;
+  for (i = 0; i + 1 < len; ++i) {
+    if (src[i] != '\\') { continue; }
+    if (src[i + 1] == 'G') { return TRUE; }
+    ++i;
   }
-
-  return result;
+  return FALSE;
 }
 
-static mrb_value
-reg_operand(mrb_state *mrb, mrb_value obj) {
-  mrb_value ret;
+// Returns a referenced entry for the pattern. Unless lazy is set the pattern
+// is compiled before returning and RegexpError is raised if it is invalid.
+static onig_regexp_entry*
+onig_regexp_entry_acquire(mrb_state* mrb, char const* src, size_t len, OnigOptionType options,
+                          OnigEncoding enc, OnigSyntaxType const* syntax, mrb_bool lazy) {
+  uint32_t const hash = onig_registry_hash(src, len, options, enc, syntax);
+  char err[ONIG_MAX_ERROR_MESSAGE_LEN] = "";
+  onig_regexp_entry* entry;
+
+  ONIG_REGISTRY_LOCK();
+#ifndef MRB_ONIG_REGEXP_NO_SHARED_REGISTRY
+  if (onig_registry_bucket_count) {
+    for (entry = onig_registry_buckets[hash & (onig_registry_bucket_count - 1)]; entry; entry = entry->next) {
+      if (entry->hash == hash && entry->options == options && entry->enc == enc &&
+          entry->syntax == syntax && entry->source_len == len &&
+          memcmp(entry->source, src, len) == 0) {
+        ++entry->refcount;
+        if (!lazy && !entry->reg && onig_regexp_entry_compile(entry, err) != ONIG_NORMAL) {
+          ONIG_REGISTRY_UNLOCK();
+          onig_regexp_entry_release(entry);
+          onig_regexp_raise_invalid(mrb, mrb_str_new(mrb, src, len), err);
+        }
+        ONIG_REGISTRY_UNLOCK();
+        return entry;
+      }
+    }
+  }
+#endif
 
-  if (mrb_symbol_p(obj)) {
-    ret = mrb_sym2str(mrb, mrb_symbol(obj));
+  entry = (onig_regexp_entry*)malloc(offsetof(onig_regexp_entry, source) + len + 1);
+  if (!entry) {
+    ONIG_REGISTRY_UNLOCK();
+    mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory");
   }
-  else {
-    ret = mrb_string_type(mrb, obj);
+  entry->hash = hash;
+  entry->refcount = 1;
+  entry->reg = NULL;
+  memset(entry->variants, 0, sizeof(entry->variants));
+  entry->variant_mask = 0;
+  if (enc == ONIG_ENCODING_UTF8 && onig_regexp_ascii_variant_p(src, len, options)) {
+    entry->variant_mask |= ONIG_VARIANT_ASCII;
   }
-  return ret;
-}
-
-static mrb_value
-onig_regexp_match(mrb_state *mrb, mrb_value self) {
-  mrb_value str = mrb_nil_value();
-  OnigRegex reg;
-  mrb_int pos = 0;
-  mrb_value block = mrb_nil_value();
-
-  mrb_get_args(mrb, "o|i&", &str, &pos, &block);
-  if (mrb_nil_p(str)) {
-    return mrb_nil_value();
+  if (!(options & (ONIG_OPTION_DONT_CAPTURE_GROUP | ONIG_OPTION_CAPTURE_GROUP)) &&
+      onig_regexp_no_capture_variant_p(src, len)) {
+    entry->variant_mask |= ONIG_VARIANT_NO_CAPTURE;
   }
-  str = reg_operand(mrb, str);
-  if (pos < 0 || (pos > 0 && pos >= RSTRING_LEN(str))) {
-    return mrb_nil_value();
+  entry->no_capture = -1;
+  entry->options = options;
+  entry->enc = enc;
+  entry->syntax = syntax;
+  entry->source_len = len;
+  memcpy(entry->source, src, len);
+  entry->next = NULL;
+
+  if (!lazy && onig_regexp_entry_compile(entry, err) != ONIG_NORMAL) {
+    ONIG_REGISTRY_UNLOCK();
+    free(entry);
+    onig_regexp_raise_invalid(mrb, mrb_str_new(mrb, src, len), err);
   }
 
-  Data_Get_Struct(mrb, self, &mrb_onig_regexp_type, reg);
-
-  mrb_value const ret = create_onig_region(mrb, str, self);
-  if (onig_match_common(mrb, reg, ret, str, pos) == ONIG_MISMATCH) {
-    return mrb_nil_value();
+#ifndef MRB_ONIG_REGEXP_NO_SHARED_REGISTRY
+  if (onig_registry_entry_count >= onig_registry_bucket_count) {
+    onig_registry_grow();
+  }
+  if (onig_registry_bucket_count) {
+    entry->next = onig_registry_buckets[hash & (onig_registry_bucket_count - 1)];
+    onig_registry_buckets[hash & (onig_registry_bucket_count - 1)] = entry;
+    ++onig_registry_entry_count;
   }
+#endif
+  ONIG_REGISTRY_UNLOCK();
+  return entry;
+}
 
-  if (mrb_nil_p(block)) {
-    return ret;
-  } else {
-    return mrb_yield(mrb, block, ret);
+// Returns the compiled pattern, compiling a lazily restored entry first.
+static OnigRegex
+onig_regexp_entry_reg(mrb_state* mrb, onig_regexp_entry* entry) {
+  OnigRegex reg = ONIG_ENTRY_REG(entry);
+  if (!reg) {
+    char err[ONIG_MAX_ERROR_MESSAGE_LEN] = "";
+    int result = ONIG_NORMAL;
+    ONIG_REGISTRY_LOCK();
+    if (!entry->reg) { result = onig_regexp_entry_compile(entry, err); }
+    reg = entry->reg;
+    ONIG_REGISTRY_UNLOCK();
+    if (result != ONIG_NORMAL) {
+      onig_regexp_raise_invalid(mrb, mrb_str_new(mrb, entry->source, entry->source_len), err);
+    }
   }
+  return reg;
 }
 
-static mrb_value
-onig_regexp_match_p(mrb_state *mrb, mrb_value self) {
-  mrb_value str = mrb_nil_value();
-  mrb_int pos = 0;
-  OnigRegex reg;
-  OnigUChar const* str_ptr;
+// Returns the compilation for the variant flags v, made on first use.
+// Flags the entry has no variant for are ignored; a variant that fails to
+// compile falls back to the primary compilation. Whether the groups allow
+// ONIG_VARIANT_NO_CAPTURE is only decided here, so that restoring or
+// creating an OnigRegexp does not parse its pattern; if they do not, the
+// variant is compiled without it.
+static OnigRegex
+onig_regexp_entry_variant(mrb_state* mrb, onig_regexp_entry* entry, unsigned v) {
+  OnigRegex const primary = onig_regexp_entry_reg(mrb, entry);
+  v &= entry->variant_mask;
+  if (v == 0) { return primary; }
+  OnigRegex reg = ONIG_ENTRY_LOAD(entry, variants[v - 1]);
+  if (!reg) {
+    ONIG_REGISTRY_LOCK();
+    if (!entry->variants[v - 1]) {
+      OnigErrorInfo einfo;
+      OnigRegex compiled;
+      if ((v & ONIG_VARIANT_NO_CAPTURE) && entry->no_capture < 0) {
+        entry->no_capture = (signed char)onig_regexp_no_capture_safe_p(
+            entry->source, entry->source_len, entry->options, entry->enc);
+      }
+      OnigOptionType const options = entry->options |
+          (v & ONIG_VARIANT_NO_CAPTURE && entry->no_capture ? ONIG_OPTION_DONT_CAPTURE_GROUP : 0);
+      if (options == entry->options && !(v & ONIG_VARIANT_ASCII)) {
+        compiled = primary;
+      } else if (onig_new(&compiled, (OnigUChar const*)entry->source,
+                          (OnigUChar const*)entry->source + entry->source_len, options,
+                          v & ONIG_VARIANT_ASCII ? ONIG_ENCODING_ASCII : entry->enc,
+                          entry->syntax, &einfo) != ONIG_NORMAL) {
+        compiled = primary;
+      }
+      ONIG_ENTRY_STORE(entry, variants[v - 1], compiled);
+    }
+    reg = entry->variants[v - 1];
+    ONIG_REGISTRY_UNLOCK();
+  }
+  return reg;
+}
 
-  mrb_get_args(mrb, "o|i", &str, &pos);
-  if (mrb_nil_p(str)) {
-    return mrb_nil_value();
+static void
+onig_regexp_entry_release(onig_regexp_entry* entry) {
+  int i;
+  ONIG_REGISTRY_LOCK();
+  if (--entry->refcount > 0) {
+    ONIG_REGISTRY_UNLOCK();
+    return;
   }
-  str = reg_operand(mrb, str);
-  if (pos < 0 || (pos > 0 && pos >= RSTRING_LEN(str))) {
-    return mrb_nil_value();
+#ifndef MRB_ONIG_REGEXP_NO_SHARED_REGISTRY
+  if (onig_registry_bucket_count) {
+    onig_regexp_entry** link = &onig_registry_buckets[entry->hash & (onig_registry_bucket_count - 1)];
+    while (*link && *link != entry) { link = &(*link)->next; }
+    if (*link) {
+      *link = entry->next;
+      --onig_registry_entry_count;
+    }
   }
+#endif
+  ONIG_REGISTRY_UNLOCK();
 
-  Data_Get_Struct(mrb, self, &mrb_onig_regexp_type, reg);
-  str_ptr = (OnigUChar const*)RSTRING_PTR(str);
-  return mrb_bool_value(onig_search(
-      reg, str_ptr, str_ptr + RSTRING_LEN(str),
-      str_ptr + pos, str_ptr + RSTRING_LEN(str), NULL, 0) != ONIG_MISMATCH);
+  for (i = 0; i < ONIG_VARIANT_COUNT - 1; ++i) {
+    if (entry->variants[i] && entry->variants[i] != entry->reg) { onig_free(entry->variants[i]); }
+  }
+  if (entry->reg) { onig_free(entry->reg); }
+  free(entry);
 }
 
-static mrb_value
-string_match_p(mrb_state *mrb, mrb_value self) {
-  mrb_value str = self;
-  mrb_int pos = 0;
-  OnigRegex reg;
-  OnigUChar const* str_ptr;
+// Bytes of a compiled program, counted like Onigmo's onig_memsize(), which
+// is only built for CRuby. Oniguruma keeps regex_t opaque.
+static size_t
+onig_program_memsize(OnigRegex reg) {
+  if (!reg) { return 0; }
+#ifdef HAVE_ONIGMO_H
+  size_t size = sizeof(*reg);
+  if (reg->p) { size += reg->alloc; }
+  if (reg->exact) { size += reg->exact_end - reg->exact; }
+  if (reg->repeat_range) { size += reg->repeat_range_alloc * sizeof(OnigRepeatRange); }
+  return size + onig_program_memsize(reg->chain);
+#else
+  return 0;
+#endif
+}
 
-  mrb_get_args(mrb, "d|i", &reg, &mrb_onig_regexp_type, &pos);
-  if (pos < 0 || (pos > 0 && pos >= RSTRING_LEN(str))) {
-    return mrb_nil_value();
+// Bytes of an entry and of the programs compiled for it so far.
+static size_t
+onig_regexp_entry_memsize(onig_regexp_entry* entry) {
+  OnigRegex const reg = ONIG_ENTRY_REG(entry);
+  size_t size = sizeof(onig_regexp_entry) + entry->source_len + onig_program_memsize(reg);
+  int i;
+  for (i = 0; i < ONIG_VARIANT_COUNT - 1; ++i) {
+    OnigRegex const variant = ONIG_ENTRY_LOAD(entry, variants[i]);
+    if (variant != reg) { size += onig_program_memsize(variant); }
   }
+  return size;
+}
 
-  if (mrb_nil_p(str)) {
-    return mrb_nil_value();
-  }
-  str = mrb_string_type(mrb, str);
+#ifdef MRB_ONIG_REGEXP_STATS
+// Search statistics of one OnigRegexp, allocated on its first search while
+// recording is enabled. histogram[i] counts searches that took
+// [2**i, 2**(i+1)) nanoseconds.
+#define ONIG_STATS_BUCKETS 32
+typedef struct onig_regexp_stats {
+  uint64_t calls;
+  uint64_t matches;
+  uint64_t mismatches;
+  uint64_t bytes;
+  uint64_t time_ns;
+  uint64_t histogram[ONIG_STATS_BUCKETS];
+} onig_regexp_stats;
+
+// Recording is toggled process-wide so the disabled path is one branch.
+static int volatile onig_stats_enabled;
+#endif
 
-  str_ptr = (OnigUChar const*)RSTRING_PTR(str);
-  return mrb_bool_value(onig_search(
-      reg, str_ptr, str_ptr + RSTRING_LEN(str),
-      str_ptr + pos, str_ptr + RSTRING_LEN(str), NULL, 0) != ONIG_MISMATCH);
-}
+// How captures are returned (OnigRegexp#intern_captures=, intern: keyword).
+enum {
+  ONIG_INTERN_NONE,    // fresh Strings
+  ONIG_INTERN_STRING,  // frozen Strings shared through the intern table
+  ONIG_INTERN_SYMBOL   // Symbols
+};
 
-static mrb_value
-onig_regexp_equal(mrb_state *mrb, mrb_value self) {
-  mrb_value other;
-  OnigRegex self_reg, other_reg;
+// Per-object data of an OnigRegexp: the (possibly shared) compiled pattern
+// plus the state that belongs to this object only.
+typedef struct onig_regexp {
+  onig_regexp_entry* entry;
+  mrb_int retry_limit; // < 0: use OnigRegexp.retry_limit
+  signed char intern;  // ONIG_INTERN_*
+#ifdef MRB_ONIG_REGEXP_STATS
+  onig_regexp_stats* stats;
+#endif
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+  onig_dfa* dfa;
+  signed char dfa_mode;   // OnigRegexp#dfa=: 0 auto, 1 forced, -1 disabled
+  signed char dfa_state;  // 0 undecided, 1 dfa built, -1 searches use Onigmo only
+#endif
+#ifdef MRB_ONIG_REGEXP_PCRE2
+  onig_pcre2* pcre2;
+  signed char pcre2_state;  // 0 undecided, 1 translated, -1 not translatable
+#endif
+} onig_regexp;
 
-  mrb_get_args(mrb, "o", &other);
-  if (mrb_obj_equal(mrb, self, other)){
-    return mrb_true_value();
-  }
-  if (mrb_nil_p(other)) {
-    return mrb_false_value();
-  }
-  if (!mrb_obj_is_kind_of(mrb, other, ONIG_REGEXP_CLASS(mrb))) {
-    return mrb_false_value();
-  }
-  Data_Get_Struct(mrb, self, &mrb_onig_regexp_type, self_reg);
-  Data_Get_Struct(mrb, other, &mrb_onig_regexp_type, other_reg);
+// Process-wide default for OnigRegexp#retry_limit (0: unlimited).
+static mrb_int onig_default_retry_limit;
 
-  if (!self_reg || !other_reg){
-      mrb_raise(mrb, E_RUNTIME_ERROR, "Invalid OnigRegexp");
-  }
-  if (onig_get_options(self_reg) != onig_get_options(other_reg)){
-      return mrb_false_value();
-  }
-  return mrb_str_equal(mrb, mrb_iv_get(mrb, self, MRB_IVSYM(source)), mrb_iv_get(mrb, other, MRB_IVSYM(source))) ?
-      mrb_true_value() : mrb_false_value();
+static onig_regexp*
+onig_regexp_data_new(mrb_state* mrb) {
+  onig_regexp* const re = (onig_regexp*)mrb_calloc(mrb, 1, sizeof(onig_regexp));
+  re->retry_limit = -1;
+  return re;
 }
 
-static mrb_value
-onig_regexp_casefold_p(mrb_state *mrb, mrb_value self) {
-  OnigRegex reg;
-
-  Data_Get_Struct(mrb, self, &mrb_onig_regexp_type, reg);
-  return (onig_get_options(reg) & ONIG_OPTION_IGNORECASE) ? mrb_true_value() : mrb_false_value();
+static void
+onig_regexp_free(mrb_state *mrb, void *p) {
+  onig_regexp* const re = (onig_regexp*)p;
+  if (!re) { return; }
+  if (re->entry) { onig_regexp_entry_release(re->entry); }
+#ifdef MRB_ONIG_REGEXP_STATS
+  mrb_free(mrb, re->stats);
+#endif
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+  if (re->dfa) { onig_dfa_free(re->dfa); }
+#endif
+#ifdef MRB_ONIG_REGEXP_PCRE2
+  onig_pcre2_free(re->pcre2);
+#endif
+  mrb_free(mrb, re);
 }
 
-typedef struct {
-  mrb_state* mrb;
-  mrb_value names;
-} foreach_name_data;
+static struct mrb_data_type mrb_onig_regexp_type = {
+  "PosixRegexp", onig_regexp_free
+};
 
-static int
-foreach_name(const OnigUChar* name, const OnigUChar* name_end, int num, int* num_list, OnigRegex reg, void* arg) {
-  foreach_name_data* data = (foreach_name_data*)arg;
-  mrb_state* mrb = data->mrb;
-  mrb_value key, indexes;
+#define ONIG_REGEXP_P(obj) \
+  ((mrb_type(obj) == MRB_TT_DATA) && (DATA_TYPE(obj) == &mrb_onig_regexp_type))
 
-  key = mrb_str_new(mrb, (const char*)name, name_end - name);
-  indexes = mrb_ary_new_capa(mrb, (mrb_int)num);
-  for(int i = 0; i < num; i++) {
-    mrb_ary_push(mrb, indexes, mrb_int_value(mrb, num_list[i]));
+static onig_regexp*
+onig_regexp_ptr(mrb_state* mrb, mrb_value self) {
+  onig_regexp* re;
+  Data_Get_Struct(mrb, self, &mrb_onig_regexp_type, re);
+  if (!re || !re->entry) {
+    mrb_raise(mrb, E_TYPE_ERROR, "uninitialized OnigRegexp");
   }
-  mrb_hash_set(mrb, data->names, key, indexes);
+  return re;
+}
 
-  return ONIG_NORMAL;
+static OnigRegex
+onig_regexp_get(mrb_state* mrb, mrb_value self) {
+  onig_regexp* re;
+  Data_Get_Struct(mrb, self, &mrb_onig_regexp_type, re);
+  return re && re->entry ? onig_regexp_entry_reg(mrb, re->entry) : NULL;
 }
 
-static mrb_value
-onig_regexp_named_captures_common(mrb_state* mrb, mrb_value self) {
-  OnigRegex reg;
-  foreach_name_data data;
-  int count, result;
+#ifdef MRB_ONIG_REGEXP_STATS
+static uint64_t
+onig_stats_now_ns(void) {
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+#endif
+
+#ifdef ONIG_OPTION_ASCII_RANGE
+#define ONIG_OPTION_ASCII_RANGE_ ONIG_OPTION_ASCII_RANGE
+#define ONIG_OPTION_POSIX_BRACKET_ALL_RANGE_ ONIG_OPTION_POSIX_BRACKET_ALL_RANGE
+#define ONIG_OPTION_WORD_BOUND_ALL_RANGE_ ONIG_OPTION_WORD_BOUND_ALL_RANGE
+#else
+#define ONIG_OPTION_ASCII_RANGE_ 0
+#define ONIG_OPTION_POSIX_BRACKET_ALL_RANGE_ 0
+#define ONIG_OPTION_WORD_BOUND_ALL_RANGE_ 0
+#endif
+#ifdef ONIG_OPTION_NEWLINE_CRLF
+#define ONIG_OPTION_NEWLINE_CRLF_ ONIG_OPTION_NEWLINE_CRLF
+#else
+#define ONIG_OPTION_NEWLINE_CRLF_ 0
+#endif
+#ifdef ONIG_OPTION_NOTBOS
+#define ONIG_OPTION_NOTBOS_ ONIG_OPTION_NOTBOS
+#define ONIG_OPTION_NOTEOS_ ONIG_OPTION_NOTEOS
+#else
+#define ONIG_OPTION_NOTBOS_ 0
+#define ONIG_OPTION_NOTEOS_ 0
+#endif
 
-  Data_Get_Struct(mrb, self, &mrb_onig_regexp_type, reg);
+// Options OnigRegexp.new takes from an Integer flag, and the ones the
+// search methods take through their options: keyword instead.
+#define ONIG_REGEXP_COMPILE_OPTIONS \
+  (ONIG_OPTION_IGNORECASE | ONIG_OPTION_EXTEND | ONIG_OPTION_MULTILINE | ONIG_OPTION_SINGLELINE | \
+   ONIG_OPTION_FIND_LONGEST | ONIG_OPTION_FIND_NOT_EMPTY | ONIG_OPTION_NEGATE_SINGLELINE | \
+   ONIG_OPTION_DONT_CAPTURE_GROUP | ONIG_OPTION_CAPTURE_GROUP | ONIG_OPTION_ASCII_RANGE_ | \
+   ONIG_OPTION_POSIX_BRACKET_ALL_RANGE_ | ONIG_OPTION_WORD_BOUND_ALL_RANGE_ | ONIG_OPTION_NEWLINE_CRLF_)
+#define ONIG_REGEXP_SEARCH_OPTIONS \
+  (ONIG_OPTION_NOTBOL | ONIG_OPTION_NOTEOL | ONIG_OPTION_NOTBOS_ | ONIG_OPTION_NOTEOS_)
+
+// Match positions: Onigmo 6 reports them as OnigPosition (ptrdiff_t),
+// Oniguruma as int.
+#if defined(ONIGMO_VERSION_MAJOR) && ONIGMO_VERSION_MAJOR >= 6
+typedef OnigPosition onig_position;
+#else
+typedef int onig_position;
+#endif
 
-  count = onig_number_of_names(reg);
-  data.mrb = mrb;
-  data.names = mrb_hash_new_capa(mrb, (mrb_int)count);
+// Backtracking limits: the bundled Onigmo is patched to provide a per-thread
+// limit (see onigmo-6.2.0-retry-limit.patch), Oniguruma 6.8+ takes one per
+// call through OnigMatchParam. Both count backtracks per start position.
+// Other libraries cannot enforce a limit.
+#if defined(ONIG_HAVE_THREAD_RETRY_LIMIT) || \
+    (defined(ONIGURUMA_VERSION_INT) && ONIGURUMA_VERSION_INT >= 60800)
+#define ONIG_REGEXP_RETRY_LIMIT 1
+#endif
 
-  result = onig_foreach_name(reg, foreach_name, &data);
-  if (result != ONIG_NORMAL) {
-    mrb_raisef(mrb, E_REGEXP_ERROR, "onig_foreach_name error");
+static void
+onig_regexp_raise_search_error(mrb_state* mrb, int result) {
+  char err[ONIG_MAX_ERROR_MESSAGE_LEN] = "";
+  onig_error_code_to_str((OnigUChar*)err, result);
+#ifdef ONIGERR_RETRY_LIMIT_IN_MATCH_OVER
+  if (result == ONIGERR_RETRY_LIMIT_IN_MATCH_OVER) {
+    mrb_raise(mrb, mrb_class_get_under(mrb, ONIG_STATE(mrb)->cls_onig_regexp, "TimeoutError"), err);
   }
-
-  return data.names;
+#endif
+  mrb_raise(mrb, E_REGEXP_ERROR, err);
 }
 
-static mrb_value
-onig_regexp_named_captures(mrb_state* mrb, mrb_value self) {
-  return onig_regexp_named_captures_common(mrb, self);
-}
+// Runs Onigmo under the retry limit: a search of [start, range), or with
+// at != NULL a single attempt anchored there. Returns the match position
+// or ONIG_MISMATCH; library errors are raised.
+static onig_position
+onig_regexp_exec(mrb_state* mrb, onig_regexp const* re, OnigRegex reg, OnigUChar const* str,
+                 OnigUChar const* end, OnigUChar const* start, OnigUChar const* range,
+                 OnigUChar const* at, OnigRegion* region, OnigOptionType option) {
+  onig_position result;
+#ifdef ONIG_REGEXP_RETRY_LIMIT
+  mrb_int const limit = re->retry_limit >= 0 ? re->retry_limit : onig_default_retry_limit;
+#else
+  (void)re;
+#endif
 
-static mrb_value
-onig_regexp_names(mrb_state* mrb, mrb_value self) {
-  return mrb_hash_keys(mrb, onig_regexp_named_captures_common(mrb, self));
-}
-static mrb_value
-onig_regexp_options(mrb_state *mrb, mrb_value self) {
-  OnigRegex reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_regexp_type, reg);
-  return mrb_fixnum_value(onig_get_options(reg));
-}
+#if defined(ONIG_HAVE_THREAD_RETRY_LIMIT)
+  onig_set_thread_retry_limit((unsigned long)limit);
+#elif defined(ONIG_REGEXP_RETRY_LIMIT)
+  if (limit > 0) {
+    OnigMatchParam* const mp = onig_new_match_param();
+    if (!mp) { mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory"); }
+    onig_initialize_match_param(mp);
+    onig_set_retry_limit_in_match_of_match_param(mp, (unsigned long)limit);
+    result = at
+        ? onig_match_with_param(reg, str, end, at, region, option, mp)
+        : onig_search_with_param(reg, str, end, start, range, region, option, mp);
+    onig_free_match_param(mp);
+    if (result < 0 && result != ONIG_MISMATCH) { onig_regexp_raise_search_error(mrb, (int)result); }
+    return result >= 0 && at ? (onig_position)(at - str) : result;
+  }
+#endif
 
-static char *
-option_to_str(char str[4], int options) {
-  char *p = str;
-  if (options & ONIG_OPTION_MULTILINE) *p++ = 'm';
-  if (options & ONIG_OPTION_IGNORECASE) *p++ = 'i';
-  if (options & ONIG_OPTION_EXTEND) *p++ = 'x';
-  *p = 0;
-  return str;
+  result = at
+      ? onig_match(reg, str, end, at, region, option)
+      : onig_search(reg, str, end, start, range, region, option);
+  if (result < 0 && result != ONIG_MISMATCH) { onig_regexp_raise_search_error(mrb, (int)result); }
+  return result >= 0 && at ? (onig_position)(at - str) : result;
 }
 
-static mrb_value
-regexp_expr_str(mrb_state *mrb, mrb_value str, const char *p, int len) {
-  const char *pend;
-  char buf[5];
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+// Memory bound of each direction's state cache. A search that would thrash
+// the cache falls back to Onigmo, so this only trades memory for speed.
+#ifndef MRB_ONIG_REGEXP_DFA_CACHE_SIZE
+#define MRB_ONIG_REGEXP_DFA_CACHE_SIZE (512 * 1024)
+#endif
 
-  pend = (const char *) p + len;
-  for (;p < pend; p++) {
-    unsigned char c, cc;
+// Whether Onigmo finds candidate positions with a Boyer-Moore scan for a
+// literal, which beats a byte-at-a-time DFA on texts with few matches.
+static mrb_bool
+onig_regexp_fast_scan_p(OnigRegex reg) {
+#ifdef ONIGMO_VERSION_MAJOR
+  switch (reg->optimize) {
+  case 2: case 3: case 6: case 7: // ONIG_OPTIMIZE_EXACT_BM{,_NOT_REV}{,_IC}
+    return TRUE;
+  default:
+    return FALSE;
+  }
+#else
+  (void)reg; // regex_t is opaque in Oniguruma
+  return TRUE;
+#endif
+}
 
-    c = *p;
-    if (c == '/') {
-      buf[0] = '\\'; buf[1] = c;
-      mrb_str_cat(mrb, str, buf, 2);
-      continue;
-    }
-    if (ISPRINT(c)) {
-      buf[0] = c;
-      mrb_str_cat(mrb, str, buf, 1);
-      continue;
-    }
-    switch (c) {
-      case '\n': cc = 'n'; break;
-      case '\r': cc = 'r'; break;
-      case '\t': cc = 't'; break;
-      default: cc = 0; break;
-    }
-    if (cc) {
-      buf[0] = '\\';
-      buf[1] = (char)cc;
-      mrb_str_cat(mrb, str, buf, 2);
-      continue;
-    }
-    else {
-      buf[0] = '\\';
-      buf[3] = '0' + c % 8; c /= 8;
-      buf[2] = '0' + c % 8; c /= 8;
-      buf[1] = '0' + c % 8;
-      mrb_str_cat(mrb, str, buf, 4);
-      continue;
-    }
+// Builds the DFA of re on first use. Automatically it is used only when
+// Onigmo could backtrack superlinearly or has no fast scan of its own.
+static onig_dfa*
+onig_regexp_dfa(onig_regexp* re, OnigRegex reg) {
+  if (re->dfa_state != 0) { return re->dfa; }
+  re->dfa_state = -1;
+  onig_regexp_entry const* const entry = re->entry;
+  if (re->dfa_mode < 0 || entry->syntax != ONIG_SYNTAX_RUBY ||
+      (entry->enc != ONIG_ENCODING_UTF8 && entry->enc != ONIG_ENCODING_ASCII) ||
+      (entry->options & ~(ONIG_OPTION_IGNORECASE | ONIG_OPTION_EXTEND | ONIG_OPTION_MULTILINE))) {
+    return NULL;
   }
-  return str;
+  int const utf8 = entry->enc == ONIG_ENCODING_UTF8;
+  onig_ast* const ast = onig_ast_parse(entry->source, entry->source_len, (unsigned)entry->options, utf8);
+  if (!ast) { return NULL; }
+  onig_ast_analysis a;
+  onig_ast_analyze(ast, &a);
+  if (re->dfa_mode > 0 || !a.linear || !onig_regexp_fast_scan_p(reg)) {
+    re->dfa = onig_dfa_new(ast, utf8, MRB_ONIG_REGEXP_DFA_CACHE_SIZE);
+    if (re->dfa) { re->dfa_state = 1; }
+  }
+  onig_ast_free(ast);
+  return re->dfa;
 }
 
-static mrb_value
-onig_regexp_inspect(mrb_state *mrb, mrb_value self) {
-  OnigRegex reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_regexp_type, reg);
-  mrb_value str = mrb_str_new_lit(mrb, "/");
-  mrb_value src = mrb_iv_get(mrb, self, MRB_IVSYM(source));
-  regexp_expr_str(mrb, str, (const char *)RSTRING_PTR(src), RSTRING_LEN(src));
-  mrb_str_cat_lit(mrb, str, "/");
-  char opts[4];
-  if (*option_to_str(opts, onig_get_options(reg))) {
-    mrb_str_cat_cstr(mrb, str, opts);
+static void
+onig_regexp_reset_dfa(onig_regexp* re) {
+  if (re->dfa) { onig_dfa_free(re->dfa); }
+  re->dfa = NULL;
+  re->dfa_state = 0;
+}
+#endif
+
+// Whether the subject consists of 7-bit bytes. With MRB_UTF8_STRING mruby
+// caches a positive answer in the string's MRB_STR_ASCII flag, which any
+// modification clears; the bytes are only checked when scan is set so that
+// loops searching one subject repeatedly do not rescan it each time.
+static mrb_bool
+onig_subject_ascii_p(struct RString* subject, mrb_bool scan) {
+#ifdef MRB_UTF8_STRING
+  if (RSTR_ASCII_P(subject)) { return TRUE; }
+#endif
+  if (!scan) { return FALSE; }
+  unsigned char const* p = (unsigned char const*)RSTR_PTR(subject);
+  unsigned char const* const end = p + RSTR_LEN(subject);
+  for (; end - p >= 8; p += 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    if (word & UINT64_C(0x8080808080808080)) { return FALSE; }
   }
-  if (onig_get_encoding(reg) == ONIG_ENCODING_ASCII) {
-    mrb_str_cat_lit(mrb, str, "n");
+  for (; p < end; ++p) {
+    if (*p & 0x80) { return FALSE; }
   }
-  return str;
+#ifdef MRB_UTF8_STRING
+  RSTR_SET_ASCII_FLAG(subject);
+#endif
+  return TRUE;
 }
 
-static mrb_value
-onig_regexp_to_s(mrb_state *mrb, mrb_value self) {
-  int options;
-  const int embeddable = ONIG_OPTION_MULTILINE|ONIG_OPTION_IGNORECASE|ONIG_OPTION_EXTEND;
-  long len;
-  const char* ptr;
-  mrb_value str = mrb_str_new_lit(mrb, "(?");
-  char optbuf[5];
+#ifdef MRB_ONIG_REGEXP_PCRE2
+// Translates re for the PCRE2 JIT on first use. Only UTF-8 patterns Onigmo
+// matches in linear time qualify: the JIT backtracks too, and retry limits
+// do not reach it. The patterns the DFA is there for are left to the DFA.
+static onig_pcre2*
+onig_regexp_pcre2(onig_regexp* re, OnigRegex reg) {
+  if (re->pcre2_state != 0) { return re->pcre2; }
+  re->pcre2_state = -1;
+  onig_regexp_entry const* const entry = re->entry;
+  if (entry->syntax != ONIG_SYNTAX_RUBY || entry->enc != ONIG_ENCODING_UTF8 ||
+      (entry->options & ~(ONIG_OPTION_IGNORECASE | ONIG_OPTION_EXTEND | ONIG_OPTION_MULTILINE))) {
+    return NULL;
+  }
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+  if (re->dfa_mode > 0) { return NULL; }
+#endif
+  onig_ast* const ast = onig_ast_parse(entry->source, entry->source_len, (unsigned)entry->options, 1);
+  if (!ast) { return NULL; }
+  onig_ast_analysis a;
+  onig_ast_analyze(ast, &a);
+  if (a.linear) {
+#ifdef ONIGMO_VERSION_MAJOR
+    int const ascii_range = 1; // \d, \s, \w and \h of ONIG_SYNTAX_RUBY
+#else
+    int const ascii_range = 0;
+#endif
+    re->pcre2 = onig_pcre2_new(ast, entry->source, entry->source_len,
+                               onig_number_of_captures(reg), ascii_range);
+    if (re->pcre2) { re->pcre2_state = 1; }
+  }
+  onig_ast_free(ast);
+  return re->pcre2;
+}
 
-  OnigRegex reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_regexp_type, reg);
-  options = onig_get_options(reg);
-  mrb_value src = mrb_iv_get(mrb, self, MRB_IVSYM(source));
-  ptr = RSTRING_PTR(src);
-  len = RSTRING_LEN(src);
+static void
+onig_regexp_reset_pcre2(onig_regexp* re) {
+  onig_pcre2_free(re->pcre2);
+  re->pcre2 = NULL;
+  re->pcre2_state = 0;
+}
 
- again:
-  if (len >= 4 && ptr[0] == '(' && ptr[1] == '?') {
-    int err = 1;
-    ptr += 2;
-    if ((len -= 2) > 0) {
-      do {
-        if(strchr(ptr, 'i')) { options |= ONIG_OPTION_IGNORECASE; }
-        if(strchr(ptr, 'x')) { options |= ONIG_OPTION_EXTEND; }
-        if(strchr(ptr, 'm')) { options |= ONIG_OPTION_MULTILINE; }
-        ++ptr;
-      } while (--len > 0);
-    }
-    if (len > 1 && *ptr == '-') {
-      ++ptr;
-      --len;
-      do {
-        if(strchr(ptr, 'i')) { options &= ~ONIG_OPTION_IGNORECASE; }
-        if(strchr(ptr, 'x')) { options &= ~ONIG_OPTION_EXTEND; }
-        if(strchr(ptr, 'm')) { options &= ~ONIG_OPTION_MULTILINE; }
-        ++ptr;
-      } while (--len > 0);
-    }
-    if (*ptr == ')') {
-      --len;
-      ++ptr;
-      goto again;
+// Searches [start, end) of subject with the translated pattern. Subjects
+// PCRE2 could see differently (invalid UTF-8, or any non-ASCII byte for
+// patterns using \b or /i) return ONIG_PCRE2_FAIL and go to Onigmo. Only
+// mruby's ASCII flag is trusted across calls: strings can be edited in
+// place without changing their buffer or length, so other subjects are
+// validated by every search.
+static int
+onig_regexp_pcre2_search(onig_pcre2* pcre2, OnigRegex reg, struct RString* subject,
+                         OnigUChar const* str, OnigUChar const* end, OnigUChar const* start,
+                         OnigRegion* region) {
+  int const kind = onig_subject_ascii_p(subject, FALSE)
+      ? ONIG_PCRE2_ASCII : onig_pcre2_subject_kind(str, (size_t)(end - str));
+  if (kind == ONIG_PCRE2_INVALID || (kind == ONIG_PCRE2_UTF8 && onig_pcre2_ascii_only(pcre2)) ||
+      (start < end && (*start & 0xc0) == 0x80)) {
+    return ONIG_PCRE2_FAIL;
+  }
+  long const found = onig_pcre2_search(pcre2, str, (size_t)(end - str), (size_t)(start - str));
+  if (found < 0) { return found == ONIG_PCRE2_NOMATCH ? ONIG_MISMATCH : ONIG_PCRE2_FAIL; }
+  if (region) {
+    int const n = onig_number_of_captures(reg) + 1;
+    if (onig_region_resize(region, n) != ONIG_NORMAL) { return ONIG_PCRE2_FAIL; }
+    for (int i = 0; i < n; ++i) {
+      long beg, fin;
+      onig_pcre2_group(pcre2, i, &beg, &fin);
+      region->beg[i] = beg;
+      region->end[i] = fin;
     }
-    if (*ptr == ':' && ptr[len-1] == ')') {
-      OnigRegex rp;
-      ++ptr;
-      len -= 2;
-      err = onig_new(&rp, (OnigUChar*)ptr, (OnigUChar*)ptr + len, ONIG_OPTION_DEFAULT,
-                     ONIG_ENCODING_UTF8, OnigDefaultSyntax, NULL);
-      onig_free(rp);
+  }
+  return (int)found;
+}
+#endif
+
+static onig_position
+onig_regexp_search_engines(mrb_state* mrb, onig_regexp* re, struct RString* subject,
+                           OnigUChar const* str, OnigUChar const* end, OnigUChar const* start,
+                           OnigUChar const* range, OnigRegion* region, OnigOptionType option) {
+  onig_regexp_entry* const entry = re->entry;
+  OnigRegex reg = onig_regexp_entry_reg(mrb, entry);
+#ifdef MRB_ONIG_REGEXP_PCRE2
+  // Unanchored forward searches of translatable patterns run on the PCRE2
+  // JIT, unless a retry limit asks for Onigmo's accounting.
+  if (subject && range == end && range != start && option == ONIG_OPTION_NONE && re->pcre2_state >= 0
+#ifdef ONIG_REGEXP_RETRY_LIMIT
+      && (re->retry_limit >= 0 ? re->retry_limit : onig_default_retry_limit) == 0
+#endif
+      ) {
+    onig_pcre2* const pcre2 = onig_regexp_pcre2(re, reg);
+    if (pcre2) {
+      int const result = onig_regexp_pcre2_search(pcre2, reg, subject, str, end, start, region);
+      if (result != ONIG_PCRE2_FAIL) { return result; }
     }
-    if (err) {
-      options = onig_get_options(reg);
-      ptr = RSTRING_PTR(src);
-      len = RSTRING_LEN(src);
+  }
+#endif
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+  // The DFA locates the leftmost match in linear time; Onigmo then only
+  // runs anchored at its start to fill in the captures.
+  onig_dfa* const dfa = range == end && option == ONIG_OPTION_NONE && re->dfa_state >= 0
+      ? onig_regexp_dfa(re, reg) : NULL;
+#endif
+  unsigned v = region ? 0 : ONIG_VARIANT_NO_CAPTURE;
+  if ((entry->variant_mask & ONIG_VARIANT_ASCII) && subject && onig_subject_ascii_p(subject, start == str)) {
+    v |= ONIG_VARIANT_ASCII;
+  }
+  if (v) { reg = onig_regexp_entry_variant(mrb, entry, v); }
+  if (range == start) {
+    return onig_regexp_exec(mrb, re, reg, str, end, start, range, start, region, option);
+  }
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+  if (dfa) {
+    long match_start = 0;
+    long const found = onig_dfa_search(dfa, str, end, start, region ? &match_start : NULL);
+    if (found == ONIG_DFA_NOMATCH) { return ONIG_MISMATCH; }
+    if (found >= 0 && !region) { return (onig_position)found; }
+    if (found >= 0) {
+      onig_position const result = onig_regexp_exec(mrb, re, reg, str, end, start, range, str + match_start, region, option);
+      if (result != ONIG_MISMATCH) { return result; }
     }
   }
+#endif
+  return onig_regexp_exec(mrb, re, reg, str, end, start, range, NULL, region, option);
+}
 
-  if (*option_to_str(optbuf, options)) mrb_str_cat_cstr(mrb, str, optbuf);
+#ifdef MRB_ONIG_REGEXP_STATS
+static onig_position
+onig_regexp_search_recorded(mrb_state* mrb, onig_regexp* re, struct RString* subject,
+                            OnigUChar const* str, OnigUChar const* end, OnigUChar const* start,
+                            OnigUChar const* range, OnigRegion* region, OnigOptionType option) {
+  if (!re->stats) {
+    re->stats = (onig_regexp_stats*)mrb_calloc(mrb, 1, sizeof(onig_regexp_stats));
+  }
+  uint64_t const started = onig_stats_now_ns();
+  onig_position const result = onig_regexp_search_engines(mrb, re, subject, str, end, start, range, region, option);
+  uint64_t const elapsed = onig_stats_now_ns() - started;
+
+  onig_regexp_stats* const stats = re->stats;
+  int bucket = 0;
+  while (bucket < ONIG_STATS_BUCKETS - 1 && (elapsed >> (bucket + 1)) != 0) { ++bucket; }
+  ++stats->calls;
+  if (result >= 0) { ++stats->matches; }
+  else if (result == ONIG_MISMATCH) { ++stats->mismatches; }
+  stats->bytes += (uint64_t)(range > start ? range - start : start - range);
+  stats->time_ns += elapsed;
+  ++stats->histogram[bucket];
+  return result;
+}
+#endif
 
-  if ((options & embeddable) != embeddable) {
-    optbuf[0] = '-';
-    option_to_str(optbuf + 1, ~options);
-    mrb_str_cat_cstr(mrb, str, optbuf);
+// Every search of an OnigRegexp goes through here; str and end delimit the
+// bytes of subject (NULL when they are not a String, as for scan_file) and
+// option holds search-time options. range == start
+// asks for a match starting exactly at start (onig_match), which is not
+// what onig_search would do: its range also bounds the match end. Returns
+// the match position or ONIG_MISMATCH; library errors are raised. Without a region
+// the caller only learns whether there is a match: the result is then any
+// non-negative offset.
+static onig_position
+onig_regexp_search(mrb_state* mrb, onig_regexp* re, struct RString* subject,
+                   OnigUChar const* str, OnigUChar const* end, OnigUChar const* start,
+                   OnigUChar const* range, OnigRegion* region, OnigOptionType option) {
+#ifdef MRB_ONIG_REGEXP_STATS
+  if (onig_stats_enabled) {
+    return onig_regexp_search_recorded(mrb, re, subject, str, end, start, range, region, option);
   }
+#endif
+  return onig_regexp_search_engines(mrb, re, subject, str, end, start, range, region, option);
+}
 
-  mrb_str_cat_cstr(mrb, str, ":");
-  regexp_expr_str(mrb, str, ptr, len);
-  mrb_str_cat_cstr(mrb, str, ")");
-  return str;
+static void
+match_data_free(mrb_state* mrb, void* p) {
+  (void)mrb;
+  onig_region_free((OnigRegion*)p, 1);
 }
 
+static struct mrb_data_type mrb_onig_region_type = {
+  "OnigRegion", match_data_free
+};
 
 static mrb_value
-onig_regexp_version(mrb_state* mrb, mrb_value self) {
-  (void)self;
-  return mrb_str_new_cstr(mrb, onig_version());
+onig_str_substr(mrb_state *mrb, mrb_value str, mrb_int beg, mrb_int len)
+{
+#ifdef MRB_UTF8_STRING
+  if (len > 0) {
+    return mrb_str_new(mrb, RSTRING_PTR(str) + beg, len);
+  } else {
+    return mrb_str_new(mrb, NULL, 0);
+  }
+#else
+  return mrb_str_substr(mrb, str, beg, len);
+#endif
 }
 
-static mrb_value
-match_data_to_a(mrb_state* mrb, mrb_value self);
+// Interned captures. Symbols come from mrb_intern(). Frozen Strings are
+// looked up by their bytes in a direct-mapped table of
+// MRB_ONIG_REGEXP_INTERN_SIZE slots per mrb_state, so the table never
+// grows: a new value takes the slot of an older one with the same hash,
+// which stays valid but is no longer handed out. Captures longer than
+// MRB_ONIG_REGEXP_INTERN_MAX_LEN are frozen without a lookup.
+#ifndef MRB_ONIG_REGEXP_INTERN_SIZE
+#define MRB_ONIG_REGEXP_INTERN_SIZE 4096
+#endif
+#ifndef MRB_ONIG_REGEXP_INTERN_MAX_LEN
+#define MRB_ONIG_REGEXP_INTERN_MAX_LEN 64
+#endif
 
-static mrb_int
-match_data_actual_index(mrb_state* mrb, mrb_value self, mrb_value idx_value) {
-  if(mrb_fixnum_p(idx_value)) { return mrb_fixnum(idx_value); }
+typedef struct onig_interner {
+  int mode;         // ONIG_INTERN_*
+  mrb_value table;  // the intern table in ONIG_INTERN_STRING mode
+} onig_interner;
+
+static int
+onig_intern_mode(mrb_state* mrb, mrb_value mode) {
+  if (!mrb_test(mode)) { return ONIG_INTERN_NONE; }
+  if (mrb_type(mode) == MRB_TT_TRUE ||
+      (mrb_symbol_p(mode) && mrb_symbol(mode) == MRB_SYM(string))) {
+    return ONIG_INTERN_STRING;
+  }
+  if (mrb_symbol_p(mode) && mrb_symbol(mode) == MRB_SYM(symbol)) {
+    return ONIG_INTERN_SYMBOL;
+  }
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown intern mode: %S", mode);
+  return ONIG_INTERN_NONE;
+}
+
+static mrb_value
+onig_intern_table(mrb_state* mrb) {
+  struct RClass* const cls = ONIG_STATE(mrb)->cls_onig_regexp;
+  mrb_value table = mrb_obj_iv_get(mrb, (struct RObject*)cls, MRB_SYM(intern_table));
+  if (mrb_nil_p(table)) {
+    table = mrb_ary_new_capa(mrb, MRB_ONIG_REGEXP_INTERN_SIZE);
+    mrb_ary_set(mrb, table, MRB_ONIG_REGEXP_INTERN_SIZE - 1, mrb_nil_value());
+    mrb_obj_iv_set(mrb, (struct RObject*)cls, MRB_SYM(intern_table), table);
+  }
+  return table;
+}
+
+// Sets up the interning of one call: the intern: keyword unless it is
+// absent (undef) or nil, else the setting of the regexp.
+static void
+onig_interner_init(mrb_state* mrb, onig_interner* in, int regexp_mode, mrb_value mode) {
+  in->mode = mrb_undef_p(mode) || mrb_nil_p(mode) ? regexp_mode : onig_intern_mode(mrb, mode);
+  in->table = in->mode == ONIG_INTERN_STRING ? onig_intern_table(mrb) : mrb_nil_value();
+}
+
+// A capture of the len bytes at p.
+static mrb_value
+onig_capture_bytes(mrb_state* mrb, onig_interner const* in, char const* p, mrb_int len) {
+  mrb_value value;
+  switch (in->mode) {
+  case ONIG_INTERN_SYMBOL:
+    return mrb_symbol_value(mrb_intern(mrb, p, (size_t)len));
+  case ONIG_INTERN_STRING:
+    if (len <= MRB_ONIG_REGEXP_INTERN_MAX_LEN) {
+      mrb_int const slot = (mrb_int)(onig_source_hash(p, (size_t)len, 0) % MRB_ONIG_REGEXP_INTERN_SIZE);
+      value = RARRAY_PTR(in->table)[slot];
+      if (mrb_string_p(value) && RSTRING_LEN(value) == len && memcmp(RSTRING_PTR(value), p, (size_t)len) == 0) {
+        return value;
+      }
+      value = mrb_obj_freeze(mrb, mrb_str_new(mrb, p, len));
+      mrb_ary_set(mrb, in->table, slot, value);
+      return value;
+    }
+    return mrb_obj_freeze(mrb, mrb_str_new(mrb, p, len));
+  default:
+    return mrb_str_new(mrb, p, len);
+  }
+}
+
+// onig_str_substr() for captures.
+static mrb_value
+onig_capture_value(mrb_state* mrb, onig_interner const* in, mrb_value str, mrb_int beg, mrb_int len) {
+  if (in->mode == ONIG_INTERN_NONE) { return onig_str_substr(mrb, str, beg, len); }
+  return onig_capture_bytes(mrb, in, len > 0 ? RSTRING_PTR(str) + beg : "", len);
+}
+
+static void
+onig_regexp_analyze_source(mrb_state* mrb, char const* src, size_t len, OnigOptionType options,
+                           OnigEncoding enc, onig_ast_analysis* result) {
+  onig_ast* const ast = onig_ast_parse(src, len, (unsigned)options, enc == ONIG_ENCODING_UTF8);
+  if (!ast) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory while analyzing regexp");
+  }
+  onig_ast_analyze(ast, result);
+  onig_ast_free(ast);
+}
+
+static void
+onig_regexp_analyze_entry(mrb_state* mrb, onig_regexp_entry const* entry, onig_ast_analysis* result) {
+  onig_regexp_analyze_source(mrb, entry->source, entry->source_len, entry->options, entry->enc, result);
+}
+
+static char const*
+onig_regexp_nonlinear_reason(onig_ast_analysis const* a) {
+  if (a->nested_quantifiers) { return "nested quantifiers"; }
+  if (a->overlapping_alternations) { return "overlapping alternatives under repetition"; }
+  if (a->adjacent_quantifiers) { return "adjacent overlapping quantifiers"; }
+  if (a->backreferences) { return "backreference"; }
+  if (a->lookarounds) { return "lookaround"; }
+  return "unsupported construct";
+}
+
+// Raises RegexpError for a pattern OnigRegexp.strict rejects.
+static void
+onig_regexp_check_strict(mrb_state* mrb, onig_ast_analysis const* analysis, mrb_value source) {
+  if (!analysis->linear) {
+    mrb_raisef(mrb, E_REGEXP_ERROR, "pattern may backtrack catastrophically (%S): %S",
+               mrb_str_new_cstr(mrb, onig_regexp_nonlinear_reason(analysis)), source);
+  }
+}
+
+static mrb_value
+onig_regexp_initialize(mrb_state *mrb, mrb_value self) {
+  mrb_value str, flag = mrb_nil_value(), code = mrb_nil_value();
+  mrb_get_args(mrb, "S|oo", &str, &flag, &code);
+
+  int cflag = 0;
+  OnigEncoding enc = ONIG_ENCODING_UTF8;
+  if(mrb_string_p(code)) {
+    char const* str_code = mrb_string_value_ptr(mrb, code);
+    if(strchr(str_code, 'n') || strchr(str_code, 'N')) {
+      enc = ONIG_ENCODING_ASCII;
+    }
+  }
+  if(mrb_nil_p(flag)) {
+  } else if(mrb_type(flag) == MRB_TT_TRUE) {
+    cflag |= ONIG_OPTION_IGNORECASE;
+  } else if(mrb_fixnum_p(flag)) {
+    // every compile-time option; the syntax's defaults are implied (and
+    // part of #options), so leave them out of the registry key
+    cflag = (int)(mrb_fixnum(flag) & ONIG_REGEXP_COMPILE_OPTIONS & ~ONIG_SYNTAX_RUBY->options);
+  } else if(mrb_string_p(flag)) {
+    char const* str_flags = mrb_string_value_ptr(mrb, flag);
+    if(strchr(str_flags, 'i')) { cflag |= ONIG_OPTION_IGNORECASE; }
+    if(strchr(str_flags, 'x')) { cflag |= ONIG_OPTION_EXTEND; }
+    if(strchr(str_flags, 'm')) { cflag |= ONIG_OPTION_MULTILINE; }
+  } else {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown regexp flag: %S", flag);
+  }
+
+  onig_regexp* re = (onig_regexp*)(DATA_TYPE(self) == &mrb_onig_regexp_type ? DATA_PTR(self) : NULL);
+  if (!re) {
+    re = onig_regexp_data_new(mrb);
+    DATA_PTR(self) = re;
+    DATA_TYPE(self) = &mrb_onig_regexp_type;
+  }
+
+#ifdef MRB_ONIG_REGEXP_LITERALS
+  mrb_bool const lazy = enc == ONIG_ENCODING_UTF8 &&
+      onig_regexp_literal_p(RSTRING_PTR(str), (size_t)RSTRING_LEN(str), cflag);
+#else
+  mrb_bool const lazy = FALSE;
+#endif
+  onig_regexp_entry* const entry = onig_regexp_entry_acquire(
+      mrb, RSTRING_PTR(str), (size_t)RSTRING_LEN(str), cflag, enc, ONIG_SYNTAX_RUBY, lazy);
+  if (ONIG_STATE(mrb)->strict) {
+    onig_ast_analysis analysis;
+    onig_regexp_analyze_entry(mrb, entry, &analysis);
+    if (!analysis.linear) {
+      onig_regexp_entry_release(entry);
+      onig_regexp_check_strict(mrb, &analysis, str);
+    }
+  }
+  mrb_iv_set(mrb, self, MRB_IVSYM(source), str);
+
+  if (re->entry) {
+    // re-initialization; drop the previously compiled pattern
+    onig_regexp_entry_release(re->entry);
+  }
+  re->entry = entry;
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+  onig_regexp_reset_dfa(re);
+#endif
+#ifdef MRB_ONIG_REGEXP_PCRE2
+  onig_regexp_reset_pcre2(re);
+#endif
+
+  return self;
+}
+
+static mrb_value
+create_onig_region(mrb_state* mrb, mrb_value const str, mrb_value rex) {
+  mrb_assert(mrb_string_p(str));
+  mrb_assert(mrb_type(rex) == MRB_TT_DATA && DATA_TYPE(rex) == &mrb_onig_regexp_type);
+  mrb_value const c = mrb_obj_value(mrb_data_object_alloc(
+      mrb, ONIG_STATE(mrb)->cls_onig_match_data, onig_region_new(), &mrb_onig_region_type));
+  mrb_iv_set(mrb, c, MRB_SYM(string), mrb_str_dup(mrb, str));
+  mrb_iv_set(mrb, c, MRB_SYM(regexp), rex);
+  return c;
+}
+
+#define MATCH_VALUE_NIL_OR(v) (mrb_nil_p(match_value) ? mrb_nil_value() : (v))
+
+static void
+onig_gv_set(mrb_state* mrb, onig_regexp_state const* st, mrb_value match_value) {
+
+  mrb_gv_set(mrb, st->sym_dollar_tilde, match_value);
+  mrb_gv_set(mrb, st->sym_dollar_ampersand,
+             MATCH_VALUE_NIL_OR(mrb_ary_entry(match_data_to_a(mrb, match_value), 0)));
+  mrb_gv_set(mrb, st->sym_dollar_backtick,
+             MATCH_VALUE_NIL_OR(match_data_pre_match(mrb, match_value)));
+  mrb_gv_set(mrb, st->sym_dollar_quote,
+             MATCH_VALUE_NIL_OR(match_data_post_match(mrb, match_value)));
+  mrb_gv_set(mrb, st->sym_dollar_plus,
+             MATCH_VALUE_NIL_OR(mrb_ary_entry(match_data_to_a(mrb, match_value), -1)));
+
+  // $1 to $9
+  int idx = 1;
+  if (mrb_nil_p(match_value)) {
+    for (; idx < 10; ++idx) {
+      mrb_gv_remove(mrb, st->sym_dollar_numbers[idx]);
+    }
+  } else {
+    OnigRegion* const match = (OnigRegion*)DATA_PTR(match_value);
+
+    // Set $1 to $9 based on match->num_regs
+    int const idx_max = match->num_regs > 10? 10 : match->num_regs;
+
+    // Set available capture groups ($1 to $9)
+    for (; idx < 10; ++idx) {
+      if (idx_max > idx) {
+        mrb_gv_set(mrb, st->sym_dollar_numbers[idx], mrb_funcall_id(mrb, match_value, MRB_OPSYM(aref), 1, mrb_fixnum_value(idx)));
+      } else {
+        mrb_gv_remove(mrb, st->sym_dollar_numbers[idx]);
+      }
+    }
+  }
+}
+
+#define MISMATCH_NIL_OR(v) (result == ONIG_MISMATCH ? mrb_nil_value() : (v))
+
+// The keywords of the search methods, for mrb_get_args. Methods taking
+// the end position positionally accept only the first, options:.
+enum {
+  ONIG_SEARCH_KW_OPTIONS,
+  ONIG_SEARCH_KW_STOP,
+  ONIG_SEARCH_KW_LIMIT,
+  ONIG_SEARCH_KW_INTERN,
+  ONIG_SEARCH_KW_COUNT
+};
+
+typedef struct onig_search_kwargs {
+  mrb_sym names[ONIG_SEARCH_KW_COUNT];
+  mrb_value values[ONIG_SEARCH_KW_COUNT];
+  mrb_kwargs kwargs;
+} onig_search_kwargs;
+
+static mrb_kwargs*
+onig_search_kwargs_init(mrb_state* mrb, onig_search_kwargs* kw, int num) {
+  int i;
+  mrb_assert(num > 0 && num <= ONIG_SEARCH_KW_COUNT);
+  kw->names[ONIG_SEARCH_KW_OPTIONS] = MRB_SYM(options);
+  kw->names[ONIG_SEARCH_KW_STOP] = MRB_SYM(stop);
+  kw->names[ONIG_SEARCH_KW_LIMIT] = MRB_SYM(limit);
+  kw->names[ONIG_SEARCH_KW_INTERN] = MRB_SYM(intern);
+  for (i = 0; i < ONIG_SEARCH_KW_COUNT; ++i) { kw->values[i] = mrb_undef_value(); }
+  kw->kwargs.num = num;
+  kw->kwargs.required = 0;
+  kw->kwargs.table = kw->names;
+  kw->kwargs.values = kw->values;
+  kw->kwargs.rest = NULL;
+  return &kw->kwargs;
+}
+
+static mrb_value
+onig_search_kwargs_get(onig_search_kwargs const* kw, int i) {
+  return mrb_undef_p(kw->values[i]) ? mrb_nil_value() : kw->values[i];
+}
+
+static OnigOptionType
+onig_search_kwargs_options(mrb_state* mrb, onig_search_kwargs const* kw) {
+  mrb_value const value = onig_search_kwargs_get(kw, ONIG_SEARCH_KW_OPTIONS);
+  if (mrb_nil_p(value)) { return ONIG_OPTION_NONE; }
+  mrb_int const options = mrb_fixnum(mrb_to_int(mrb, value));
+  if (options & ~(mrb_int)ONIG_REGEXP_SEARCH_OPTIONS) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "not a search-time option: %S", value);
+  }
+  return (OnigOptionType)options;
+}
+
+// Checks the start position of a search and resolves its end position,
+// nil meaning the end of str. The search then runs as if str ended there,
+// without slicing it. Returns FALSE when nothing can match.
+static mrb_bool
+onig_search_window(mrb_state* mrb, mrb_value str, mrb_int pos, mrb_value stop_value, mrb_int* stop) {
+  mrb_int const len = RSTRING_LEN(str);
+  if (pos < 0 || (pos > 0 && pos >= len)) { return FALSE; }
+  *stop = mrb_nil_p(stop_value) ? len : mrb_fixnum(mrb_to_int(mrb, stop_value));
+  if (*stop > len) { *stop = len; }
+  return *stop >= pos;
+}
+
+// The limit: keyword; -1 when absent.
+static mrb_int
+onig_search_kwargs_limit(mrb_state* mrb, onig_search_kwargs const* kw) {
+  mrb_value const value = onig_search_kwargs_get(kw, ONIG_SEARCH_KW_LIMIT);
+  if (mrb_nil_p(value)) { return -1; }
+  mrb_int const limit = mrb_fixnum(mrb_to_int(mrb, value));
+  if (limit < 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative limit: %S", value);
+  }
+  return limit;
+}
+
+// Sets OnigRegexp.last_match and, when enabled, $~ and friends; nil for
+// a failed search.
+static void
+onig_last_match_set(mrb_state* mrb, mrb_value match_value) {
+  onig_regexp_state const* const st = ONIG_STATE(mrb);
+  mrb_obj_iv_set(mrb, (struct RObject*)st->cls_onig_regexp, MRB_IVSYM(last_match), match_value);
+
+  if (st->set_global_variables &&
+      mrb_class_get_id(mrb, MRB_SYM(Regexp)) == st->cls_onig_regexp)
+  {
+    onig_gv_set(mrb, st, match_value);
+  }
+}
+
+// Searches the bytes of str up to stop from pos, or only at pos when
+// anchored, filling the region of match_value. Loops that do not run user
+// code in between use this and set the last match once at the end.
+static onig_position
+onig_search_region(mrb_state* mrb, onig_regexp* re, mrb_value match_value, mrb_value str, mrb_int pos,
+                   mrb_int stop, mrb_bool anchored, OnigOptionType option) {
+  mrb_assert(mrb_string_p(str));
+  mrb_assert(DATA_TYPE(match_value) == &mrb_onig_region_type);
+  mrb_assert(stop <= RSTRING_LEN(str));
+  OnigRegion* const match = (OnigRegion*)DATA_PTR(match_value);
+  OnigUChar const* str_ptr = (OnigUChar const*)RSTRING_PTR(str);
+  OnigUChar const* const end = str_ptr + stop;
+  return onig_regexp_search(mrb, re, mrb_str_ptr(str), str_ptr, end, str_ptr + pos,
+                            anchored ? str_ptr + pos : end, match, option);
+}
+
+// onig_search_region, updating the last match.
+static onig_position
+onig_match_region(mrb_state* mrb, onig_regexp* re, mrb_value match_value, mrb_value str, mrb_int pos,
+                  mrb_int stop, mrb_bool anchored, OnigOptionType option) {
+  onig_position const result = onig_search_region(mrb, re, match_value, str, pos, stop, anchored, option);
+  onig_last_match_set(mrb, MISMATCH_NIL_OR(match_value));
+  return result;
+}
+
+static onig_position
+onig_match_common(mrb_state* mrb, onig_regexp* re, mrb_value match_value, mrb_value str, mrb_int pos,
+                  OnigOptionType option) {
+  return onig_match_region(mrb, re, match_value, str, pos, RSTRING_LEN(str), FALSE, option);
+}
+
+static mrb_value
+reg_operand(mrb_state *mrb, mrb_value obj) {
+  mrb_value ret;
+
+  if (mrb_symbol_p(obj)) {
+    ret = mrb_sym2str(mrb, mrb_symbol(obj));
+  }
+  else {
+    ret = mrb_string_type(mrb, obj);
+  }
+  return ret;
+}
+
+static mrb_value
+onig_regexp_match(mrb_state *mrb, mrb_value self) {
+  mrb_value str = mrb_nil_value();
+  onig_regexp* re;
+  mrb_int pos = 0;
+  mrb_value stop_value = mrb_nil_value();
+  mrb_int stop;
+  mrb_value block = mrb_nil_value();
+  onig_search_kwargs kw;
+
+  mrb_get_args(mrb, "o|io:&", &str, &pos, &stop_value, onig_search_kwargs_init(mrb, &kw, 1), &block);
+  if (mrb_nil_p(str)) {
+    return mrb_nil_value();
+  }
+  str = reg_operand(mrb, str);
+  if (!onig_search_window(mrb, str, pos, stop_value, &stop)) {
+    return mrb_nil_value();
+  }
+
+  re = onig_regexp_ptr(mrb, self);
+
+  mrb_value const ret = create_onig_region(mrb, str, self);
+  if (onig_match_region(mrb, re, ret, str, pos, stop, FALSE,
+                        onig_search_kwargs_options(mrb, &kw)) == ONIG_MISMATCH) {
+    return mrb_nil_value();
+  }
+
+  if (mrb_nil_p(block)) {
+    return ret;
+  } else {
+    return mrb_yield(mrb, block, ret);
+  }
+}
+
+// Like match, but the match has to start at pos.
+static mrb_value
+onig_regexp_match_at(mrb_state *mrb, mrb_value self) {
+  mrb_value str = mrb_nil_value();
+  mrb_int pos = 0;
+  onig_search_kwargs kw;
+
+  mrb_get_args(mrb, "o|i:", &str, &pos, onig_search_kwargs_init(mrb, &kw, 1));
+  if (mrb_nil_p(str)) {
+    return mrb_nil_value();
+  }
+  str = reg_operand(mrb, str);
+  if (pos < 0 || pos > RSTRING_LEN(str)) {
+    return mrb_nil_value();
+  }
+
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  mrb_value const ret = create_onig_region(mrb, str, self);
+  if (onig_match_region(mrb, re, ret, str, pos, RSTRING_LEN(str), TRUE,
+                        onig_search_kwargs_options(mrb, &kw)) == ONIG_MISMATCH) {
+    return mrb_nil_value();
+  }
+  return ret;
+}
+
+// Yields a MatchData for each match between pos and stop, or returns
+// them in an Array without a block.
+static mrb_value
+onig_regexp_each_match(mrb_state *mrb, mrb_value self) {
+  mrb_value str = mrb_nil_value();
+  mrb_int pos = 0;
+  mrb_value stop_value = mrb_nil_value();
+  mrb_int stop;
+  mrb_value block = mrb_nil_value();
+  onig_search_kwargs kw;
+
+  mrb_get_args(mrb, "o|io:&", &str, &pos, &stop_value, onig_search_kwargs_init(mrb, &kw, 1), &block);
+  mrb_value const result = mrb_nil_p(block) ? mrb_ary_new(mrb) : self;
+  if (mrb_nil_p(str)) {
+    return result;
+  }
+  str = reg_operand(mrb, str);
+  if (!onig_search_window(mrb, str, pos, stop_value, &stop)) {
+    return result;
+  }
+
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  OnigOptionType const option = onig_search_kwargs_options(mrb, &kw);
+  int const ai = mrb_gc_arena_save(mrb);
+  while (pos <= stop) {
+    mrb_value const m_value = create_onig_region(mrb, str, self);
+    if (onig_match_region(mrb, re, m_value, str, pos, stop, FALSE, option) == ONIG_MISMATCH) {
+      break;
+    }
+    OnigRegion const* const m = (OnigRegion*)DATA_PTR(m_value);
+    if (m->beg[0] < m->end[0]) {
+      pos = m->end[0];
+    } else if (m->end[0] < stop) {
+      pos = m->end[0] + utf8len(RSTRING_PTR(str) + m->end[0], RSTRING_PTR(str) + stop);
+    } else {
+      pos = m->end[0] + 1;
+    }
+    if (mrb_nil_p(block)) {
+      mrb_ary_push(mrb, result, m_value);
+    } else {
+      mrb_yield(mrb, block, m_value);
+      if (stop > RSTRING_LEN(str)) { stop = RSTRING_LEN(str); }
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  return result;
+}
+
+// Counts the matches between pos and stop with a single region and no
+// objects; the last match is left alone.
+static mrb_value
+onig_regexp_count(mrb_state *mrb, mrb_value self) {
+  mrb_value str;
+  mrb_int pos = 0;
+  mrb_value stop_value = mrb_nil_value();
+  mrb_int stop;
+  onig_search_kwargs kw;
+
+  mrb_get_args(mrb, "S|io:", &str, &pos, &stop_value, onig_search_kwargs_init(mrb, &kw, 1));
+  if (!onig_search_window(mrb, str, pos, stop_value, &stop)) {
+    return mrb_fixnum_value(0);
+  }
+
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  OnigOptionType const option = onig_search_kwargs_options(mrb, &kw);
+  // owned by a data object so that it is freed if the search raises
+  mrb_value const region_value = mrb_obj_value(mrb_data_object_alloc(
+      mrb, ONIG_STATE(mrb)->cls_onig_match_data, NULL, &mrb_onig_region_type));
+  OnigRegion* const region = onig_region_new();
+  if (!region) { mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory"); }
+  DATA_PTR(region_value) = region;
+
+  OnigUChar const* const p = (OnigUChar const*)RSTRING_PTR(str);
+  mrb_int count = 0;
+  while (pos <= stop) {
+    if (onig_regexp_search(mrb, re, mrb_str_ptr(str), p, p + stop, p + pos, p + stop,
+                           region, option) == ONIG_MISMATCH) {
+      break;
+    }
+    ++count;
+    if (region->beg[0] < region->end[0]) {
+      pos = region->end[0];
+    } else if (region->end[0] < stop) {
+      pos = region->end[0] + utf8len((char const*)p + region->end[0], (char const*)p + stop);
+    } else {
+      pos = region->end[0] + 1;
+    }
+  }
+  return mrb_fixnum_value(count);
+}
+
+static mrb_value
+onig_regexp_match_p(mrb_state *mrb, mrb_value self) {
+  mrb_value str = mrb_nil_value();
+  mrb_int pos = 0;
+  mrb_value stop_value = mrb_nil_value();
+  mrb_int stop;
+  onig_regexp* re;
+  OnigUChar const* str_ptr;
+  onig_search_kwargs kw;
+
+  mrb_get_args(mrb, "o|io:", &str, &pos, &stop_value, onig_search_kwargs_init(mrb, &kw, 1));
+  if (mrb_nil_p(str)) {
+    return mrb_nil_value();
+  }
+  str = reg_operand(mrb, str);
+  if (!onig_search_window(mrb, str, pos, stop_value, &stop)) {
+    return mrb_nil_value();
+  }
+
+  re = onig_regexp_ptr(mrb, self);
+  str_ptr = (OnigUChar const*)RSTRING_PTR(str);
+  return mrb_bool_value(onig_regexp_search(
+      mrb, re, mrb_str_ptr(str), str_ptr, str_ptr + stop,
+      str_ptr + pos, str_ptr + stop, NULL,
+      onig_search_kwargs_options(mrb, &kw)) != ONIG_MISMATCH);
+}
+
+static mrb_value
+string_match_p(mrb_state *mrb, mrb_value self) {
+  mrb_value str = self;
+  mrb_int pos = 0;
+  mrb_value stop_value = mrb_nil_value();
+  mrb_int stop;
+  onig_regexp* re;
+  OnigUChar const* str_ptr;
+  onig_search_kwargs kw;
+
+  mrb_get_args(mrb, "d|io:", &re, &mrb_onig_regexp_type, &pos, &stop_value, onig_search_kwargs_init(mrb, &kw, 1));
+  if (!re || !re->entry) {
+    mrb_raise(mrb, E_TYPE_ERROR, "uninitialized OnigRegexp");
+  }
+  if (mrb_nil_p(str)) {
+    return mrb_nil_value();
+  }
+  str = mrb_string_type(mrb, str);
+  if (!onig_search_window(mrb, str, pos, stop_value, &stop)) {
+    return mrb_nil_value();
+  }
+
+  str_ptr = (OnigUChar const*)RSTRING_PTR(str);
+  return mrb_bool_value(onig_regexp_search(
+      mrb, re, mrb_str_ptr(str), str_ptr, str_ptr + stop,
+      str_ptr + pos, str_ptr + stop, NULL,
+      onig_search_kwargs_options(mrb, &kw)) != ONIG_MISMATCH);
+}
+
+static mrb_value
+onig_regexp_equal(mrb_state *mrb, mrb_value self) {
+  mrb_value other;
+  OnigRegex self_reg, other_reg;
+
+  mrb_get_args(mrb, "o", &other);
+  if (mrb_obj_equal(mrb, self, other)){
+    return mrb_true_value();
+  }
+  if (mrb_nil_p(other)) {
+    return mrb_false_value();
+  }
+  if (!mrb_obj_is_kind_of(mrb, other, ONIG_STATE(mrb)->cls_onig_regexp)) {
+    return mrb_false_value();
+  }
+  self_reg = onig_regexp_get(mrb, self);
+  other_reg = onig_regexp_get(mrb, other);
+
+  if (!self_reg || !other_reg){
+      mrb_raise(mrb, E_RUNTIME_ERROR, "Invalid OnigRegexp");
+  }
+  if (onig_get_options(self_reg) != onig_get_options(other_reg)){
+      return mrb_false_value();
+  }
+  return mrb_str_equal(mrb, mrb_iv_get(mrb, self, MRB_IVSYM(source)), mrb_iv_get(mrb, other, MRB_IVSYM(source))) ?
+      mrb_true_value() : mrb_false_value();
+}
+
+static mrb_value
+onig_regexp_casefold_p(mrb_state *mrb, mrb_value self) {
+  OnigRegex reg;
+
+  reg = onig_regexp_get(mrb, self);
+  return (onig_get_options(reg) & ONIG_OPTION_IGNORECASE) ? mrb_true_value() : mrb_false_value();
+}
+
+typedef struct {
+  mrb_state* mrb;
+  mrb_value names;
+} foreach_name_data;
+
+static int
+foreach_name(const OnigUChar* name, const OnigUChar* name_end, int num, int* num_list, OnigRegex reg, void* arg) {
+  foreach_name_data* data = (foreach_name_data*)arg;
+  mrb_state* mrb = data->mrb;
+  mrb_value key, indexes;
+
+  key = mrb_str_new(mrb, (const char*)name, name_end - name);
+  indexes = mrb_ary_new_capa(mrb, (mrb_int)num);
+  for(int i = 0; i < num; i++) {
+    mrb_ary_push(mrb, indexes, mrb_int_value(mrb, num_list[i]));
+  }
+  mrb_hash_set(mrb, data->names, key, indexes);
+
+  return ONIG_NORMAL;
+}
+
+static mrb_value
+onig_regexp_named_captures_common(mrb_state* mrb, mrb_value self) {
+  OnigRegex reg;
+  foreach_name_data data;
+  int count, result;
+
+  reg = onig_regexp_get(mrb, self);
+
+  count = onig_number_of_names(reg);
+  data.mrb = mrb;
+  data.names = mrb_hash_new_capa(mrb, (mrb_int)count);
+
+  result = onig_foreach_name(reg, foreach_name, &data);
+  if (result != ONIG_NORMAL) {
+    mrb_raisef(mrb, E_REGEXP_ERROR, "onig_foreach_name error");
+  }
+
+  return data.names;
+}
+
+static mrb_value
+onig_regexp_named_captures(mrb_state* mrb, mrb_value self) {
+  return onig_regexp_named_captures_common(mrb, self);
+}
+
+static mrb_value
+onig_regexp_names(mrb_state* mrb, mrb_value self) {
+  return mrb_hash_keys(mrb, onig_regexp_named_captures_common(mrb, self));
+}
+static mrb_value
+onig_regexp_options(mrb_state *mrb, mrb_value self) {
+  OnigRegex reg;
+  reg = onig_regexp_get(mrb, self);
+  return mrb_fixnum_value(onig_get_options(reg));
+}
+
+static char *
+option_to_str(char str[4], int options) {
+  char *p = str;
+  if (options & ONIG_OPTION_MULTILINE) *p++ = 'm';
+  if (options & ONIG_OPTION_IGNORECASE) *p++ = 'i';
+  if (options & ONIG_OPTION_EXTEND) *p++ = 'x';
+  *p = 0;
+  return str;
+}
+
+static mrb_value
+regexp_expr_str(mrb_state *mrb, mrb_value str, const char *p, int len) {
+  const char *pend;
+  char buf[5];
+
+  pend = (const char *) p + len;
+  for (;p < pend; p++) {
+    unsigned char c, cc;
+
+    c = *p;
+    if (c == '/') {
+      buf[0] = '\\'; buf[1] = c;
+      mrb_str_cat(mrb, str, buf, 2);
+      continue;
+    }
+    if (ISPRINT(c)) {
+      buf[0] = c;
+      mrb_str_cat(mrb, str, buf, 1);
+      continue;
+    }
+    switch (c) {
+      case '\n': cc = 'n'; break;
+      case '\r': cc = 'r'; break;
+      case '\t': cc = 't'; break;
+      default: cc = 0; break;
+    }
+    if (cc) {
+      buf[0] = '\\';
+      buf[1] = (char)cc;
+      mrb_str_cat(mrb, str, buf, 2);
+      continue;
+    }
+    else {
+      buf[0] = '\\';
+      buf[3] = '0' + c % 8; c /= 8;
+      buf[2] = '0' + c % 8; c /= 8;
+      buf[1] = '0' + c % 8;
+      mrb_str_cat(mrb, str, buf, 4);
+      continue;
+    }
+  }
+  return str;
+}
+
+static mrb_value
+onig_regexp_inspect(mrb_state *mrb, mrb_value self) {
+  OnigRegex reg;
+  reg = onig_regexp_get(mrb, self);
+  mrb_value str = mrb_str_new_lit(mrb, "/");
+  mrb_value src = mrb_iv_get(mrb, self, MRB_IVSYM(source));
+  regexp_expr_str(mrb, str, (const char *)RSTRING_PTR(src), RSTRING_LEN(src));
+  mrb_str_cat_lit(mrb, str, "/");
+  char opts[4];
+  if (*option_to_str(opts, onig_get_options(reg))) {
+    mrb_str_cat_cstr(mrb, str, opts);
+  }
+  if (onig_get_encoding(reg) == ONIG_ENCODING_ASCII) {
+    mrb_str_cat_lit(mrb, str, "n");
+  }
+  return str;
+}
+
+static mrb_value
+onig_regexp_to_s(mrb_state *mrb, mrb_value self) {
+  int options;
+  const int embeddable = ONIG_OPTION_MULTILINE|ONIG_OPTION_IGNORECASE|ONIG_OPTION_EXTEND;
+  long len;
+  const char* ptr;
+  mrb_value str = mrb_str_new_lit(mrb, "(?");
+  char optbuf[5];
+
+  OnigRegex reg;
+  reg = onig_regexp_get(mrb, self);
+  options = onig_get_options(reg);
+  mrb_value src = mrb_iv_get(mrb, self, MRB_IVSYM(source));
+  ptr = RSTRING_PTR(src);
+  len = RSTRING_LEN(src);
+
+ again:
+  if (len >= 4 && ptr[0] == '(' && ptr[1] == '?') {
+    int err = 1;
+    ptr += 2;
+    if ((len -= 2) > 0) {
+      do {
+        if(strchr(ptr, 'i')) { options |= ONIG_OPTION_IGNORECASE; }
+        if(strchr(ptr, 'x')) { options |= ONIG_OPTION_EXTEND; }
+        if(strchr(ptr, 'm')) { options |= ONIG_OPTION_MULTILINE; }
+        ++ptr;
+      } while (--len > 0);
+    }
+    if (len > 1 && *ptr == '-') {
+      ++ptr;
+      --len;
+      do {
+        if(strchr(ptr, 'i')) { options &= ~ONIG_OPTION_IGNORECASE; }
+        if(strchr(ptr, 'x')) { options &= ~ONIG_OPTION_EXTEND; }
+        if(strchr(ptr, 'm')) { options &= ~ONIG_OPTION_MULTILINE; }
+        ++ptr;
+      } while (--len > 0);
+    }
+    if (*ptr == ')') {
+      --len;
+      ++ptr;
+      goto again;
+    }
+    if (*ptr == ':' && ptr[len-1] == ')') {
+      OnigRegex rp;
+      ++ptr;
+      len -= 2;
+      err = onig_new(&rp, (OnigUChar*)ptr, (OnigUChar*)ptr + len, ONIG_OPTION_DEFAULT,
+                     ONIG_ENCODING_UTF8, OnigDefaultSyntax, NULL);
+      onig_free(rp);
+    }
+    if (err) {
+      options = onig_get_options(reg);
+      ptr = RSTRING_PTR(src);
+      len = RSTRING_LEN(src);
+    }
+  }
+
+  if (*option_to_str(optbuf, options)) mrb_str_cat_cstr(mrb, str, optbuf);
+
+  if ((options & embeddable) != embeddable) {
+    optbuf[0] = '-';
+    option_to_str(optbuf + 1, ~options);
+    mrb_str_cat_cstr(mrb, str, optbuf);
+  }
+
+  mrb_str_cat_cstr(mrb, str, ":");
+  regexp_expr_str(mrb, str, ptr, len);
+  mrb_str_cat_cstr(mrb, str, ")");
+  return str;
+}
+
+
+static mrb_value
+onig_regexp_version(mrb_state* mrb, mrb_value self) {
+  (void)self;
+  return mrb_str_new_cstr(mrb, onig_version());
+}
+
+// Pattern dumps.
+//
+// OnigRegexp.dump writes the definition of already compiled (and therefore
+// valid) regexps into a binary blob tagged with onig_version():
+//
+//   "ONIGRX\0\1"                  magic and format version
+//   u8 length, bytes              Onigmo version string
+//   u32 count
+//   count * { u32 options, u8 encoding, u32 length, bytes }
+//
+// Integers are little-endian. Compiled Onigmo programs are not dumped: they
+// are not exposed by the public API and embed process-specific pointers.
+// Instead OnigRegexp.load skips parsing and compiling when the blob comes from
+// the same Onigmo version, and compiles each pattern on its first use (through
+// the shared registry). Blobs from another version are recompiled eagerly so
+// that patterns the linked library rejects still raise RegexpError at load.
+// The version is the only check that a blob is one dump wrote: load is for
+// caches a program keeps of its own patterns, not for patterns from
+// elsewhere, whose errors would only surface on first use.
+static char const onig_dump_magic[8] = { 'O', 'N', 'I', 'G', 'R', 'X', 0, 1 };
+
+enum {
+  ONIG_DUMP_ENC_UTF8 = 0,
+  ONIG_DUMP_ENC_ASCII = 1,
+};
+
+static void
+onig_dump_u32(mrb_state* mrb, mrb_value buf, uint32_t v) {
+  char const b[] = { (char)(v & 0xff), (char)((v >> 8) & 0xff),
+                     (char)((v >> 16) & 0xff), (char)((v >> 24) & 0xff) };
+  mrb_str_cat(mrb, buf, b, 4);
+}
+
+static uint32_t
+onig_load_u32(unsigned char const* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static mrb_value
+onig_regexp_dump(mrb_state* mrb, mrb_value self) {
+  mrb_value regexps;
+  mrb_get_args(mrb, "A", &regexps);
+
+  char const* const version = onig_version();
+  size_t const version_len = strlen(version);
+  mrb_value const ret = mrb_str_new(mrb, onig_dump_magic, sizeof(onig_dump_magic));
+  char const vlen = (char)(version_len & 0xff);
+  mrb_str_cat(mrb, ret, &vlen, 1);
+  mrb_str_cat(mrb, ret, version, version_len & 0xff);
+  onig_dump_u32(mrb, ret, (uint32_t)RARRAY_LEN(regexps));
+
+  mrb_int i;
+  for (i = 0; i < RARRAY_LEN(regexps); ++i) {
+    mrb_value const re = RARRAY_PTR(regexps)[i];
+    if (!ONIG_REGEXP_P(re)) {
+      mrb_raisef(mrb, E_TYPE_ERROR, "%S is not an OnigRegexp", re);
+    }
+    onig_regexp_entry const* const entry = onig_regexp_ptr(mrb, re)->entry;
+    if (entry->enc != ONIG_ENCODING_UTF8 && entry->enc != ONIG_ENCODING_ASCII) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "cannot dump %S: unsupported encoding", re);
+    }
+    char const enc = entry->enc == ONIG_ENCODING_ASCII ? ONIG_DUMP_ENC_ASCII : ONIG_DUMP_ENC_UTF8;
+    onig_dump_u32(mrb, ret, (uint32_t)entry->options);
+    mrb_str_cat(mrb, ret, &enc, 1);
+    onig_dump_u32(mrb, ret, (uint32_t)entry->source_len);
+    mrb_str_cat(mrb, ret, entry->source, entry->source_len);
+  }
+  return ret;
+}
+
+static void
+onig_regexp_load_error(mrb_state* mrb) {
+  mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid OnigRegexp dump");
+}
+
+static mrb_value
+onig_regexp_load(mrb_state* mrb, mrb_value self) {
+  mrb_value blob;
+  mrb_get_args(mrb, "S", &blob);
+
+  unsigned char const* p = (unsigned char const*)RSTRING_PTR(blob);
+  unsigned char const* const end = p + RSTRING_LEN(blob);
+  struct RClass* const cls = mrb_class_ptr(self);
+
+  if (end - p < (ptrdiff_t)sizeof(onig_dump_magic) + 1 ||
+      memcmp(p, onig_dump_magic, sizeof(onig_dump_magic)) != 0) {
+    onig_regexp_load_error(mrb);
+  }
+  p += sizeof(onig_dump_magic);
+  size_t const version_len = *p++;
+  if ((size_t)(end - p) < version_len + 4) { onig_regexp_load_error(mrb); }
+  mrb_bool const trusted = strlen(onig_version()) == version_len &&
+      memcmp(p, onig_version(), version_len) == 0;
+  p += version_len;
+  uint32_t const count = onig_load_u32(p);
+  p += 4;
+
+  mrb_value const ret = mrb_ary_new_capa(mrb, count < 1024 ? count : 1024);
+  int const ai = mrb_gc_arena_save(mrb);
+  uint32_t i;
+  for (i = 0; i < count; ++i) {
+    if (end - p < 9) { onig_regexp_load_error(mrb); }
+    OnigOptionType const options = (OnigOptionType)onig_load_u32(p);
+    int const enc = p[4];
+    size_t const len = onig_load_u32(p + 5);
+    p += 9;
+    // dump only writes what OnigRegexp.new keeps (see onig_regexp_initialize)
+    if ((size_t)(end - p) < len ||
+        (options & ~(OnigOptionType)(ONIG_REGEXP_COMPILE_OPTIONS & ~ONIG_SYNTAX_RUBY->options)) ||
+        (enc != ONIG_DUMP_ENC_UTF8 && enc != ONIG_DUMP_ENC_ASCII)) {
+      onig_regexp_load_error(mrb);
+    }
+    OnigEncoding const encoding = enc == ONIG_DUMP_ENC_ASCII ? ONIG_ENCODING_ASCII : ONIG_ENCODING_UTF8;
+    if (ONIG_STATE(mrb)->strict) {
+      onig_ast_analysis analysis;
+      onig_regexp_analyze_source(mrb, (char const*)p, len, options, encoding, &analysis);
+      onig_regexp_check_strict(mrb, &analysis, mrb_str_new(mrb, (char const*)p, len));
+    }
+
+    mrb_value const re = mrb_obj_value(mrb_data_object_alloc(mrb, cls, NULL, &mrb_onig_regexp_type));
+    mrb_ary_push(mrb, ret, re);
+    mrb_iv_set(mrb, re, MRB_IVSYM(source), mrb_str_new(mrb, (char const*)p, len));
+    onig_regexp* const data = onig_regexp_data_new(mrb);
+    DATA_PTR(re) = data;
+    data->entry = onig_regexp_entry_acquire(
+        mrb, (char const*)p, len, options, encoding, ONIG_SYNTAX_RUBY, trusted);
+    p += len;
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  return ret;
+}
+
+static mrb_value
+onig_regexp_compiled_p(mrb_state* mrb, mrb_value self) {
+  onig_regexp const* const re = onig_regexp_ptr(mrb, self);
+  return mrb_bool_value(ONIG_ENTRY_REG(re->entry) != NULL);
+}
+
+static mrb_int
+onig_retry_limit_arg(mrb_state* mrb, mrb_int limit) {
+  if (limit < 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "negative retry limit");
+  }
+#ifndef ONIG_REGEXP_RETRY_LIMIT
+  if (limit > 0) {
+    mrb_raise(mrb, E_NOTIMP_ERROR, "the linked Onigmo/Oniguruma does not support retry limits");
+  }
+#endif
+  return limit;
+}
+
+static mrb_value
+onig_regexp_default_retry_limit(mrb_state* mrb, mrb_value self) {
+  (void)self;
+  return mrb_fixnum_value(onig_default_retry_limit);
+}
+
+static mrb_value
+onig_regexp_set_default_retry_limit(mrb_state* mrb, mrb_value self) {
+  mrb_int limit;
+  mrb_get_args(mrb, "i", &limit);
+  onig_default_retry_limit = onig_retry_limit_arg(mrb, limit);
+  return mrb_fixnum_value(limit);
+}
+
+static mrb_value
+onig_regexp_retry_limit(mrb_state* mrb, mrb_value self) {
+  onig_regexp const* const re = onig_regexp_ptr(mrb, self);
+  return re->retry_limit < 0 ? mrb_nil_value() : mrb_fixnum_value(re->retry_limit);
+}
+
+static mrb_value
+onig_regexp_set_retry_limit(mrb_state* mrb, mrb_value self) {
+  mrb_value limit;
+  mrb_get_args(mrb, "o", &limit);
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  re->retry_limit = mrb_nil_p(limit) ? -1 : onig_retry_limit_arg(mrb, mrb_fixnum(mrb_to_int(mrb, limit)));
+  return limit;
+}
+
+static mrb_value
+onig_regexp_intern_captures(mrb_state* mrb, mrb_value self) {
+  onig_regexp const* const re = onig_regexp_ptr(mrb, self);
+  switch (re->intern) {
+  case ONIG_INTERN_STRING: return mrb_symbol_value(MRB_SYM(string));
+  case ONIG_INTERN_SYMBOL: return mrb_symbol_value(MRB_SYM(symbol));
+  default: return mrb_nil_value();
+  }
+}
+
+static mrb_value
+onig_regexp_set_intern_captures(mrb_state* mrb, mrb_value self) {
+  mrb_value mode;
+  mrb_get_args(mrb, "o", &mode);
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  re->intern = (signed char)onig_intern_mode(mrb, mode);
+  return mode;
+}
+
+static mrb_value
+onig_regexp_analyze(mrb_state* mrb, mrb_value self) {
+  onig_regexp const* const re = onig_regexp_ptr(mrb, self);
+  onig_ast_analysis a;
+  onig_regexp_analyze_entry(mrb, re->entry, &a);
+  mrb_value const hash = mrb_hash_new_capa(mrb, 7);
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(nested_quantifiers)), mrb_fixnum_value(a.nested_quantifiers));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(overlapping_alternations)), mrb_fixnum_value(a.overlapping_alternations));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(adjacent_quantifiers)), mrb_fixnum_value(a.adjacent_quantifiers));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(backreferences)), mrb_fixnum_value(a.backreferences));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(lookarounds)), mrb_fixnum_value(a.lookarounds));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(regular)), mrb_bool_value(a.regular));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(linear)), mrb_bool_value(a.linear));
+  return hash;
+}
+
+static mrb_value
+onig_regexp_dfa_p(mrb_state* mrb, mrb_value self) {
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  return mrb_bool_value(onig_regexp_dfa(re, onig_regexp_entry_reg(mrb, re->entry)) != NULL);
+#else
+  onig_regexp_ptr(mrb, self);
+  return mrb_false_value();
+#endif
+}
+
+static mrb_value
+onig_regexp_set_dfa(mrb_state* mrb, mrb_value self) {
+  mrb_value arg;
+  mrb_get_args(mrb, "o", &arg);
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+  onig_regexp_reset_dfa(re);
+#ifdef MRB_ONIG_REGEXP_PCRE2
+  onig_regexp_reset_pcre2(re);
+#endif
+  re->dfa_mode = mrb_nil_p(arg) ? 0 : mrb_bool(arg) ? 1 : -1;
+  if (re->dfa_mode > 0 && !onig_regexp_dfa(re, onig_regexp_entry_reg(mrb, re->entry))) {
+    re->dfa_mode = 0;
+    re->dfa_state = 0;
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "pattern cannot be searched with a DFA: %S",
+               mrb_iv_get(mrb, self, MRB_IVSYM(source)));
+  }
+#else
+  (void)re;
+  if (mrb_test(arg)) {
+    mrb_raise(mrb, E_NOTIMP_ERROR, "DFA engine disabled by MRB_ONIG_REGEXP_NO_DFA");
+  }
+#endif
+  return arg;
+}
+
+// The engine unanchored searches of this regexp start with: :pcre2_jit
+// (which hands subjects it cannot match exactly to the others), :dfa, or
+// the regular expression library.
+static mrb_value
+onig_regexp_engine(mrb_state* mrb, mrb_value self) {
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  OnigRegex const reg = onig_regexp_entry_reg(mrb, re->entry);
+#ifdef MRB_ONIG_REGEXP_PCRE2
+  if (onig_regexp_pcre2(re, reg)) { return mrb_symbol_value(MRB_SYM(pcre2_jit)); }
+#endif
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+  if (onig_regexp_dfa(re, reg)) { return mrb_symbol_value(MRB_SYM(dfa)); }
+#else
+  (void)reg;
+#endif
+#ifdef ONIGMO_VERSION_MAJOR
+  return mrb_symbol_value(MRB_SYM(onigmo));
+#else
+  return mrb_symbol_value(MRB_SYM(oniguruma));
+#endif
+}
+
+// Bytes held for this regexp, including its compiled programs, which are
+// shared with other OnigRegexp objects of the same pattern.
+static mrb_value
+onig_regexp_memsize(mrb_state* mrb, mrb_value self) {
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  size_t size = sizeof(onig_regexp) + onig_regexp_entry_memsize(re->entry);
+#ifdef MRB_ONIG_REGEXP_STATS
+  if (re->stats) { size += sizeof(onig_regexp_stats); }
+#endif
+#ifndef MRB_ONIG_REGEXP_NO_DFA
+  if (re->dfa) { size += onig_dfa_memsize(re->dfa); }
+#endif
+#ifdef MRB_ONIG_REGEXP_PCRE2
+  if (re->pcre2) { size += onig_pcre2_memsize(re->pcre2); }
+#endif
+  return mrb_fixnum_value((mrb_int)size);
+}
+
+// Bytes held by Onigmo in the process: with the bundled library every
+// allocation it makes (programs and match regions) is counted; otherwise
+// the registered patterns are summed up. nil when neither is available.
+static mrb_value
+onig_regexp_total_memsize(mrb_state* mrb, mrb_value self) {
+  (void)mrb; (void)self;
+#if defined(MRB_ONIG_REGEXP_COUNTING_ALLOC)
+  return mrb_fixnum_value((mrb_int)onig_regexp_allocated());
+#elif !defined(MRB_ONIG_REGEXP_NO_SHARED_REGISTRY)
+  size_t size = 0, i;
+  ONIG_REGISTRY_LOCK();
+  for (i = 0; i < onig_registry_bucket_count; ++i) {
+    onig_regexp_entry* entry;
+    for (entry = onig_registry_buckets[i]; entry; entry = entry->next) {
+      size += onig_regexp_entry_memsize(entry);
+    }
+  }
+  ONIG_REGISTRY_UNLOCK();
+  return mrb_fixnum_value((mrb_int)size);
+#else
+  return mrb_nil_value();
+#endif
+}
+
+static mrb_value
+onig_regexp_strict_p(mrb_state* mrb, mrb_value self) {
+  (void)self;
+  return mrb_bool_value(ONIG_STATE(mrb)->strict);
+}
+
+static mrb_value
+onig_regexp_set_strict(mrb_state* mrb, mrb_value self) {
+  mrb_value arg;
+  mrb_get_args(mrb, "o", &arg);
+  ONIG_STATE(mrb)->strict = mrb_bool(arg);
+  return arg;
+}
+
+#ifdef MRB_ONIG_REGEXP_STATS
+static mrb_value
+onig_stats_to_hash(mrb_state* mrb, onig_regexp_stats const* stats) {
+  mrb_value const hash = mrb_hash_new_capa(mrb, 6);
+  mrb_value const histogram = mrb_ary_new_capa(mrb, ONIG_STATS_BUCKETS);
+  int i;
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(calls)), mrb_int_value(mrb, (mrb_int)stats->calls));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(matches)), mrb_int_value(mrb, (mrb_int)stats->matches));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(mismatches)), mrb_int_value(mrb, (mrb_int)stats->mismatches));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(bytes)), mrb_int_value(mrb, (mrb_int)stats->bytes));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(time_ns)), mrb_int_value(mrb, (mrb_int)stats->time_ns));
+  for (i = 0; i < ONIG_STATS_BUCKETS; ++i) {
+    mrb_ary_push(mrb, histogram, mrb_int_value(mrb, (mrb_int)stats->histogram[i]));
+  }
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(histogram)), histogram);
+  return hash;
+}
+
+typedef struct {
+  onig_regexp const** items;
+  size_t count;
+  size_t capa;
+} onig_stats_collect_data;
+
+static int
+onig_stats_collect_i(mrb_state* mrb, struct RBasic* obj, void* data) {
+  onig_stats_collect_data* const c = (onig_stats_collect_data*)data;
+  (void)mrb;
+  if (obj->tt == MRB_TT_DATA && ((struct RData*)obj)->type == &mrb_onig_regexp_type) {
+    onig_regexp const* const re = (onig_regexp const*)((struct RData*)obj)->data;
+    if (re && re->entry && re->stats) {
+      if (c->count < c->capa) { c->items[c->count] = re; }
+      ++c->count;
+    }
+  }
+  return MRB_EACH_OBJ_OK;
+}
+
+static int
+onig_stats_entry_cmp(void const* a, void const* b) {
+  onig_regexp_entry const* const x = (*(onig_regexp const* const*)a)->entry;
+  onig_regexp_entry const* const y = (*(onig_regexp const* const*)b)->entry;
+  if (x == y) { return 0; }
+  if (x->hash != y->hash) { return x->hash < y->hash ? -1 : 1; }
+  if (x->options != y->options) { return x->options < y->options ? -1 : 1; }
+  if (x->enc != y->enc) { return (uintptr_t)x->enc < (uintptr_t)y->enc ? -1 : 1; }
+  if (x->source_len != y->source_len) { return x->source_len < y->source_len ? -1 : 1; }
+  return memcmp(x->source, y->source, x->source_len);
+}
+
+typedef struct {
+  onig_regexp_entry const* entry;
+  mrb_int regexps;
+  onig_regexp_stats stats;
+} onig_stats_group;
+
+static int
+onig_stats_group_cmp(void const* a, void const* b) {
+  onig_stats_group const* const x = (onig_stats_group const*)a;
+  onig_stats_group const* const y = (onig_stats_group const*)b;
+  if (x->stats.time_ns != y->stats.time_ns) { return x->stats.time_ns > y->stats.time_ns ? -1 : 1; }
+  if (x->stats.calls != y->stats.calls) { return x->stats.calls > y->stats.calls ? -1 : 1; }
+  return 0;
+}
+#endif
+
+static mrb_value
+onig_regexp_stats_get(mrb_state* mrb, mrb_value self) {
+#ifdef MRB_ONIG_REGEXP_STATS
+  onig_regexp const* const re = onig_regexp_ptr(mrb, self);
+  return re->stats ? onig_stats_to_hash(mrb, re->stats) : mrb_nil_value();
+#else
+  (void)self;
+  return mrb_nil_value();
+#endif
+}
+
+static mrb_value
+onig_regexp_reset_stats(mrb_state* mrb, mrb_value self) {
+#ifdef MRB_ONIG_REGEXP_STATS
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  mrb_free(mrb, re->stats);
+  re->stats = NULL;
+#endif
+  return self;
+}
+
+static mrb_value
+onig_regexp_stats_enabled_p(mrb_state* mrb, mrb_value self) {
+  (void)self;
+#ifdef MRB_ONIG_REGEXP_STATS
+  return mrb_bool_value(onig_stats_enabled != 0);
+#else
+  return mrb_false_value();
+#endif
+}
+
+static mrb_value
+onig_regexp_set_stats_enabled(mrb_state* mrb, mrb_value self) {
+  mrb_bool enabled;
+  mrb_get_args(mrb, "b", &enabled);
+#ifdef MRB_ONIG_REGEXP_STATS
+  onig_stats_enabled = enabled;
+#else
+  if (enabled) {
+    mrb_raise(mrb, E_NOTIMP_ERROR, "OnigRegexp was built without MRB_ONIG_REGEXP_STATS");
+  }
+#endif
+  return mrb_bool_value(enabled);
+}
+
+// Aggregates the statistics of all live OnigRegexp objects by pattern and
+// returns the n most expensive ones by search time.
+static mrb_value
+onig_regexp_top_patterns(mrb_state* mrb, mrb_value self) {
+  mrb_int n = 10;
+  mrb_get_args(mrb, "|i", &n);
+  mrb_value const ret = mrb_ary_new(mrb);
+#ifdef MRB_ONIG_REGEXP_STATS
+  onig_stats_collect_data c = { NULL, 0, 0 };
+  onig_stats_group* groups;
+  size_t i, group_count = 0;
+
+  mrb_objspace_each_objects(mrb, onig_stats_collect_i, &c);
+  if (c.count == 0 || n <= 0) { return ret; }
+  c.capa = c.count;
+  c.count = 0;
+  c.items = (onig_regexp const**)mrb_malloc(mrb, c.capa * sizeof(onig_regexp const*));
+  mrb_objspace_each_objects(mrb, onig_stats_collect_i, &c);
+  if (c.count > c.capa) { c.count = c.capa; }
+  qsort(c.items, c.count, sizeof(onig_regexp const*), onig_stats_entry_cmp);
+
+  groups = (onig_stats_group*)mrb_malloc(mrb, c.count * sizeof(onig_stats_group));
+  for (i = 0; i < c.count; ++i) {
+    onig_regexp_stats const* const stats = c.items[i]->stats;
+    onig_stats_group* g;
+    int b;
+    if (i == 0 || onig_stats_entry_cmp(&c.items[i - 1], &c.items[i]) != 0) {
+      g = &groups[group_count++];
+      memset(g, 0, sizeof(*g));
+      g->entry = c.items[i]->entry;
+    } else {
+      g = &groups[group_count - 1];
+    }
+    ++g->regexps;
+    g->stats.calls += stats->calls;
+    g->stats.matches += stats->matches;
+    g->stats.mismatches += stats->mismatches;
+    g->stats.bytes += stats->bytes;
+    g->stats.time_ns += stats->time_ns;
+    for (b = 0; b < ONIG_STATS_BUCKETS; ++b) {
+      g->stats.histogram[b] += stats->histogram[b];
+    }
+  }
+  mrb_free(mrb, c.items);
+  qsort(groups, group_count, sizeof(onig_stats_group), onig_stats_group_cmp);
+
+  for (i = 0; i < group_count && (mrb_int)i < n; ++i) {
+    mrb_value const hash = onig_stats_to_hash(mrb, &groups[i].stats);
+    mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(source)),
+                 mrb_str_new(mrb, groups[i].entry->source, groups[i].entry->source_len));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(options)),
+                 mrb_fixnum_value((mrb_int)groups[i].entry->options));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(regexps)), mrb_fixnum_value(groups[i].regexps));
+    mrb_ary_push(mrb, ret, hash);
+  }
+  mrb_free(mrb, groups);
+#else
+  (void)self;
+#endif
+  return ret;
+}
+
+static mrb_value
+match_data_to_a(mrb_state* mrb, mrb_value self);
+
+// Resolves a group given as Integer, Symbol or String name.
+static mrb_int
+onig_group_index(mrb_state* mrb, OnigRegex reg, OnigRegion* region, mrb_value idx_value) {
+  if(mrb_fixnum_p(idx_value)) { return mrb_fixnum(idx_value); }
 
   char const* name = NULL;
   char const* name_end = NULL;
@@ -651,551 +2436,1689 @@ match_data_actual_index(mrb_state* mrb, mrb_value self, mrb_value idx_value) {
   } else { mrb_assert(FALSE); }
   mrb_assert(name && name_end);
 
-  mrb_value const regexp = mrb_iv_get(mrb, self, MRB_SYM(regexp));
-  mrb_assert(!mrb_nil_p(regexp));
-  mrb_assert(DATA_TYPE(regexp) == &mrb_onig_regexp_type);
-  mrb_assert(DATA_TYPE(self) == &mrb_onig_region_type);
-  int const idx = onig_name_to_backref_number(
-      (OnigRegex)DATA_PTR(regexp), (OnigUChar const*)name, (OnigUChar const*)name_end,
-      (OnigRegion*)DATA_PTR(self));
-  if (idx < 0) {
-    mrb_raisef(mrb, E_INDEX_ERROR, "undefined group name reference: %S", idx_value);
+  int const idx = onig_name_to_backref_number(
+      reg, (OnigUChar const*)name, (OnigUChar const*)name_end, region);
+  if (idx < 0) {
+    mrb_raisef(mrb, E_INDEX_ERROR, "undefined group name reference: %S", idx_value);
+  }
+  return idx;
+}
+
+static mrb_int
+match_data_actual_index(mrb_state* mrb, mrb_value self, mrb_value idx_value) {
+  if(mrb_fixnum_p(idx_value)) { return mrb_fixnum(idx_value); }
+
+  mrb_value const regexp = mrb_iv_get(mrb, self, MRB_SYM(regexp));
+  mrb_assert(!mrb_nil_p(regexp));
+  mrb_assert(DATA_TYPE(regexp) == &mrb_onig_regexp_type);
+  mrb_assert(DATA_TYPE(self) == &mrb_onig_region_type);
+  return onig_group_index(mrb, onig_regexp_get(mrb, regexp), (OnigRegion*)DATA_PTR(self), idx_value);
+}
+
+// ISO 15.2.16.3.1
+static mrb_value
+match_data_index(mrb_state* mrb, mrb_value self) {
+  mrb_value src;
+  mrb_int argc; mrb_value *argv;
+
+  mrb_get_args(mrb, "*", &argv, &argc);
+
+  src = match_data_to_a(mrb, self);
+
+  if (argc == 1) {
+    switch (mrb_type(argv[0])) {
+    case MRB_TT_FIXNUM:
+    case MRB_TT_SYMBOL:
+    case MRB_TT_STRING:
+      return mrb_ary_entry(src, match_data_actual_index(mrb, self, argv[0]));
+    default: break;
+    }
+  }
+
+  return mrb_funcall_argv(mrb, src, MRB_OPSYM(aref), argc, argv);
+}
+
+#define match_data_check_index(idx) \
+  if(idx < 0 || reg->num_regs <= idx) \
+    mrb_raisef(mrb, E_INDEX_ERROR, "index %S out of matches", mrb_fixnum_value(idx)) \
+
+// ISO 15.2.16.3.2
+static mrb_value
+match_data_begin(mrb_state* mrb, mrb_value self) {
+  mrb_value idx_value;
+  mrb_get_args(mrb, "o", &idx_value);
+  OnigRegion* reg;
+  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
+  mrb_int const idx = match_data_actual_index(mrb, self, idx_value);
+  match_data_check_index(idx);
+  return mrb_fixnum_value(reg->beg[idx]);
+}
+
+// ISO 15.2.16.3.3
+static mrb_value
+match_data_captures(mrb_state* mrb, mrb_value self) {
+  mrb_value ary = match_data_to_a(mrb, self);
+  return mrb_ary_new_from_values(mrb, RARRAY_LEN(ary) - 1, RARRAY_PTR(ary) + 1);
+}
+
+// ISO 15.2.16.3.4
+static mrb_value
+match_data_end(mrb_state* mrb, mrb_value self) {
+  mrb_value idx_value;
+  mrb_get_args(mrb, "o", &idx_value);
+  OnigRegion* reg;
+  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
+  mrb_int const idx = match_data_actual_index(mrb, self, idx_value);
+  match_data_check_index(idx);
+  return mrb_fixnum_value(reg->end[idx]);
+}
+
+// ISO 15.2.16.3.5
+static mrb_value
+match_data_copy(mrb_state* mrb, mrb_value self) {
+  mrb_value src_val;
+  mrb_get_args(mrb, "o", &src_val);
+
+  OnigRegion* src;
+  Data_Get_Struct(mrb, src_val, &mrb_onig_region_type, src);
+
+  OnigRegion* dst = onig_region_new();
+  onig_region_copy(dst, src);
+
+  DATA_PTR(self) = dst;
+  DATA_TYPE(self) = &mrb_onig_region_type;
+  mrb_iv_set(mrb, self, MRB_SYM(string), mrb_iv_get(mrb, src_val, MRB_SYM(string)));
+  mrb_iv_set(mrb, self, MRB_SYM(regexp), mrb_iv_get(mrb, src_val, MRB_SYM(regexp)));
+  return self;
+}
+
+// ISO 15.2.16.3.6
+// ISO 15.2.16.3.10
+static mrb_value
+match_data_length(mrb_state* mrb, mrb_value self) {
+  OnigRegion* reg;
+  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
+  return mrb_fixnum_value(reg->num_regs);
+}
+
+// ISO 15.2.16.3.7
+static mrb_value
+match_data_offset(mrb_state* mrb, mrb_value self) {
+  mrb_value idx_value;
+  mrb_get_args(mrb, "o", &idx_value);
+  OnigRegion* reg;
+  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
+  mrb_int const idx = match_data_actual_index(mrb, self, idx_value);
+  match_data_check_index(idx);
+  mrb_value ret = mrb_ary_new_capa(mrb, 2);
+  mrb_ary_push(mrb, ret, mrb_fixnum_value(reg->beg[idx]));
+  mrb_ary_push(mrb, ret, mrb_fixnum_value(reg->end[idx]));
+  return ret;
+}
+
+// ISO 15.2.16.3.8
+static mrb_value
+match_data_post_match(mrb_state* mrb, mrb_value self) {
+  OnigRegion* reg;
+  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
+  mrb_value str = mrb_iv_get(mrb, self, MRB_SYM(string));
+  return onig_str_substr(mrb, str, reg->end[0], RSTRING_LEN(str) - reg->end[0]);
+}
+
+// ISO 15.2.16.3.9
+static mrb_value
+match_data_pre_match(mrb_state* mrb, mrb_value self) {
+  OnigRegion* reg;
+  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
+  mrb_value str = mrb_iv_get(mrb, self, MRB_SYM(string));
+  return onig_str_substr(mrb, str, 0, reg->beg[0]);
+}
+
+// ISO 15.2.16.3.11
+static mrb_value
+match_data_string(mrb_state* mrb, mrb_value self) {
+  return mrb_iv_get(mrb, self, MRB_SYM(string));
+}
+
+static mrb_value
+match_data_regexp(mrb_state* mrb, mrb_value self) {
+  return mrb_iv_get(mrb, self, MRB_SYM(regexp));
+}
+
+// ISO 15.2.16.3.12
+static mrb_value
+match_data_to_a(mrb_state* mrb, mrb_value self) {
+  mrb_value cache = mrb_iv_get(mrb, self, MRB_SYM(cache));
+  if(!mrb_nil_p(cache)) {
+    return cache;
+  }
+
+  mrb_value str = mrb_iv_get(mrb, self, MRB_SYM(string));
+  OnigRegion* reg;
+  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
+
+  mrb_value ret = mrb_ary_new_capa(mrb, reg->num_regs);
+  int i, ai = mrb_gc_arena_save(mrb);
+  for(i = 0; i < reg->num_regs; ++i) {
+    if(reg->beg[i] == ONIG_REGION_NOTPOS) {
+      mrb_ary_push(mrb, ret, mrb_nil_value());
+    } else {
+      mrb_ary_push(mrb, ret, onig_str_substr(mrb, str, reg->beg[i], reg->end[i] - reg->beg[i]));
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  mrb_iv_set(mrb, self, MRB_SYM(cache), ret);
+  return ret;
+}
+
+// ISO 15.2.16.3.13
+static mrb_value
+match_data_to_s(mrb_state* mrb, mrb_value self) {
+  mrb_value str = mrb_iv_get(mrb, self, MRB_SYM(string));
+  OnigRegion* reg;
+  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
+  return onig_str_substr(mrb, str, reg->beg[0], reg->end[0] - reg->beg[0]);
+}
+
+static void
+append_replace_str(mrb_state* mrb, mrb_value result, mrb_value replace,
+                   mrb_value src, OnigRegex reg, OnigRegion* match)
+{
+  if (mrb_hash_p(replace)) {
+    mrb_value v = mrb_hash_get(mrb, replace, mrb_str_substr(mrb, src, match->beg[0], match->end[0] - match->beg[0]));
+    v = mrb_str_to_str(mrb, v);
+    mrb_str_cat_str(mrb, result, v);
+    return;
+  }
+
+  mrb_assert(mrb_string_p(replace));
+  char const* ch;
+  char const* const end = RSTRING_PTR(replace) + RSTRING_LEN(replace);
+  for(ch = RSTRING_PTR(replace); ch < end; ++ch) {
+    if (*ch != '\\' || (ch + 1) >= end) {
+      mrb_str_cat(mrb, result, ch, 1);
+      continue;
+    }
+
+    switch(*(++ch)) { // skip back slash and get next char
+      case 'k': { // group name
+        if ((ch + 2) >= end || ch[1] != '<') { goto replace_expr_error; }
+        char const* name_beg = ch += 2;
+        while (*ch != '>') { if(++ch == end) { goto replace_expr_error; } }
+        mrb_assert(ch < end);
+        mrb_assert(*ch == '>');
+        int const idx = onig_name_to_backref_number(
+            reg, (OnigUChar const*)name_beg, (OnigUChar const*)ch, match);
+        if (idx < 0) {
+          mrb_raisef(mrb, E_INDEX_ERROR, "undefined group name reference: %S",
+                     onig_str_substr(mrb, replace, name_beg - RSTRING_PTR(replace), ch - name_beg));
+        }
+        mrb_str_cat(mrb, result, RSTRING_PTR(src) + match->beg[idx], match->end[idx] - match->beg[idx]);
+      } break;
+
+      case '\\': // escaped back slash
+        mrb_str_cat(mrb, result, ch, 1);
+        break;
+
+      default:
+        if (isdigit(*ch)) { // group number 0-9
+          int const idx = *ch - '0';
+          if (idx < match->num_regs) {
+            mrb_str_cat(mrb, result, RSTRING_PTR(src) + match->beg[idx], match->end[idx] - match->beg[idx]);
+          }
+        } else {
+          char const str[] = { '\\', *ch };
+          mrb_str_cat(mrb, result, str, 2);
+        }
+        break;
+    }
+  }
+
+  if(ch == end) { return; }
+
+replace_expr_error:
+  mrb_raisef(mrb, E_REGEXP_ERROR, "invalid replace expression: %S", replace);
+}
+
+// ISO 15.2.10.5.18
+static mrb_value
+string_gsub(mrb_state* mrb, mrb_value self) {
+  mrb_value blk, match_expr, replace_expr = mrb_nil_value();
+  onig_search_kwargs kw;
+  int const argc = mrb_get_args(mrb, "&o|o:", &blk, &match_expr, &replace_expr, onig_search_kwargs_init(mrb, &kw, 1));
+
+  if(!ONIG_REGEXP_P(match_expr)) {
+    mrb_value argv[] = { match_expr, replace_expr };
+    return mrb_funcall_with_block(mrb, self, MRB_SYM(string_gsub), argc, argv, blk);
+  }
+
+  if(argc == 1 && mrb_nil_p(blk)) {
+    return mrb_funcall_id(mrb, self, MRB_SYM(to_enum), 2, mrb_symbol_value(MRB_SYM(onig_regexp_gsub)), match_expr);
+  }
+
+  if(!mrb_nil_p(blk) && !mrb_nil_p(replace_expr)) {
+    blk = mrb_nil_value();
+  }
+
+  if (mrb_nil_p(blk) && !mrb_hash_p(replace_expr)) {
+    replace_expr = mrb_string_type(mrb, replace_expr);
+  }
+
+  onig_regexp* const re = onig_regexp_ptr(mrb, match_expr);
+  OnigRegex const reg = onig_regexp_entry_reg(mrb, re->entry);
+  mrb_value const result = mrb_str_new(mrb, NULL, 0);
+  mrb_value const match_value = create_onig_region(mrb, self, match_expr);
+  OnigRegion* const match = (OnigRegion*)DATA_PTR(match_value);
+  OnigOptionType const option = onig_search_kwargs_options(mrb, &kw);
+  mrb_int last_end_pos = 0;
+  int const ai = mrb_gc_arena_save(mrb);
+
+  while(1) {
+    // only a block can observe the last match of each iteration
+    if((mrb_nil_p(blk)
+        ? onig_search_region(mrb, re, match_value, self, last_end_pos, RSTRING_LEN(self), FALSE, option)
+        : onig_match_common(mrb, re, match_value, self, last_end_pos, option)) == ONIG_MISMATCH) { break; }
+
+    mrb_str_cat(mrb, result, RSTRING_PTR(self) + last_end_pos, match->beg[0] - last_end_pos);
+
+    if(mrb_nil_p(blk)) {
+      append_replace_str(mrb, result, replace_expr, self, reg, match);
+    } else {
+      mrb_value const tmp_str = mrb_str_to_str(mrb, mrb_yield(mrb, blk, onig_str_substr(
+          mrb, self, match->beg[0], match->end[0] - match->beg[0])));
+      mrb_assert(mrb_string_p(tmp_str));
+      mrb_str_concat(mrb, result, tmp_str);
+    }
+
+    last_end_pos = match->end[0];
+    if (match->beg[0] == match->end[0]) {
+      /*
+       * Always consume at least one character of the input string
+       * in order to prevent infinite loops.
+       */
+      char* p = RSTRING_PTR(self) + last_end_pos;
+      char* e = p + RSTRING_LEN(self);
+      mrb_int len = utf8len(p, e);
+      if (RSTRING_LEN(self) < last_end_pos + len) break;
+      mrb_str_cat(mrb, result, p, len);
+      last_end_pos += len;
+    }
+    mrb_gc_arena_restore(mrb, ai);
   }
-  return idx;
+  if (mrb_nil_p(blk)) {
+    onig_last_match_set(mrb, mrb_nil_value());
+  }
+
+  if (RSTRING_LEN(self) < last_end_pos) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid byte sequence in UTF-8");
+  }
+  mrb_str_cat(mrb, result, RSTRING_PTR(self) + last_end_pos, RSTRING_LEN(self) - last_end_pos);
+  return result;
 }
 
-// ISO 15.2.16.3.1
+// ISO 15.2.10.5.32
 static mrb_value
-match_data_index(mrb_state* mrb, mrb_value self) {
-  mrb_value src;
-  mrb_int argc; mrb_value *argv;
+string_scan(mrb_state* mrb, mrb_value self) {
+  mrb_value blk, match_expr;
+  onig_search_kwargs kw;
+  mrb_get_args(mrb, "&o:", &blk, &match_expr, onig_search_kwargs_init(mrb, &kw, ONIG_SEARCH_KW_COUNT));
+
+  if(!ONIG_REGEXP_P(match_expr)) {
+    return mrb_funcall_with_block(mrb, self, MRB_SYM(string_scan),
+                                  1, &match_expr, blk);
+  }
+
+  onig_regexp* const re = onig_regexp_ptr(mrb, match_expr);
+  mrb_value const result = mrb_nil_p(blk)? mrb_ary_new(mrb) : self;
+  mrb_value m_value = create_onig_region(mrb, self, match_expr);
+  OnigRegion* const m = (OnigRegion*)DATA_PTR(m_value);
+  OnigOptionType const option = onig_search_kwargs_options(mrb, &kw);
+  mrb_int stop;
+  mrb_int limit = onig_search_kwargs_limit(mrb, &kw);
+  mrb_int last_end_pos = 0;
+  onig_position onig_result = ONIG_MISMATCH;
+  int i;
+  onig_interner in;
+  onig_interner_init(mrb, &in, re->intern, kw.values[ONIG_SEARCH_KW_INTERN]);
+
+  if (!onig_search_window(mrb, self, 0, onig_search_kwargs_get(&kw, ONIG_SEARCH_KW_STOP), &stop)) {
+    return result;
+  }
+  int const ai = mrb_gc_arena_save(mrb);
+  while (limit != 0 && last_end_pos <= stop) {
+    // only a block can observe the last match of each iteration
+    onig_result = mrb_nil_p(blk)
+        ? onig_search_region(mrb, re, m_value, self, last_end_pos, stop, FALSE, option)
+        : onig_match_region(mrb, re, m_value, self, last_end_pos, stop, FALSE, option);
+    if(onig_result == ONIG_MISMATCH) { break; }
+
+    if(mrb_nil_p(blk)) {
+      mrb_assert(mrb_array_p(result));
+      if(m->num_regs == 1) {
+        mrb_ary_push(mrb, result, onig_capture_value(mrb, &in, self, m->beg[0], m->end[0] - m->beg[0]));
+      } else {
+        mrb_value const elem = mrb_ary_new_capa(mrb, m->num_regs - 1);
+        for(i = 1; i < m->num_regs; ++i) {
+          mrb_ary_push(mrb, elem, onig_capture_value(mrb, &in, self, m->beg[i], m->end[i] - m->beg[i]));
+        }
+        mrb_ary_push(mrb, result, elem);
+      }
+    } else { // call block
+      mrb_assert(mrb_string_p(result));
+      if(m->num_regs == 1) {
+        mrb_yield(mrb, blk, onig_capture_value(mrb, &in, self, m->beg[0], m->end[0] - m->beg[0]));
+      } else {
+        mrb_value argv = mrb_ary_new_capa(mrb, m->num_regs - 1);
+        for(i = 1; i < m->num_regs; ++i) {
+          mrb_ary_push(mrb, argv, onig_capture_value(mrb, &in, self, m->beg[i], m->end[i] - m->beg[i]));
+        }
+        mrb_yield(mrb, blk, argv);
+      }
+      // the block may have shortened the string
+      if (stop > RSTRING_LEN(self)) { stop = RSTRING_LEN(self); }
+    }
+
+    if (m->beg[0] == m->end[0]) {
+      /*
+      * Always consume at least one character of the input string
+      */
+      if (stop > m->end[0]) {
+        char* p = RSTRING_PTR(self) + m->end[0];
+        char* e = RSTRING_PTR(self) + RSTRING_LEN(self);
+        mrb_int len = utf8len(p, e);
+        last_end_pos = m->end[0] + len;
+      } else {
+        last_end_pos = m->end[0] + 1;
+      }
+    } else {
+      last_end_pos = m->end[0];
+    }
+    if (limit > 0) { --limit; }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  if (mrb_nil_p(blk)) {
+    onig_last_match_set(mrb, onig_result == ONIG_MISMATCH ? mrb_nil_value() : m_value);
+  }
+
+  return result;
+}
+
+// Where the pieces of a split go: an Array, or the block, as Strings or,
+// with offsets: true, as begin and end byte offsets. When trailing empty
+// pieces are to be dropped, empty ones are held back until a non-empty
+// piece follows, which gives the same result as popping them at the end
+// without keeping the other pieces.
+typedef struct onig_split_sink {
+  mrb_value str;
+  mrb_value result;   /* nil when yielding */
+  mrb_value block;
+  mrb_value pending;  /* offsets of the held back pieces, or nil */
+  mrb_bool offsets;
+  onig_interner in;
+} onig_split_sink;
+
+static void
+onig_split_put(mrb_state* mrb, onig_split_sink const* sink, mrb_int beg, mrb_int end) {
+  mrb_value piece;
+  if (sink->offsets) {
+    mrb_value argv[] = { mrb_fixnum_value(beg), mrb_fixnum_value(end) };
+    if (mrb_nil_p(sink->result)) {
+      mrb_yield_argv(mrb, sink->block, 2, argv);
+      return;
+    }
+    piece = mrb_ary_new_from_values(mrb, 2, argv);
+  } else {
+    piece = beg == end && sink->in.mode == ONIG_INTERN_NONE
+        ? mrb_str_new_lit(mrb, "") : onig_capture_value(mrb, &sink->in, sink->str, beg, end - beg);
+  }
+  if (mrb_nil_p(sink->result)) {
+    mrb_yield(mrb, sink->block, piece);
+  } else {
+    mrb_ary_push(mrb, sink->result, piece);
+  }
+}
+
+static void
+onig_split_emit(mrb_state* mrb, onig_split_sink const* sink, mrb_int beg, mrb_int end) {
+  if (!mrb_nil_p(sink->pending)) {
+    mrb_int i;
+    if (beg == end) {
+      mrb_ary_push(mrb, sink->pending, mrb_fixnum_value(beg));
+      return;
+    }
+    for (i = 0; i < RARRAY_LEN(sink->pending); ++i) {
+      int const ai = mrb_gc_arena_save(mrb);
+      mrb_int const pos = mrb_fixnum(RARRAY_PTR(sink->pending)[i]);
+      onig_split_put(mrb, sink, pos, pos);
+      mrb_gc_arena_restore(mrb, ai);
+    }
+    mrb_ary_clear(mrb, sink->pending);
+  }
+  onig_split_put(mrb, sink, beg, end);
+}
+
+// ISO 15.2.10.5.35
+static mrb_value
+string_split(mrb_state* mrb, mrb_value self) {
+  mrb_value pattern = mrb_nil_value(), blk; mrb_int limit = 0;
+  mrb_sym const kw_names[] = { MRB_SYM(offsets), MRB_SYM(intern) };
+  mrb_value kw_values[] = { mrb_undef_value(), mrb_undef_value() };
+  mrb_kwargs kwargs;
+  kwargs.num = 2;
+  kwargs.required = 0;
+  kwargs.table = kw_names;
+  kwargs.values = kw_values;
+  kwargs.rest = NULL;
+  int argc = mrb_get_args(mrb, "|oi:&", &pattern, &limit, &kwargs, &blk);
+  mrb_value const offsets = kw_values[0], intern = kw_values[1];
+  onig_regexp_state* const st = ONIG_STATE(mrb);
+  mrb_value const orig = self;
+  mrb_bool lim_p = !(argc == 2 && 0 < limit);
+  mrb_bool awk = FALSE;
+  onig_split_sink sink;
+
+  sink.offsets = !mrb_undef_p(offsets) && mrb_test(offsets);
+  sink.block = blk;
+
+  if(mrb_nil_p(pattern)) { // check $; global variable
+    pattern = mrb_gv_get(mrb, st->sym_dollar_semicolon);
+    if (mrb_nil_p(pattern)) {
+      pattern = mrb_str_new_lit(mrb, " ");
+    } else if (!mrb_string_p(pattern) && !ONIG_REGEXP_P(pattern)) {
+      mrb_raise(mrb, E_TYPE_ERROR, "value of $; must be String or Regexp");
+    }
+    if (argc == 0) { argc = 1; }
+  }
+
+  if (!ONIG_REGEXP_P(pattern)) {
+    /* When another Regexp implementation (e.g. mruby core mruby-regexp) is
+       present, a Regexp literal is not an OnigRegexp. Convert it via its
+       source so that split() still works instead of failing to coerce it
+       into a String. */
+    if(!mrb_nil_p(pattern) && !mrb_string_p(pattern) &&
+       mrb_respond_to(mrb, pattern, MRB_SYM(source))) {
+      mrb_value src = mrb_funcall_id(mrb, pattern, MRB_SYM(source), 0);
+      pattern = mrb_funcall_id(mrb, mrb_obj_value(st->cls_onig_regexp), MRB_SYM(new), 1, src);
+    }
+  }
+
+  if (!ONIG_REGEXP_P(pattern)) {
+    if(!mrb_nil_p(pattern)) { pattern = mrb_string_type(mrb, pattern); }
+    if(mrb_string_p(pattern) && RSTRING_LEN(pattern) == 0) {
+      /* Special case - split into chars */
+      pattern = mrb_funcall_id(mrb, mrb_obj_value(st->cls_onig_regexp), MRB_SYM(new), 1, pattern);
+    } else if (mrb_nil_p(blk) && !sink.offsets &&
+               (mrb_undef_p(intern) || onig_intern_mode(mrb, intern) == ONIG_INTERN_NONE)) {
+      return mrb_funcall_id(mrb, self, MRB_SYM(string_split), argc, pattern, mrb_fixnum_value(limit));
+    } else {
+      /* streaming needs a pattern; " " splits on runs of ASCII whitespace
+         after skipping the leading ones, like awk */
+      awk = RSTRING_LEN(pattern) == 1 && RSTRING_PTR(pattern)[0] == ' ';
+      pattern = awk ? mrb_str_new_lit(mrb, "[\\t\\n\\v\\f\\r ]+")
+                    : mrb_funcall_id(mrb, mrb_obj_value(st->cls_onig_regexp), MRB_SYM(escape), 1, pattern);
+      pattern = mrb_funcall_id(mrb, mrb_obj_value(st->cls_onig_regexp), MRB_SYM(new), 1, pattern);
+    }
+  }
+
+  if (!mrb_nil_p(blk)) {
+    /* shares the buffer, which the block cannot then modify under us */
+    self = mrb_str_dup(mrb, self);
+  }
+  onig_regexp* const re = onig_regexp_ptr(mrb, pattern);
+  sink.str = self;
+  sink.result = mrb_nil_p(blk) ? mrb_ary_new(mrb) : mrb_nil_value();
+  sink.pending = lim_p && limit == 0 ? mrb_ary_new(mrb) : mrb_nil_value();
+  onig_interner_init(mrb, &sink.in, re->intern, intern);
+
+  if(RSTRING_LEN(self) == 0) { return mrb_nil_p(blk) ? sink.result : orig; }
+  if(limit == 1) {
+    if (mrb_nil_p(blk) && !sink.offsets && sink.in.mode == ONIG_INTERN_NONE) {
+      return mrb_ary_new_from_values(mrb, 1, &self);
+    }
+    onig_split_emit(mrb, &sink, 0, RSTRING_LEN(self));
+    return mrb_nil_p(blk) ? sink.result : orig;
+  }
+
+  mrb_value const match_value = create_onig_region(mrb, self, pattern);
+  OnigRegion* const match = (OnigRegion*)DATA_PTR(match_value);
+  char const* ptr = RSTRING_PTR(self);
+  mrb_int len = RSTRING_LEN(self);
+  mrb_int start = 0, beg = 0, end = 0;
+  mrb_int idx = 0, i = 0;
+  mrb_int last_null = 0;
+  if (argc == 2) { i = 1; }
+  if (awk) {
+    while (start < len && (ptr[start] == ' ' || (ptr[start] >= '\t' && ptr[start] <= '\r'))) { ++start; }
+    beg = start;
+  }
+
+  int const ai = mrb_gc_arena_save(mrb);
+  while ((end = onig_search_region(mrb, re, match_value, self, start, len, FALSE, ONIG_OPTION_NONE)) >= 0) {
+    mrb_gc_arena_restore(mrb, ai);
+    if (start == end && match->beg[0] == match->end[0]) {
+      if (!ptr) {
+        onig_split_emit(mrb, &sink, 0, 0);
+        break;
+      }
+      else if (last_null == 1) {
+        onig_split_emit(mrb, &sink, beg, beg + utf8len(ptr+beg, ptr+len));
+        beg = start;
+      }
+      else {
+        if (start == len)
+          start++;
+        else
+          start += utf8len(ptr+start, ptr+len);
+        last_null = 1;
+        continue;
+      }
+    }
+    else {
+      onig_split_emit(mrb, &sink, beg, end);
+      beg = start = match->end[0];
+    }
+    last_null = 0;
+
+    for (idx=1; idx < match->num_regs; idx++) {
+      if (match->beg[idx] == -1) continue;
+      onig_split_emit(mrb, &sink, match->beg[idx], match->end[idx]);
+    }
+    if (!lim_p && limit <= ++i) break;
+  }
+  mrb_gc_arena_restore(mrb, ai);
+
+  onig_last_match_set(mrb, end >= 0 ? match_value : mrb_nil_value());
+
+  if (RSTRING_LEN(self) > 0 && (!lim_p || RSTRING_LEN(self) > beg || limit < 0)) {
+    onig_split_emit(mrb, &sink, beg, RSTRING_LEN(self));
+  }
+
+  return mrb_nil_p(blk) ? sink.result : orig;
+}
+
+// ISO 15.2.10.5.36
+static mrb_value
+string_sub(mrb_state* mrb, mrb_value self) {
+  mrb_value blk, match_expr, replace_expr = mrb_nil_value();
+  int const argc = mrb_get_args(mrb, "&o|o", &blk, &match_expr, &replace_expr);
+
+  if(!ONIG_REGEXP_P(match_expr)) {
+    mrb_value argv[] = { match_expr, replace_expr };
+    return mrb_funcall_with_block(mrb, self, MRB_SYM(string_sub), argc, argv, blk);
+  }
+
+  if(argc == 1 && mrb_nil_p(blk)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (given 1, expected 2)");
+  }
+
+  if(!mrb_nil_p(blk) && !mrb_nil_p(replace_expr)) {
+    blk = mrb_nil_value();
+  }
+
+  if (mrb_nil_p(blk) && !mrb_hash_p(replace_expr)) {
+    replace_expr = mrb_string_type(mrb, replace_expr);
+  }
+
+  onig_regexp* const re = onig_regexp_ptr(mrb, match_expr);
+  OnigRegex const reg = onig_regexp_entry_reg(mrb, re->entry);
+  mrb_value const result = mrb_str_new(mrb, NULL, 0);
+  mrb_value const match_value = create_onig_region(mrb, self, match_expr);
+  OnigRegion* const match = (OnigRegion*)DATA_PTR(match_value);
+
+  onig_position const onig_result = onig_match_common(mrb, re, match_value, self, 0, ONIG_OPTION_NONE);
+  if(onig_result == ONIG_MISMATCH) { return self; }
+
+  mrb_str_cat(mrb, result, RSTRING_PTR(self), match->beg[0]);
+
+  if(mrb_nil_p(blk)) {
+    append_replace_str(mrb, result, replace_expr, self, reg, match);
+  } else {
+    mrb_value const tmp_str = mrb_str_to_str(mrb, mrb_yield(mrb, blk, onig_str_substr(
+        mrb, self, match->beg[0], match->end[0] - match->beg[0])));
+    mrb_assert(mrb_string_p(tmp_str));
+    mrb_str_concat(mrb, result, tmp_str);
+  }
+
+  int const last_end_pos = match->end[0];
+  mrb_str_cat(mrb, result, RSTRING_PTR(self) + last_end_pos, RSTRING_LEN(self) - last_end_pos);
+
+  return result;
+}
+
+// OnigStringScanner: a scan pointer over a string for lexers. It refers to
+// the string instead of copying it, reuses one region for every match and
+// leaves the last match and $~ alone, like CRuby's StringScanner.
+typedef struct onig_scanner {
+  OnigRegion* region;
+  mrb_int pos;
+  mrb_int prev;     // pos before the last match
+  mrb_bool matched;
+} onig_scanner;
+
+static void
+onig_scanner_free(mrb_state* mrb, void* p) {
+  onig_scanner* const sc = (onig_scanner*)p;
+  if (!sc) { return; }
+  onig_region_free(sc->region, 1);
+  mrb_free(mrb, sc);
+}
+
+static struct mrb_data_type mrb_onig_scanner_type = {
+  "OnigStringScanner", onig_scanner_free
+};
+
+static onig_scanner*
+onig_scanner_ptr(mrb_state* mrb, mrb_value self) {
+  onig_scanner* sc;
+  Data_Get_Struct(mrb, self, &mrb_onig_scanner_type, sc);
+  if (!sc) {
+    mrb_raise(mrb, E_TYPE_ERROR, "uninitialized OnigStringScanner");
+  }
+  return sc;
+}
+
+static mrb_value
+onig_scanner_string_value(mrb_state* mrb, mrb_value self) {
+  return mrb_iv_get(mrb, self, MRB_SYM(string));
+}
+
+static mrb_value
+onig_scanner_initialize(mrb_state* mrb, mrb_value self) {
+  mrb_value str;
+  mrb_get_args(mrb, "S", &str);
+  onig_scanner* sc = (onig_scanner*)(DATA_TYPE(self) == &mrb_onig_scanner_type ? DATA_PTR(self) : NULL);
+  if (!sc) {
+    sc = (onig_scanner*)mrb_calloc(mrb, 1, sizeof(onig_scanner));
+    DATA_PTR(self) = sc;
+    DATA_TYPE(self) = &mrb_onig_scanner_type;
+    sc->region = onig_region_new();
+    if (!sc->region) { mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory"); }
+  }
+  sc->pos = sc->prev = 0;
+  sc->matched = FALSE;
+  mrb_iv_set(mrb, self, MRB_SYM(string), str);
+  return self;
+}
+
+// Matches the argument at the scan pointer (anchored) or anywhere after it
+// and advances the pointer to the match end if asked to. Returns the match
+// end or -1.
+static mrb_int
+onig_scanner_exec(mrb_state* mrb, mrb_value self, mrb_bool anchored, mrb_bool advance) {
+  mrb_value re_value;
+  mrb_get_args(mrb, "o", &re_value);
+  if (!ONIG_REGEXP_P(re_value)) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "%S is not an OnigRegexp", re_value);
+  }
+  onig_scanner* const sc = onig_scanner_ptr(mrb, self);
+  onig_regexp* const re = onig_regexp_ptr(mrb, re_value);
+  mrb_value const str = onig_scanner_string_value(mrb, self);
+  OnigUChar const* const p = (OnigUChar const*)RSTRING_PTR(str);
+  OnigUChar const* const end = p + RSTRING_LEN(str);
+
+  sc->matched = FALSE;
+  if (sc->pos > RSTRING_LEN(str)) { return -1; }
+  if (onig_regexp_search(mrb, re, mrb_str_ptr(str), p, end, p + sc->pos,
+                         anchored ? p + sc->pos : end, sc->region, ONIG_OPTION_NONE) == ONIG_MISMATCH) {
+    return -1;
+  }
+  mrb_iv_set(mrb, self, MRB_SYM(regexp), re_value);
+  sc->matched = TRUE;
+  sc->prev = sc->pos;
+  if (advance) { sc->pos = sc->region->end[0]; }
+  return sc->region->end[0];
+}
 
-  mrb_get_args(mrb, "*", &argv, &argc);
+// The string from the old scan pointer to the match end, or nil.
+static mrb_value
+onig_scanner_exec_str(mrb_state* mrb, mrb_value self, mrb_bool anchored, mrb_bool advance) {
+  mrb_int const end = onig_scanner_exec(mrb, self, anchored, advance);
+  if (end < 0) { return mrb_nil_value(); }
+  onig_scanner const* const sc = onig_scanner_ptr(mrb, self);
+  return onig_str_substr(mrb, onig_scanner_string_value(mrb, self), sc->prev, end - sc->prev);
+}
 
-  src = match_data_to_a(mrb, self);
+// The length from the old scan pointer to the match end, or nil.
+static mrb_value
+onig_scanner_exec_len(mrb_state* mrb, mrb_value self, mrb_bool anchored, mrb_bool advance) {
+  mrb_int const end = onig_scanner_exec(mrb, self, anchored, advance);
+  if (end < 0) { return mrb_nil_value(); }
+  return mrb_fixnum_value(end - onig_scanner_ptr(mrb, self)->prev);
+}
 
-  if (argc == 1) {
-    switch (mrb_type(argv[0])) {
-    case MRB_TT_FIXNUM:
-    case MRB_TT_SYMBOL:
-    case MRB_TT_STRING:
-      return mrb_ary_entry(src, match_data_actual_index(mrb, self, argv[0]));
-    default: break;
-    }
-  }
+static mrb_value
+onig_scanner_scan(mrb_state* mrb, mrb_value self) {
+  return onig_scanner_exec_str(mrb, self, TRUE, TRUE);
+}
 
-  return mrb_funcall_argv(mrb, src, MRB_OPSYM(aref), argc, argv);
+static mrb_value
+onig_scanner_check(mrb_state* mrb, mrb_value self) {
+  return onig_scanner_exec_str(mrb, self, TRUE, FALSE);
 }
 
-#define match_data_check_index(idx) \
-  if(idx < 0 || reg->num_regs <= idx) \
-    mrb_raisef(mrb, E_INDEX_ERROR, "index %S out of matches", mrb_fixnum_value(idx)) \
+static mrb_value
+onig_scanner_skip(mrb_state* mrb, mrb_value self) {
+  return onig_scanner_exec_len(mrb, self, TRUE, TRUE);
+}
 
-// ISO 15.2.16.3.2
 static mrb_value
-match_data_begin(mrb_state* mrb, mrb_value self) {
-  mrb_value idx_value;
-  mrb_get_args(mrb, "o", &idx_value);
-  OnigRegion* reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
-  mrb_int const idx = match_data_actual_index(mrb, self, idx_value);
-  match_data_check_index(idx);
-  return mrb_fixnum_value(reg->beg[idx]);
+onig_scanner_match_p(mrb_state* mrb, mrb_value self) {
+  return onig_scanner_exec_len(mrb, self, TRUE, FALSE);
 }
 
-// ISO 15.2.16.3.3
 static mrb_value
-match_data_captures(mrb_state* mrb, mrb_value self) {
-  mrb_value ary = match_data_to_a(mrb, self);
-  return mrb_ary_new_from_values(mrb, RARRAY_LEN(ary) - 1, RARRAY_PTR(ary) + 1);
+onig_scanner_scan_until(mrb_state* mrb, mrb_value self) {
+  return onig_scanner_exec_str(mrb, self, FALSE, TRUE);
 }
 
-// ISO 15.2.16.3.4
 static mrb_value
-match_data_end(mrb_state* mrb, mrb_value self) {
-  mrb_value idx_value;
-  mrb_get_args(mrb, "o", &idx_value);
-  OnigRegion* reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
-  mrb_int const idx = match_data_actual_index(mrb, self, idx_value);
-  match_data_check_index(idx);
-  return mrb_fixnum_value(reg->end[idx]);
+onig_scanner_check_until(mrb_state* mrb, mrb_value self) {
+  return onig_scanner_exec_str(mrb, self, FALSE, FALSE);
 }
 
-// ISO 15.2.16.3.5
 static mrb_value
-match_data_copy(mrb_state* mrb, mrb_value self) {
-  mrb_value src_val;
-  mrb_get_args(mrb, "o", &src_val);
+onig_scanner_skip_until(mrb_state* mrb, mrb_value self) {
+  return onig_scanner_exec_len(mrb, self, FALSE, TRUE);
+}
 
-  OnigRegion* src;
-  Data_Get_Struct(mrb, src_val, &mrb_onig_region_type, src);
+static mrb_value
+onig_scanner_pos(mrb_state* mrb, mrb_value self) {
+  return mrb_fixnum_value(onig_scanner_ptr(mrb, self)->pos);
+}
 
-  OnigRegion* dst = onig_region_new();
-  onig_region_copy(dst, src);
+static mrb_value
+onig_scanner_set_pos(mrb_state* mrb, mrb_value self) {
+  mrb_int pos;
+  mrb_get_args(mrb, "i", &pos);
+  onig_scanner* const sc = onig_scanner_ptr(mrb, self);
+  mrb_int const len = RSTRING_LEN(onig_scanner_string_value(mrb, self));
+  if (pos < 0) { pos += len; }
+  if (pos < 0 || pos > len) {
+    mrb_raise(mrb, E_RANGE_ERROR, "index out of range");
+  }
+  sc->pos = pos;
+  return mrb_fixnum_value(pos);
+}
 
-  DATA_PTR(self) = dst;
-  DATA_TYPE(self) = &mrb_onig_region_type;
-  mrb_iv_set(mrb, self, MRB_SYM(string), mrb_iv_get(mrb, src_val, MRB_SYM(string)));
-  mrb_iv_set(mrb, self, MRB_SYM(regexp), mrb_iv_get(mrb, src_val, MRB_SYM(regexp)));
-  return self;
+static mrb_value
+onig_scanner_matched(mrb_state* mrb, mrb_value self) {
+  onig_scanner const* const sc = onig_scanner_ptr(mrb, self);
+  if (!sc->matched) { return mrb_nil_value(); }
+  return onig_str_substr(mrb, onig_scanner_string_value(mrb, self),
+                         sc->region->beg[0], sc->region->end[0] - sc->region->beg[0]);
 }
 
-// ISO 15.2.16.3.6
-// ISO 15.2.16.3.10
 static mrb_value
-match_data_length(mrb_state* mrb, mrb_value self) {
-  OnigRegion* reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
-  return mrb_fixnum_value(reg->num_regs);
+onig_scanner_matched_p(mrb_state* mrb, mrb_value self) {
+  return mrb_bool_value(onig_scanner_ptr(mrb, self)->matched);
 }
 
-// ISO 15.2.16.3.7
 static mrb_value
-match_data_offset(mrb_state* mrb, mrb_value self) {
+onig_scanner_aref(mrb_state* mrb, mrb_value self) {
   mrb_value idx_value;
   mrb_get_args(mrb, "o", &idx_value);
-  OnigRegion* reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
-  mrb_int const idx = match_data_actual_index(mrb, self, idx_value);
-  match_data_check_index(idx);
-  mrb_value ret = mrb_ary_new_capa(mrb, 2);
-  mrb_ary_push(mrb, ret, mrb_fixnum_value(reg->beg[idx]));
-  mrb_ary_push(mrb, ret, mrb_fixnum_value(reg->end[idx]));
-  return ret;
+  onig_scanner const* const sc = onig_scanner_ptr(mrb, self);
+  if (!sc->matched) { return mrb_nil_value(); }
+  if (!mrb_fixnum_p(idx_value) && !mrb_symbol_p(idx_value) && !mrb_string_p(idx_value)) {
+    idx_value = mrb_to_int(mrb, idx_value);
+  }
+  mrb_value const regexp = mrb_iv_get(mrb, self, MRB_SYM(regexp));
+  mrb_int idx = onig_group_index(mrb, onig_regexp_get(mrb, regexp), sc->region, idx_value);
+  if (idx < 0) { idx += sc->region->num_regs; }
+  if (idx < 0 || idx >= sc->region->num_regs || sc->region->beg[idx] < 0) { return mrb_nil_value(); }
+  return onig_str_substr(mrb, onig_scanner_string_value(mrb, self),
+                         sc->region->beg[idx], sc->region->end[idx] - sc->region->beg[idx]);
 }
 
-// ISO 15.2.16.3.8
 static mrb_value
-match_data_post_match(mrb_state* mrb, mrb_value self) {
-  OnigRegion* reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
-  mrb_value str = mrb_iv_get(mrb, self, MRB_SYM(string));
-  return onig_str_substr(mrb, str, reg->end[0], RSTRING_LEN(str) - reg->end[0]);
+onig_scanner_eos_p(mrb_state* mrb, mrb_value self) {
+  return mrb_bool_value(onig_scanner_ptr(mrb, self)->pos >= RSTRING_LEN(onig_scanner_string_value(mrb, self)));
 }
 
-// ISO 15.2.16.3.9
 static mrb_value
-match_data_pre_match(mrb_state* mrb, mrb_value self) {
-  OnigRegion* reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
-  mrb_value str = mrb_iv_get(mrb, self, MRB_SYM(string));
-  return onig_str_substr(mrb, str, 0, reg->beg[0]);
+onig_scanner_rest(mrb_state* mrb, mrb_value self) {
+  onig_scanner const* const sc = onig_scanner_ptr(mrb, self);
+  mrb_value const str = onig_scanner_string_value(mrb, self);
+  if (sc->pos >= RSTRING_LEN(str)) { return mrb_str_new(mrb, NULL, 0); }
+  return onig_str_substr(mrb, str, sc->pos, RSTRING_LEN(str) - sc->pos);
 }
 
-// ISO 15.2.16.3.11
 static mrb_value
-match_data_string(mrb_state* mrb, mrb_value self) {
-  return mrb_iv_get(mrb, self, MRB_SYM(string));
+onig_scanner_string(mrb_state* mrb, mrb_value self) {
+  onig_scanner_ptr(mrb, self);
+  return onig_scanner_string_value(mrb, self);
 }
 
 static mrb_value
-match_data_regexp(mrb_state* mrb, mrb_value self) {
-  return mrb_iv_get(mrb, self, MRB_SYM(regexp));
+onig_scanner_reset(mrb_state* mrb, mrb_value self) {
+  onig_scanner* const sc = onig_scanner_ptr(mrb, self);
+  sc->pos = sc->prev = 0;
+  sc->matched = FALSE;
+  return self;
 }
 
-// ISO 15.2.16.3.12
 static mrb_value
-match_data_to_a(mrb_state* mrb, mrb_value self) {
-  mrb_value cache = mrb_iv_get(mrb, self, MRB_SYM(cache));
-  if(!mrb_nil_p(cache)) {
-    return cache;
-  }
+onig_scanner_terminate(mrb_state* mrb, mrb_value self) {
+  onig_scanner* const sc = onig_scanner_ptr(mrb, self);
+  sc->pos = RSTRING_LEN(onig_scanner_string_value(mrb, self));
+  sc->matched = FALSE;
+  return self;
+}
 
-  mrb_value str = mrb_iv_get(mrb, self, MRB_SYM(string));
-  OnigRegion* reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
+// OnigRegexp::Cursor: a scan or gsub done in slices by #resume, each
+// trying match starts in at most a budget of bytes of the subject, so that
+// an event loop can run other work in between. Matches are those of a
+// single pass; only their start is bounded by a slice. The cursor holds a
+// shared copy of the subject, which later changes to the string do not
+// affect, and like OnigStringScanner reuses one region and leaves the last
+// match alone.
+typedef struct onig_cursor {
+  OnigRegion* region;
+  mrb_int pos;      // where the next search starts
+  mrb_int copied;   // gsub: the subject before this is in the result
+  mrb_int budget;
+  mrb_int count;    // matches so far
+  mrb_bool gsub;
+  mrb_bool done;
+} onig_cursor;
+
+#define ONIG_CURSOR_DEFAULT_BUDGET (64 * 1024)
 
-  mrb_value ret = mrb_ary_new_capa(mrb, reg->num_regs);
-  int i, ai = mrb_gc_arena_save(mrb);
-  for(i = 0; i < reg->num_regs; ++i) {
-    if(reg->beg[i] == ONIG_REGION_NOTPOS) {
-      mrb_ary_push(mrb, ret, mrb_nil_value());
-    } else {
-      mrb_ary_push(mrb, ret, onig_str_substr(mrb, str, reg->beg[i], reg->end[i] - reg->beg[i]));
-    }
-    mrb_gc_arena_restore(mrb, ai);
+static void
+onig_cursor_free(mrb_state* mrb, void* p) {
+  onig_cursor* const cur = (onig_cursor*)p;
+  if (!cur) { return; }
+  if (cur->region) { onig_region_free(cur->region, 1); }
+  mrb_free(mrb, cur);
+}
+
+static struct mrb_data_type mrb_onig_cursor_type = {
+  "OnigRegexp::Cursor", onig_cursor_free
+};
+
+static onig_cursor*
+onig_cursor_ptr(mrb_state* mrb, mrb_value self) {
+  onig_cursor* cur;
+  Data_Get_Struct(mrb, self, &mrb_onig_cursor_type, cur);
+  if (!cur) {
+    mrb_raise(mrb, E_TYPE_ERROR, "uninitialized OnigRegexp::Cursor");
+  }
+  return cur;
+}
+
+static mrb_int
+onig_cursor_budget_arg(mrb_state* mrb, mrb_value value) {
+  mrb_int const budget = mrb_fixnum(mrb_to_int(mrb, value));
+  if (budget <= 0) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "budget must be positive: %S", value);
   }
+  return budget;
+}
 
-  mrb_iv_set(mrb, self, MRB_SYM(cache), ret);
-  return ret;
+// The budget_bytes: keyword of scan_incremental and gsub_incremental.
+static mrb_kwargs*
+onig_cursor_kwargs_init(mrb_kwargs* kwargs, mrb_sym const* name, mrb_value* value) {
+  *value = mrb_undef_value();
+  kwargs->num = 1;
+  kwargs->required = 0;
+  kwargs->table = name;
+  kwargs->values = value;
+  kwargs->rest = NULL;
+  return kwargs;
 }
 
-// ISO 15.2.16.3.13
 static mrb_value
-match_data_to_s(mrb_state* mrb, mrb_value self) {
-  mrb_value str = mrb_iv_get(mrb, self, MRB_SYM(string));
-  OnigRegion* reg;
-  Data_Get_Struct(mrb, self, &mrb_onig_region_type, reg);
-  return onig_str_substr(mrb, str, reg->beg[0], reg->end[0] - reg->beg[0]);
+onig_cursor_new(mrb_state* mrb, mrb_value re_value, mrb_value str, mrb_value budget_value, mrb_bool gsub) {
+  struct RClass* const cls = mrb_class_get_under(mrb, ONIG_STATE(mrb)->cls_onig_regexp, "Cursor");
+  mrb_int const budget = mrb_undef_p(budget_value) ? ONIG_CURSOR_DEFAULT_BUDGET
+                                                   : onig_cursor_budget_arg(mrb, budget_value);
+  struct RData* const data = mrb_data_object_alloc(mrb, cls, NULL, &mrb_onig_cursor_type);
+  mrb_value const self = mrb_obj_value(data);
+  onig_cursor* const cur = (onig_cursor*)mrb_calloc(mrb, 1, sizeof(onig_cursor));
+  data->data = cur;
+  cur->region = onig_region_new();
+  if (!cur->region) { mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory"); }
+  cur->budget = budget;
+  cur->gsub = gsub;
+  // frozen, since #string hands it out
+  mrb_iv_set(mrb, self, MRB_SYM(string), mrb_obj_freeze(mrb, mrb_str_dup(mrb, str)));
+  mrb_iv_set(mrb, self, MRB_SYM(regexp), re_value);
+  if (gsub) { mrb_iv_set(mrb, self, MRB_SYM(result), mrb_str_new(mrb, NULL, 0)); }
+  return self;
 }
 
-static void
-append_replace_str(mrb_state* mrb, mrb_value result, mrb_value replace,
-                   mrb_value src, OnigRegex reg, OnigRegion* match)
-{
-  if (mrb_hash_p(replace)) {
-    mrb_value v = mrb_hash_get(mrb, replace, mrb_str_substr(mrb, src, match->beg[0], match->end[0] - match->beg[0]));
-    v = mrb_str_to_str(mrb, v);
-    mrb_str_cat_str(mrb, result, v);
-    return;
-  }
+static mrb_value
+onig_regexp_scan_incremental(mrb_state* mrb, mrb_value self) {
+  mrb_value str, budget;
+  mrb_sym const kw_name = MRB_SYM(budget_bytes);
+  mrb_kwargs kwargs;
+  mrb_get_args(mrb, "S:", &str, onig_cursor_kwargs_init(&kwargs, &kw_name, &budget));
+  return onig_cursor_new(mrb, self, str, budget, FALSE);
+}
 
-  mrb_assert(mrb_string_p(replace));
-  char const* ch;
-  char const* const end = RSTRING_PTR(replace) + RSTRING_LEN(replace);
-  for(ch = RSTRING_PTR(replace); ch < end; ++ch) {
-    if (*ch != '\\' || (ch + 1) >= end) {
-      mrb_str_cat(mrb, result, ch, 1);
-      continue;
+static mrb_value
+onig_regexp_gsub_incremental(mrb_state* mrb, mrb_value self) {
+  mrb_value str, replace = mrb_nil_value(), budget, blk;
+  mrb_sym const kw_name = MRB_SYM(budget_bytes);
+  mrb_kwargs kwargs;
+  mrb_get_args(mrb, "S|o:&", &str, &replace, onig_cursor_kwargs_init(&kwargs, &kw_name, &budget), &blk);
+  if (mrb_nil_p(replace)) {
+    if (mrb_nil_p(blk)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (given 1, expected 2)");
     }
+    replace = blk;
+  } else if (!mrb_hash_p(replace)) {
+    replace = mrb_string_type(mrb, replace);
+  }
+  mrb_value const cursor = onig_cursor_new(mrb, self, str, budget, TRUE);
+  mrb_iv_set(mrb, cursor, MRB_SYM(replacement), replace);
+  return cursor;
+}
 
-    switch(*(++ch)) { // skip back slash and get next char
-      case 'k': { // group name
-        if ((ch + 2) >= end || ch[1] != '<') { goto replace_expr_error; }
-        char const* name_beg = ch += 2;
-        while (*ch != '>') { if(++ch == end) { goto replace_expr_error; } }
-        mrb_assert(ch < end);
-        mrb_assert(*ch == '>');
-        int const idx = onig_name_to_backref_number(
-            reg, (OnigUChar const*)name_beg, (OnigUChar const*)ch, match);
-        if (idx < 0) {
-          mrb_raisef(mrb, E_INDEX_ERROR, "undefined group name reference: %S",
-                     onig_str_substr(mrb, replace, name_beg - RSTRING_PTR(replace), ch - name_beg));
-        }
-        mrb_str_cat(mrb, result, RSTRING_PTR(src) + match->beg[idx], match->end[idx] - match->beg[idx]);
-      } break;
+// The leftmost match starting in [pos, stop), or at the end of str when
+// stop reaches it. Onigmo patched with ONIG_HAVE_START_RANGE_SEARCH does
+// this in one search; other libraries also keep the match itself inside
+// the range, so each position is tried in turn.
+static onig_position
+onig_cursor_search(mrb_state* mrb, onig_regexp* re, mrb_value str, mrb_int pos, mrb_int stop,
+                   OnigRegion* region) {
+  OnigUChar const* const p = (OnigUChar const*)RSTRING_PTR(str);
+  mrb_int const len = RSTRING_LEN(str);
+#ifdef ONIG_HAVE_START_RANGE_SEARCH
+  return onig_regexp_search(mrb, re, mrb_str_ptr(str), p, p + len, p + pos, p + stop, region,
+                            ONIG_OPTION_NONE);
+#else
+  for (;;) {
+    if (onig_regexp_search(mrb, re, mrb_str_ptr(str), p, p + len, p + pos, p + pos, region,
+                           ONIG_OPTION_NONE) != ONIG_MISMATCH) {
+      return pos;
+    }
+    if (pos >= len) { return ONIG_MISMATCH; }
+    pos += utf8len((char const*)p + pos, (char const*)p + len);
+    if (pos >= stop && stop < len) { return ONIG_MISMATCH; }
+  }
+#endif
+}
 
-      case '\\': // escaped back slash
-        mrb_str_cat(mrb, result, ch, 1);
-        break;
+// Processes the next slice: scan results are yielded, or returned in an
+// Array; gsub appends to the result, which is returned once complete.
+static mrb_value
+onig_cursor_resume(mrb_state* mrb, mrb_value self) {
+  mrb_value budget_value = mrb_nil_value(), blk;
+  mrb_get_args(mrb, "|o&", &budget_value, &blk);
+  onig_cursor* const cur = onig_cursor_ptr(mrb, self);
+  mrb_int const budget = mrb_nil_p(budget_value) ? cur->budget : onig_cursor_budget_arg(mrb, budget_value);
+  mrb_value const str = mrb_iv_get(mrb, self, MRB_SYM(string));
+  mrb_value const re_value = mrb_iv_get(mrb, self, MRB_SYM(regexp));
+  onig_regexp* const re = onig_regexp_ptr(mrb, re_value);
+  mrb_value const result = cur->gsub ? mrb_iv_get(mrb, self, MRB_SYM(result))
+                                     : mrb_nil_p(blk) ? mrb_ary_new(mrb) : self;
+  mrb_value const replace = cur->gsub ? mrb_iv_get(mrb, self, MRB_SYM(replacement)) : mrb_nil_value();
+  OnigRegion* const m = cur->region;
+  char const* const p = RSTRING_PTR(str);
+  mrb_int const len = RSTRING_LEN(str);
+  mrb_int stop = len - cur->pos <= budget ? len : cur->pos + budget;
+  int i;
+  onig_interner in;
+  onig_interner_init(mrb, &in, cur->gsub ? ONIG_INTERN_NONE : re->intern, mrb_undef_value());
+
+  if (onig_regexp_search_start_p(re->entry->source, re->entry->source_len)) {
+    // the next slice would be a new search start for \G
+    stop = len;
+  } else if (re->entry->enc == ONIG_ENCODING_UTF8) {
+    // a slice ends on a character boundary
+    while (stop < len && ((unsigned char)p[stop] & 0xC0) == 0x80) { ++stop; }
+  }
+  int const ai = mrb_gc_arena_save(mrb);
+  while (!cur->done && (cur->pos < stop || stop == len)) {
+    if (onig_cursor_search(mrb, re, str, cur->pos, stop, m) == ONIG_MISMATCH) {
+      if (stop == len) { cur->done = TRUE; } else { cur->pos = stop; }
+      break;
+    }
+    ++cur->count;
 
-      default:
-        if (isdigit(*ch)) { // group number 0-9
-          int const idx = *ch - '0';
-          if (idx < match->num_regs) {
-            mrb_str_cat(mrb, result, RSTRING_PTR(src) + match->beg[idx], match->end[idx] - match->beg[idx]);
-          }
-        } else {
-          char const str[] = { '\\', *ch };
-          mrb_str_cat(mrb, result, str, 2);
+    if (cur->gsub) {
+      mrb_str_cat(mrb, result, p + cur->copied, m->beg[0] - cur->copied);
+      if (mrb_type(replace) == MRB_TT_PROC) {
+        mrb_str_concat(mrb, result, mrb_str_to_str(mrb, mrb_yield(mrb, replace, onig_str_substr(
+            mrb, str, m->beg[0], m->end[0] - m->beg[0]))));
+      } else {
+        append_replace_str(mrb, result, replace, str, onig_regexp_entry_reg(mrb, re->entry), m);
+      }
+      cur->copied = m->end[0];
+    } else {
+      mrb_value elem;
+      if (m->num_regs == 1) {
+        elem = onig_capture_value(mrb, &in, str, m->beg[0], m->end[0] - m->beg[0]);
+      } else {
+        elem = mrb_ary_new_capa(mrb, m->num_regs - 1);
+        for (i = 1; i < m->num_regs; ++i) {
+          mrb_ary_push(mrb, elem, onig_capture_value(mrb, &in, str, m->beg[i], m->end[i] - m->beg[i]));
         }
-        break;
+      }
+      if (mrb_nil_p(blk)) {
+        mrb_ary_push(mrb, result, elem);
+      } else {
+        mrb_yield(mrb, blk, elem);
+      }
     }
+
+    if (m->beg[0] < m->end[0]) {
+      cur->pos = m->end[0];
+    } else if (m->end[0] < len) {
+      // step over a character after an empty match
+      int const n = utf8len(p + m->end[0], p + len);
+      if (cur->gsub) {
+        mrb_str_cat(mrb, result, p + m->end[0], n);
+        cur->copied = m->end[0] + n;
+      }
+      cur->pos = m->end[0] + n;
+    } else {
+      cur->done = TRUE;
+    }
+    mrb_gc_arena_restore(mrb, ai);
   }
 
-  if(ch == end) { return; }
+  if (!cur->gsub) { return result; }
+  if (!cur->done) { return mrb_nil_value(); }
+  if (cur->copied < len) {
+    mrb_str_cat(mrb, result, p + cur->copied, len - cur->copied);
+    cur->copied = len;
+  }
+  return result;
+}
 
-replace_expr_error:
-  mrb_raisef(mrb, E_REGEXP_ERROR, "invalid replace expression: %S", replace);
+static mrb_value
+onig_cursor_done_p(mrb_state* mrb, mrb_value self) {
+  return mrb_bool_value(onig_cursor_ptr(mrb, self)->done);
 }
 
-// ISO 15.2.10.5.18
 static mrb_value
-string_gsub(mrb_state* mrb, mrb_value self) {
-  mrb_value blk, match_expr, replace_expr = mrb_nil_value();
-  int const argc = mrb_get_args(mrb, "&o|o", &blk, &match_expr, &replace_expr);
+onig_cursor_pos(mrb_state* mrb, mrb_value self) {
+  return mrb_fixnum_value(onig_cursor_ptr(mrb, self)->pos);
+}
 
-  if(!ONIG_REGEXP_P(match_expr)) {
-    mrb_value argv[] = { match_expr, replace_expr };
-    return mrb_funcall_with_block(mrb, self, MRB_SYM(string_gsub), argc, argv, blk);
-  }
+static mrb_value
+onig_cursor_count(mrb_state* mrb, mrb_value self) {
+  return mrb_fixnum_value(onig_cursor_ptr(mrb, self)->count);
+}
 
-  if(argc == 1 && mrb_nil_p(blk)) {
-    return mrb_funcall_id(mrb, self, MRB_SYM(to_enum), 2, mrb_symbol_value(MRB_SYM(onig_regexp_gsub)), match_expr);
-  }
+static mrb_value
+onig_cursor_budget(mrb_state* mrb, mrb_value self) {
+  return mrb_fixnum_value(onig_cursor_ptr(mrb, self)->budget);
+}
 
-  if(!mrb_nil_p(blk) && !mrb_nil_p(replace_expr)) {
-    blk = mrb_nil_value();
-  }
+static mrb_value
+onig_cursor_set_budget(mrb_state* mrb, mrb_value self) {
+  mrb_value value;
+  mrb_get_args(mrb, "o", &value);
+  onig_cursor_ptr(mrb, self)->budget = onig_cursor_budget_arg(mrb, value);
+  return value;
+}
 
-  if (mrb_nil_p(blk) && !mrb_hash_p(replace_expr)) {
-    replace_expr = mrb_string_type(mrb, replace_expr);
-  }
+static mrb_value
+onig_cursor_string(mrb_state* mrb, mrb_value self) {
+  onig_cursor_ptr(mrb, self);
+  return mrb_iv_get(mrb, self, MRB_SYM(string));
+}
 
-  OnigRegex reg;
-  Data_Get_Struct(mrb, match_expr, &mrb_onig_regexp_type, reg);
-  mrb_value const result = mrb_str_new(mrb, NULL, 0);
-  mrb_value const match_value = create_onig_region(mrb, self, match_expr);
-  OnigRegion* const match = (OnigRegion*)DATA_PTR(match_value);
-  int last_end_pos = 0;
+static mrb_value
+onig_cursor_regexp(mrb_state* mrb, mrb_value self) {
+  onig_cursor_ptr(mrb, self);
+  return mrb_iv_get(mrb, self, MRB_SYM(regexp));
+}
+
+// gsub: the result so far; nil for a scan
+static mrb_value
+onig_cursor_result(mrb_state* mrb, mrb_value self) {
+  onig_cursor_ptr(mrb, self);
+  return mrb_iv_get(mrb, self, MRB_SYM(result));
+}
 
-  while(1) {
-    if(onig_match_common(mrb, reg, match_value, self, last_end_pos) == ONIG_MISMATCH) { break; }
+// OnigRegexp#scan_file, #grep_file and #count_file search the contents of
+// a file mapped read-only (see onig_regexp_file.h) rather than a String, so
+// only the results are copied. Onigmo 6 reports positions as OnigPosition,
+// so files are searched whole, with the results of String#scan on their
+// contents. Libraries reporting them as int (see onig_position) refuse
+// files over ONIG_FILE_MAX bytes.
+#if defined(ONIGMO_VERSION_MAJOR) && ONIGMO_VERSION_MAJOR >= 6
+#define ONIG_FILE_MAX ((size_t)MRB_INT_MAX)
+#else
+#define ONIG_FILE_MAX ((size_t)INT_MAX < (size_t)MRB_INT_MAX ? (size_t)INT_MAX : (size_t)MRB_INT_MAX)
+#endif
 
-    mrb_str_cat(mrb, result, RSTRING_PTR(self) + last_end_pos, match->beg[0] - last_end_pos);
+static void
+onig_file_free(mrb_state* mrb, void* p) {
+  if (!p) { return; }
+  onig_file_map_close((onig_file_map*)p);
+  mrb_free(mrb, p);
+}
 
-    if(mrb_nil_p(blk)) {
-      append_replace_str(mrb, result, replace_expr, self, reg, match);
-    } else {
-      mrb_value const tmp_str = mrb_str_to_str(mrb, mrb_yield(mrb, blk, onig_str_substr(
-          mrb, self, match->beg[0], match->end[0] - match->beg[0])));
-      mrb_assert(mrb_string_p(tmp_str));
-      mrb_str_concat(mrb, result, tmp_str);
-    }
+static struct mrb_data_type mrb_onig_file_type = {
+  "OnigRegexpFile", onig_file_free
+};
 
-    last_end_pos = match->end[0];
-    if (match->beg[0] == match->end[0]) {
-      /*
-       * Always consume at least one character of the input string
-       * in order to prevent infinite loops.
-       */
-      char* p = RSTRING_PTR(self) + last_end_pos;
-      char* e = p + RSTRING_LEN(self);
-      int len = utf8len(p, e);
-      if (RSTRING_LEN(self) < last_end_pos + len) break;
-      mrb_str_cat(mrb, result, p, len);
-      last_end_pos += len;
-    }
+// Maps the file at path to be searched. The mapping is owned by
+// *holder, so that it is released by the GC if the search raises;
+// onig_file_close() releases it at once.
+static onig_file_map*
+onig_file_open(mrb_state* mrb, mrb_value path, mrb_value* holder) {
+  char const* const cpath = mrb_string_value_cstr(mrb, &path);
+  *holder = mrb_obj_value(mrb_data_object_alloc(mrb, mrb->object_class, NULL, &mrb_onig_file_type));
+  onig_file_map* const map = (onig_file_map*)mrb_malloc(mrb, sizeof(onig_file_map));
+  int const err = onig_file_map_open(map, cpath);
+  if (err) {
+    mrb_free(mrb, map);
+    errno = err;
+    mrb_sys_fail(mrb, cpath);
   }
-
-  if (RSTRING_LEN(self) < last_end_pos) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "invalid byte sequence in UTF-8");
+  DATA_PTR(*holder) = map;
+  if (map->len > ONIG_FILE_MAX) {
+    mrb_raisef(mrb, E_RANGE_ERROR, "file too large to search: %S", path);
   }
-  mrb_str_cat(mrb, result, RSTRING_PTR(self) + last_end_pos, RSTRING_LEN(self) - last_end_pos);
-  return result;
+  return map;
 }
 
-// ISO 15.2.10.5.32
-static mrb_value
-string_scan(mrb_state* mrb, mrb_value self) {
-  mrb_value blk, match_expr;
-  mrb_get_args(mrb, "&o", &blk, &match_expr);
+static void
+onig_file_close(mrb_state* mrb, mrb_value holder) {
+  onig_file_map* const map = (onig_file_map*)DATA_PTR(holder);
+  DATA_PTR(holder) = NULL;
+  onig_file_free(mrb, map);
+}
 
-  if(!ONIG_REGEXP_P(match_expr)) {
-    return mrb_funcall_with_block(mrb, self, MRB_SYM(string_scan),
-                                  1, &match_expr, blk);
+// Finds the first match starting at or after pos.
+static mrb_bool
+onig_file_search(mrb_state* mrb, onig_regexp* re, onig_file_map const* map, mrb_int pos, OnigRegion* region) {
+  OnigUChar const* const p = (OnigUChar const*)map->ptr;
+  OnigUChar const* const end = p + map->len;
+  if (pos > (mrb_int)map->len) { return FALSE; }
+  return onig_regexp_search(mrb, re, NULL, p, end, p + pos, end, region, ONIG_OPTION_NONE) != ONIG_MISMATCH;
+}
+
+// Where a scan goes on after the match in region, as String#scan does.
+static mrb_int
+onig_file_next_pos(onig_file_map const* map, OnigRegion const* region) {
+  mrb_int const len = (mrb_int)map->len;
+  if (region->beg[0] < region->end[0]) { return region->end[0]; }
+  if (region->end[0] < len) {
+    return region->end[0] + utf8len(map->ptr + region->end[0], map->ptr + len);
   }
+  return region->end[0] + 1;
+}
 
-  OnigRegex reg;
-  Data_Get_Struct(mrb, match_expr, &mrb_onig_regexp_type, reg);
-  mrb_value const result = mrb_nil_p(blk)? mrb_ary_new(mrb) : self;
-  mrb_value m_value = create_onig_region(mrb, self, match_expr);
-  OnigRegion* const m = (OnigRegion*)DATA_PTR(m_value);
-  int last_end_pos = 0;
-  int i;
+// A region owned by a data object so that it is freed if the search raises.
+static mrb_value
+onig_file_region(mrb_state* mrb, OnigRegion** region) {
+  mrb_value const region_value = mrb_obj_value(mrb_data_object_alloc(
+      mrb, ONIG_STATE(mrb)->cls_onig_match_data, NULL, &mrb_onig_region_type));
+  *region = onig_region_new();
+  if (!*region) { mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory"); }
+  DATA_PTR(region_value) = *region;
+  return region_value;
+}
 
-  while (1) {
-    if(onig_match_common(mrb, reg, m_value, self, last_end_pos) == ONIG_MISMATCH) { break; }
+// Yields each match in the file, or its captures when the pattern has
+// groups, or with offsets: true its begin and end byte offsets; returns
+// them in an Array without a block, else the number of matches. Captures
+// follow intern_captures unless intern: is given.
+static mrb_value
+onig_regexp_scan_file(mrb_state* mrb, mrb_value self) {
+  mrb_value path, blk;
+  mrb_sym const kw_names[] = { MRB_SYM(offsets), MRB_SYM(intern) };
+  mrb_value kw_values[] = { mrb_undef_value(), mrb_undef_value() };
+  mrb_kwargs kwargs;
+  kwargs.num = 2;
+  kwargs.required = 0;
+  kwargs.table = kw_names;
+  kwargs.values = kw_values;
+  kwargs.rest = NULL;
+  mrb_get_args(mrb, "S:&", &path, &kwargs, &blk);
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  mrb_bool const offsets = !mrb_undef_p(kw_values[0]) && mrb_test(kw_values[0]);
+  onig_interner in;
+  onig_interner_init(mrb, &in, re->intern, kw_values[1]);
+
+  mrb_value holder;
+  onig_file_map const* const map = onig_file_open(mrb, path, &holder);
+  OnigRegion* region;
+  onig_file_region(mrb, &region);
+  mrb_value const result = mrb_nil_p(blk) ? mrb_ary_new(mrb) : mrb_nil_value();
+  mrb_int pos = 0, count = 0;
+  int i;
 
-    if(mrb_nil_p(blk)) {
-      mrb_assert(mrb_array_p(result));
-      if(m->num_regs == 1) {
-        mrb_ary_push(mrb, result, onig_str_substr(mrb, self, m->beg[0], m->end[0] - m->beg[0]));
-      } else {
-        mrb_value const elem = mrb_ary_new_capa(mrb, m->num_regs - 1);
-        for(i = 1; i < m->num_regs; ++i) {
-          mrb_ary_push(mrb, elem, onig_str_substr(mrb, self, m->beg[i], m->end[i] - m->beg[i]));
-        }
-        mrb_ary_push(mrb, result, elem);
+  int const ai = mrb_gc_arena_save(mrb);
+  while (onig_file_search(mrb, re, map, pos, region)) {
+    mrb_value elem;
+    ++count;
+    if (offsets) {
+      mrb_value argv[] = { mrb_int_value(mrb, region->beg[0]), mrb_int_value(mrb, region->end[0]) };
+      if (!mrb_nil_p(blk)) {
+        mrb_yield_argv(mrb, blk, 2, argv);
+        goto next;
       }
-    } else { // call block
-      mrb_assert(mrb_string_p(result));
-      if(m->num_regs == 1) {
-        mrb_yield(mrb, blk, onig_str_substr(mrb, self, m->beg[0], m->end[0] - m->beg[0]));
-      } else {
-        mrb_value argv = mrb_ary_new_capa(mrb, m->num_regs - 1);
-        for(i = 1; i < m->num_regs; ++i) {
-          mrb_ary_push(mrb, argv, onig_str_substr(mrb, self, m->beg[i], m->end[i] - m->beg[i]));
-        }
-        mrb_yield(mrb, blk, argv);
+      elem = mrb_ary_new_from_values(mrb, 2, argv);
+    } else if (region->num_regs == 1) {
+      elem = onig_capture_bytes(mrb, &in, map->ptr + region->beg[0], region->end[0] - region->beg[0]);
+    } else {
+      elem = mrb_ary_new_capa(mrb, region->num_regs - 1);
+      for (i = 1; i < region->num_regs; ++i) {
+        mrb_ary_push(mrb, elem, region->beg[i] == ONIG_REGION_NOTPOS ? mrb_nil_value()
+                     : onig_capture_bytes(mrb, &in, map->ptr + region->beg[i], region->end[i] - region->beg[i]));
       }
     }
+    if (mrb_nil_p(blk)) {
+      mrb_ary_push(mrb, result, elem);
+    } else {
+      mrb_yield(mrb, blk, elem);
+    }
+  next:
+    pos = onig_file_next_pos(map, region);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  onig_file_close(mrb, holder);
+  return mrb_nil_p(blk) ? result : mrb_int_value(mrb, count);
+}
 
-    if (m->beg[0] == m->end[0]) {
-      /*
-      * Always consume at least one character of the input string
-      */
-      if (RSTRING_LEN(self) > m->end[0]) {
-        char* p = RSTRING_PTR(self) + last_end_pos;
-        char* e = p + RSTRING_LEN(self);
-        int len = utf8len(p, e);
-        last_end_pos = m->end[0] + len;
+// Yields each line of the file in which a match starts, with its line
+// number, or with offsets: true its begin and end byte offsets and line
+// number. Lines keep their newline. Without a block the lines, or the
+// [beg, end, lineno] triples, are returned in an Array, else the number of
+// matching lines.
+static mrb_value
+onig_regexp_grep_file(mrb_state* mrb, mrb_value self) {
+  mrb_value path, blk;
+  mrb_sym const kw_name = MRB_SYM(offsets);
+  mrb_value offsets_value = mrb_undef_value();
+  mrb_kwargs kwargs;
+  kwargs.num = 1;
+  kwargs.required = 0;
+  kwargs.table = &kw_name;
+  kwargs.values = &offsets_value;
+  kwargs.rest = NULL;
+  mrb_get_args(mrb, "S:&", &path, &kwargs, &blk);
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  mrb_bool const offsets = !mrb_undef_p(offsets_value) && mrb_test(offsets_value);
+
+  mrb_value holder;
+  onig_file_map const* const map = onig_file_open(mrb, path, &holder);
+  OnigRegion* region;
+  onig_file_region(mrb, &region);
+  mrb_value const result = mrb_nil_p(blk) ? mrb_ary_new(mrb) : mrb_nil_value();
+  char const* const p = map->ptr;
+  mrb_int const len = (mrb_int)map->len;
+  mrb_int pos = 0, lineno = 1, count = 0;
+
+  // pos is the start of a line, and lineno its number
+  int const ai = mrb_gc_arena_save(mrb);
+  while (pos < len && onig_file_search(mrb, re, map, pos, region)) {
+    mrb_int const at = region->beg[0];
+    mrb_int beg = pos, end;
+    char const* nl;
+    // an empty match after the final newline is on no line
+    if (at == len && p[len - 1] == '\n') { break; }
+    while ((nl = (char const*)memchr(p + beg, '\n', (size_t)(at - beg))) != NULL) {
+      beg = nl - p + 1;
+      ++lineno;
+    }
+    nl = at < len ? (char const*)memchr(p + at, '\n', (size_t)(len - at)) : NULL;
+    end = nl ? nl - p + 1 : len;
+    ++count;
+    if (offsets) {
+      mrb_value argv[] = { mrb_int_value(mrb, beg), mrb_int_value(mrb, end), mrb_int_value(mrb, lineno) };
+      if (mrb_nil_p(blk)) {
+        mrb_ary_push(mrb, result, mrb_ary_new_from_values(mrb, 3, argv));
       } else {
-        last_end_pos = m->end[0] + 1;
+        mrb_yield_argv(mrb, blk, 3, argv);
       }
     } else {
-      last_end_pos = m->end[0];
+      mrb_value const line = mrb_str_new(mrb, p + beg, end - beg);
+      if (mrb_nil_p(blk)) {
+        mrb_ary_push(mrb, result, line);
+      } else {
+        mrb_value argv[] = { line, mrb_int_value(mrb, lineno) };
+        mrb_yield_argv(mrb, blk, 2, argv);
+      }
     }
+    pos = end;
+    ++lineno;
+    mrb_gc_arena_restore(mrb, ai);
   }
-
-  return result;
+  onig_file_close(mrb, holder);
+  return mrb_nil_p(blk) ? result : mrb_int_value(mrb, count);
 }
 
-// ISO 15.2.10.5.35
+// The number of matches scan_file would yield, without creating objects.
 static mrb_value
-string_split(mrb_state* mrb, mrb_value self) {
-  mrb_value pattern = mrb_nil_value(); mrb_int limit = 0;
-  int argc = mrb_get_args(mrb, "|oi", &pattern, &limit);
-  mrb_value result, tmp;
-  mrb_bool lim_p = !(argc == 2 && 0 < limit);
-
-  if(mrb_nil_p(pattern)) { // check $; global variable
-    pattern = mrb_gv_get(mrb, ONIG_SYM_SEMICOLON(mrb));
-    if (mrb_nil_p(pattern)) {
-      pattern = mrb_str_new_lit(mrb, " ");
-    } else if (!mrb_string_p(pattern) && !ONIG_REGEXP_P(pattern)) {
-      mrb_raise(mrb, E_TYPE_ERROR, "value of $; must be String or Regexp");
-    }
-    if (argc == 0) { argc = 1; }
+onig_regexp_count_file(mrb_state* mrb, mrb_value self) {
+  mrb_value path;
+  mrb_get_args(mrb, "S", &path);
+  onig_regexp* const re = onig_regexp_ptr(mrb, self);
+  mrb_value holder;
+  onig_file_map const* const map = onig_file_open(mrb, path, &holder);
+  OnigRegion* region;
+  onig_file_region(mrb, &region);
+  mrb_int pos = 0, count = 0;
+  while (onig_file_search(mrb, re, map, pos, region)) {
+    ++count;
+    pos = onig_file_next_pos(map, region);
   }
+  onig_file_close(mrb, holder);
+  return mrb_int_value(mrb, count);
+}
 
-  if (!ONIG_REGEXP_P(pattern)) {
-    /* When another Regexp implementation (e.g. mruby core mruby-regexp) is
-       present, a Regexp literal is not an OnigRegexp. Convert it via its
-       source so that split() still works instead of failing to coerce it
-       into a String. */
-    if(!mrb_nil_p(pattern) && !mrb_string_p(pattern) &&
-       mrb_respond_to(mrb, pattern, MRB_SYM(source))) {
-      mrb_value src = mrb_funcall_id(mrb, pattern, MRB_SYM(source), 0);
-      pattern = mrb_funcall_id(mrb, mrb_obj_value(ONIG_REGEXP_CLASS(mrb)), MRB_SYM(new), 1, src);
-    }
-  }
+// OnigRegexp::LiteralSet: a set of literal keywords searched with an
+// Aho-Corasick automaton, leftmost-longest. The keywords are kept in the
+// order given; a match is reported as the index of its keyword, so that
+// replacements are looked up with the keyword objects themselves.
+static void
+onig_literal_set_free(mrb_state* mrb, void* p) {
+  (void)mrb;
+  onig_ac_free((onig_ac*)p);
+}
 
-  if (!ONIG_REGEXP_P(pattern)) {
-    if(!mrb_nil_p(pattern)) { pattern = mrb_string_type(mrb, pattern); }
-    if(mrb_string_p(pattern) && RSTRING_LEN(pattern) == 0) {
-      /* Special case - split into chars */
-      pattern = mrb_funcall_id(mrb, mrb_obj_value(ONIG_REGEXP_CLASS(mrb)), MRB_SYM(new), 1, pattern);
-    } else {
-      return mrb_funcall_id(mrb, self, MRB_SYM(string_split), argc, pattern, mrb_fixnum_value(limit));
-    }
-  }
+static struct mrb_data_type mrb_onig_literal_set_type = {
+  "OnigRegexp::LiteralSet", onig_literal_set_free
+};
 
-  if(RSTRING_LEN(self) == 0) { return mrb_ary_new(mrb); }
-  if(limit == 1) { return mrb_ary_new_from_values(mrb, 1, &self); }
+static onig_ac*
+onig_literal_set_ptr(mrb_state* mrb, mrb_value self) {
+  onig_ac* ac;
+  Data_Get_Struct(mrb, self, &mrb_onig_literal_set_type, ac);
+  if (!ac) {
+    mrb_raise(mrb, E_TYPE_ERROR, "uninitialized OnigRegexp::LiteralSet");
+  }
+  return ac;
+}
 
-  result = mrb_ary_new(mrb);
+static mrb_value
+onig_literal_set_initialize(mrb_state* mrb, mrb_value self) {
+  mrb_value keywords;
+  mrb_sym const kw_name = MRB_SYM(ignorecase);
+  mrb_value ignorecase = mrb_undef_value();
+  mrb_kwargs kwargs;
+  kwargs.num = 1;
+  kwargs.required = 0;
+  kwargs.table = &kw_name;
+  kwargs.values = &ignorecase;
+  kwargs.rest = NULL;
+  mrb_get_args(mrb, "o:", &keywords, &kwargs);
+
+  keywords = mrb_hash_p(keywords) ? mrb_hash_keys(mrb, keywords) : mrb_ensure_array_type(mrb, keywords);
+  if (RARRAY_LEN(keywords) > INT32_MAX) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "too many keywords");
+  }
 
-  OnigRegex reg;
-  Data_Get_Struct(mrb, pattern, &mrb_onig_regexp_type, reg);
-  mrb_value const match_value = create_onig_region(mrb, self, pattern);
-  OnigRegion* const match = (OnigRegion*)DATA_PTR(match_value);
-  char *ptr = mrb_str_to_cstr(mrb, self);
-  mrb_int len = RSTRING_LEN(self);
-  mrb_int start = 0, beg = 0, end = 0;
-  mrb_int idx = 0, i = 0;
-  mrb_int last_null = 0;
-  if (argc == 2) { i = 1; }
+  onig_ac_free((onig_ac*)DATA_PTR(self));
+  DATA_PTR(self) = NULL;
+  DATA_TYPE(self) = &mrb_onig_literal_set_type;
+  onig_ac* const ac = onig_ac_new(!mrb_undef_p(ignorecase) && mrb_test(ignorecase));
+  if (!ac) { mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory"); }
+  DATA_PTR(self) = ac;
 
-  mrb_value last_set_global_variables = mrb_obj_iv_get(mrb, (struct RObject*)ONIG_REGEXP_CLASS(mrb), MRB_IVSYM(set_global_variables));
-  mrb_obj_iv_set(mrb, (struct RObject*)ONIG_REGEXP_CLASS(mrb), MRB_IVSYM(set_global_variables), mrb_false_value());
-  while ((end = onig_match_common(mrb, reg, match_value, self, start)) >= 0) {
-    if (start == end && match->beg[0] == match->end[0]) {
-      if (!ptr) {
-        mrb_ary_push(mrb, result, mrb_str_new_lit(mrb, ""));
-        break;
-      }
-      else if (last_null == 1) {
-        mrb_ary_push(mrb, result, onig_str_substr(mrb, self, beg, utf8len(ptr+beg, ptr+len)));
-        beg = start;
-      }
-      else {
-        if (start == len)
-          start++;
-        else
-          start += utf8len(ptr+start, ptr+len);
-        last_null = 1;
-        continue;
-      }
+  mrb_value const strings = mrb_ary_new_capa(mrb, RARRAY_LEN(keywords));
+  mrb_int i;
+  for (i = 0; i < RARRAY_LEN(keywords); ++i) {
+    mrb_value const keyword = mrb_string_type(mrb, RARRAY_PTR(keywords)[i]);
+    mrb_ary_push(mrb, strings, keyword);
+    if (RSTRING_LEN(keyword) == 0) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "empty keyword");
     }
-    else {
-      mrb_ary_push(mrb, result, onig_str_substr(mrb, self, beg, end-beg));
-      beg = start = match->end[0];
+    if (onig_ac_add(ac, (unsigned char const*)RSTRING_PTR(keyword), RSTRING_LEN(keyword), (int32_t)i) < 0) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory");
     }
-    last_null = 0;
+  }
+  if (onig_ac_build(ac) < 0) { mrb_raise(mrb, E_RUNTIME_ERROR, "out of memory"); }
+  mrb_iv_set(mrb, self, MRB_SYM(keywords), strings);
+  return self;
+}
 
-    for (idx=1; idx < match->num_regs; idx++) {
-      if (match->beg[idx] == -1) continue;
-      if (match->beg[idx] == match->end[idx])
-        tmp = mrb_str_new_lit(mrb, "");
-      else
-        tmp = onig_str_substr(mrb, self, match->beg[idx], match->end[idx]-match->beg[idx]);
-      mrb_ary_push(mrb, result, tmp);
+// Finds the next keyword in str from pos.
+static mrb_bool
+onig_literal_set_next(onig_ac const* ac, mrb_value str, mrb_int pos, size_t* beg, size_t* end, int32_t* idx) {
+  unsigned char const* const p = (unsigned char const*)RSTRING_PTR(str);
+  if (pos > RSTRING_LEN(str)) { return FALSE; }
+  return onig_ac_search(ac, p, p + RSTRING_LEN(str), p + pos, beg, end, idx);
+}
+
+static mrb_value
+onig_literal_set_match_p(mrb_state* mrb, mrb_value self) {
+  mrb_value str;
+  size_t beg, end;
+  int32_t idx;
+  mrb_get_args(mrb, "S", &str);
+  return mrb_bool_value(onig_literal_set_next(onig_literal_set_ptr(mrb, self), str, 0, &beg, &end, &idx));
+}
+
+static mrb_value
+onig_literal_set_scan(mrb_state* mrb, mrb_value self) {
+  mrb_value str, blk;
+  size_t beg, end;
+  int32_t idx;
+  mrb_get_args(mrb, "S&", &str, &blk);
+  onig_ac const* const ac = onig_literal_set_ptr(mrb, self);
+  mrb_value const result = mrb_nil_p(blk) ? mrb_ary_new(mrb) : str;
+  mrb_int pos = 0;
+  int const ai = mrb_gc_arena_save(mrb);
+  while (onig_literal_set_next(ac, str, pos, &beg, &end, &idx)) {
+    mrb_value const m = onig_str_substr(mrb, str, (mrb_int)beg, (mrb_int)(end - beg));
+    if (mrb_nil_p(blk)) {
+      mrb_ary_push(mrb, result, m);
+    } else {
+      mrb_yield(mrb, blk, m);
     }
-    if (!lim_p && limit <= ++i) break;
+    pos = (mrb_int)end;
+    mrb_gc_arena_restore(mrb, ai);
   }
+  return result;
+}
 
-  mrb_obj_iv_set(mrb, (struct RObject*)ONIG_REGEXP_CLASS(mrb), MRB_IVSYM(set_global_variables), last_set_global_variables);
-  onig_gv_set(mrb, match_value);
-
-  if (RSTRING_LEN(self) > 0 && (!lim_p || RSTRING_LEN(self) > beg || limit < 0)) {
-    if (RSTRING_LEN(self) == beg)
-      tmp = mrb_str_new_lit(mrb, "");
-    else
-      tmp = onig_str_substr(mrb, self, beg, RSTRING_LEN(self)-beg);
-    mrb_ary_push(mrb, result, tmp);
+// gsub(str, hash), gsub(str, replacement) or gsub(str) { |keyword| }. A Hash
+// is looked up with the keyword as given to new, so no key is created.
+static mrb_value
+onig_literal_set_gsub(mrb_state* mrb, mrb_value self) {
+  mrb_value str, replace = mrb_nil_value(), blk;
+  size_t beg, end;
+  int32_t idx;
+  int const argc = mrb_get_args(mrb, "S|o&", &str, &replace, &blk);
+  if (argc == 1 && mrb_nil_p(blk)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (given 1, expected 2)");
   }
-  if (lim_p && limit == 0) {
-    while ((len = RARRAY_LEN(result)) > 0 &&
-        (tmp = mrb_ary_ref(mrb, result, len-1), RSTRING_LEN(tmp) == 0))
-      mrb_ary_pop(mrb, result);
+  if (argc == 2 && !mrb_hash_p(replace)) {
+    replace = mrb_string_type(mrb, replace);
+  }
+  onig_ac const* const ac = onig_literal_set_ptr(mrb, self);
+  mrb_value const keywords = mrb_iv_get(mrb, self, MRB_SYM(keywords));
+  mrb_value const result = mrb_str_new(mrb, NULL, 0);
+  mrb_int pos = 0;
+  int const ai = mrb_gc_arena_save(mrb);
+  while (onig_literal_set_next(ac, str, pos, &beg, &end, &idx)) {
+    mrb_str_cat(mrb, result, RSTRING_PTR(str) + pos, (mrb_int)beg - pos);
+    if (argc == 1) {
+      mrb_str_concat(mrb, result, mrb_str_to_str(mrb, mrb_yield(mrb, blk, onig_str_substr(
+          mrb, str, (mrb_int)beg, (mrb_int)(end - beg)))));
+    } else if (mrb_hash_p(replace)) {
+      mrb_str_concat(mrb, result, mrb_str_to_str(mrb, mrb_hash_get(mrb, replace, mrb_ary_ref(mrb, keywords, idx))));
+    } else {
+      mrb_str_cat_str(mrb, result, replace);
+    }
+    pos = (mrb_int)end;
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  if (pos < RSTRING_LEN(str)) {
+    mrb_str_cat(mrb, result, RSTRING_PTR(str) + pos, RSTRING_LEN(str) - pos);
   }
-
   return result;
 }
 
-// ISO 15.2.10.5.36
 static mrb_value
-string_sub(mrb_state* mrb, mrb_value self) {
-  mrb_value blk, match_expr, replace_expr = mrb_nil_value();
-  int const argc = mrb_get_args(mrb, "&o|o", &blk, &match_expr, &replace_expr);
+onig_literal_set_size(mrb_state* mrb, mrb_value self) {
+  return mrb_fixnum_value((mrb_int)onig_ac_size(onig_literal_set_ptr(mrb, self)));
+}
 
-  if(!ONIG_REGEXP_P(match_expr)) {
-    mrb_value argv[] = { match_expr, replace_expr };
-    return mrb_funcall_with_block(mrb, self, MRB_SYM(string_sub), argc, argv, blk);
-  }
+static mrb_value
+onig_literal_set_keywords(mrb_state* mrb, mrb_value self) {
+  onig_literal_set_ptr(mrb, self);
+  mrb_value const keywords = mrb_iv_get(mrb, self, MRB_SYM(keywords));
+  return mrb_ary_new_from_values(mrb, RARRAY_LEN(keywords), RARRAY_PTR(keywords));
+}
 
-  if(argc == 1 && mrb_nil_p(blk)) {
-    mrb_raise(mrb, E_ARGUMENT_ERROR, "wrong number of arguments (given 1, expected 2)");
+// OnigRegexp::Rewriter: an ordered list of (regexp, replacement) rules
+// applied in one left-to-right pass. At each position the rule whose next
+// match starts leftmost wins, the earlier rule on a tie; the text it
+// replaces is not looked at again. Each rule keeps its next match across
+// iterations until the position passes its start, in one region per rule.
+static mrb_value
+onig_rewriter_rule_add(mrb_state* mrb, mrb_value self, mrb_value re, mrb_value replace) {
+  if (!ONIG_REGEXP_P(re)) {
+    mrb_raisef(mrb, E_TYPE_ERROR, "%S is not an OnigRegexp", re);
+  }
+  if (!mrb_hash_p(replace) && mrb_type(replace) != MRB_TT_PROC) {
+    replace = mrb_string_type(mrb, replace);
   }
+  mrb_value rules = mrb_iv_get(mrb, self, MRB_SYM(rules));
+  if (mrb_nil_p(rules)) {
+    rules = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, self, MRB_SYM(rules), rules);
+  }
+  mrb_ary_push(mrb, rules, mrb_assoc_new(mrb, re, replace));
+  return self;
+}
 
-  if(!mrb_nil_p(blk) && !mrb_nil_p(replace_expr)) {
-    blk = mrb_nil_value();
+// rule(re, replacement) or rule(re) { |matched| }; the replacement is a
+// template as for gsub, or a Hash.
+static mrb_value
+onig_rewriter_rule(mrb_state* mrb, mrb_value self) {
+  mrb_value re, replace = mrb_nil_value(), blk;
+  int const argc = mrb_get_args(mrb, "o|o&", &re, &replace, &blk);
+  if (argc == 1) {
+    if (mrb_nil_p(blk)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "replacement or block required");
+    }
+    replace = blk;
   }
+  return onig_rewriter_rule_add(mrb, self, re, replace);
+}
 
-  if (mrb_nil_p(blk) && !mrb_hash_p(replace_expr)) {
-    replace_expr = mrb_string_type(mrb, replace_expr);
+// new(rules = []) with rules as [regexp, replacement] pairs.
+static mrb_value
+onig_rewriter_initialize(mrb_state* mrb, mrb_value self) {
+  mrb_value rules = mrb_nil_value();
+  mrb_get_args(mrb, "|A!", &rules);
+  mrb_iv_set(mrb, self, MRB_SYM(rules), mrb_ary_new(mrb));
+  if (mrb_nil_p(rules)) { return self; }
+  mrb_int i;
+  for (i = 0; i < RARRAY_LEN(rules); ++i) {
+    mrb_value const rule = mrb_ensure_array_type(mrb, RARRAY_PTR(rules)[i]);
+    if (RARRAY_LEN(rule) != 2) {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "rule must be [regexp, replacement]: %S", rule);
+    }
+    onig_rewriter_rule_add(mrb, self, RARRAY_PTR(rule)[0], RARRAY_PTR(rule)[1]);
   }
+  return self;
+}
 
-  OnigRegex reg;
-  Data_Get_Struct(mrb, match_expr, &mrb_onig_regexp_type, reg);
-  mrb_value const result = mrb_str_new(mrb, NULL, 0);
-  mrb_value const match_value = create_onig_region(mrb, self, match_expr);
-  OnigRegion* const match = (OnigRegion*)DATA_PTR(match_value);
+static mrb_value
+onig_rewriter_rules(mrb_state* mrb, mrb_value self) {
+  mrb_value const rules = mrb_iv_get(mrb, self, MRB_SYM(rules));
+  if (mrb_nil_p(rules)) { return mrb_ary_new(mrb); }
+  return mrb_ary_new_from_values(mrb, RARRAY_LEN(rules), RARRAY_PTR(rules));
+}
 
-  int const onig_result = onig_match_common(mrb, reg, match_value, self, 0);
-  if(onig_result == ONIG_MISMATCH) { return self; }
+static void
+onig_rewriter_next_free(mrb_state* mrb, void* p) {
+  mrb_free(mrb, p);
+}
 
-  mrb_str_cat(mrb, result, RSTRING_PTR(self), match->beg[0]);
+static struct mrb_data_type mrb_onig_rewriter_next_type = {
+  "OnigRegexp::Rewriter positions", onig_rewriter_next_free
+};
 
-  if(mrb_nil_p(blk)) {
-    append_replace_str(mrb, result, replace_expr, self, reg, match);
-  } else {
-    mrb_value const tmp_str = mrb_str_to_str(mrb, mrb_yield(mrb, blk, onig_str_substr(
-        mrb, self, match->beg[0], match->end[0] - match->beg[0])));
-    mrb_assert(mrb_string_p(tmp_str));
-    mrb_str_concat(mrb, result, tmp_str);
+#define ONIG_REWRITER_UNKNOWN (-2)
+
+static mrb_value
+onig_rewriter_rewrite(mrb_state* mrb, mrb_value self) {
+  mrb_value str;
+  mrb_get_args(mrb, "S", &str);
+  mrb_value rules = mrb_iv_get(mrb, self, MRB_SYM(rules));
+  if (mrb_nil_p(rules) || RARRAY_LEN(rules) == 0) { return mrb_str_dup(mrb, str); }
+  // a block may add rules while we run
+  rules = mrb_ary_new_from_values(mrb, RARRAY_LEN(rules), RARRAY_PTR(rules));
+  mrb_int const n = RARRAY_LEN(rules);
+
+  // per rule: its match data and the start of its next match, or
+  // ONIG_MISMATCH when it has none, or ONIG_REWRITER_UNKNOWN
+  mrb_value const matches = mrb_ary_new_capa(mrb, n);
+  struct RData* const next_data = mrb_data_object_alloc(mrb, ONIG_STATE(mrb)->cls_onig_match_data, NULL,
+                                                         &mrb_onig_rewriter_next_type);
+  mrb_int* const next = (mrb_int*)mrb_malloc(mrb, sizeof(mrb_int) * n);
+  next_data->data = next;
+  mrb_int i;
+  for (i = 0; i < n; ++i) {
+    mrb_ary_push(mrb, matches, create_onig_region(mrb, str, RARRAY_PTR(RARRAY_PTR(rules)[i])[0]));
+    next[i] = ONIG_REWRITER_UNKNOWN;
   }
 
-  int const last_end_pos = match->end[0];
-  mrb_str_cat(mrb, result, RSTRING_PTR(self) + last_end_pos, RSTRING_LEN(self) - last_end_pos);
+  mrb_value const result = mrb_str_new(mrb, NULL, 0);
+  mrb_int pos = 0;
+  int const ai = mrb_gc_arena_save(mrb);
+  while (pos <= RSTRING_LEN(str)) {
+    mrb_int best = -1;
+    for (i = 0; i < n; ++i) {
+      if (next[i] == ONIG_REWRITER_UNKNOWN || (next[i] >= 0 && next[i] < pos)) {
+        mrb_value const re = RARRAY_PTR(RARRAY_PTR(rules)[i])[0];
+        next[i] = onig_search_region(mrb, onig_regexp_ptr(mrb, re), RARRAY_PTR(matches)[i], str,
+                                     pos, RSTRING_LEN(str), FALSE, ONIG_OPTION_NONE);
+      }
+      if (next[i] >= 0 && (best < 0 || next[i] < next[best])) { best = i; }
+    }
+    if (best < 0) { break; }
+
+    mrb_value const rule = RARRAY_PTR(rules)[best];
+    mrb_value const match_value = RARRAY_PTR(matches)[best];
+    mrb_value const replace = RARRAY_PTR(rule)[1];
+    OnigRegion const* const match = (OnigRegion*)DATA_PTR(match_value);
+    mrb_int const beg = match->beg[0], end = match->end[0];
+    mrb_str_cat(mrb, result, RSTRING_PTR(str) + pos, beg - pos);
+    if (mrb_type(replace) == MRB_TT_PROC) {
+      onig_last_match_set(mrb, match_value);
+      mrb_value const tmp_str = mrb_str_to_str(mrb, mrb_yield(mrb, replace, onig_str_substr(mrb, str, beg, end - beg)));
+      mrb_str_concat(mrb, result, tmp_str);
+    } else {
+      append_replace_str(mrb, result, replace, str, onig_regexp_get(mrb, RARRAY_PTR(rule)[0]),
+                         (OnigRegion*)DATA_PTR(match_value));
+    }
+    pos = end;
+    if (beg == end) {
+      // consume a character after an empty match
+      if (pos >= RSTRING_LEN(str)) { break; }
+      mrb_int const len = utf8len(RSTRING_PTR(str) + pos, RSTRING_END(str));
+      mrb_str_cat(mrb, result, RSTRING_PTR(str) + pos, len);
+      pos += len;
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  onig_last_match_set(mrb, mrb_nil_value());
 
+  if (pos < RSTRING_LEN(str)) {
+    mrb_str_cat(mrb, result, RSTRING_PTR(str) + pos, RSTRING_LEN(str) - pos);
+  }
   return result;
 }
 
 static mrb_value
 onig_regexp_clear_global_variables(mrb_state* mrb, mrb_value self) {
-  mrb_gv_remove(mrb, ONIG_SYM_TILDE(mrb));
-  mrb_gv_remove(mrb, ONIG_SYM_AMPERSAND(mrb));
-  mrb_gv_remove(mrb, ONIG_SYM_BACKTICK(mrb));
-  mrb_gv_remove(mrb, ONIG_SYM_QUOTE(mrb));
-  mrb_gv_remove(mrb, ONIG_SYM_PLUS(mrb));
+  onig_regexp_state const* const st = ONIG_STATE(mrb);
+  mrb_gv_remove(mrb, st->sym_dollar_tilde);
+  mrb_gv_remove(mrb, st->sym_dollar_ampersand);
+  mrb_gv_remove(mrb, st->sym_dollar_backtick);
+  mrb_gv_remove(mrb, st->sym_dollar_quote);
+  mrb_gv_remove(mrb, st->sym_dollar_plus);
 
   // Remove $1 to $9 global variables
   int idx;
   for (idx = 1; idx < 10; ++idx) {
-    mrb_gv_remove(mrb, ONIG_SYM_NUMBER(mrb, idx));
+    mrb_gv_remove(mrb, st->sym_dollar_numbers[idx]);
   }
 
   return self;
@@ -1204,16 +4127,14 @@ onig_regexp_clear_global_variables(mrb_state* mrb, mrb_value self) {
 static mrb_value
 onig_regexp_does_set_global_variables(mrb_state* mrb, mrb_value self) {
   (void)self;
-  return mrb_obj_iv_get(mrb, (struct RObject*)ONIG_REGEXP_CLASS(mrb),
-                        MRB_IVSYM(set_global_variables));
+  return mrb_bool_value(ONIG_STATE(mrb)->set_global_variables);
 }
 static mrb_value
 onig_regexp_set_set_global_variables(mrb_state* mrb, mrb_value self) {
   mrb_value arg;
   mrb_get_args(mrb, "o", &arg);
   mrb_value const ret = mrb_bool_value(mrb_bool(arg));
-  mrb_obj_iv_set(mrb, (struct RObject*)ONIG_REGEXP_CLASS(mrb),
-                 MRB_IVSYM(set_global_variables), ret);
+  ONIG_STATE(mrb)->set_global_variables = mrb_bool(arg);
   onig_regexp_clear_global_variables(mrb, self);
   return ret;
 }
@@ -1271,28 +4192,38 @@ onig_regexp_escape(mrb_state* mrb, mrb_value self) {
 void
 mrb_mruby_onig_regexp_gem_init(mrb_state* mrb) {
 #ifdef MRB_ONIG_REGEXP_CACHE
-  // Cache the special-character symbols. Only safe for single-mrb_state builds;
-  // see the comment by the macro definition.
-  sym_dollar_tilde = mrb_intern_lit(mrb, "$~");
-  sym_dollar_ampersand = mrb_intern_lit(mrb, "$&");
-  sym_dollar_backtick = mrb_intern_lit(mrb, "$`");
-  sym_dollar_quote = mrb_intern_lit(mrb, "$'");
-  sym_dollar_plus = mrb_intern_lit(mrb, "$+");
-  sym_dollar_semicolon = mrb_intern_lit(mrb, "$;");
+  // Only safe for single-mrb_state builds; see the comment by the struct
+  // definition.
+  onig_regexp_state* const st = &onig_regexp_global_state;
+#else
+  onig_regexp_state* const st = (onig_regexp_state*)mrb_calloc(mrb, 1, sizeof(onig_regexp_state));
+  mrb_obj_iv_set(mrb, (struct RObject*)mrb->object_class, MRB_SYM(onig_regexp_state), mrb_obj_value(
+      mrb_data_object_alloc(mrb, mrb->object_class, st, &mrb_onig_regexp_state_type)));
+#endif
+
+  // Cache the special-character symbols.
+  st->sym_dollar_tilde = mrb_intern_lit(mrb, "$~");
+  st->sym_dollar_ampersand = mrb_intern_lit(mrb, "$&");
+  st->sym_dollar_backtick = mrb_intern_lit(mrb, "$`");
+  st->sym_dollar_quote = mrb_intern_lit(mrb, "$'");
+  st->sym_dollar_plus = mrb_intern_lit(mrb, "$+");
+  st->sym_dollar_semicolon = mrb_intern_lit(mrb, "$;");
 
   // Initialize $0 to $9 symbols
   for (int idx = 0; idx < 10; ++idx) {
     char const n[] = { '$', '0' + idx };
-    sym_dollar_numbers[idx] = mrb_intern(mrb, n, 2);
+    st->sym_dollar_numbers[idx] = mrb_intern(mrb, n, 2);
   }
-#endif
 
   struct RClass* cls_onig_regexp = mrb_define_class(mrb, "OnigRegexp", mrb->object_class);
-  ONIG_CACHE_REGEXP_CLASS(cls_onig_regexp);
+  st->cls_onig_regexp = cls_onig_regexp;
   MRB_SET_INSTANCE_TT(cls_onig_regexp, MRB_TT_DATA);
 
+  mrb_define_class_under(mrb, cls_onig_regexp, "TimeoutError", E_REGEXP_ERROR);
+
   // enable global variables setting in onig_match_common by default
-  mrb_obj_iv_set(mrb, (struct RObject*)cls_onig_regexp, MRB_IVSYM(set_global_variables), mrb_true_value());
+  st->set_global_variables = TRUE;
+  st->strict = FALSE;
 
   mrb_define_const(mrb, cls_onig_regexp, "IGNORECASE", mrb_fixnum_value(ONIG_OPTION_IGNORECASE));
   mrb_define_const(mrb, cls_onig_regexp, "EXTENDED", mrb_fixnum_value(ONIG_OPTION_EXTEND));
@@ -1329,12 +4260,30 @@ mrb_mruby_onig_regexp_gem_init(mrb_state* mrb) {
 
   mrb_define_method(mrb, cls_onig_regexp, "initialize", onig_regexp_initialize, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
   mrb_define_method(mrb, cls_onig_regexp, "==", onig_regexp_equal, MRB_ARGS_REQ(1));
-  mrb_define_method(mrb, cls_onig_regexp, "match", onig_regexp_match, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
-  mrb_define_method(mrb, cls_onig_regexp, "match?", onig_regexp_match_p, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cls_onig_regexp, "match", onig_regexp_match, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, cls_onig_regexp, "match_at", onig_regexp_match_at, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cls_onig_regexp, "count", onig_regexp_count, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, cls_onig_regexp, "each_match", onig_regexp_each_match, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2) | MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, cls_onig_regexp, "match?", onig_regexp_match_p, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
   mrb_define_method(mrb, cls_onig_regexp, "casefold?", onig_regexp_casefold_p, MRB_ARGS_NONE());
   mrb_define_method(mrb, cls_onig_regexp, "named_captures", onig_regexp_named_captures, MRB_ARGS_NONE());
   mrb_define_method(mrb, cls_onig_regexp, "names", onig_regexp_names, MRB_ARGS_NONE());
 
+  mrb_define_method(mrb, cls_onig_regexp, "compiled?", onig_regexp_compiled_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_regexp, "stats", onig_regexp_stats_get, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_regexp, "reset_stats", onig_regexp_reset_stats, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_regexp, "retry_limit", onig_regexp_retry_limit, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_regexp, "retry_limit=", onig_regexp_set_retry_limit, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_regexp, "intern_captures", onig_regexp_intern_captures, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_regexp, "intern_captures=", onig_regexp_set_intern_captures, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_regexp, "scan_file", onig_regexp_scan_file, MRB_ARGS_REQ(1)|MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, cls_onig_regexp, "grep_file", onig_regexp_grep_file, MRB_ARGS_REQ(1)|MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, cls_onig_regexp, "count_file", onig_regexp_count_file, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_regexp, "analyze", onig_regexp_analyze, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_regexp, "dfa?", onig_regexp_dfa_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_regexp, "dfa=", onig_regexp_set_dfa, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_regexp, "engine", onig_regexp_engine, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_regexp, "memsize", onig_regexp_memsize, MRB_ARGS_NONE());
   mrb_define_method(mrb, cls_onig_regexp, "options", onig_regexp_options, MRB_ARGS_NONE());
   mrb_define_method(mrb, cls_onig_regexp, "inspect", onig_regexp_inspect, MRB_ARGS_NONE());
   mrb_define_method(mrb, cls_onig_regexp, "to_s", onig_regexp_to_s, MRB_ARGS_NONE());
@@ -1342,12 +4291,22 @@ mrb_mruby_onig_regexp_gem_init(mrb_state* mrb) {
   mrb_define_module_function(mrb, cls_onig_regexp, "escape", onig_regexp_escape, MRB_ARGS_REQ(1));
   mrb_define_module_function(mrb, cls_onig_regexp, "quote", onig_regexp_escape, MRB_ARGS_REQ(1));
   mrb_define_module_function(mrb, cls_onig_regexp, "version", onig_regexp_version, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cls_onig_regexp, "dump", onig_regexp_dump, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, cls_onig_regexp, "load", onig_regexp_load, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, cls_onig_regexp, "stats_enabled?", onig_regexp_stats_enabled_p, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cls_onig_regexp, "stats_enabled=", onig_regexp_set_stats_enabled, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, cls_onig_regexp, "top_patterns", onig_regexp_top_patterns, MRB_ARGS_OPT(1));
+  mrb_define_class_method(mrb, cls_onig_regexp, "retry_limit", onig_regexp_default_retry_limit, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cls_onig_regexp, "retry_limit=", onig_regexp_set_default_retry_limit, MRB_ARGS_REQ(1));
+  mrb_define_class_method(mrb, cls_onig_regexp, "total_memsize", onig_regexp_total_memsize, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cls_onig_regexp, "strict?", onig_regexp_strict_p, MRB_ARGS_NONE());
+  mrb_define_class_method(mrb, cls_onig_regexp, "strict=", onig_regexp_set_strict, MRB_ARGS_REQ(1));
   mrb_define_module_function(mrb, cls_onig_regexp, "set_global_variables?", onig_regexp_does_set_global_variables, MRB_ARGS_NONE());
   mrb_define_module_function(mrb, cls_onig_regexp, "set_global_variables=", onig_regexp_set_set_global_variables, MRB_ARGS_REQ(1));
   mrb_define_module_function(mrb, cls_onig_regexp, "clear_global_variables", onig_regexp_clear_global_variables, MRB_ARGS_NONE());
 
   struct RClass* cls_onig_match_data = mrb_define_class(mrb, "OnigMatchData", mrb->object_class);
-  ONIG_CACHE_MATCH_DATA_CLASS(cls_onig_match_data);
+  st->cls_onig_match_data = cls_onig_match_data;
   MRB_SET_INSTANCE_TT(cls_onig_match_data, MRB_TT_DATA);
   mrb_undef_class_method(mrb, cls_onig_match_data, "new");
 
@@ -1371,11 +4330,63 @@ mrb_mruby_onig_regexp_gem_init(mrb_state* mrb) {
   mrb_define_method(mrb, cls_onig_match_data, "to_s", &match_data_to_s, MRB_ARGS_NONE());
   // mrb_define_method(mrb, cls_onig_match_data, "values_at", &match_data_values_at);
 
+  mrb_define_method(mrb, cls_onig_regexp, "scan_incremental", onig_regexp_scan_incremental, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_regexp, "gsub_incremental", onig_regexp_gsub_incremental, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+
+  struct RClass* cls_onig_cursor = mrb_define_class_under(mrb, cls_onig_regexp, "Cursor", mrb->object_class);
+  MRB_SET_INSTANCE_TT(cls_onig_cursor, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, cls_onig_cursor, "new");
+  mrb_define_method(mrb, cls_onig_cursor, "resume", onig_cursor_resume, MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, cls_onig_cursor, "done?", onig_cursor_done_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_cursor, "pos", onig_cursor_pos, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_cursor, "count", onig_cursor_count, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_cursor, "budget_bytes", onig_cursor_budget, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_cursor, "budget_bytes=", onig_cursor_set_budget, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_cursor, "string", onig_cursor_string, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_cursor, "regexp", onig_cursor_regexp, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_cursor, "result", onig_cursor_result, MRB_ARGS_NONE());
+
+  struct RClass* cls_onig_literal_set = mrb_define_class_under(mrb, cls_onig_regexp, "LiteralSet", mrb->object_class);
+  MRB_SET_INSTANCE_TT(cls_onig_literal_set, MRB_TT_DATA);
+  mrb_define_method(mrb, cls_onig_literal_set, "initialize", &onig_literal_set_initialize, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_literal_set, "match?", &onig_literal_set_match_p, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_literal_set, "scan", &onig_literal_set_scan, MRB_ARGS_REQ(1) | MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, cls_onig_literal_set, "gsub", &onig_literal_set_gsub, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, cls_onig_literal_set, "size", &onig_literal_set_size, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_literal_set, "keywords", &onig_literal_set_keywords, MRB_ARGS_NONE());
+
+  struct RClass* cls_onig_rewriter = mrb_define_class_under(mrb, cls_onig_regexp, "Rewriter", mrb->object_class);
+  mrb_define_method(mrb, cls_onig_rewriter, "initialize", &onig_rewriter_initialize, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, cls_onig_rewriter, "rule", &onig_rewriter_rule, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, cls_onig_rewriter, "rules", &onig_rewriter_rules, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_rewriter, "rewrite", &onig_rewriter_rewrite, MRB_ARGS_REQ(1));
+
+  struct RClass* cls_onig_scanner = mrb_define_class(mrb, "OnigStringScanner", mrb->object_class);
+  MRB_SET_INSTANCE_TT(cls_onig_scanner, MRB_TT_DATA);
+  mrb_define_method(mrb, cls_onig_scanner, "initialize", &onig_scanner_initialize, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_scanner, "scan", &onig_scanner_scan, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_scanner, "check", &onig_scanner_check, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_scanner, "skip", &onig_scanner_skip, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_scanner, "match?", &onig_scanner_match_p, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_scanner, "scan_until", &onig_scanner_scan_until, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_scanner, "check_until", &onig_scanner_check_until, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_scanner, "skip_until", &onig_scanner_skip_until, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_scanner, "pos", &onig_scanner_pos, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_scanner, "pos=", &onig_scanner_set_pos, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_scanner, "matched", &onig_scanner_matched, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_scanner, "matched?", &onig_scanner_matched_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_scanner, "[]", &onig_scanner_aref, MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, cls_onig_scanner, "eos?", &onig_scanner_eos_p, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_scanner, "rest", &onig_scanner_rest, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_scanner, "string", &onig_scanner_string, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_scanner, "reset", &onig_scanner_reset, MRB_ARGS_NONE());
+  mrb_define_method(mrb, cls_onig_scanner, "terminate", &onig_scanner_terminate, MRB_ARGS_NONE());
+
   mrb_define_method(mrb, mrb->string_class, "onig_regexp_gsub", &string_gsub, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
   mrb_define_method(mrb, mrb->string_class, "onig_regexp_sub", &string_sub, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
-  mrb_define_method(mrb, mrb->string_class, "onig_regexp_split", &string_split, MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, mrb->string_class, "onig_regexp_split", &string_split, MRB_ARGS_OPT(2) | MRB_ARGS_BLOCK());
   mrb_define_method(mrb, mrb->string_class, "onig_regexp_scan", &string_scan, MRB_ARGS_REQ(1) | MRB_ARGS_BLOCK());
-  mrb_define_method(mrb, mrb->string_class, "onig_regexp_match?", &string_match_p, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, mrb->string_class, "onig_regexp_match?", &string_match_p, MRB_ARGS_REQ(1) | MRB_ARGS_OPT(2));
 }
 
 void
@@ -0,0 +1,238 @@
+/*
+** onig_regexp_ac.c - Aho-Corasick automaton for sets of literal strings
+**
+** See onig_regexp_ac.h. The trie is stored as an array of nodes, with the
+** edges of the root in a direct table and all others in one open-addressed
+** hash table keyed by (node, byte), which keeps large sets compact. Each
+** node has its failure link and a link to the nearest node on the failure
+** chain that ends a keyword, so the longest keyword ending at a position is
+** found without walking the chain.
+**
+** For leftmost-longest results the search keeps the best match seen so far
+** and goes on only while the current state (the longest suffix of the
+** input that is a prefix in the trie) could still extend a keyword
+** starting at or before it.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "onig_regexp_ac.h"
+
+#define AC_NONE UINT32_MAX
+
+typedef struct {
+  uint32_t fail;
+  uint32_t dict;        /* nearest keyword end on the failure chain, 0 if none */
+  uint32_t depth;
+  uint32_t first_child; /* children list, for the breadth-first build */
+  uint32_t sibling;
+  int32_t value;        /* keyword value, -1 when no keyword ends here */
+  unsigned char label;
+} ac_node;
+
+typedef struct {
+  uint32_t from, to;
+  unsigned char c;
+} ac_edge;
+
+struct onig_ac {
+  int ignorecase;
+  int built;
+  size_t nkeywords;
+  ac_node* nodes;
+  uint32_t nnodes, nodes_cap;
+  ac_edge* edges;       /* capacity is a power of two */
+  size_t nedges, edges_cap;
+  uint32_t root[256];   /* 0: no edge */
+};
+
+#define AC_FOLD(ac, c) ((ac)->ignorecase && (c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+static size_t
+edge_slot(uint32_t from, unsigned c, size_t mask) {
+  uint32_t h = from * 0x9E3779B1u ^ (uint32_t)c * 0x85EBCA77u;
+  h ^= h >> 15;
+  return h & mask;
+}
+
+static uint32_t
+edge_get(onig_ac const* ac, uint32_t from, unsigned c) {
+  size_t const mask = ac->edges_cap - 1;
+  size_t i;
+  for (i = edge_slot(from, c, mask); ac->edges[i].from != AC_NONE; i = (i + 1) & mask) {
+    if (ac->edges[i].from == from && ac->edges[i].c == c) { return ac->edges[i].to; }
+  }
+  return AC_NONE;
+}
+
+static void
+edge_put(ac_edge* edges, size_t cap, uint32_t from, unsigned c, uint32_t to) {
+  size_t const mask = cap - 1;
+  size_t i = edge_slot(from, c, mask);
+  while (edges[i].from != AC_NONE) { i = (i + 1) & mask; }
+  edges[i].from = from;
+  edges[i].to = to;
+  edges[i].c = (unsigned char)c;
+}
+
+static int
+edges_reserve(onig_ac* ac) {
+  size_t cap, i;
+  ac_edge* edges;
+  if ((ac->nedges + 1) * 2 <= ac->edges_cap) { return 0; }
+  cap = ac->edges_cap ? ac->edges_cap * 2 : 64;
+  edges = (ac_edge*)malloc(cap * sizeof(ac_edge));
+  if (!edges) { return -1; }
+  for (i = 0; i < cap; ++i) { edges[i].from = AC_NONE; }
+  for (i = 0; i < ac->edges_cap; ++i) {
+    if (ac->edges[i].from != AC_NONE) {
+      edge_put(edges, cap, ac->edges[i].from, ac->edges[i].c, ac->edges[i].to);
+    }
+  }
+  free(ac->edges);
+  ac->edges = edges;
+  ac->edges_cap = cap;
+  return 0;
+}
+
+static uint32_t
+node_new(onig_ac* ac, uint32_t depth, unsigned char label) {
+  ac_node* n;
+  if (ac->nnodes == ac->nodes_cap) {
+    uint32_t const cap = ac->nodes_cap * 2;
+    ac_node* const nodes = cap > ac->nodes_cap ? (ac_node*)realloc(ac->nodes, cap * sizeof(ac_node)) : NULL;
+    if (!nodes) { return AC_NONE; }
+    ac->nodes = nodes;
+    ac->nodes_cap = cap;
+  }
+  n = &ac->nodes[ac->nnodes];
+  n->fail = n->dict = 0;
+  n->depth = depth;
+  n->first_child = n->sibling = 0;
+  n->value = -1;
+  n->label = label;
+  return ac->nnodes++;
+}
+
+onig_ac*
+onig_ac_new(int ignorecase) {
+  onig_ac* const ac = (onig_ac*)calloc(1, sizeof(onig_ac));
+  if (!ac) { return NULL; }
+  ac->ignorecase = ignorecase;
+  ac->nodes_cap = 64;
+  ac->nodes = (ac_node*)malloc(ac->nodes_cap * sizeof(ac_node));
+  if (!ac->nodes || edges_reserve(ac) < 0) {
+    onig_ac_free(ac);
+    return NULL;
+  }
+  node_new(ac, 0, 0);
+  return ac;
+}
+
+void
+onig_ac_free(onig_ac* ac) {
+  if (!ac) { return; }
+  free(ac->nodes);
+  free(ac->edges);
+  free(ac);
+}
+
+int
+onig_ac_add(onig_ac* ac, unsigned char const* str, size_t len, int32_t value) {
+  uint32_t s = 0;
+  size_t i;
+  if (ac->built || len == 0 || value < 0) { return -1; }
+  for (i = 0; i < len; ++i) {
+    unsigned const c = AC_FOLD(ac, str[i]);
+    uint32_t t = s == 0 ? (ac->root[c] ? ac->root[c] : AC_NONE) : edge_get(ac, s, c);
+    if (t == AC_NONE) {
+      t = node_new(ac, (uint32_t)i + 1, (unsigned char)c);
+      if (t == AC_NONE) { return -1; }
+      if (s == 0) {
+        ac->root[c] = t;
+      } else {
+        if (edges_reserve(ac) < 0) { return -1; }
+        edge_put(ac->edges, ac->edges_cap, s, c, t);
+        ++ac->nedges;
+      }
+      ac->nodes[t].sibling = ac->nodes[s].first_child;
+      ac->nodes[s].first_child = t;
+    }
+    s = t;
+  }
+  if (ac->nodes[s].value < 0) {
+    ac->nodes[s].value = value;
+    ++ac->nkeywords;
+  }
+  return 0;
+}
+
+static uint32_t
+ac_step(onig_ac const* ac, uint32_t s, unsigned c) {
+  for (;;) {
+    uint32_t t;
+    if (s == 0) { return ac->root[c]; }
+    t = edge_get(ac, s, c);
+    if (t != AC_NONE) { return t; }
+    s = ac->nodes[s].fail;
+  }
+}
+
+int
+onig_ac_build(onig_ac* ac) {
+  uint32_t* queue;
+  uint32_t head = 0, tail = 0;
+  uint32_t u;
+  if (ac->built) { return 0; }
+  queue = (uint32_t*)malloc(ac->nnodes * sizeof(uint32_t));
+  if (!queue) { return -1; }
+  for (u = ac->nodes[0].first_child; u; u = ac->nodes[u].sibling) {
+    ac->nodes[u].fail = 0;
+    ac->nodes[u].dict = 0;
+    queue[tail++] = u;
+  }
+  while (head < tail) {
+    uint32_t v;
+    u = queue[head++];
+    for (v = ac->nodes[u].first_child; v; v = ac->nodes[v].sibling) {
+      uint32_t const f = ac_step(ac, ac->nodes[u].fail, ac->nodes[v].label);
+      ac->nodes[v].fail = f;
+      ac->nodes[v].dict = ac->nodes[f].value >= 0 ? f : ac->nodes[f].dict;
+      queue[tail++] = v;
+    }
+  }
+  free(queue);
+  ac->built = 1;
+  return 0;
+}
+
+int
+onig_ac_search(onig_ac const* ac, unsigned char const* str, unsigned char const* end,
+               unsigned char const* start, size_t* match_beg, size_t* match_end,
+               int32_t* value) {
+  unsigned char const* p;
+  uint32_t s = 0;
+  int found = 0;
+  size_t best_beg = 0;
+  for (p = start; p < end; ++p) {
+    size_t const next = (size_t)(p - str) + 1;
+    uint32_t t;
+    s = ac_step(ac, s, AC_FOLD(ac, *p));
+    /* no keyword in progress can start at or before the best match */
+    if (found && next - ac->nodes[s].depth > best_beg) { break; }
+    t = ac->nodes[s].value >= 0 ? s : ac->nodes[s].dict;
+    if (t && (!found || next - ac->nodes[t].depth <= best_beg)) {
+      found = 1;
+      best_beg = next - ac->nodes[t].depth;
+      *match_beg = best_beg;
+      *match_end = next;
+      *value = ac->nodes[t].value;
+    }
+  }
+  return found;
+}
+
+size_t
+onig_ac_size(onig_ac const* ac) {
+  return ac->nkeywords;
+}
@@ -0,0 +1,50 @@
+/*
+** onig_regexp_ac.h - Aho-Corasick automaton for sets of literal strings
+**
+** Finds the keywords of a set in one pass over the subject, whatever their
+** number, where an alternation of the same literals makes Onigmo try every
+** branch at every position. Matching works on bytes; the case-insensitive
+** mode folds ASCII letters only.
+*/
+
+#ifndef ONIG_REGEXP_AC_H
+#define ONIG_REGEXP_AC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct onig_ac onig_ac;
+
+/* Returns NULL when out of memory. */
+onig_ac* onig_ac_new(int ignorecase);
+void onig_ac_free(onig_ac* ac);
+
+/* Adds a non-empty keyword, identified by a non-negative value in search
+   results. Adding a keyword twice keeps the first value. Returns 0, or -1
+   when out of memory. Keywords cannot be added once the automaton is
+   built. */
+int onig_ac_add(onig_ac* ac, unsigned char const* str, size_t len, int32_t value);
+
+/* Computes the failure links; required before searching. Returns 0, or -1
+   when out of memory. */
+int onig_ac_build(onig_ac* ac);
+
+/* Finds the leftmost match in [start, end) of the string beginning at str,
+   the longest one among keywords starting at the same position. Returns 1
+   and the offsets from str and value of the keyword, or 0. */
+int onig_ac_search(onig_ac const* ac, unsigned char const* str, unsigned char const* end,
+                   unsigned char const* start, size_t* match_beg, size_t* match_end,
+                   int32_t* value);
+
+/* number of keywords */
+size_t onig_ac_size(onig_ac const* ac);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ONIG_REGEXP_AC_H */
@@ -0,0 +1,80 @@
+/*
+** onig_regexp_alloc.c - counting allocator for the bundled Onigmo
+**
+** See onig_regexp_alloc.h. Each block is preceded by a header holding its
+** size, padded to the strictest alignment malloc guarantees.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "onig_regexp_alloc.h"
+
+typedef union {
+  size_t size;
+  long double ld;
+  long long ll;
+  void* p;
+} alloc_header;
+
+static size_t allocated;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ALLOC_ADD(n) __atomic_add_fetch(&allocated, (n), __ATOMIC_RELAXED)
+#define ALLOC_SUB(n) __atomic_sub_fetch(&allocated, (n), __ATOMIC_RELAXED)
+#define ALLOC_GET()  __atomic_load_n(&allocated, __ATOMIC_RELAXED)
+#else
+/* approximate without atomics when several threads run VMs */
+#define ALLOC_ADD(n) (allocated += (n))
+#define ALLOC_SUB(n) (allocated -= (n))
+#define ALLOC_GET()  (allocated)
+#endif
+
+void*
+onig_regexp_xmalloc(size_t size) {
+  alloc_header* h;
+  if (size > (size_t)-1 - sizeof(alloc_header)) { return NULL; }
+  h = (alloc_header*)malloc(sizeof(alloc_header) + size);
+  if (!h) { return NULL; }
+  h->size = size;
+  ALLOC_ADD(size);
+  return h + 1;
+}
+
+void*
+onig_regexp_xrealloc(void* ptr, size_t size) {
+  alloc_header* h;
+  size_t old;
+  if (!ptr) { return onig_regexp_xmalloc(size); }
+  if (size > (size_t)-1 - sizeof(alloc_header)) { return NULL; }
+  h = (alloc_header*)ptr - 1;
+  old = h->size;
+  h = (alloc_header*)realloc(h, sizeof(alloc_header) + size);
+  if (!h) { return NULL; }
+  h->size = size;
+  ALLOC_SUB(old);
+  ALLOC_ADD(size);
+  return h + 1;
+}
+
+void*
+onig_regexp_xcalloc(size_t count, size_t size) {
+  void* p;
+  if (size && count > (size_t)-1 / size) { return NULL; }
+  p = onig_regexp_xmalloc(count * size);
+  if (p) { memset(p, 0, count * size); }
+  return p;
+}
+
+void
+onig_regexp_xfree(void* ptr) {
+  alloc_header* h;
+  if (!ptr) { return; }
+  h = (alloc_header*)ptr - 1;
+  ALLOC_SUB(h->size);
+  free(h);
+}
+
+size_t
+onig_regexp_allocated(void) {
+  return ALLOC_GET();
+}
@@ -0,0 +1,33 @@
+/*
+** onig_regexp_alloc.h - counting allocator for the bundled Onigmo
+**
+** When mrbgem.rake builds the bundled Onigmo it compiles the library with
+** xmalloc, xrealloc, xcalloc and xfree defined to these functions (and this
+** header forced in), and defines MRB_ONIG_REGEXP_COUNTING_ALLOC for the gem.
+** They keep a process-wide count of the bytes Onigmo holds: compiled
+** programs are shared between mrb_states by the pattern registry, so the
+** memory cannot be charged to the allocator of one VM.
+*/
+
+#ifndef ONIG_REGEXP_ALLOC_H
+#define ONIG_REGEXP_ALLOC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void* onig_regexp_xmalloc(size_t size);
+void* onig_regexp_xrealloc(void* ptr, size_t size);
+void* onig_regexp_xcalloc(size_t count, size_t size);
+void onig_regexp_xfree(void* ptr);
+
+/* bytes currently allocated through the functions above */
+size_t onig_regexp_allocated(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ONIG_REGEXP_ALLOC_H */
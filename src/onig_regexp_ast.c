@@ -0,0 +1,1126 @@
+/*
+** onig_regexp_ast.c - syntax tree of Ruby-syntax regular expressions
+**
+** See onig_regexp_ast.h. The parser is deliberately forgiving: the pattern
+** has already been accepted by Onigmo, so anything unexpected is recorded
+** as an ONIG_AST_OTHER node instead of being reported as an error.
+*/
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include "onig_regexp_ast.h"
+
+#define ONIG_AST_MAX_DEPTH 200
+
+typedef struct onig_ast_block {
+  struct onig_ast_block* next;
+  size_t used, size;
+} onig_ast_block;
+
+struct onig_ast {
+  onig_ast_block* blocks;
+  onig_ast_node* root;
+  uint32_t max_cp;
+  jmp_buf oom;
+};
+
+/* Nodes and range arrays live in an arena freed with the tree. */
+static void*
+ast_alloc(onig_ast* ast, size_t size) {
+  onig_ast_block* b = ast->blocks;
+  size = (size + 7) & ~(size_t)7;
+  if (!b || b->size - b->used < size) {
+    size_t const data = size > 4096 ? size : 4096;
+    b = (onig_ast_block*)malloc(sizeof(onig_ast_block) + data);
+    if (!b) { longjmp(ast->oom, 1); }
+    b->next = ast->blocks;
+    b->used = 0;
+    b->size = data;
+    ast->blocks = b;
+  }
+  void* const p = (char*)(b + 1) + b->used;
+  b->used += size;
+  memset(p, 0, size);
+  return p;
+}
+
+/* growable range set */
+typedef struct {
+  onig_ast_range* r;
+  size_t n, cap;
+} rset;
+
+static void
+rset_add(onig_ast* ast, rset* s, uint32_t lo, uint32_t hi) {
+  if (lo > hi) { return; }
+  if (s->n == s->cap) {
+    size_t const cap = s->cap ? s->cap * 2 : 8;
+    onig_ast_range* const r = (onig_ast_range*)ast_alloc(ast, cap * sizeof(onig_ast_range));
+    if (s->n) { memcpy(r, s->r, s->n * sizeof(onig_ast_range)); }
+    s->r = r;
+    s->cap = cap;
+  }
+  s->r[s->n].lo = lo;
+  s->r[s->n].hi = hi;
+  ++s->n;
+}
+
+static int
+range_cmp(void const* a, void const* b) {
+  onig_ast_range const* const x = (onig_ast_range const*)a;
+  onig_ast_range const* const y = (onig_ast_range const*)b;
+  return x->lo < y->lo ? -1 : x->lo > y->lo ? 1 : 0;
+}
+
+static void
+rset_normalize(rset* s) {
+  size_t i, n = 0;
+  if (s->n < 2) { return; }
+  qsort(s->r, s->n, sizeof(onig_ast_range), range_cmp);
+  for (i = 1; i < s->n; ++i) {
+    if (s->r[i].lo <= s->r[n].hi + 1) {
+      if (s->r[i].hi > s->r[n].hi) { s->r[n].hi = s->r[i].hi; }
+    } else {
+      s->r[++n] = s->r[i];
+    }
+  }
+  s->n = n + 1;
+}
+
+static void
+rset_negate(onig_ast* ast, rset* s) {
+  rset out = { NULL, 0, 0 };
+  uint32_t next = 0;
+  size_t i;
+  rset_normalize(s);
+  for (i = 0; i < s->n; ++i) {
+    if (s->r[i].lo > next) { rset_add(ast, &out, next, s->r[i].lo - 1); }
+    next = s->r[i].hi + 1;
+  }
+  if (next <= ast->max_cp && (s->n == 0 || s->r[s->n - 1].hi < ast->max_cp)) {
+    rset_add(ast, &out, next, ast->max_cp);
+  }
+  *s = out;
+}
+
+static void
+rset_intersect(onig_ast* ast, rset* a, rset* b) {
+  rset out = { NULL, 0, 0 };
+  size_t i = 0, j = 0;
+  rset_normalize(a);
+  rset_normalize(b);
+  while (i < a->n && j < b->n) {
+    uint32_t const lo = a->r[i].lo > b->r[j].lo ? a->r[i].lo : b->r[j].lo;
+    uint32_t const hi = a->r[i].hi < b->r[j].hi ? a->r[i].hi : b->r[j].hi;
+    if (lo <= hi) { rset_add(ast, &out, lo, hi); }
+    if (a->r[i].hi < b->r[j].hi) { ++i; } else { ++j; }
+  }
+  *a = out;
+}
+
+static void
+rset_union(onig_ast* ast, rset* a, rset const* b) {
+  size_t i;
+  for (i = 0; i < b->n; ++i) { rset_add(ast, a, b->r[i].lo, b->r[i].hi); }
+}
+
+/* Adds the other ASCII case of every ASCII letter in the set. */
+static void
+rset_fold_ascii(onig_ast* ast, rset* s) {
+  size_t i, n = s->n;
+  for (i = 0; i < n; ++i) {
+    uint32_t const lo = s->r[i].lo, hi = s->r[i].hi;
+    uint32_t a = lo > 'A' ? lo : 'A', b = hi < 'Z' ? hi : 'Z';
+    if (a <= b) { rset_add(ast, s, a + 32, b + 32); }
+    a = lo > 'a' ? lo : 'a';
+    b = hi < 'z' ? hi : 'z';
+    if (a <= b) { rset_add(ast, s, a - 32, b - 32); }
+  }
+}
+
+typedef struct {
+  onig_ast* ast;
+  unsigned char const* begin;
+  unsigned char const* p;
+  unsigned char const* end;
+  int utf8;
+  int depth;
+  int captures;
+} parser;
+
+static onig_ast_node*
+new_node(parser* ps, enum onig_ast_type type, unsigned char const* at) {
+  onig_ast_node* const n = (onig_ast_node*)ast_alloc(ps->ast, sizeof(onig_ast_node));
+  n->type = type;
+  n->pos = (size_t)(at - ps->begin);
+  return n;
+}
+
+static onig_ast_node*
+class_node(parser* ps, rset* s, int flags, unsigned options, unsigned char const* at) {
+  onig_ast_node* const n = new_node(ps, ONIG_AST_CLASS, at);
+  if (options & ONIG_AST_OPT_IGNORECASE) {
+    size_t i;
+    flags |= ONIG_AST_IGNORECASE;
+    rset_fold_ascii(ps->ast, s);
+    for (i = 0; i < s->n; ++i) {
+      if (s->r[i].hi >= 0x80) { flags |= ONIG_AST_OPAQUE; }  /* Unicode case folding */
+    }
+  }
+  rset_normalize(s);
+  n->flags = flags;
+  n->ranges = s->r;
+  n->nranges = s->n;
+  return n;
+}
+
+static uint32_t
+read_char(parser* ps) {
+  unsigned char const c = *ps->p++;
+  uint32_t cp;
+  int more, i;
+  if (!ps->utf8 || c < 0x80) { return c; }
+  if (c >= 0xf0) { cp = c & 0x07; more = 3; }
+  else if (c >= 0xe0) { cp = c & 0x0f; more = 2; }
+  else if (c >= 0xc0) { cp = c & 0x1f; more = 1; }
+  else { return c; }
+  for (i = 0; i < more && ps->p < ps->end && (*ps->p & 0xc0) == 0x80; ++i) {
+    cp = (cp << 6) | (*ps->p++ & 0x3f);
+  }
+  return cp;
+}
+
+static int
+hex_value(int c) {
+  if (c >= '0' && c <= '9') { return c - '0'; }
+  if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+  if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+  return -1;
+}
+
+static uint32_t
+read_number(parser* ps, int base, int max_digits) {
+  uint32_t v = 0;
+  int d, i;
+  for (i = 0; i < max_digits && ps->p < ps->end; ++i) {
+    d = hex_value(*ps->p);
+    if (d < 0 || d >= base) { break; }
+    v = v * base + d;
+    ++ps->p;
+  }
+  return v;
+}
+
+static void
+add_shorthand(parser* ps, rset* s, int c) {
+  onig_ast* const ast = ps->ast;
+  switch (c | 0x20) {
+    case 'd': rset_add(ast, s, '0', '9'); break;
+    case 'h': rset_add(ast, s, '0', '9'); rset_add(ast, s, 'A', 'F'); rset_add(ast, s, 'a', 'f'); break;
+    case 's': rset_add(ast, s, '\t', '\r'); rset_add(ast, s, ' ', ' '); break;
+    case 'w':
+      rset_add(ast, s, '0', '9'); rset_add(ast, s, 'A', 'Z');
+      rset_add(ast, s, '_', '_'); rset_add(ast, s, 'a', 'z');
+      break;
+  }
+  if (c >= 'A' && c <= 'Z') { rset_negate(ast, s); }
+}
+
+static int
+is_shorthand(int c) {
+  switch (c) {
+    case 'd': case 'D': case 'h': case 'H': case 's': case 'S': case 'w': case 'W': return 1;
+  }
+  return 0;
+}
+
+/* \p{...}, \P{...}: the property itself is not modelled. */
+static void
+skip_property(parser* ps) {
+  if (ps->p < ps->end && *ps->p == '{') {
+    while (ps->p < ps->end && *ps->p != '}') { ++ps->p; }
+    if (ps->p < ps->end) { ++ps->p; }
+  } else if (ps->p < ps->end) {
+    ++ps->p;
+  }
+}
+
+/* Character escapes shared by classes and atoms; ps->p is after the letter.
+   Returns -1 for sequences that are not a single character. */
+static long
+char_escape(parser* ps, int c) {
+  switch (c) {
+    case 't': return '\t';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case 'a': return 7;
+    case 'e': return 27;
+    case 'x':
+      if (ps->p < ps->end && *ps->p == '{') {
+        ++ps->p;
+        uint32_t const v = read_number(ps, 16, 8);
+        if (ps->p < ps->end && *ps->p == '}') { ++ps->p; }
+        return v;
+      }
+      return read_number(ps, 16, 2);
+    case 'u':
+      if (ps->p < ps->end && *ps->p == '{') {
+        unsigned char const* const save = ps->p++;
+        uint32_t const v = read_number(ps, 16, 8);
+        if (ps->p < ps->end && *ps->p == '}') { ++ps->p; return v; }
+        ps->p = save;
+        return -1;  /* \u{a b}: several characters */
+      }
+      return read_number(ps, 16, 4);
+    case '0': return read_number(ps, 8, 2);
+    case 'c': case 'C': case 'M':
+      return -1;
+  }
+  return c;
+}
+
+static void skip_control_escape(parser* ps, int c);
+
+static void parse_class_items(parser* ps, rset* s, int* flags, unsigned options);
+
+static int
+parse_posix_bracket(parser* ps, rset* s, int* flags) {
+  static char const* const names[] = {
+    "alnum", "alpha", "ascii", "blank", "cntrl", "digit", "graph",
+    "lower", "print", "punct", "space", "upper", "xdigit", "word", NULL
+  };
+  onig_ast* const ast = ps->ast;
+  unsigned char const* q = ps->p + 2;  /* after "[:" */
+  int negate = 0, i;
+  rset tmp = { NULL, 0, 0 };
+  if (q < ps->end && *q == '^') { negate = 1; ++q; }
+  for (i = 0; names[i]; ++i) {
+    size_t const len = strlen(names[i]);
+    if ((size_t)(ps->end - q) >= len + 2 && memcmp(q, names[i], len) == 0 &&
+        q[len] == ':' && q[len + 1] == ']') {
+      ps->p = q + len + 2;
+      break;
+    }
+  }
+  if (!names[i]) { return 0; }
+  switch (i) {
+    case 0: rset_add(ast, &tmp, '0', '9'); rset_add(ast, &tmp, 'A', 'Z'); rset_add(ast, &tmp, 'a', 'z'); break;
+    case 1: rset_add(ast, &tmp, 'A', 'Z'); rset_add(ast, &tmp, 'a', 'z'); break;
+    case 2: rset_add(ast, &tmp, 0, 0x7f); break;
+    case 3: rset_add(ast, &tmp, '\t', '\t'); rset_add(ast, &tmp, ' ', ' '); break;
+    case 4: rset_add(ast, &tmp, 0, 0x1f); rset_add(ast, &tmp, 0x7f, 0x7f); break;
+    case 5: rset_add(ast, &tmp, '0', '9'); break;
+    case 6: rset_add(ast, &tmp, 0x21, 0x7e); break;
+    case 7: rset_add(ast, &tmp, 'a', 'z'); break;
+    case 8: rset_add(ast, &tmp, 0x20, 0x7e); break;
+    case 9: rset_add(ast, &tmp, 0x21, 0x2f); rset_add(ast, &tmp, 0x3a, 0x40);
+            rset_add(ast, &tmp, 0x5b, 0x60); rset_add(ast, &tmp, 0x7b, 0x7e); break;
+    case 10: rset_add(ast, &tmp, '\t', '\r'); rset_add(ast, &tmp, ' ', ' '); break;
+    case 11: rset_add(ast, &tmp, 'A', 'Z'); break;
+    case 12: add_shorthand(ps, &tmp, 'h'); break;
+    case 13: add_shorthand(ps, &tmp, 'w'); break;
+  }
+  if (negate) { rset_negate(ast, &tmp); }
+  rset_union(ast, s, &tmp);
+  *flags |= ONIG_AST_ENC_DEPENDENT;  /* Unicode aware in Onigmo */
+  return 1;
+}
+
+/* Reads one class member into s; returns its code point when it is a single
+   character (so it can start a range), -1 otherwise. */
+static long
+parse_class_atom(parser* ps, rset* s, int* flags, unsigned options) {
+  onig_ast* const ast = ps->ast;
+  if (*ps->p == '[') {
+    if (ps->p + 1 < ps->end && ps->p[1] == ':' && parse_posix_bracket(ps, s, flags)) {
+      return -1;
+    }
+    rset inner = { NULL, 0, 0 };
+    int negate = 0;
+    ++ps->p;
+    if (ps->p < ps->end && *ps->p == '^') { negate = 1; ++ps->p; }
+    parse_class_items(ps, &inner, flags, options);
+    if (negate) { rset_negate(ast, &inner); }
+    rset_union(ast, s, &inner);
+    return -1;
+  }
+  if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+    int const c = ps->p[1];
+    ps->p += 2;
+    if (is_shorthand(c)) {
+      add_shorthand(ps, s, c);
+      *flags |= ONIG_AST_ENC_DEPENDENT;
+      return -1;
+    }
+    if (c == 'p' || c == 'P') {
+      skip_property(ps);
+      rset_add(ast, s, 0, ast->max_cp);
+      *flags |= ONIG_AST_OPAQUE;
+      return -1;
+    }
+    if (c == 'c' || c == 'C' || c == 'M') {
+      skip_control_escape(ps, c);
+      rset_add(ast, s, 0, ast->max_cp);
+      *flags |= ONIG_AST_OPAQUE;
+      return -1;
+    }
+    if (c >= '1' && c <= '7') {
+      --ps->p;
+      return read_number(ps, 8, 3);
+    }
+    if (c == 'b') { rset_add(ast, s, 8, 8); return 8; }
+    {
+      long const v = char_escape(ps, c);
+      if (v < 0) {
+        rset_add(ast, s, 0, ast->max_cp);
+        *flags |= ONIG_AST_OPAQUE;
+        return -1;
+      }
+      rset_add(ast, s, (uint32_t)v, (uint32_t)v);
+      return v;
+    }
+  }
+  {
+    uint32_t const cp = read_char(ps);
+    rset_add(ast, s, cp, cp);
+    return cp;
+  }
+}
+
+/* Parses class members up to and including the closing ']'. */
+static void
+parse_class_items(parser* ps, rset* s, int* flags, unsigned options) {
+  onig_ast* const ast = ps->ast;
+  int first = 1;
+  while (ps->p < ps->end) {
+    if (*ps->p == ']' && !first) { ++ps->p; return; }
+    if (*ps->p == '&' && ps->p + 1 < ps->end && ps->p[1] == '&') {
+      rset rhs = { NULL, 0, 0 };
+      int negate = 0;
+      ps->p += 2;
+      if (ps->p < ps->end && *ps->p == '^') { negate = 1; ++ps->p; }
+      parse_class_items(ps, &rhs, flags, options);  /* consumes the outer ']' */
+      if (negate) { rset_negate(ast, &rhs); }
+      rset_intersect(ast, s, &rhs);
+      return;
+    }
+    first = 0;
+    {
+      long const lo = parse_class_atom(ps, s, flags, options);
+      if (lo >= 0 && ps->p + 1 < ps->end && *ps->p == '-' && ps->p[1] != ']') {
+        rset tmp = { NULL, 0, 0 };
+        long hi;
+        ++ps->p;
+        hi = parse_class_atom(ps, &tmp, flags, options);
+        if (hi >= lo) {
+          rset_add(ast, s, (uint32_t)lo, (uint32_t)hi);
+        } else {
+          rset_union(ast, s, &tmp);
+        }
+      }
+    }
+  }
+}
+
+static void
+skip_control_escape(parser* ps, int c) {
+  /* \cX, \C-X, \M-X, possibly nested (\M-\C-x) */
+  if (c != 'c' && ps->p < ps->end && *ps->p == '-') { ++ps->p; }
+  if (ps->p < ps->end && *ps->p == '\\' && ps->p + 1 < ps->end) {
+    int const next = ps->p[1];
+    ps->p += 2;
+    if (next == 'c' || next == 'C' || next == 'M') { skip_control_escape(ps, next); }
+  } else if (ps->p < ps->end) {
+    read_char(ps);
+  }
+}
+
+static void
+skip_space(parser* ps, unsigned options) {
+  if (!(options & ONIG_AST_OPT_EXTEND)) { return; }
+  while (ps->p < ps->end) {
+    unsigned char const c = *ps->p;
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v') {
+      ++ps->p;
+    } else if (c == '#') {
+      while (ps->p < ps->end && *ps->p != '\n') { ++ps->p; }
+    } else {
+      break;
+    }
+  }
+}
+
+static onig_ast_node* parse_alt(parser* ps, unsigned options);
+
+static onig_ast_node*
+wrap(parser* ps, enum onig_ast_type type, onig_ast_node* child, unsigned char const* at) {
+  onig_ast_node* const n = new_node(ps, type, at);
+  n->child = child;
+  return n;
+}
+
+static void
+expect_close(parser* ps) {
+  if (ps->p < ps->end && *ps->p == ')') { ++ps->p; }
+}
+
+static int
+parse_options(parser* ps, unsigned* options) {
+  int on = 1;
+  while (ps->p < ps->end) {
+    unsigned bit = 0;
+    switch (*ps->p) {
+      case 'i': bit = ONIG_AST_OPT_IGNORECASE; break;
+      case 'x': bit = ONIG_AST_OPT_EXTEND; break;
+      case 'm': bit = ONIG_AST_OPT_MULTILINE; break;
+      case 'a': case 'd': case 'u': case 'l': break;
+      case '-': on = 0; break;
+      default: return 1;
+    }
+    if (on) { *options |= bit; } else { *options &= ~bit; }
+    ++ps->p;
+  }
+  return 0;
+}
+
+static onig_ast_node*
+parse_group(parser* ps, unsigned options, unsigned char const* at) {
+  onig_ast_node* n;
+  if (ps->p >= ps->end || *ps->p != '?') {
+    n = wrap(ps, ONIG_AST_GROUP, parse_alt(ps, options), at);
+    n->value = ++ps->captures;
+    expect_close(ps);
+    return n;
+  }
+  ++ps->p;
+  if (ps->p >= ps->end) { return new_node(ps, ONIG_AST_OTHER, at); }
+  switch (*ps->p) {
+    case '#':
+      while (ps->p < ps->end && *ps->p != ')') { ++ps->p; }
+      expect_close(ps);
+      return new_node(ps, ONIG_AST_EMPTY, at);
+    case ':':
+      ++ps->p;
+      n = parse_alt(ps, options);
+      expect_close(ps);
+      return n;
+    case '=': case '!':
+      n = new_node(ps, ONIG_AST_LOOK, at);
+      n->flags = *ps->p++ == '!' ? ONIG_AST_NEGATIVE : 0;
+      n->child = parse_alt(ps, options);
+      expect_close(ps);
+      return n;
+    case '>':
+      ++ps->p;
+      n = wrap(ps, ONIG_AST_ATOMIC, parse_alt(ps, options), at);
+      expect_close(ps);
+      return n;
+    case '~':
+      ++ps->p;
+      n = wrap(ps, ONIG_AST_OTHER, parse_alt(ps, options), at);
+      expect_close(ps);
+      return n;
+    case '(':
+      /* conditional: (?(cond)yes|no) */
+      while (ps->p < ps->end && *ps->p != ')') { ++ps->p; }
+      if (ps->p < ps->end) { ++ps->p; }
+      n = wrap(ps, ONIG_AST_OTHER, parse_alt(ps, options), at);
+      expect_close(ps);
+      return n;
+    case '<': case '\'':
+      if (ps->p + 1 < ps->end && *ps->p == '<' && (ps->p[1] == '=' || ps->p[1] == '!')) {
+        n = new_node(ps, ONIG_AST_LOOK, at);
+        n->flags = ONIG_AST_BEHIND | (ps->p[1] == '!' ? ONIG_AST_NEGATIVE : 0);
+        ps->p += 2;
+        n->child = parse_alt(ps, options);
+        expect_close(ps);
+        return n;
+      }
+      {
+        unsigned char const term = *ps->p++ == '<' ? '>' : '\'';
+        while (ps->p < ps->end && *ps->p != term) { ++ps->p; }
+        if (ps->p < ps->end) { ++ps->p; }
+      }
+      n = wrap(ps, ONIG_AST_GROUP, parse_alt(ps, options), at);
+      n->value = ++ps->captures;
+      expect_close(ps);
+      return n;
+  }
+  {
+    unsigned opts = options;
+    if (parse_options(ps, &opts) && ps->p < ps->end && *ps->p == ':') {
+      ++ps->p;
+      n = parse_alt(ps, opts);
+      expect_close(ps);
+      return n;
+    }
+    if (ps->p < ps->end && *ps->p == ')') {
+      /* (?imx): applies to the rest of the enclosing group */
+      ++ps->p;
+      return parse_alt(ps, opts);
+    }
+    return new_node(ps, ONIG_AST_OTHER, at);
+  }
+}
+
+static onig_ast_node*
+parse_escape(parser* ps, unsigned options, unsigned char const* at) {
+  onig_ast* const ast = ps->ast;
+  rset s = { NULL, 0, 0 };
+  onig_ast_node* n;
+  int c;
+  if (ps->p >= ps->end) { return new_node(ps, ONIG_AST_OTHER, at); }
+  c = *ps->p++;
+  if (is_shorthand(c)) {
+    add_shorthand(ps, &s, c);
+    return class_node(ps, &s, ONIG_AST_ENC_DEPENDENT, options, at);
+  }
+  switch (c) {
+    case 'A': case 'z': case 'Z': case 'b': case 'B': case 'G':
+      n = new_node(ps, ONIG_AST_ANCHOR, at);
+      n->value = c;
+      return n;
+    case 'p': case 'P':
+      skip_property(ps);
+      rset_add(ast, &s, 0, ast->max_cp);
+      return class_node(ps, &s, ONIG_AST_OPAQUE, options, at);
+    case 'k':
+      n = new_node(ps, ONIG_AST_BACKREF, at);
+      if (ps->p < ps->end && (*ps->p == '<' || *ps->p == '\'')) {
+        unsigned char const term = *ps->p++ == '<' ? '>' : '\'';
+        while (ps->p < ps->end && *ps->p != term) { ++ps->p; }
+        if (ps->p < ps->end) { ++ps->p; }
+      }
+      return n;
+    case 'g':
+      if (ps->p < ps->end && (*ps->p == '<' || *ps->p == '\'')) {
+        unsigned char const term = *ps->p++ == '<' ? '>' : '\'';
+        while (ps->p < ps->end && *ps->p != term) { ++ps->p; }
+        if (ps->p < ps->end) { ++ps->p; }
+      }
+      return new_node(ps, ONIG_AST_OTHER, at);
+    case 'K': case 'R': case 'X': case 'N': case 'O':
+      return new_node(ps, ONIG_AST_OTHER, at);
+    case 'c': case 'C': case 'M':
+      skip_control_escape(ps, c);
+      rset_add(ast, &s, 0, ast->max_cp);
+      return class_node(ps, &s, ONIG_AST_OPAQUE, options, at);
+  }
+  if (c >= '1' && c <= '9') {
+    while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') { ++ps->p; }
+    return new_node(ps, ONIG_AST_BACKREF, at);
+  }
+  --ps->p;
+  if ((c & 0x80) && ps->utf8) {
+    uint32_t const cp = read_char(ps);
+    rset_add(ast, &s, cp, cp);
+    return class_node(ps, &s, 0, options, at);
+  }
+  ++ps->p;
+  {
+    long const v = char_escape(ps, c);
+    if (v < 0) {
+      if (c == 'u') {
+        /* \u{61 62}: a sequence of characters */
+        onig_ast_node* const seq = new_node(ps, ONIG_AST_CONCAT, at);
+        onig_ast_node** tail = &seq->child;
+        ++ps->p;
+        while (ps->p < ps->end && *ps->p != '}') {
+          if (*ps->p == ' ') { ++ps->p; continue; }
+          rset one = { NULL, 0, 0 };
+          uint32_t const cp = read_number(ps, 16, 8);
+          rset_add(ast, &one, cp, cp);
+          *tail = class_node(ps, &one, 0, options, at);
+          tail = &(*tail)->next;
+          if (ps->p < ps->end && hex_value(*ps->p) < 0 && *ps->p != ' ' && *ps->p != '}') { ++ps->p; }
+        }
+        if (ps->p < ps->end) { ++ps->p; }
+        return seq;
+      }
+      return new_node(ps, ONIG_AST_OTHER, at);
+    }
+    rset_add(ast, &s, (uint32_t)v, (uint32_t)v);
+    return class_node(ps, &s, 0, options, at);
+  }
+}
+
+static onig_ast_node*
+parse_atom(parser* ps, unsigned options) {
+  onig_ast* const ast = ps->ast;
+  unsigned char const* const at = ps->p;
+  rset s = { NULL, 0, 0 };
+  int flags = 0;
+  uint32_t cp;
+  switch (*ps->p) {
+    case '(':
+      ++ps->p;
+      if (++ps->depth > ONIG_AST_MAX_DEPTH) { longjmp(ast->oom, 2); }
+      {
+        onig_ast_node* const n = parse_group(ps, options, at);
+        --ps->depth;
+        return n;
+      }
+    case '[':
+      ++ps->p;
+      {
+        int negate = 0;
+        if (ps->p < ps->end && *ps->p == '^') { negate = 1; ++ps->p; }
+        parse_class_items(ps, &s, &flags, options);
+        if (negate) { rset_negate(ast, &s); }
+      }
+      return class_node(ps, &s, flags, options, at);
+    case '.':
+      ++ps->p;
+      if (options & ONIG_AST_OPT_MULTILINE) {
+        rset_add(ast, &s, 0, ast->max_cp);
+      } else {
+        rset_add(ast, &s, 0, '\n' - 1);
+        rset_add(ast, &s, '\n' + 1, ast->max_cp);
+      }
+      return class_node(ps, &s, 0, 0, at);
+    case '^': case '$':
+      {
+        onig_ast_node* const n = new_node(ps, ONIG_AST_ANCHOR, at);
+        n->value = *ps->p++;
+        return n;
+      }
+    case '\\':
+      ++ps->p;
+      return parse_escape(ps, options, at);
+  }
+  cp = read_char(ps);
+  rset_add(ast, &s, cp, cp);
+  return class_node(ps, &s, 0, options, at);
+}
+
+/* Parses "{n}", "{n,}", "{,m}" or "{n,m}"; leaves ps->p untouched if the
+   brace does not start an interval (it is then a literal). */
+static int
+parse_interval(parser* ps, int* min, int* max) {
+  unsigned char const* q = ps->p + 1;
+  long lo = -1, hi = -1;
+  if (q < ps->end && *q >= '0' && *q <= '9') {
+    lo = 0;
+    while (q < ps->end && *q >= '0' && *q <= '9') { lo = lo * 10 + (*q++ - '0'); if (lo > 100000) { lo = 100000; } }
+  }
+  if (q < ps->end && *q == ',') {
+    ++q;
+    if (q < ps->end && *q >= '0' && *q <= '9') {
+      hi = 0;
+      while (q < ps->end && *q >= '0' && *q <= '9') { hi = hi * 10 + (*q++ - '0'); if (hi > 100000) { hi = 100000; } }
+    }
+    if (lo < 0 && hi < 0) { return 0; }
+    if (lo < 0) { lo = 0; }
+  } else {
+    if (lo < 0) { return 0; }
+    hi = lo;
+  }
+  if (q >= ps->end || *q != '}') { return 0; }
+  ps->p = q + 1;
+  *min = (int)lo;
+  *max = (int)hi;
+  return 1;
+}
+
+static onig_ast_node*
+parse_quantifiers(parser* ps, onig_ast_node* atom, unsigned options) {
+  int stacked;
+  for (stacked = 0;; ++stacked) {
+    unsigned char const* const at = ps->p;
+    int min, max, interval = 0;
+    skip_space(ps, options);
+    if (ps->p >= ps->end) { return atom; }
+    switch (*ps->p) {
+      case '*': min = 0; max = -1; ++ps->p; break;
+      case '+': min = 1; max = -1; ++ps->p; break;
+      case '?': min = 0; max = 1; ++ps->p; break;
+      case '{':
+        if (!parse_interval(ps, &min, &max)) { ps->p = at; return atom; }
+        /* {n} takes no ? or + of its own: a{2}? is (?:a{2})? */
+        interval = memchr(at, ',', (size_t)(ps->p - at)) ? 1 : 2;
+        break;
+      default:
+        ps->p = at;
+        return atom;
+    }
+    if (ps->depth + stacked > ONIG_AST_MAX_DEPTH) { longjmp(ps->ast->oom, 2); }
+    {
+      onig_ast_node* const n = wrap(ps, ONIG_AST_REPEAT, atom, at);
+      n->min = min;
+      n->max = max;
+      if (interval != 2 && ps->p < ps->end && *ps->p == '?') {
+        n->flags |= ONIG_AST_LAZY;
+        ++ps->p;
+      } else if (!interval && ps->p < ps->end && *ps->p == '+') {
+        n->flags |= ONIG_AST_POSSESSIVE;
+        ++ps->p;
+      }
+      atom = n;
+    }
+  }
+}
+
+static onig_ast_node*
+parse_concat(parser* ps, unsigned options) {
+  onig_ast_node* const seq = new_node(ps, ONIG_AST_CONCAT, ps->p);
+  onig_ast_node** tail = &seq->child;
+  for (;;) {
+    skip_space(ps, options);
+    if (ps->p >= ps->end || *ps->p == '|' || *ps->p == ')') { break; }
+    if (*ps->p == '(' && ps->p + 2 < ps->end && ps->p[1] == '?' &&
+        (ps->p[2] == 'i' || ps->p[2] == 'm' || ps->p[2] == 'x' || ps->p[2] == '-')) {
+      /* an option switch without ':' swallows the rest of the group,
+         including further alternatives */
+      unsigned char const* const save = ps->p;
+      unsigned opts = options;
+      ps->p += 2;
+      if (!parse_options(ps, &opts) || (ps->p < ps->end && *ps->p == ')')) {
+        if (ps->p < ps->end && *ps->p == ')') {
+          ++ps->p;
+          if (++ps->depth > ONIG_AST_MAX_DEPTH) { longjmp(ps->ast->oom, 2); }
+          *tail = parse_alt(ps, opts);
+          --ps->depth;
+          break;
+        }
+      }
+      ps->p = save;
+    }
+    *tail = parse_quantifiers(ps, parse_atom(ps, options), options);
+    tail = &(*tail)->next;
+  }
+  if (seq->child && !seq->child->next) { return seq->child; }
+  if (!seq->child) { seq->type = ONIG_AST_EMPTY; }
+  return seq;
+}
+
+static onig_ast_node*
+parse_alt(parser* ps, unsigned options) {
+  unsigned char const* const at = ps->p;
+  onig_ast_node* const first = parse_concat(ps, options);
+  if (ps->p >= ps->end || *ps->p != '|') { return first; }
+  {
+    onig_ast_node* const alt = new_node(ps, ONIG_AST_ALT, at);
+    onig_ast_node** tail = &first->next;
+    alt->child = first;
+    while (ps->p < ps->end && *ps->p == '|') {
+      ++ps->p;
+      *tail = parse_concat(ps, options);
+      tail = &(*tail)->next;
+    }
+    return alt;
+  }
+}
+
+onig_ast*
+onig_ast_parse(char const* src, size_t len, unsigned options, int utf8) {
+  onig_ast* const ast = (onig_ast*)malloc(sizeof(onig_ast));
+  parser ps;
+  int jumped;
+  if (!ast) { return NULL; }
+  ast->blocks = NULL;
+  ast->root = NULL;
+  ast->max_cp = utf8 ? 0x10ffff : 0xff;
+
+  ps.ast = ast;
+  ps.begin = ps.p = (unsigned char const*)src;
+  ps.end = ps.begin + len;
+  ps.utf8 = utf8;
+  ps.depth = 0;
+  ps.captures = 0;
+
+  jumped = setjmp(ast->oom);
+  if (jumped == 1) {
+    onig_ast_free(ast);
+    return NULL;
+  }
+  if (jumped == 2) {
+    /* nested too deeply to analyze */
+    ast->root = new_node(&ps, ONIG_AST_OTHER, ps.begin);
+    return ast;
+  }
+  ast->root = parse_alt(&ps, options & 7u);
+  while (ps.p < ps.end) {
+    /* unbalanced ')': Onigmo rejects these, keep whatever follows */
+    onig_ast_node* const seq = new_node(&ps, ONIG_AST_CONCAT, ps.p);
+    ++ps.p;
+    seq->child = ast->root;
+    ast->root->next = parse_alt(&ps, options & 7u);
+    ast->root = seq;
+  }
+  return ast;
+}
+
+void
+onig_ast_free(onig_ast* ast) {
+  onig_ast_block* b;
+  if (!ast) { return; }
+  b = ast->blocks;
+  while (b) {
+    onig_ast_block* const next = b->next;
+    free(b);
+    b = next;
+  }
+  free(ast);
+}
+
+onig_ast_node const*
+onig_ast_root(onig_ast const* ast) {
+  return ast->root;
+}
+
+uint32_t
+onig_ast_max_codepoint(onig_ast const* ast) {
+  return ast->max_cp;
+}
+
+/* --- analysis --- */
+
+/* first-character set: ASCII bitmap plus "some non-ASCII character" */
+typedef struct {
+  uint32_t ascii[4];
+  int high;
+} fset;
+
+static void
+fset_all(fset* f) {
+  f->ascii[0] = f->ascii[1] = f->ascii[2] = f->ascii[3] = 0xffffffffu;
+  f->high = 1;
+}
+
+static void
+fset_or(fset* a, fset const* b) {
+  int i;
+  for (i = 0; i < 4; ++i) { a->ascii[i] |= b->ascii[i]; }
+  a->high |= b->high;
+}
+
+static int
+fset_overlaps(fset const* a, fset const* b) {
+  int i;
+  for (i = 0; i < 4; ++i) {
+    if (a->ascii[i] & b->ascii[i]) { return 1; }
+  }
+  return a->high && b->high;
+}
+
+int
+onig_ast_nullable(onig_ast_node const* n) {
+  onig_ast_node const* c;
+  switch (n->type) {
+    case ONIG_AST_CLASS:
+      return 0;
+    case ONIG_AST_CONCAT:
+      for (c = n->child; c; c = c->next) {
+        if (!onig_ast_nullable(c)) { return 0; }
+      }
+      return 1;
+    case ONIG_AST_ALT:
+      for (c = n->child; c; c = c->next) {
+        if (onig_ast_nullable(c)) { return 1; }
+      }
+      return 0;
+    case ONIG_AST_REPEAT:
+      return n->min == 0 || onig_ast_nullable(n->child);
+    case ONIG_AST_GROUP: case ONIG_AST_ATOMIC:
+      return onig_ast_nullable(n->child);
+    default:
+      return 1;
+  }
+}
+
+static int
+has_capture(onig_ast_node const* n) {
+  onig_ast_node const* c;
+  if (n->type == ONIG_AST_GROUP) { return 1; }
+  for (c = n->child; c; c = c->next) {
+    if (has_capture(c)) { return 1; }
+  }
+  return 0;
+}
+
+int
+onig_ast_capture_sensitive(onig_ast_node const* n) {
+  onig_ast_node const* c;
+  if (n->type == ONIG_AST_REPEAT && (n->max < 0 || n->max > 1)) {
+    if (onig_ast_nullable(n->child) && has_capture(n->child)) { return 1; }
+    for (c = n->child; c->type == ONIG_AST_GROUP; c = c->child) {
+      if (c->child->type == ONIG_AST_REPEAT) { return 1; }
+    }
+  }
+  for (c = n->child; c; c = c->next) {
+    if (onig_ast_capture_sensitive(c)) { return 1; }
+  }
+  return 0;
+}
+
+static void
+node_first(onig_ast_node const* n, fset* f) {
+  onig_ast_node const* c;
+  size_t i;
+  switch (n->type) {
+    case ONIG_AST_CLASS:
+      for (i = 0; i < n->nranges; ++i) {
+        uint32_t lo = n->ranges[i].lo;
+        uint32_t const hi = n->ranges[i].hi;
+        for (; lo <= hi && lo < 0x80; ++lo) { f->ascii[lo >> 5] |= 1u << (lo & 31); }
+        if (hi >= 0x80) { f->high = 1; }
+      }
+      break;
+    case ONIG_AST_CONCAT:
+      for (c = n->child; c; c = c->next) {
+        node_first(c, f);
+        if (!onig_ast_nullable(c)) { break; }
+      }
+      break;
+    case ONIG_AST_ALT:
+      for (c = n->child; c; c = c->next) { node_first(c, f); }
+      break;
+    case ONIG_AST_REPEAT:
+      if (n->max != 0) { node_first(n->child, f); }
+      break;
+    case ONIG_AST_GROUP: case ONIG_AST_ATOMIC:
+      node_first(n->child, f);
+      break;
+    case ONIG_AST_BACKREF: case ONIG_AST_OTHER:
+      fset_all(f);
+      break;
+    default:
+      break;
+  }
+}
+
+static int
+unbounded_repeat_p(onig_ast_node const* n) {
+  return n->type == ONIG_AST_REPEAT && n->max < 0 && !(n->flags & ONIG_AST_POSSESSIVE);
+}
+
+/* follow: characters that may come right after n, including those of the
+   next iteration of an enclosing loop. in_loop: n is inside a repeat that
+   may iterate more than once, with no atomic boundary in between. */
+static void
+analyze_node(onig_ast_node const* n, fset const* follow, int in_loop, onig_ast_analysis* r) {
+  onig_ast_node const* c;
+  fset f;
+  switch (n->type) {
+    case ONIG_AST_CONCAT: {
+      onig_ast_node const* items[64];
+      onig_ast_node const** all = items;
+      size_t count = 0, i;
+      for (c = n->child; c; c = c->next) { ++count; }
+      if (count > 64) {
+        all = (onig_ast_node const**)malloc(count * sizeof(*all));
+        if (!all) { r->regular = 0; return; }
+      }
+      for (i = 0, c = n->child; c; c = c->next) { all[i++] = c; }
+
+      /* overlapping unbounded repeats in sequence: \d+\d+, .*.* */
+      for (i = 0; i < count; ++i) {
+        size_t j;
+        fset fi;
+        if (!unbounded_repeat_p(all[i])) { continue; }
+        memset(&fi, 0, sizeof(fi));
+        node_first(all[i]->child, &fi);
+        for (j = i + 1; j < count; ++j) {
+          if (unbounded_repeat_p(all[j])) {
+            fset fj;
+            memset(&fj, 0, sizeof(fj));
+            node_first(all[j]->child, &fj);
+            if (fset_overlaps(&fi, &fj)) { ++r->adjacent_quantifiers; break; }
+          }
+          if (!onig_ast_nullable(all[j])) { break; }
+        }
+      }
+
+      f = *follow;
+      for (i = count; i-- > 0;) {
+        fset next;
+        analyze_node(all[i], &f, in_loop, r);
+        memset(&next, 0, sizeof(next));
+        node_first(all[i], &next);
+        if (onig_ast_nullable(all[i])) { fset_or(&next, &f); }
+        f = next;
+      }
+      if (all != items) { free((void*)all); }
+      break;
+    }
+    case ONIG_AST_ALT:
+      if (in_loop) {
+        onig_ast_node const* d;
+        int overlap = 0;
+        for (c = n->child; c && !overlap; c = c->next) {
+          fset fc;
+          memset(&fc, 0, sizeof(fc));
+          node_first(c, &fc);
+          if (onig_ast_nullable(c)) { fset_or(&fc, follow); }
+          for (d = c->next; d && !overlap; d = d->next) {
+            fset fd;
+            memset(&fd, 0, sizeof(fd));
+            node_first(d, &fd);
+            if (onig_ast_nullable(d)) { fset_or(&fd, follow); }
+            overlap = fset_overlaps(&fc, &fd);
+          }
+        }
+        if (overlap) { ++r->overlapping_alternations; }
+      }
+      for (c = n->child; c; c = c->next) { analyze_node(c, follow, in_loop, r); }
+      break;
+    case ONIG_AST_REPEAT: {
+      int const loops = n->max < 0 || n->max > 1;
+      if (n->flags & ONIG_AST_POSSESSIVE) {
+        fset none;
+        memset(&none, 0, sizeof(none));
+        analyze_node(n->child, &none, 0, r);
+        break;
+      }
+      memset(&f, 0, sizeof(f));
+      node_first(n->child, &f);
+      if (in_loop && n->max < 0 && fset_overlaps(&f, follow)) {
+        ++r->nested_quantifiers;
+      }
+      if (loops) { fset_or(&f, follow); } else { f = *follow; }
+      analyze_node(n->child, &f, in_loop || loops, r);
+      break;
+    }
+    case ONIG_AST_GROUP:
+      analyze_node(n->child, follow, in_loop, r);
+      break;
+    case ONIG_AST_ATOMIC: {
+      fset none;
+      memset(&none, 0, sizeof(none));
+      analyze_node(n->child, &none, 0, r);
+      break;
+    }
+    case ONIG_AST_LOOK: {
+      fset none;
+      memset(&none, 0, sizeof(none));
+      ++r->lookarounds;
+      r->regular = 0;
+      analyze_node(n->child, &none, 0, r);
+      break;
+    }
+    case ONIG_AST_BACKREF:
+      ++r->backreferences;
+      r->regular = 0;
+      break;
+    case ONIG_AST_OTHER:
+      r->regular = 0;
+      if (n->child) { analyze_node(n->child, follow, in_loop, r); }
+      break;
+    default:
+      break;
+  }
+}
+
+void
+onig_ast_analyze(onig_ast const* ast, onig_ast_analysis* result) {
+  fset end;
+  memset(result, 0, sizeof(*result));
+  memset(&end, 0, sizeof(end));
+  result->regular = 1;
+  analyze_node(ast->root, &end, 0, result);
+  result->linear = result->regular && !result->nested_quantifiers &&
+      !result->overlapping_alternations && !result->adjacent_quantifiers;
+}
@@ -0,0 +1,97 @@
+/*
+** onig_regexp_ast.h - syntax tree of Ruby-syntax regular expressions
+**
+** A small, independent parser for the pattern language accepted by
+** ONIG_SYNTAX_RUBY. It does not replace Onigmo's compiler: patterns are
+** always compiled by the library first, and the tree is only used to reason
+** about them (complexity analysis, DFA prefiltering). Constructs the parser
+** does not model precisely are kept as ONIG_AST_OTHER nodes or as classes
+** flagged ONIG_AST_OPAQUE, which consumers must treat conservatively.
+*/
+
+#ifndef ONIG_REGEXP_AST_H
+#define ONIG_REGEXP_AST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* option bits, identical to ONIG_OPTION_IGNORECASE/EXTEND/MULTILINE */
+#define ONIG_AST_OPT_IGNORECASE 1u
+#define ONIG_AST_OPT_EXTEND     2u
+#define ONIG_AST_OPT_MULTILINE  4u
+
+enum onig_ast_type {
+  ONIG_AST_EMPTY,
+  ONIG_AST_CLASS,     /* one character out of ranges (literals too) */
+  ONIG_AST_CONCAT,
+  ONIG_AST_ALT,
+  ONIG_AST_REPEAT,    /* min, max (-1: unbounded) */
+  ONIG_AST_GROUP,     /* capture group; value is its number */
+  ONIG_AST_ANCHOR,    /* value: '^', '$', 'A', 'z', 'Z', 'b', 'B', 'G' */
+  ONIG_AST_BACKREF,
+  ONIG_AST_LOOK,      /* lookahead / lookbehind */
+  ONIG_AST_ATOMIC,    /* (?>...) */
+  ONIG_AST_OTHER      /* anything else: calls, conditionals, \K, \X, ... */
+};
+
+/* node flags */
+#define ONIG_AST_IGNORECASE  0x01 /* class: parsed under /i (ASCII folded) */
+#define ONIG_AST_ENC_DEPENDENT 0x02 /* class: exact for ASCII subjects only */
+#define ONIG_AST_OPAQUE      0x04 /* class: ranges are an approximation */
+#define ONIG_AST_LAZY        0x08 /* repeat: reluctant */
+#define ONIG_AST_POSSESSIVE  0x10 /* repeat: possessive */
+#define ONIG_AST_BEHIND      0x20 /* look: lookbehind */
+#define ONIG_AST_NEGATIVE    0x40 /* look: negative */
+
+typedef struct onig_ast_range {
+  uint32_t lo, hi;
+} onig_ast_range;
+
+typedef struct onig_ast_node {
+  enum onig_ast_type type;
+  int flags;
+  int min, max;
+  int value;
+  size_t pos;                     /* offset of the node in the source */
+  struct onig_ast_node* child;    /* first child */
+  struct onig_ast_node* next;     /* next sibling */
+  onig_ast_range const* ranges;   /* ONIG_AST_CLASS, sorted and disjoint */
+  size_t nranges;
+} onig_ast_node;
+
+typedef struct onig_ast onig_ast;
+
+/* Parses a pattern. Returns NULL when out of memory. */
+onig_ast* onig_ast_parse(char const* src, size_t len, unsigned options, int utf8);
+void onig_ast_free(onig_ast* ast);
+onig_ast_node const* onig_ast_root(onig_ast const* ast);
+uint32_t onig_ast_max_codepoint(onig_ast const* ast);
+/* whether the node can match the empty string */
+int onig_ast_nullable(onig_ast_node const* node);
+/* whether Onigmo matches the pattern differently when groups do not
+   capture: a repeat whose body can match empty and contains a group (the
+   check for empty iterations looks at captures), or a repeated group whose
+   body is itself a repeat (only reduced like (?:a+?)++ without capture) */
+int onig_ast_capture_sensitive(onig_ast_node const* node);
+
+typedef struct onig_ast_analysis {
+  int nested_quantifiers;       /* ambiguous unbounded repeat inside another */
+  int overlapping_alternations; /* alternatives sharing a first character under repetition */
+  int adjacent_quantifiers;     /* overlapping unbounded repeats in sequence */
+  int backreferences;
+  int lookarounds;
+  int regular;                  /* no backrefs, lookaround or other extensions */
+  int linear;                   /* regular and none of the ambiguities above */
+} onig_ast_analysis;
+
+void onig_ast_analyze(onig_ast const* ast, onig_ast_analysis* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ONIG_REGEXP_AST_H */
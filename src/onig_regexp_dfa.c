@@ -0,0 +1,850 @@
+/*
+** onig_regexp_dfa.c - lazy DFA for backreference-free patterns
+**
+** See onig_regexp_dfa.h. The pattern is compiled into two byte-level
+** Thompson NFAs, one reading forward and one reading the reversed pattern
+** backward. DFA states are sets of NFA instructions reached right after a
+** byte ("kernels") together with the context of that byte, which is what
+** the zero-width assertions (^ $ \A \z \b \B) need; epsilon closures are
+** evaluated when a transition is first taken, once the byte on the other
+** side of the boundary is known.
+**
+** Kernels are ordered by priority like the threads of a backtracking
+** matcher, and threads started at later positions always come last. The
+** forward DFA drops everything behind a thread that reaches the match
+** instruction (and stops starting new threads), so the last match it sees
+** is the one starting leftmost. The reverse DFA, run from that end, then
+** finds the leftmost start, where Onigmo only has to match once.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "onig_regexp_dfa.h"
+
+#define DFA_MAX_INSTS 20000
+
+/* context of a boundary side */
+enum { CTX_EDGE, CTX_NL, CTX_WORD, CTX_OTHER, CTX_COUNT };
+
+enum { OP_RANGE, OP_SPLIT, OP_ASSERT, OP_MATCH };
+enum { LOOK_BOL, LOOK_EOL, LOOK_BOT, LOOK_EOT, LOOK_WB, LOOK_NWB };
+
+typedef struct {
+  unsigned char op, lo, hi, look;
+  int x, y;
+} dfa_inst;
+
+/* transition values: (state << 1) | matched-before-the-byte */
+#define TRANS_UNKNOWN (-1)
+#define TRANS_BAIL    (-2)
+#define TRANS_OOM     (-3)
+
+typedef struct {
+  uint32_t hash;
+  unsigned char ctx;     /* context of the byte just consumed */
+  unsigned char utf8;    /* UTF-8 validator state */
+  unsigned char restart; /* still starting a thread at every position */
+  int ninsts;
+  int* insts;            /* kernel, by priority */
+  int32_t* next;         /* per byte class, plus one end marker per context */
+} dfa_state;
+
+typedef struct {
+  dfa_inst* code;
+  int ncode;
+  int start;
+  int reverse;
+  int anchored;          /* forward: starts at the search start only */
+
+  dfa_state** states;
+  int nstates, cap;
+  int* table;            /* open addressing, state index + 1 */
+  size_t table_size;
+  size_t mem, budget;
+
+  /* scratch */
+  int* dense;
+  int* sparse;
+  int* stack;
+  int* kernel;
+  int* ksparse;
+} dfa_machine;
+
+struct onig_dfa {
+  unsigned char classes[256];
+  int nclasses;
+  int ascii_only;        /* bytes >= 0x80 in the subject: give up */
+  int check_utf8;        /* validate the subject while scanning */
+  dfa_machine fwd, rev;
+};
+
+static int
+is_word_byte(unsigned c) {
+  return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+}
+
+static int
+ctx_of(unsigned c) {
+  return c == '\n' ? CTX_NL : is_word_byte(c) ? CTX_WORD : CTX_OTHER;
+}
+
+/* --- NFA construction --- */
+
+typedef struct {
+  dfa_inst* code;
+  int n, cap;
+  int reverse;
+  int utf8;
+  int ascii_only;
+  int fail;
+  int* alts;             /* entries of the byte sequences of one class */
+  int nalts, alts_cap;
+} builder;
+
+static int
+emit(builder* b, int op, int lo, int hi, int look, int x, int y) {
+  if (b->fail) { return x; }
+  if (b->n == b->cap) {
+    int const cap = b->cap ? b->cap * 2 : 64;
+    dfa_inst* code;
+    if (cap > DFA_MAX_INSTS * 2) { b->fail = 1; return x; }
+    code = (dfa_inst*)realloc(b->code, (size_t)cap * sizeof(dfa_inst));
+    if (!code) { b->fail = 1; return x; }
+    b->code = code;
+    b->cap = cap;
+  }
+  if (b->n >= DFA_MAX_INSTS) { b->fail = 1; return x; }
+  b->code[b->n].op = (unsigned char)op;
+  b->code[b->n].lo = (unsigned char)lo;
+  b->code[b->n].hi = (unsigned char)hi;
+  b->code[b->n].look = (unsigned char)look;
+  b->code[b->n].x = x;
+  b->code[b->n].y = y;
+  return b->n++;
+}
+
+static void
+push_alt(builder* b, int pc) {
+  if (b->fail) { return; }
+  if (b->nalts == b->alts_cap) {
+    int const cap = b->alts_cap ? b->alts_cap * 2 : 16;
+    int* const alts = (int*)realloc(b->alts, (size_t)cap * sizeof(int));
+    if (!alts) { b->fail = 1; return; }
+    b->alts = alts;
+    b->alts_cap = cap;
+  }
+  b->alts[b->nalts++] = pc;
+}
+
+/* Emits one sequence of byte ranges (read backward in the reverse NFA). */
+static int
+emit_sequence(builder* b, unsigned char const* lo, unsigned char const* hi, int len, int next) {
+  int i;
+  if (b->reverse) {
+    for (i = 0; i < len; ++i) { next = emit(b, OP_RANGE, lo[i], hi[i], 0, next, 0); }
+  } else {
+    for (i = len; i-- > 0;) { next = emit(b, OP_RANGE, lo[i], hi[i], 0, next, 0); }
+  }
+  return next;
+}
+
+static int
+utf8_encode(uint32_t c, unsigned char* out) {
+  if (c < 0x80) { out[0] = (unsigned char)c; return 1; }
+  if (c < 0x800) {
+    out[0] = (unsigned char)(0xc0 | (c >> 6));
+    out[1] = (unsigned char)(0x80 | (c & 0x3f));
+    return 2;
+  }
+  if (c < 0x10000) {
+    out[0] = (unsigned char)(0xe0 | (c >> 12));
+    out[1] = (unsigned char)(0x80 | ((c >> 6) & 0x3f));
+    out[2] = (unsigned char)(0x80 | (c & 0x3f));
+    return 3;
+  }
+  out[0] = (unsigned char)(0xf0 | (c >> 18));
+  out[1] = (unsigned char)(0x80 | ((c >> 12) & 0x3f));
+  out[2] = (unsigned char)(0x80 | ((c >> 6) & 0x3f));
+  out[3] = (unsigned char)(0x80 | (c & 0x3f));
+  return 4;
+}
+
+/* Splits a code point range into ranges whose UTF-8 encodings differ in
+   one byte position at most, each a sequence of byte ranges. */
+static void
+utf8_ranges(builder* b, uint32_t lo, uint32_t hi, int next) {
+  static uint32_t const limits[] = { 0x7f, 0x7ff, 0xffff };
+  unsigned char l[4], h[4];
+  int i, n;
+  if (lo > hi || b->fail) { return; }
+  if (lo <= 0xdfff && hi >= 0xd800) {
+    /* surrogates are not valid UTF-8 */
+    if (lo < 0xd800) { utf8_ranges(b, lo, 0xd7ff, next); }
+    if (hi > 0xdfff) { utf8_ranges(b, 0xe000, hi, next); }
+    return;
+  }
+  for (i = 0; i < 3; ++i) {
+    if (lo <= limits[i] && hi > limits[i]) {
+      utf8_ranges(b, lo, limits[i], next);
+      utf8_ranges(b, limits[i] + 1, hi, next);
+      return;
+    }
+  }
+  if (hi >= 0x80) {
+    n = lo < 0x800 ? 2 : lo < 0x10000 ? 3 : 4;
+    for (i = 1; i < n; ++i) {
+      uint32_t const m = (1u << (6 * i)) - 1;
+      if ((lo & ~m) != (hi & ~m)) {
+        if ((lo & m) != 0) {
+          utf8_ranges(b, lo, lo | m, next);
+          utf8_ranges(b, (lo | m) + 1, hi, next);
+          return;
+        }
+        if ((hi & m) != m) {
+          utf8_ranges(b, lo, (hi & ~m) - 1, next);
+          utf8_ranges(b, hi & ~m, hi, next);
+          return;
+        }
+      }
+    }
+  }
+  n = utf8_encode(lo, l);
+  utf8_encode(hi, h);
+  push_alt(b, emit_sequence(b, l, h, n, next));
+}
+
+static int
+compile_class(builder* b, onig_ast_node const* node, int next) {
+  int const base = b->nalts;
+  size_t i;
+  int pc;
+  for (i = 0; i < node->nranges; ++i) {
+    uint32_t lo = node->ranges[i].lo, hi = node->ranges[i].hi;
+    if (b->ascii_only && hi > 0x7f) { hi = 0x7f; }
+    if (!b->utf8 && hi > 0xff) { hi = 0xff; }
+    if (lo > hi) { continue; }
+    if (b->utf8) {
+      utf8_ranges(b, lo, hi, next);
+    } else {
+      unsigned char const l = (unsigned char)lo, h = (unsigned char)hi;
+      push_alt(b, emit_sequence(b, &l, &h, 1, next));
+    }
+  }
+  if (b->fail) { return next; }
+  if (b->nalts == base) {
+    /* matches nothing: a range no byte falls in */
+    b->nalts = base;
+    return emit(b, OP_SPLIT, 0, 0, 0, -1, -1);
+  }
+  pc = b->alts[b->nalts - 1];
+  for (i = (size_t)(b->nalts - 1); i-- > (size_t)base;) {
+    pc = emit(b, OP_SPLIT, 0, 0, 0, b->alts[i], pc);
+  }
+  b->nalts = base;
+  return pc;
+}
+
+static int compile(builder* b, onig_ast_node const* n, int next);
+
+/* SPLIT trying x first: the body for greedy repeats, the rest for lazy */
+static int
+emit_choice(builder* b, onig_ast_node const* n, int body, int rest) {
+  return (n->flags & ONIG_AST_LAZY) ? emit(b, OP_SPLIT, 0, 0, 0, rest, body)
+                                    : emit(b, OP_SPLIT, 0, 0, 0, body, rest);
+}
+
+static int
+compile_repeat(builder* b, onig_ast_node const* n, int next) {
+  int i;
+  if (n->max < 0) {
+    int const loop = emit(b, OP_SPLIT, 0, 0, 0, -1, -1);
+    int body;
+    if (b->fail) { return next; }
+    body = compile(b, n->child, loop);
+    if (b->fail) { return next; }
+    /* compile() may have moved b->code */
+    if (n->flags & ONIG_AST_LAZY) {
+      b->code[loop].x = next;
+      b->code[loop].y = body;
+    } else {
+      b->code[loop].x = body;
+      b->code[loop].y = next;
+    }
+    next = loop;
+  } else {
+    for (i = n->min; i < n->max && !b->fail; ++i) {
+      next = emit_choice(b, n, compile(b, n->child, next), next);
+    }
+  }
+  for (i = 0; i < n->min && !b->fail; ++i) {
+    next = compile(b, n->child, next);
+  }
+  return next;
+}
+
+static int
+compile(builder* b, onig_ast_node const* n, int next) {
+  onig_ast_node const* c;
+  if (b->fail) { return next; }
+  switch (n->type) {
+    case ONIG_AST_EMPTY:
+      return next;
+    case ONIG_AST_CLASS:
+      return compile_class(b, n, next);
+    case ONIG_AST_CONCAT: {
+      onig_ast_node const* items[64];
+      onig_ast_node const** all = items;
+      size_t count = 0, i;
+      for (c = n->child; c; c = c->next) { ++count; }
+      if (count > 64) {
+        all = (onig_ast_node const**)malloc(count * sizeof(*all));
+        if (!all) { b->fail = 1; return next; }
+      }
+      for (i = 0, c = n->child; c; c = c->next) { all[i++] = c; }
+      if (b->reverse) {
+        for (i = 0; i < count; ++i) { next = compile(b, all[i], next); }
+      } else {
+        for (i = count; i-- > 0;) { next = compile(b, all[i], next); }
+      }
+      if (all != items) { free((void*)all); }
+      return next;
+    }
+    case ONIG_AST_ALT: {
+      /* the first alternative has the highest priority */
+      int entries[64];
+      int* all = entries;
+      size_t count = 0, i;
+      int pc;
+      for (c = n->child; c; c = c->next) { ++count; }
+      if (count > 64) {
+        all = (int*)malloc(count * sizeof(int));
+        if (!all) { b->fail = 1; return next; }
+      }
+      for (i = 0, c = n->child; c; c = c->next) { all[i++] = compile(b, c, next); }
+      pc = all[count - 1];
+      for (i = count - 1; i-- > 0;) { pc = emit(b, OP_SPLIT, 0, 0, 0, all[i], pc); }
+      if (all != entries) { free(all); }
+      return pc;
+    }
+    case ONIG_AST_REPEAT:
+      return compile_repeat(b, n, next);
+    case ONIG_AST_GROUP:
+      return compile(b, n->child, next);
+    case ONIG_AST_ANCHOR: {
+      int look;
+      switch (n->value) {
+        case '^': look = LOOK_BOL; break;
+        case '$': look = LOOK_EOL; break;
+        case 'A': look = LOOK_BOT; break;
+        case 'z': look = LOOK_EOT; break;
+        case 'b': look = LOOK_WB; break;
+        case 'B': look = LOOK_NWB; break;
+        default: b->fail = 1; return next;
+      }
+      return emit(b, OP_ASSERT, 0, 0, look, next, 0);
+    }
+    default:
+      b->fail = 1;
+      return next;
+  }
+}
+
+static int
+has_capture_or_anchor(onig_ast_node const* n) {
+  onig_ast_node const* c;
+  if (n->type == ONIG_AST_GROUP || n->type == ONIG_AST_ANCHOR) { return 1; }
+  for (c = n->child; c; c = c->next) {
+    if (has_capture_or_anchor(c)) { return 1; }
+  }
+  return 0;
+}
+
+static int
+class_has(onig_ast_node const* n, uint32_t c) {
+  size_t i;
+  for (i = 0; i < n->nranges && n->ranges[i].lo <= c; ++i) {
+    if (c <= n->ranges[i].hi) { return 1; }
+  }
+  return 0;
+}
+
+/* A class that does not treat both cases of an ASCII letter alike. Onigmo
+   mis-optimizes such classes next to (?i) parts: "xA" !~ /[^a]+(?i:a)/ */
+static int
+case_sensitive(onig_ast_node const* n) {
+  onig_ast_node const* c;
+  uint32_t l;
+  if (n->type == ONIG_AST_CLASS && !(n->flags & ONIG_AST_IGNORECASE)) {
+    for (l = 'A'; l <= 'Z'; ++l) {
+      if (class_has(n, l) != class_has(n, l + 32)) { return 1; }
+    }
+  }
+  for (c = n->child; c; c = c->next) {
+    if (case_sensitive(c)) { return 1; }
+  }
+  return 0;
+}
+
+static int
+has_ignorecase(onig_ast_node const* n) {
+  onig_ast_node const* c;
+  if (n->type == ONIG_AST_CLASS && (n->flags & ONIG_AST_IGNORECASE)) { return 1; }
+  for (c = n->child; c; c = c->next) {
+    if (has_ignorecase(c)) { return 1; }
+  }
+  return 0;
+}
+
+/* Onigmo only tries the first position for patterns starting with
+   assertions and then .* under /m: "ab\nc" !~ /$.*\/m */
+static int
+asserted_anychar_star(onig_ast_node const* root, uint32_t max_cp) {
+  onig_ast_node const* c;
+  int asserted = 0;
+  if (root->type != ONIG_AST_CONCAT) { return 0; }
+  for (c = root->child; c && c->type == ONIG_AST_ANCHOR; c = c->next) { asserted = 1; }
+  return asserted && c && c->type == ONIG_AST_REPEAT && c->min == 0 && c->max < 0 &&
+      c->child->type == ONIG_AST_CLASS && c->child->nranges == 1 &&
+      c->child->ranges[0].lo == 0 && c->child->ranges[0].hi == max_cp;
+}
+
+/* Checks that a DFA can decide the pattern; sets *ascii_only when its
+   meaning for non-ASCII subjects depends on Unicode tables. */
+static int
+supported(onig_ast_node const* n, int* ascii_only) {
+  onig_ast_node const* c;
+  switch (n->type) {
+    case ONIG_AST_EMPTY:
+      return 1;
+    case ONIG_AST_CLASS:
+      if (n->flags & ONIG_AST_OPAQUE) { return 0; }
+      if (n->flags & (ONIG_AST_IGNORECASE | ONIG_AST_ENC_DEPENDENT)) { *ascii_only = 1; }
+      return 1;
+    case ONIG_AST_ANCHOR:
+      switch (n->value) {
+        case '^': case '$': case 'A': case 'z': return 1;
+        case 'b': case 'B': *ascii_only = 1; return 1;
+      }
+      return 0;
+    case ONIG_AST_REPEAT:
+      if (n->flags & ONIG_AST_POSSESSIVE) { return 0; }
+      /* Onigmo ends a repeat at its first empty iteration, which only
+         preserves the language when empty iterations do not depend on
+         their position: "x\nca" !~ /(?:$[^a]{,2}){2}\w/ */
+      if ((n->max < 0 || n->max > 1) && onig_ast_nullable(n->child) &&
+          has_capture_or_anchor(n->child)) {
+        return 0;
+      }
+      return supported(n->child, ascii_only);
+    case ONIG_AST_CONCAT: case ONIG_AST_ALT: case ONIG_AST_GROUP:
+      for (c = n->child; c; c = c->next) {
+        if (!supported(c, ascii_only)) { return 0; }
+      }
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* --- states --- */
+
+static uint32_t
+state_hash(int ctx, int utf8, int restart, int const* insts, int n) {
+  uint32_t h = 2166136261u ^ (uint32_t)(ctx | (utf8 << 4) | (restart << 8));
+  int i;
+  h *= 16777619u;
+  for (i = 0; i < n; ++i) {
+    h ^= (uint32_t)insts[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static void
+machine_clear(dfa_machine* m) {
+  int i;
+  for (i = 0; i < m->nstates; ++i) { free(m->states[i]); }
+  m->nstates = 0;
+  m->mem = 0;
+  if (m->table) { memset(m->table, 0, m->table_size * sizeof(int)); }
+}
+
+static void
+machine_free(dfa_machine* m) {
+  machine_clear(m);
+  free(m->states);
+  free(m->table);
+  free(m->code);
+  free(m->dense);
+  free(m->sparse);
+  free(m->stack);
+  free(m->kernel);
+  free(m->ksparse);
+}
+
+static int
+table_rebuild(dfa_machine* m, size_t size) {
+  int* const table = (int*)calloc(size, sizeof(int));
+  int i;
+  if (!table) { return 0; }
+  for (i = 0; i < m->nstates; ++i) {
+    size_t j = m->states[i]->hash & (size - 1);
+    while (table[j]) { j = (j + 1) & (size - 1); }
+    table[j] = i + 1;
+  }
+  free(m->table);
+  m->table = table;
+  m->table_size = size;
+  return 1;
+}
+
+/* Returns the index of the state, creating it if needed; -1 when out of
+   memory. */
+static int
+intern(onig_dfa* dfa, dfa_machine* m, int ctx, int utf8, int restart, int const* insts, int n) {
+  uint32_t const hash = state_hash(ctx, utf8, restart, insts, n);
+  size_t j;
+  int nnext = dfa->nclasses + CTX_COUNT, i;
+  dfa_state* s;
+  if (m->table) {
+    for (j = hash & (m->table_size - 1); m->table[j]; j = (j + 1) & (m->table_size - 1)) {
+      s = m->states[m->table[j] - 1];
+      if (s->hash == hash && s->ctx == ctx && s->utf8 == utf8 && s->restart == restart && s->ninsts == n &&
+          memcmp(s->insts, insts, (size_t)n * sizeof(int)) == 0) {
+        return m->table[j] - 1;
+      }
+    }
+  }
+  if ((size_t)(m->nstates + 1) * 2 > m->table_size &&
+      !table_rebuild(m, m->table_size ? m->table_size * 2 : 64)) {
+    return -1;
+  }
+  if (m->nstates == m->cap) {
+    int const cap = m->cap ? m->cap * 2 : 32;
+    dfa_state** const states = (dfa_state**)realloc(m->states, (size_t)cap * sizeof(dfa_state*));
+    if (!states) { return -1; }
+    m->states = states;
+    m->cap = cap;
+  }
+  {
+    size_t const size = sizeof(dfa_state) + (size_t)nnext * sizeof(int32_t) + (size_t)n * sizeof(int);
+    s = (dfa_state*)malloc(size);
+    if (!s) { return -1; }
+    s->hash = hash;
+    s->ctx = (unsigned char)ctx;
+    s->utf8 = (unsigned char)utf8;
+    s->restart = (unsigned char)restart;
+    s->ninsts = n;
+    s->next = (int32_t*)(s + 1);
+    s->insts = (int*)(s->next + nnext);
+    for (i = 0; i < nnext; ++i) { s->next[i] = TRANS_UNKNOWN; }
+    if (n) { memcpy(s->insts, insts, (size_t)n * sizeof(int)); }
+    m->mem += size;
+  }
+  m->states[m->nstates] = s;
+  for (j = hash & (m->table_size - 1); m->table[j]; j = (j + 1) & (m->table_size - 1)) {}
+  m->table[j] = m->nstates + 1;
+  return m->nstates++;
+}
+
+static int
+look_holds(int look, int left, int right) {
+  switch (look) {
+    case LOOK_BOL: return left == CTX_EDGE || (left == CTX_NL && right != CTX_EDGE);
+    case LOOK_EOL: return right == CTX_EDGE || right == CTX_NL;
+    case LOOK_BOT: return left == CTX_EDGE;
+    case LOOK_EOT: return right == CTX_EDGE;
+    case LOOK_WB: return (left == CTX_WORD) != (right == CTX_WORD);
+    case LOOK_NWB: return (left == CTX_WORD) == (right == CTX_WORD);
+  }
+  return 0;
+}
+
+/* UTF-8 validator: 0 at a character boundary, -1 on invalid input. */
+static int
+utf8_step(int state, unsigned c) {
+  switch (state) {
+    case 0:
+      if (c < 0x80) { return 0; }
+      if (c >= 0xc2 && c <= 0xdf) { return 1; }
+      if (c == 0xe0) { return 2; }
+      if (c == 0xed) { return 4; }
+      if (c >= 0xe1 && c <= 0xef) { return 3; }
+      if (c == 0xf0) { return 5; }
+      if (c >= 0xf1 && c <= 0xf3) { return 6; }
+      if (c == 0xf4) { return 7; }
+      return -1;
+    case 1: return c >= 0x80 && c <= 0xbf ? 0 : -1;
+    case 2: return c >= 0xa0 && c <= 0xbf ? 1 : -1;
+    case 3: return c >= 0x80 && c <= 0xbf ? 1 : -1;
+    case 4: return c >= 0x80 && c <= 0x9f ? 1 : -1;
+    case 5: return c >= 0x90 && c <= 0xbf ? 3 : -1;
+    case 6: return c >= 0x80 && c <= 0xbf ? 3 : -1;
+    case 7: return c >= 0x80 && c <= 0x8f ? 3 : -1;
+  }
+  return -1;
+}
+
+/* Computes the transition of state si on byte class cls (byte is a member
+   of it, or -1 for the end marker of context cls - nclasses). */
+static int32_t
+transition(onig_dfa* dfa, dfa_machine* m, int si, int cls, int byte) {
+  dfa_state* s = m->states[si];
+  int const rctx = byte >= 0 ? ctx_of((unsigned)byte) : cls - dfa->nclasses;
+  int const left = m->reverse ? rctx : s->ctx;
+  int const right = m->reverse ? s->ctx : rctx;
+  int nvisited = 0, nk = 0, matched = 0, utf8 = 0, i, next;
+  int32_t result;
+
+  if (byte >= 0) {
+    if (dfa->ascii_only && byte >= 0x80) { return s->next[cls] = TRANS_BAIL; }
+    if (dfa->check_utf8 && !m->reverse) {
+      utf8 = utf8_step(s->utf8, (unsigned)byte);
+      if (utf8 < 0) { return s->next[cls] = TRANS_BAIL; }
+    }
+  } else if (s->utf8 != 0) {
+    return s->next[cls] = TRANS_BAIL;  /* truncated character */
+  }
+
+  /* epsilon closure of the kernel in this context, in priority order */
+  for (i = 0; i < s->ninsts; ++i) {
+    int sp = 0;
+    m->stack[sp++] = s->insts[i];
+    while (sp > 0) {
+      int const pc = m->stack[--sp];
+      dfa_inst const* in;
+      if (pc < 0) { continue; }
+      if ((unsigned)m->sparse[pc] < (unsigned)nvisited && m->dense[m->sparse[pc]] == pc) { continue; }
+      m->sparse[pc] = nvisited;
+      m->dense[nvisited++] = pc;
+      in = &m->code[pc];
+      switch (in->op) {
+        case OP_MATCH:
+          matched = 1;
+          if (!m->reverse) { goto closed; }  /* lower priorities lose */
+          break;
+        case OP_SPLIT: m->stack[sp++] = in->y; m->stack[sp++] = in->x; break;
+        case OP_ASSERT: if (look_holds(in->look, left, right)) { m->stack[sp++] = in->x; } break;
+        case OP_RANGE:
+          if (byte >= in->lo && byte <= in->hi &&
+              !((unsigned)m->ksparse[in->x] < (unsigned)nk && m->kernel[m->ksparse[in->x]] == in->x)) {
+            m->ksparse[in->x] = nk;
+            m->kernel[nk++] = in->x;
+          }
+          break;
+      }
+    }
+  }
+closed:
+  if (byte < 0) { return s->next[cls] = matched; }
+
+  {
+    int const restart = s->restart && !matched;
+    if (restart &&
+        !((unsigned)m->ksparse[m->start] < (unsigned)nk && m->kernel[m->ksparse[m->start]] == m->start)) {
+      m->kernel[nk++] = m->start;
+    }
+    if (m->mem > m->budget) {
+      /* cache full: start over, the current state is not needed anymore */
+      machine_clear(m);
+      s = NULL;
+    }
+    next = intern(dfa, m, rctx, utf8, restart, m->kernel, nk);
+  }
+  if (next < 0) { return TRANS_OOM; }
+  result = (int32_t)(((uint32_t)next << 1) | (uint32_t)matched);
+  if (s) { s->next[cls] = result; }
+  return result;
+}
+
+static int
+machine_init(dfa_machine* m, builder* b, onig_ast_node const* root, int reverse) {
+  int const match = emit(b, OP_MATCH, 0, 0, 0, -1, -1);
+  b->reverse = reverse;
+  m->start = compile(b, root, match);
+  if (b->fail) { return 0; }
+  m->code = b->code;
+  m->ncode = b->n;
+  b->code = NULL;
+  b->n = b->cap = 0;
+  m->reverse = reverse;
+  m->dense = (int*)malloc((size_t)m->ncode * sizeof(int));
+  m->sparse = (int*)calloc((size_t)m->ncode, sizeof(int));
+  m->stack = (int*)malloc((size_t)(m->ncode * 3 + 4) * sizeof(int));
+  m->kernel = (int*)malloc((size_t)(m->ncode + 1) * sizeof(int));
+  m->ksparse = (int*)calloc((size_t)m->ncode, sizeof(int));
+  return m->dense && m->sparse && m->stack && m->kernel && m->ksparse;
+}
+
+static void
+split_at(unsigned char* split, int c) {
+  if (c > 0 && c < 256) { split[c] = 1; }
+}
+
+static void
+build_classes(onig_dfa* dfa) {
+  static int const fixed[] = {
+    '\n', '\n' + 1, '0', '9' + 1, 'A', 'Z' + 1, '_', '_' + 1, 'a', 'z' + 1,
+    0x80, 0x90, 0xa0, 0xc0, 0xc2, 0xe0, 0xe1, 0xed, 0xee, 0xf0, 0xf1, 0xf4, 0xf5
+  };
+  unsigned char split[256];
+  dfa_machine const* const ms[2] = { &dfa->fwd, &dfa->rev };
+  int i, k, cls = 0;
+  memset(split, 0, sizeof(split));
+  for (i = 0; i < (int)(sizeof(fixed) / sizeof(fixed[0])); ++i) { split_at(split, fixed[i]); }
+  for (k = 0; k < 2; ++k) {
+    for (i = 0; i < ms[k]->ncode; ++i) {
+      if (ms[k]->code[i].op == OP_RANGE) {
+        split_at(split, ms[k]->code[i].lo);
+        split_at(split, ms[k]->code[i].hi + 1);
+      }
+    }
+  }
+  for (i = 0; i < 256; ++i) {
+    if (split[i]) { ++cls; }
+    dfa->classes[i] = (unsigned char)cls;
+  }
+  dfa->nclasses = cls + 1;
+}
+
+onig_dfa*
+onig_dfa_new(onig_ast const* ast, int utf8, size_t cache_size) {
+  onig_ast_node const* const root = onig_ast_root(ast);
+  onig_dfa* dfa;
+  builder b;
+  int ascii_only = 0;
+  if (!supported(root, &ascii_only) ||
+      (has_ignorecase(root) && case_sensitive(root)) ||
+      asserted_anychar_star(root, onig_ast_max_codepoint(ast))) {
+    return NULL;
+  }
+
+  dfa = (onig_dfa*)calloc(1, sizeof(onig_dfa));
+  if (!dfa) { return NULL; }
+  dfa->ascii_only = ascii_only;
+  dfa->check_utf8 = utf8 && !ascii_only;
+
+  /* \A...: the forward DFA need not restart at every position */
+  {
+    onig_ast_node const* first = root;
+    while (first->type == ONIG_AST_CONCAT || first->type == ONIG_AST_GROUP) { first = first->child; }
+    dfa->fwd.anchored = first->type == ONIG_AST_ANCHOR && first->value == 'A';
+  }
+
+  memset(&b, 0, sizeof(b));
+  b.utf8 = utf8;
+  b.ascii_only = ascii_only;
+  if (!machine_init(&dfa->fwd, &b, root, 0) ||
+      !machine_init(&dfa->rev, &b, root, 1)) {
+    free(b.code);
+    free(b.alts);
+    onig_dfa_free(dfa);
+    return NULL;
+  }
+  free(b.code);
+  free(b.alts);
+  dfa->fwd.budget = dfa->rev.budget = cache_size;
+  build_classes(dfa);
+  return dfa;
+}
+
+void
+onig_dfa_free(onig_dfa* dfa) {
+  if (!dfa) { return; }
+  machine_free(&dfa->fwd);
+  machine_free(&dfa->rev);
+  free(dfa);
+}
+
+size_t
+onig_dfa_memsize(onig_dfa const* dfa) {
+  return dfa->fwd.mem + dfa->rev.mem;
+}
+
+/* A cache that is flushed again before it served a few bytes per state it
+   held is thrashing; the backtracker will do better. */
+#define THRASHING(held, since) ((size_t)(since) < (size_t)(held) * 4)
+
+long
+onig_dfa_search(onig_dfa* dfa, unsigned char const* str, unsigned char const* end,
+                unsigned char const* start, long* match_start) {
+  dfa_machine* m = &dfa->fwd;
+  unsigned char const* p;
+  unsigned char const* flushed = start;
+  int ctx, si, nstates;
+  int32_t t;
+  long found = -1;
+
+  if (start > str && dfa->ascii_only && start[-1] >= 0x80) { return ONIG_DFA_FAIL; }
+  ctx = start == str ? CTX_EDGE : ctx_of(start[-1]);
+  si = intern(dfa, m, ctx, 0, !m->anchored, &m->start, 1);
+  if (si < 0) { return ONIG_DFA_FAIL; }
+
+  for (p = start; p < end; ++p) {
+    int const cls = dfa->classes[*p];
+    t = m->states[si]->next[cls];
+    if (t == TRANS_UNKNOWN) {
+      nstates = m->nstates;
+      t = transition(dfa, m, si, cls, *p);
+      if (m->nstates < nstates) {
+        if (nstates > 16 && THRASHING(nstates, p - flushed)) { return ONIG_DFA_FAIL; }
+        flushed = p;
+      }
+    }
+    if (t < 0) { return ONIG_DFA_FAIL; }
+    if (t & 1) {
+      found = (long)(p - str);
+      if (!match_start) { return found; }
+    }
+    si = t >> 1;
+    if (m->states[si]->ninsts == 0 && !m->states[si]->restart) { break; }
+  }
+  if (p == end) {
+    int const cls = dfa->nclasses + CTX_EDGE;
+    t = m->states[si]->next[cls];
+    if (t == TRANS_UNKNOWN) { t = transition(dfa, m, si, cls, -1); }
+    if (t < 0) { return ONIG_DFA_FAIL; }
+    if (t & 1) { found = (long)(end - str); }
+  }
+  if (found < 0) { return ONIG_DFA_NOMATCH; }
+  if (!match_start) { return found; }
+
+  /* run the reversed pattern backward from the end of the leftmost match
+     and keep the leftmost position where it accepts */
+  m = &dfa->rev;
+  {
+    long best = -1;
+    p = str + found;
+    ctx = p == end ? CTX_EDGE : ctx_of(*p);
+    if (dfa->ascii_only && p < end && *p >= 0x80) { return ONIG_DFA_FAIL; }
+    flushed = p;
+    si = intern(dfa, m, ctx, 0, 0, &m->start, 1);
+    if (si < 0) { return ONIG_DFA_FAIL; }
+    for (; p > start; --p) {
+      int const cls = dfa->classes[p[-1]];
+      t = m->states[si]->next[cls];
+      if (t == TRANS_UNKNOWN) {
+        nstates = m->nstates;
+        t = transition(dfa, m, si, cls, p[-1]);
+        if (m->nstates < nstates) {
+          if (nstates > 16 && THRASHING(nstates, flushed - p)) { return ONIG_DFA_FAIL; }
+          flushed = p;
+        }
+      }
+      if (t < 0) { return ONIG_DFA_FAIL; }
+      if (t & 1) { best = (long)(p - str); }
+      si = t >> 1;
+      if (m->states[si]->ninsts == 0) { break; }
+    }
+    if (p == start) {
+      int const cls = dfa->nclasses + (start == str ? CTX_EDGE : ctx_of(start[-1]));
+      t = m->states[si]->next[cls];
+      if (t == TRANS_UNKNOWN) { t = transition(dfa, m, si, cls, -1); }
+      if (t < 0) { return ONIG_DFA_FAIL; }
+      if (t & 1) { best = (long)(start - str); }
+    }
+    if (best < 0) { return ONIG_DFA_FAIL; }
+    *match_start = best;
+  }
+  return found;
+}
@@ -0,0 +1,52 @@
+/*
+** onig_regexp_dfa.h - lazy DFA for backreference-free patterns
+**
+** Answers "is there a match at or after start" in one pass over the subject
+** with a DFA whose states are built on demand from a Thompson NFA of the
+** pattern (see onig_regexp_ast.h) and kept in a bounded cache. A second,
+** reverse DFA finds where the leftmost match begins, so the caller only has
+** to run Onigmo anchored there when it needs captures.
+**
+** The DFA gives up (ONIG_DFA_FAIL) instead of guessing whenever its answer
+** could differ from Onigmo's: on non-ASCII subjects for patterns whose
+** semantics depend on Unicode tables (\w, POSIX brackets, /i, \b), on
+** invalid UTF-8, and when the state cache thrashes.
+*/
+
+#ifndef ONIG_REGEXP_DFA_H
+#define ONIG_REGEXP_DFA_H
+
+#include <stddef.h>
+#include "onig_regexp_ast.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ONIG_DFA_NOMATCH (-1)
+#define ONIG_DFA_FAIL    (-2)
+
+typedef struct onig_dfa onig_dfa;
+
+/* Returns NULL when the pattern uses constructs a DFA cannot decide
+   (backreferences, lookaround, atomic groups, ...) or out of memory.
+   cache_size bounds the memory of the state cache of each direction. */
+onig_dfa* onig_dfa_new(onig_ast const* ast, int utf8, size_t cache_size);
+void onig_dfa_free(onig_dfa* dfa);
+
+/* Searches [start, end) of the string beginning at str. Without match_start
+   returns the offset from str where the earliest-ending match ends, as soon
+   as it is seen. With match_start, scans on to the end of the match Onigmo
+   would report (leftmost start, same priorities) and stores its start
+   offset. Returns ONIG_DFA_NOMATCH or ONIG_DFA_FAIL otherwise. */
+long onig_dfa_search(onig_dfa* dfa, unsigned char const* str, unsigned char const* end,
+                     unsigned char const* start, long* match_start);
+
+/* bytes currently held by the state caches */
+size_t onig_dfa_memsize(onig_dfa const* dfa);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ONIG_REGEXP_DFA_H */
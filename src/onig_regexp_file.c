@@ -0,0 +1,228 @@
+/*
+** onig_regexp_file.c - read-only file mappings for searching files
+**
+** See onig_regexp_file.h. A mapping stays valid while the file is open
+** elsewhere, but like any mapping it faults when the file is truncated
+** under it.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "onig_regexp_file.h"
+
+#define READ_CHUNK (64 * 1024)
+
+static void
+map_empty(onig_file_map* map) {
+  map->ptr = "";
+  map->len = 0;
+  map->mapped = 0;
+}
+
+/* Makes room for READ_CHUNK more bytes after len. */
+static int
+buffer_reserve(char** buf, size_t* cap, size_t len) {
+  char* p;
+  size_t n = *cap ? *cap : READ_CHUNK;
+  while (n - len < READ_CHUNK) {
+    if (n > SIZE_MAX / 2) { return ENOMEM; }
+    n *= 2;
+  }
+  if (n == *cap) { return 0; }
+  p = (char*)realloc(*buf, n);
+  if (!p) { return ENOMEM; }
+  *buf = p;
+  *cap = n;
+  return 0;
+}
+
+static void
+buffer_finish(onig_file_map* map, char* buf, size_t len) {
+  if (len == 0) {
+    free(buf);
+    map_empty(map);
+    return;
+  }
+  map->ptr = buf;
+  map->len = len;
+  map->mapped = 0;
+}
+
+#ifdef _WIN32
+
+static int
+win32_errno(DWORD err) {
+  switch (err) {
+  case ERROR_FILE_NOT_FOUND:
+  case ERROR_PATH_NOT_FOUND:
+  case ERROR_INVALID_NAME:
+    return ENOENT;
+  case ERROR_ACCESS_DENIED:
+  case ERROR_SHARING_VIOLATION:
+    return EACCES;
+  case ERROR_NOT_ENOUGH_MEMORY:
+  case ERROR_OUTOFMEMORY:
+    return ENOMEM;
+  default:
+    return EIO;
+  }
+}
+
+static int
+read_all(HANDLE file, onig_file_map* map) {
+  char* buf = NULL;
+  size_t cap = 0, len = 0;
+  for (;;) {
+    DWORD n;
+    int const err = buffer_reserve(&buf, &cap, len);
+    if (err) { free(buf); return err; }
+    if (!ReadFile(file, buf + len, READ_CHUNK, &n, NULL)) {
+      DWORD const werr = GetLastError();
+      if (werr == ERROR_BROKEN_PIPE || werr == ERROR_HANDLE_EOF) { break; }
+      free(buf);
+      return win32_errno(werr);
+    }
+    if (n == 0) { break; }
+    len += n;
+  }
+  buffer_finish(map, buf, len);
+  return 0;
+}
+
+int
+onig_file_map_open(onig_file_map* map, char const* path) {
+  HANDLE file, mapping;
+  LARGE_INTEGER size;
+  int err;
+
+  map_empty(map);
+  file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                     NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE) { return win32_errno(GetLastError()); }
+  if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+    if ((unsigned long long)size.QuadPart > SIZE_MAX) {
+      CloseHandle(file);
+      return EFBIG;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+      /* the view keeps the mapping, and the mapping the file */
+      void* const p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+      if (p) {
+        CloseHandle(file);
+        map->ptr = (char const*)p;
+        map->len = (size_t)size.QuadPart;
+        map->mapped = 1;
+        return 0;
+      }
+    }
+  }
+  err = read_all(file, map);
+  CloseHandle(file);
+  return err;
+}
+
+void
+onig_file_map_close(onig_file_map* map) {
+  if (map->mapped) {
+    UnmapViewOfFile((void*)map->ptr);
+  } else if (map->len > 0) {
+    free((void*)map->ptr);
+  }
+  map_empty(map);
+}
+
+#else
+
+static int
+read_all(int fd, onig_file_map* map) {
+  char* buf = NULL;
+  size_t cap = 0, len = 0;
+  for (;;) {
+    ssize_t n;
+    int const err = buffer_reserve(&buf, &cap, len);
+    if (err) { free(buf); return err; }
+    n = read(fd, buf + len, READ_CHUNK);
+    if (n < 0) {
+      int const read_err = errno;
+      if (read_err == EINTR) { continue; }
+      free(buf);
+      return read_err;
+    }
+    if (n == 0) { break; }
+    len += (size_t)n;
+  }
+  buffer_finish(map, buf, len);
+  return 0;
+}
+
+int
+onig_file_map_open(onig_file_map* map, char const* path) {
+  struct stat st;
+  int fd, err;
+  int flags = O_RDONLY;
+#ifdef O_CLOEXEC
+  flags |= O_CLOEXEC;
+#endif
+
+  map_empty(map);
+  do {
+    fd = open(path, flags);
+  } while (fd < 0 && errno == EINTR);
+  if (fd < 0) { return errno; }
+  if (fstat(fd, &st) < 0) {
+    err = errno;
+    close(fd);
+    return err;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    close(fd);
+    return EISDIR;
+  }
+  /* files of size 0 may still have contents (/proc), so they are read */
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    void* p;
+    if ((unsigned long long)st.st_size > SIZE_MAX) {
+      close(fd);
+      return EFBIG;
+    }
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+      madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+      close(fd);
+      map->ptr = (char const*)p;
+      map->len = (size_t)st.st_size;
+      map->mapped = 1;
+      return 0;
+    }
+  }
+  err = read_all(fd, map);
+  close(fd);
+  return err;
+}
+
+void
+onig_file_map_close(onig_file_map* map) {
+  if (map->mapped) {
+    munmap((void*)map->ptr, map->len);
+  } else if (map->len > 0) {
+    free((void*)map->ptr);
+  }
+  map_empty(map);
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+** onig_regexp_file.h - read-only file mappings for searching files
+**
+** OnigRegexp#scan_file, #grep_file and #count_file search the bytes of a
+** file where they are instead of reading them into a String. Regular files
+** are mapped (mmap, or MapViewOfFile on Windows) and marked for sequential
+** access; anything that cannot be mapped, such as a pipe or a file under
+** /proc, is read into a buffer instead.
+*/
+
+#ifndef ONIG_REGEXP_FILE_H
+#define ONIG_REGEXP_FILE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct onig_file_map {
+  char const* ptr;  /* the contents; never NULL */
+  size_t len;
+  int mapped;       /* 0: ptr is a malloc()ed buffer (or empty) */
+} onig_file_map;
+
+/* Maps or reads the file at path. Returns 0, or an errno value with map
+   left empty. */
+int onig_file_map_open(onig_file_map* map, char const* path);
+/* Releases the contents; map is left empty, so closing twice is harmless. */
+void onig_file_map_close(onig_file_map* map);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ONIG_REGEXP_FILE_H */
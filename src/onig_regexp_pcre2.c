@@ -0,0 +1,383 @@
+/*
+** onig_regexp_pcre2.c - optional PCRE2 JIT backend
+**
+** See onig_regexp_pcre2.h. Every node is emitted so that it stays one atom
+** wherever it lands: classes become a single escaped character or a
+** bracket expression of \x{...} ranges, alternations and repeat bodies are
+** wrapped in (?:...). The pattern is compiled with PCRE2_MULTILINE and LF
+** newlines, which gives ^ and $ their Ruby meaning, and without PCRE2_UCP,
+** so the \b and \B it keeps see ASCII word characters only.
+*/
+
+#ifdef MRB_ONIG_REGEXP_PCRE2
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pcre2.h>
+#include "onig_regexp_pcre2.h"
+
+/* Before 10.34, PCRE2 must not be given invalid UTF-8, which a subject
+   modified in place between the searches of a scan could turn into. */
+#ifdef PCRE2_MATCH_INVALID_UTF
+#define ONIG_PCRE2_USABLE 1
+#else
+#define ONIG_PCRE2_USABLE 0
+#define PCRE2_MATCH_INVALID_UTF 0
+#endif
+
+struct onig_pcre2 {
+  pcre2_code* code;
+  pcre2_match_data* match;
+  int ascii_only;
+};
+
+typedef struct {
+  char* buf;
+  size_t len, cap;
+  int failed;
+  int captures;         /* groups emitted so far */
+  int ascii_only;
+  int lookahead;        /* a positive lookahead was emitted */
+  int folded;           /* classes under /i */
+  int cased;            /* classes with ASCII letters outside /i */
+  int shorthand_exact;  /* \d \s \w \h are ASCII-only for Onigmo too */
+} emitter;
+
+static void
+emit(emitter* e, char const* s, size_t n) {
+  if (e->failed) { return; }
+  if (e->len + n + 1 > e->cap) {
+    size_t cap = e->cap ? e->cap * 2 : 256;
+    char* buf;
+    while (cap < e->len + n + 1) { cap *= 2; }
+    buf = (char*)realloc(e->buf, cap);
+    if (!buf) { e->failed = 1; return; }
+    e->buf = buf;
+    e->cap = cap;
+  }
+  memcpy(e->buf + e->len, s, n);
+  e->len += n;
+  e->buf[e->len] = '\0';
+}
+
+static void
+emit_str(emitter* e, char const* s) {
+  emit(e, s, strlen(s));
+}
+
+static void
+emit_cp(emitter* e, uint32_t cp) {
+  char tmp[16];
+  emit(e, tmp, (size_t)snprintf(tmp, sizeof(tmp), "\\x{%lx}", (unsigned long)cp));
+}
+
+static void
+emit_range(emitter* e, uint32_t lo, uint32_t hi) {
+  emit_cp(e, lo);
+  if (hi != lo) {
+    emit(e, "-", 1);
+    emit_cp(e, hi);
+  }
+}
+
+/* PCRE2 has no surrogate code points in UTF mode and none above U+10FFFF;
+   neither occurs in the valid UTF-8 subjects it is given. */
+static void
+emit_class(emitter* e, onig_ast_node const* n) {
+  size_t i, count = 0;
+  if (n->flags & ONIG_AST_OPAQUE) { e->failed = 1; return; }
+  if ((n->flags & ONIG_AST_ENC_DEPENDENT) && !e->shorthand_exact) {
+    /* under /i, [[:alpha:]] matches "ss" since it contains U+00DF */
+    if (n->flags & ONIG_AST_IGNORECASE) { e->failed = 1; return; }
+    e->ascii_only = 1;
+  }
+  if (n->flags & ONIG_AST_IGNORECASE) {
+    e->ascii_only = 1;
+    e->folded = 1;
+  } else {
+    for (i = 0; i < n->nranges; ++i) {
+      if (n->ranges[i].lo <= 'z' && n->ranges[i].hi >= 'A' &&
+          (n->ranges[i].lo <= 'Z' || n->ranges[i].hi >= 'a')) {
+        e->cased = 1;
+      }
+    }
+  }
+  if (n->nranges == 1 && n->ranges[0].lo == n->ranges[0].hi &&
+      (n->ranges[0].lo < 0xd800 || n->ranges[0].lo > 0xdfff) && n->ranges[0].lo <= 0x10ffff) {
+    emit_cp(e, n->ranges[0].lo);
+    return;
+  }
+  emit(e, "[", 1);
+  for (i = 0; i < n->nranges; ++i) {
+    uint32_t lo = n->ranges[i].lo, hi = n->ranges[i].hi;
+    if (lo > 0x10ffff) { break; }
+    if (hi > 0x10ffff) { hi = 0x10ffff; }
+    if (lo < 0xd800 && hi >= 0xd800) {
+      emit_range(e, lo, 0xd7ff);
+      ++count;
+      lo = 0xe000;
+    } else if (lo >= 0xd800 && lo <= 0xdfff) {
+      lo = 0xe000;
+    }
+    if (lo > hi) { continue; }
+    emit_range(e, lo, hi);
+    ++count;
+  }
+  if (count == 0) {
+    /* nothing left to match: replace the "[" */
+    --e->len;
+    emit_str(e, "(?!)");
+    return;
+  }
+  emit(e, "]", 1);
+}
+
+static void emit_node(emitter* e, onig_ast_node const* n);
+
+/* ?, * or + (lazy or not) */
+static int
+simple_repeat(onig_ast_node const* n) {
+  return n->min <= 1 && (n->max == 1 || n->max < 0);
+}
+
+static void
+emit_repeat(emitter* e, onig_ast_node const* n) {
+  char tmp[32];
+  /* the libraries leave empty iterations (and repeated assertions)
+     differently */
+  if (onig_ast_nullable(n->child)) { e->failed = 1; return; }
+  /* Onigmo rewrites a simple quantifier on another one: (?:a+?)* */
+  if (n->child->type == ONIG_AST_REPEAT && simple_repeat(n) && simple_repeat(n->child)) {
+    e->failed = 1;
+    return;
+  }
+  emit_str(e, "(?:");
+  emit_node(e, n->child);
+  emit(e, ")", 1);
+  if (n->max < 0) {
+    if (n->min == 0) { emit(e, "*", 1); }
+    else if (n->min == 1) { emit(e, "+", 1); }
+    else { emit(e, tmp, (size_t)snprintf(tmp, sizeof(tmp), "{%d,}", n->min)); }
+  } else if (n->min == n->max) {
+    emit(e, tmp, (size_t)snprintf(tmp, sizeof(tmp), "{%d}", n->min));
+  } else {
+    emit(e, tmp, (size_t)snprintf(tmp, sizeof(tmp), "{%d,%d}", n->min, n->max));
+  }
+  if (n->flags & ONIG_AST_LAZY) { emit(e, "?", 1); }
+  else if (n->flags & ONIG_AST_POSSESSIVE) { emit(e, "+", 1); }
+}
+
+static void
+emit_node(emitter* e, onig_ast_node const* n) {
+  onig_ast_node const* c;
+  if (e->failed) { return; }
+  switch (n->type) {
+    case ONIG_AST_EMPTY:
+      break;
+    case ONIG_AST_CLASS:
+      emit_class(e, n);
+      break;
+    case ONIG_AST_CONCAT:
+      for (c = n->child; c; c = c->next) { emit_node(e, c); }
+      break;
+    case ONIG_AST_ALT:
+      emit_str(e, "(?:");
+      for (c = n->child; c; c = c->next) {
+        emit_node(e, c);
+        if (c->next) { emit(e, "|", 1); }
+      }
+      emit(e, ")", 1);
+      break;
+    case ONIG_AST_REPEAT:
+      emit_repeat(e, n);
+      break;
+    case ONIG_AST_GROUP:
+      /* Onigmo numbers the groups differently when some are named */
+      if (n->value != ++e->captures) { e->failed = 1; return; }
+      emit(e, "(", 1);
+      emit_node(e, n->child);
+      emit(e, ")", 1);
+      break;
+    case ONIG_AST_ANCHOR:
+      switch (n->value) {
+        case '^': emit(e, "^", 1); break;
+        case '$': emit(e, "$", 1); break;
+        case 'A': emit_str(e, "\\A"); break;
+        case 'z': emit_str(e, "\\z"); break;
+        case 'Z': emit_str(e, "\\Z"); break;
+        case 'G': emit_str(e, "\\G"); break;
+        case 'b': emit_str(e, "\\b"); e->ascii_only = 1; break;
+        case 'B': emit_str(e, "\\B"); e->ascii_only = 1; break;
+        default: e->failed = 1; break;
+      }
+      break;
+    case ONIG_AST_LOOK:
+      if (!(n->flags & (ONIG_AST_BEHIND | ONIG_AST_NEGATIVE))) { e->lookahead = 1; }
+      emit_str(e, (n->flags & ONIG_AST_BEHIND)
+               ? ((n->flags & ONIG_AST_NEGATIVE) ? "(?<!" : "(?<=")
+               : ((n->flags & ONIG_AST_NEGATIVE) ? "(?!" : "(?="));
+      emit_node(e, n->child);
+      emit(e, ")", 1);
+      break;
+    case ONIG_AST_ATOMIC:
+      emit_str(e, "(?>");
+      emit_node(e, n->child);
+      emit(e, ")", 1);
+      break;
+    default:
+      /* backreferences, calls, conditionals, absent operators, \K, ... */
+      e->failed = 1;
+      break;
+  }
+}
+
+/* Under ONIG_SYNTAX_RUBY the shorthands are ASCII-only, but POSIX brackets
+   are not and (?u) makes the shorthands Unicode-aware. The tree flags both
+   alike, so any sign of either in the source makes all of them inexact. */
+static int
+shorthand_exact(char const* src, size_t len) {
+  size_t i, j;
+  for (i = 0; i + 1 < len; ++i) {
+    if (src[i] == '[' && src[i + 1] == ':') { return 0; }
+    if (src[i] == '(' && src[i + 1] == '?') {
+      for (j = i + 2; j < len && src[j] && strchr("imx-adul", src[j]); ++j) {
+        if (strchr("adul", src[j])) { return 0; }
+      }
+    }
+  }
+  return 1;
+}
+
+onig_pcre2*
+onig_pcre2_new(onig_ast const* ast, char const* src, size_t len, int ncaptures, int ascii_range) {
+  emitter e;
+  onig_pcre2* re = NULL;
+  pcre2_compile_context* cctx = NULL;
+  pcre2_code* code = NULL;
+  int errcode;
+  PCRE2_SIZE erroffset;
+  uint32_t count = 0;
+  onig_ast_node const* const root = onig_ast_root(ast);
+
+  /* the empty-iteration check of Onigmo looks at captures, PCRE2's does not */
+  if (!ONIG_PCRE2_USABLE || onig_ast_capture_sensitive(root)) { return NULL; }
+
+  memset(&e, 0, sizeof(e));
+  e.shorthand_exact = ascii_range && shorthand_exact(src, len);
+  emit_str(&e, "");  /* an empty pattern still needs a buffer */
+  emit_node(&e, root);
+  /* Onigmo turns [^a]*(?i:A) into a possessive repeat, which cannot
+     match "A": patterns mixing case-sensitive letters with /i stay there */
+  if (e.failed || e.captures != ncaptures || (e.folded && e.cased)) { goto done; }
+
+  cctx = pcre2_compile_context_create(NULL);
+  if (!cctx) { goto done; }
+  pcre2_set_newline(cctx, PCRE2_NEWLINE_LF);
+  /* PCRE2 10.42 can take the first character of a lookahead for one
+     more required later: (?=A)_?A does not match "A" */
+  code = pcre2_compile((PCRE2_SPTR)e.buf, e.len,
+                       PCRE2_UTF | PCRE2_MATCH_INVALID_UTF | PCRE2_MULTILINE |
+                       (e.lookahead ? PCRE2_NO_START_OPTIMIZE : 0),
+                       &errcode, &erroffset, cctx);
+  if (!code) { goto done; }
+  if (pcre2_pattern_info(code, PCRE2_INFO_CAPTURECOUNT, &count) != 0 || count != (uint32_t)ncaptures ||
+      pcre2_jit_compile(code, PCRE2_JIT_COMPLETE) != 0) {
+    goto done;
+  }
+  re = (onig_pcre2*)malloc(sizeof(onig_pcre2));
+  if (!re) { goto done; }
+  re->match = pcre2_match_data_create_from_pattern(code, NULL);
+  if (!re->match) {
+    free(re);
+    re = NULL;
+    goto done;
+  }
+  re->code = code;
+  re->ascii_only = e.ascii_only;
+  code = NULL;
+
+done:
+  if (code) { pcre2_code_free(code); }
+  if (cctx) { pcre2_compile_context_free(cctx); }
+  free(e.buf);
+  return re;
+}
+
+void
+onig_pcre2_free(onig_pcre2* re) {
+  if (!re) { return; }
+  pcre2_match_data_free(re->match);
+  pcre2_code_free(re->code);
+  free(re);
+}
+
+int
+onig_pcre2_ascii_only(onig_pcre2 const* re) {
+  return re->ascii_only;
+}
+
+long
+onig_pcre2_search(onig_pcre2* re, unsigned char const* str, size_t len, size_t start) {
+  int const rc = pcre2_jit_match(re->code, (PCRE2_SPTR)str, len, start, 0, re->match, NULL);
+  if (rc == PCRE2_ERROR_NOMATCH) { return ONIG_PCRE2_NOMATCH; }
+  if (rc <= 0) { return ONIG_PCRE2_FAIL; }
+  return (long)pcre2_get_ovector_pointer(re->match)[0];
+}
+
+void
+onig_pcre2_group(onig_pcre2 const* re, int i, long* beg, long* end) {
+  PCRE2_SIZE const* const ov = pcre2_get_ovector_pointer(re->match);
+  if (ov[2 * i] == PCRE2_UNSET) {
+    *beg = *end = -1;
+  } else {
+    *beg = (long)ov[2 * i];
+    *end = (long)ov[2 * i + 1];
+  }
+}
+
+int
+onig_pcre2_subject_kind(unsigned char const* p, size_t len) {
+  unsigned char const* const end = p + len;
+  int kind = ONIG_PCRE2_ASCII;
+  while (p < end) {
+    unsigned const c = *p;
+    size_t n;
+    unsigned lo = 0x80, hi = 0xbf;
+    if (c < 0x80) { ++p; continue; }
+    if (c >= 0xc2 && c <= 0xdf) { n = 1; }
+    else if (c >= 0xe0 && c <= 0xef) {
+      n = 2;
+      if (c == 0xe0) { lo = 0xa0; }
+      if (c == 0xed) { hi = 0x9f; }
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      n = 3;
+      if (c == 0xf0) { lo = 0x90; }
+      if (c == 0xf4) { hi = 0x8f; }
+    } else {
+      return ONIG_PCRE2_INVALID;
+    }
+    if ((size_t)(end - p) <= n || p[1] < lo || p[1] > hi) { return ONIG_PCRE2_INVALID; }
+    if (n >= 2 && (p[2] & 0xc0) != 0x80) { return ONIG_PCRE2_INVALID; }
+    if (n == 3 && (p[3] & 0xc0) != 0x80) { return ONIG_PCRE2_INVALID; }
+    p += n + 1;
+    kind = ONIG_PCRE2_UTF8;
+  }
+  return kind;
+}
+
+size_t
+onig_pcre2_memsize(onig_pcre2 const* re) {
+  size_t size = 0, jit = 0;
+  pcre2_pattern_info(re->code, PCRE2_INFO_SIZE, &size);
+  pcre2_pattern_info(re->code, PCRE2_INFO_JITSIZE, &jit);
+  return sizeof(onig_pcre2) + size + jit +
+         sizeof(PCRE2_SIZE) * 2 * pcre2_get_ovector_count(re->match);
+}
+
+#else
+
+/* ISO C forbids an empty translation unit */
+typedef int onig_regexp_pcre2_unused;
+
+#endif /* MRB_ONIG_REGEXP_PCRE2 */
@@ -0,0 +1,66 @@
+/*
+** onig_regexp_pcre2.h - optional PCRE2 JIT backend
+**
+** When the gem is built against PCRE2 (MRB_ONIG_REGEXP_PCRE2), patterns
+** whose syntax tree (see onig_regexp_ast.h) only uses constructs both
+** libraries interpret the same way are translated into PCRE2 syntax and
+** JIT-compiled. The translation is a whitelist: anything Ruby-specific or
+** merely approximated by the tree (\p{...}, backreferences, calls, /i on
+** non-ASCII characters, ...) makes onig_pcre2_new() return NULL, and such
+** patterns stay with Onigmo.
+**
+** Classes are spelled out as explicit code point ranges, so the result does
+** not depend on PCRE2's character tables. Patterns using \b, \B, /i or
+** POSIX brackets are exact on ASCII subjects only (onig_pcre2_ascii_only);
+** other subjects must be well-formed UTF-8 (onig_pcre2_subject_kind).
+*/
+
+#ifndef ONIG_REGEXP_PCRE2_H
+#define ONIG_REGEXP_PCRE2_H
+
+#include <stddef.h>
+#include "onig_regexp_ast.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ONIG_PCRE2_NOMATCH (-1)
+#define ONIG_PCRE2_FAIL    (-2)
+
+typedef struct onig_pcre2 onig_pcre2;
+
+/* Translates and JIT-compiles the UTF-8 pattern src parsed as ast, which
+   Onigmo compiled with ncaptures groups. ascii_range tells that \d, \s, \w
+   and \h match ASCII characters only unless the pattern asks otherwise, as
+   with ONIG_SYNTAX_RUBY of Onigmo. Returns NULL when the pattern cannot be
+   matched exactly, when PCRE2 (or its JIT) rejects it, or out of memory. */
+onig_pcre2* onig_pcre2_new(onig_ast const* ast, char const* src, size_t len,
+                           int ncaptures, int ascii_range);
+void onig_pcre2_free(onig_pcre2* re);
+
+/* whether matches can differ from Onigmo's on subjects with non-ASCII bytes */
+int onig_pcre2_ascii_only(onig_pcre2 const* re);
+
+/* Searches str[start, len) like onig_search over the whole string. Returns
+   the match start, ONIG_PCRE2_NOMATCH, or ONIG_PCRE2_FAIL when PCRE2 gave
+   up (JIT stack exhausted, ...). start must be at a character boundary. */
+long onig_pcre2_search(onig_pcre2* re, unsigned char const* str, size_t len, size_t start);
+/* offsets of group i (0: the whole match) of the last match, -1 if unset */
+void onig_pcre2_group(onig_pcre2 const* re, int i, long* beg, long* end);
+
+/* what a subject is: ONIG_PCRE2_ASCII, ONIG_PCRE2_UTF8 (well-formed, no
+   surrogates, at most U+10FFFF) or ONIG_PCRE2_INVALID */
+#define ONIG_PCRE2_INVALID 0
+#define ONIG_PCRE2_UTF8    1
+#define ONIG_PCRE2_ASCII   2
+int onig_pcre2_subject_kind(unsigned char const* p, size_t len);
+
+/* bytes held by the compiled pattern, its JIT code and match data */
+size_t onig_pcre2_memsize(onig_pcre2 const* re);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ONIG_REGEXP_PCRE2_H */
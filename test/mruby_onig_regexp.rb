@@ -36,6 +36,524 @@ assert('OnigRegexp#initialize', '15.2.15.7.1') do
   assert_equal OnigRegexp, OnigRegexp.new(".*", OnigRegexp::MULTILINE).class
 end
 
+assert('OnigRegexp#initialize (shared compiled pattern)') do
+  regs = Array.new(4) { OnigRegexp.new('(\d+)-(\d+)') }
+  other = OnigRegexp.new('(\d+)-(\d+)', OnigRegexp::IGNORECASE)
+  regs.pop(3)
+  GC.start
+  assert_equal ['12-34', '12', '34'], regs[0].match('ab12-34').to_a
+  assert_true other.casefold?
+  assert_false regs[0].casefold?
+
+  reg = OnigRegexp.new('a')
+  reg.__send__(:initialize, 'b')
+  assert_false reg.match?('a')
+  assert_true reg.match?('b')
+end
+
+assert('OnigRegexp.dump/load') do
+  regs = [OnigRegexp.new('(\d+)-(\d+)'), OnigRegexp.new('abc', OnigRegexp::IGNORECASE)]
+  blob = OnigRegexp.dump(regs)
+  loaded = OnigRegexp.load(blob)
+  assert_equal regs, loaded
+  assert_equal ['12-34', '12', '34'], loaded[0].match('ab12-34').to_a
+  assert_true loaded[0].compiled?
+  assert_true loaded[1].match?('ABC')
+  assert_equal [], OnigRegexp.load(OnigRegexp.dump([]))
+
+  assert_raise(ArgumentError) { OnigRegexp.load('garbage') }
+  assert_raise(ArgumentError) { OnigRegexp.load(blob[0, blob.size - 1]) }
+  assert_raise(TypeError) { OnigRegexp.dump(['abc']) }
+
+  # an option bit dump never writes
+  one = OnigRegexp.dump([OnigRegexp.new('a')])
+  at = 8 + 1 + one.getbyte(8) + 4 + 3
+  assert_raise(ArgumentError) { OnigRegexp.load(one[0, at] + "\x40" + one[at + 1..-1]) }
+end
+
+assert('OnigRegexp#stats') do
+  begin
+    OnigRegexp.stats_enabled = true
+  rescue NotImplementedError
+    assert_nil OnigRegexp.new('a').stats
+    skip 'built without MRB_ONIG_REGEXP_STATS'
+  end
+
+  begin
+    reg = OnigRegexp.new('stats-\d+')
+    other = OnigRegexp.new('stats-\d+')
+    assert_nil reg.stats
+    reg.match('a stats-1')
+    reg.match?('none')
+    'stats-2 stats-3'.scan(other)
+    stats = reg.stats
+    assert_equal 2, stats[:calls]
+    assert_equal 1, stats[:matches]
+    assert_equal 1, stats[:mismatches]
+    assert_equal 13, stats[:bytes]
+    assert_equal 2, stats[:histogram].inject(0) { |a, b| a + b }
+
+    top = OnigRegexp.top_patterns(100).find { |t| t[:source] == 'stats-\d+' }
+    assert_equal 2, top[:regexps]
+    assert_equal 5, top[:calls]
+
+    reg.reset_stats
+    assert_nil reg.stats
+  ensure
+    OnigRegexp.stats_enabled = false
+  end
+  assert_false OnigRegexp.stats_enabled?
+end
+
+assert('OnigRegexp#retry_limit') do
+  assert_true OnigRegexp::TimeoutError.ancestors.include?(RegexpError)
+  reg = OnigRegexp.new('(a+)+$')
+  assert_nil reg.retry_limit
+  assert_equal 0, OnigRegexp.retry_limit
+  assert_raise(ArgumentError) { reg.retry_limit = -1 }
+  begin
+    reg.retry_limit = 1000
+  rescue NotImplementedError
+    skip 'the linked library does not support retry limits'
+  end
+
+  assert_equal 1000, reg.retry_limit
+  assert_raise(OnigRegexp::TimeoutError) { reg.match('a' * 30 + 'b') }
+  assert_raise(OnigRegexp::TimeoutError) { reg.match?('a' * 30 + 'b') }
+  assert_equal 0, reg =~ 'aaa'
+
+  # counted per start position, not over the whole search
+  lin = OnigRegexp.new('x\d')
+  lin.dfa = false
+  lin.retry_limit = 100
+  assert_nil lin.match('y' * 1000)
+  assert_equal 1000, lin =~ 'y' * 1000 + 'x1'
+
+  reg.retry_limit = nil
+  begin
+    OnigRegexp.retry_limit = 1000
+    assert_raise(OnigRegexp::TimeoutError) { reg.match?('a' * 30 + 'b') }
+    reg.retry_limit = 0
+    assert_false reg.match?('a' * 12 + 'b')
+  ensure
+    OnigRegexp.retry_limit = 0
+  end
+end
+
+assert('OnigRegexp#analyze') do
+  a = OnigRegexp.new('(a+)+$').analyze
+  assert_equal 1, a[:nested_quantifiers]
+  assert_false a[:linear]
+  assert_true a[:regular]
+  assert_equal 1, OnigRegexp.new('(a|ab)*c').analyze[:overlapping_alternations]
+  assert_equal 1, OnigRegexp.new('\d+\d+').analyze[:adjacent_quantifiers]
+  assert_true OnigRegexp.new('^[a-z]+@[a-z]+\.com$').analyze[:linear]
+  assert_true OnigRegexp.new('(?>a+)+$').analyze[:linear]
+  a = OnigRegexp.new('(a)\1(?=b)').analyze
+  assert_equal [1, 1, false], [a[:backreferences], a[:lookarounds], a[:regular]]
+
+  assert_false OnigRegexp.strict?
+  blob = OnigRegexp.dump([OnigRegexp.new('(a|a)*b')])
+  linear = OnigRegexp.dump([OnigRegexp.new('a*b')])
+  begin
+    OnigRegexp.strict = true
+    assert_raise(RegexpError) { OnigRegexp.new('(\w+\s?)*$') }
+    assert_equal 0, OnigRegexp.new('\w+\s') =~ 'ab '
+    assert_raise(RegexpError) { OnigRegexp.load(blob) }
+    assert_equal 0, OnigRegexp.load(linear)[0] =~ 'aab'
+  ensure
+    OnigRegexp.strict = false
+  end
+end
+
+assert('OnigRegexp#dfa=') do
+  assert_true OnigRegexp.new('(a+)+$').dfa?
+  assert_false OnigRegexp.new('(a)\1').dfa?
+  assert_raise(ArgumentError) { OnigRegexp.new('a(?=b)').dfa = true }
+  assert_false OnigRegexp.new('(a+)+$').match?('a' * 40 + 'b')
+
+  subject = "mail a@b.com, x@yz.com\nab bcd abcd caf\u00e9 \u00e9\u00e9"
+  ['(\w+)@(\w+)\.com', '(a|ab)(c|bcd)(d*)', 'b+?c', '^\w+$', '\u00e9+', '(?i)CAF.', '\bab\b', ' |$', 'x{2}?'].each do |src|
+    dfa, onig = OnigRegexp.new(src), OnigRegexp.new(src)
+    dfa.dfa = true
+    onig.dfa = false
+    assert_true dfa.dfa?
+    assert_false onig.dfa?
+    assert_equal onig.match?(subject), dfa.match?(subject)
+    assert_equal onig =~ subject, dfa =~ subject
+    assert_equal onig.match(subject).to_a, dfa.match(subject).to_a
+    assert_equal subject.onig_regexp_scan(onig), subject.onig_regexp_scan(dfa)
+    assert_equal subject.onig_regexp_split(onig), subject.onig_regexp_split(dfa)
+  end
+end
+
+assert('OnigRegexp#engine') do
+  assert_true [:pcre2_jit, :dfa, :onigmo, :oniguruma].include?(OnigRegexp.new('(\d+)-(\d+)').engine)
+  ['(\w)\1', '\p{Greek}+', '(?<a>x)(y)', '(a+)+$'].each do |src|
+    assert_not_equal :pcre2_jit, OnigRegexp.new(src).engine
+  end
+
+  # whichever engine runs, the answers are Onigmo's
+  s = "id=12, caf\u00e9=3\nx=45"
+  re = OnigRegexp.new('(\w+)=(\d+)')
+  assert_equal ['id=12', 'id', '12'], re.match(s).to_a
+  assert_equal [['id', '12'], ['x', '45']], s.onig_regexp_scan(re)
+  assert_equal "#, caf\u00e9=3\n#", s.onig_regexp_gsub(re, '#')
+  assert_equal ['b', nil, 'b'], OnigRegexp.new('(a)|(b)').match('xb').to_a
+  assert_equal ['1', '', '2', ''], "1\u00e92".onig_regexp_scan(OnigRegexp.new('\d*'))
+  assert_equal 0, OnigRegexp.new('x{2}?') =~ 'xy'
+  assert_nil OnigRegexp.new('\bcaf\b') =~ "caf\u00e9"
+  assert_equal 0, OnigRegexp.new('(?i)k') =~ "\u212a"
+  assert_equal 0, OnigRegexp.new('[^a]') =~ "\xffb"
+  assert_true OnigRegexp.new('^\d+$').match?("a\n42\n")
+
+  # edited in place, same buffer and length
+  edited = "\u00e9b"
+  not_a = OnigRegexp.new('[^a]')
+  assert_equal 0, not_a =~ edited
+  edited.setbyte(0, 0xff)
+  edited.setbyte(1, 0xff)
+  assert_equal 0, not_a =~ edited
+end
+
+assert('OnigRegexp on ASCII subjects') do
+  reg = OnigRegexp.new('(\w+)=([[:digit:]]+)')
+  s = 'key=12 k=3'
+  assert_equal ['key=12', 'key', '12'], reg.match(s).to_a
+  assert_equal [['key', '12'], ['k', '3']], s.onig_regexp_scan(reg)
+  s[0] = "\u00e9"
+  assert_equal ['ey=12', 'ey', '12'], reg.match(s).to_a
+  assert_equal 1, OnigRegexp.new('[^a]b') =~ "a\u00e9b"
+  assert_equal 0, OnigRegexp.new('(?i)[[:lower:]]{2}k') =~ 'ssK'
+end
+
+assert('OnigRegexp#match? without captures') do
+  reg = OnigRegexp.new('^/api/(v\d+)/(users|orders)/(\d+)$')
+  assert_true reg.match?('/api/v2/orders/12')
+  assert_false reg.match?('/api/v2/items/12')
+  assert_equal ['/api/v2/orders/12', 'v2', 'orders', '12'], reg.match('/api/v2/orders/12').to_a
+  assert_true '/api/v1/users/7'.onig_regexp_match?(reg)
+  ['(a|b)\1', '(a|)*b', '(?<x>a)\k<x>', '(\H+?)++[ab]'].each do |src|
+    reg = OnigRegexp.new(src)
+    ['aa', 'ab', 'b', 'ba', 'xy'].each do |s|
+      assert_equal !reg.match(s).nil?, reg.match?(s)
+    end
+  end
+end
+
+assert('OnigRegexp options') do
+  assert_equal 2, OnigRegexp.new('a+', OnigRegexp::FIND_LONGEST) =~ 'a aaa'
+  assert_equal ['ab'], OnigRegexp.new('(a)(b)', OnigRegexp::DONT_CAPTURE_GROUP).match('ab').to_a
+  assert_equal ['ab', 'a', 'b'], OnigRegexp.new('(a)(?<x>b)', OnigRegexp::CAPTURE_GROUP).match('ab').to_a
+  reg = OnigRegexp.new('a+', OnigRegexp::FIND_LONGEST | OnigRegexp::IGNORECASE)
+  assert_equal reg.options, reg.dup.options
+
+  bol = OnigRegexp.new('^a')
+  assert_nil bol.match('ab', options: OnigRegexp::NOTBOL)
+  assert_false bol.match?('ab', options: OnigRegexp::NOTBOL)
+  assert_false 'ab'.onig_regexp_match?(bol, options: OnigRegexp::NOTBOL)
+  assert_equal 2, "b\na".match(bol, options: OnigRegexp::NOTBOL).begin(0)
+  assert_equal ['a'], "a\na".onig_regexp_scan(bol, options: OnigRegexp::NOTBOL)
+  assert_equal "a\nb", "a\na".onig_regexp_gsub(bol, 'b', options: OnigRegexp::NOTBOL)
+  assert_false OnigRegexp.new('a$').match?('a', options: OnigRegexp::NOTEOL)
+  assert_raise(ArgumentError) { bol.match?('a', options: OnigRegexp::IGNORECASE) }
+  if OnigRegexp.const_defined?(:NOTBOS)
+    assert_false OnigRegexp.new('\Aa').match?('ab', options: OnigRegexp::NOTBOS)
+    assert_false OnigRegexp.new('a\z').match?('a', options: OnigRegexp::NOTEOS)
+  end
+end
+
+assert('OnigRegexp#match_at') do
+  reg = OnigRegexp.new('(\d+)')
+  assert_nil reg.match_at('ab12', 0)
+  m = reg.match_at('ab12', 2)
+  assert_equal ['12', '12'], m.to_a
+  assert_equal m, $~
+  assert_equal 3, reg.match_at('ab12', 3).begin(0)
+  assert_nil reg.match_at('ab12', 4)
+  assert_nil reg.match_at('ab12', 5)
+  assert_nil reg.match_at('ab12', -1)
+  assert_nil reg.match_at(nil, 0)
+  assert_nil OnigRegexp.new('^b').match_at("ab", 1)
+  assert_equal 'b', OnigRegexp.new('\Gb').match_at("ab", 1)[0]
+  assert_nil OnigRegexp.new('^b').match_at('b', 0, options: OnigRegexp::NOTBOL)
+end
+
+assert('OnigRegexp search windows') do
+  buf = 'id=123;len=45;'
+  reg = OnigRegexp.new('\d+')
+  assert_equal ['12', 3], [reg.match(buf, 0, 5)[0], reg.match(buf, 0, 5).begin(0)]
+  assert_equal buf, reg.match(buf, 0, 5).string
+  assert_nil reg.match(buf, 7, 10)
+  assert_nil reg.match(buf, 7, 6)
+  assert_equal '45', reg.match(buf, 7, 100)[0]
+  assert_equal '123', OnigRegexp.new('\d+\z').match(buf, 0, 6)[0]
+  assert_equal '12', buf.match(reg, 0, 5)[0]
+  assert_false reg.match?(buf, 7, 10)
+  assert_true reg.match?(buf, 7)
+  assert_true buf.match?(reg, 0, 4)
+  assert_false buf.match?(reg, 0, 3)
+  assert_equal ['123', '4'], buf.scan(reg, stop: 12)
+
+  # the block may shorten the receiver under the window
+  found = []
+  shrinking = 'axbxcx'
+  shrinking.onig_regexp_scan(OnigRegexp.new('x'), stop: 6) { |x| found << x; shrinking.clear }
+  assert_equal ['x'], found
+  found = []
+  shrinking = 'abcdef'
+  shrinking.onig_regexp_scan(OnigRegexp.new('x*')) { |x| found << x; shrinking.slice!(2, 4) }
+  assert_equal ['', '', ''], found
+
+  assert_equal ['123', '45'], reg.each_match(buf).map { |m| m[0] }
+  assert_equal ['123', '4'], reg.each_match(buf, 0, 12).map { |m| m[0] }
+  offsets = []
+  reg.each_match(buf, 4) { |m| offsets << m.begin(0) }
+  assert_equal [4, 11], offsets
+  assert_equal [0, 1], OnigRegexp.new('x*').each_match('ab', 0, 1).map { |m| m.begin(0) }
+  assert_equal [], reg.each_match(nil)
+end
+
+assert('gsub, scan and split keep memory flat') do
+  if Object.const_defined?(:ObjectSpace) && ObjectSpace.respond_to?(:count_objects)
+    live_strings = lambda do
+      GC.start
+      ObjectSpace.count_objects[:T_STRING] || 0
+    end
+    str = 'a' * 3000
+    reg = OnigRegexp.new('a')
+
+    samples = []
+    n = 0
+    str.onig_regexp_gsub(reg) do
+      n += 1
+      samples << live_strings.call if n == 500 || n == 2500
+      'b'
+    end
+    assert_true samples[1] - samples[0] < 500, "gsub pinned #{samples[1] - samples[0]} strings"
+
+    samples = []
+    n = 0
+    str.onig_regexp_scan(reg) do
+      n += 1
+      samples << live_strings.call if n == 500 || n == 2500
+    end
+    assert_true samples[1] - samples[0] < 500, "scan pinned #{samples[1] - samples[0]} strings"
+  end
+
+  assert_equal 3000, ('a,' * 3000).onig_regexp_split(OnigRegexp.new(',')).size
+  assert_equal 'b' * 3000, ('a' * 3000).onig_regexp_gsub(OnigRegexp.new('a'), 'b')
+  assert_nil OnigRegexp.last_match
+end
+
+assert('OnigRegexp#count') do
+  reg = OnigRegexp.new('\w+')
+  assert_equal 4, reg.count('one two, three four')
+  assert_equal 2, reg.count('one two, three four', 4, 14)
+  assert_equal 0, reg.count('')
+  assert_equal 3, OnigRegexp.new('x*').count('ab')
+  assert_equal 2, OnigRegexp.new('(a)|(b)').count('ab')
+  $~ = nil
+  reg.count('one')
+  assert_nil $~
+
+  assert_equal ['one', 'two'], 'one two three'.scan(reg, limit: 2)
+  assert_equal [], 'one two three'.scan(reg, limit: 0)
+  assert_equal [['o'], ['t']], 'one two three'.scan(OnigRegexp.new('(\w)\w*'), limit: 2)
+  assert_equal ['one'], 'one two three'.first_matches(reg, 1)
+  words = []
+  'one two three'.scan(reg, limit: 2) { |w| words << w }
+  assert_equal ['one', 'two'], words
+  assert_raise(ArgumentError) { 'one'.scan(reg, limit: -1) }
+end
+
+assert('OnigRegexp#memsize') do
+  small = OnigRegexp.new('a')
+  big_source = '(?:' + (1..200).map { |i| "memsize#{i}" }.join('|') + ')'
+  big = OnigRegexp.new(big_source)
+  assert_kind_of Integer, small.memsize
+  assert_true big.memsize > small.memsize
+
+  GC.start
+  before = OnigRegexp.total_memsize
+  if before
+    bigger = OnigRegexp.new(big_source + 'x')
+    assert_true OnigRegexp.total_memsize > before
+    assert_true bigger.memsize > 0
+  end
+end
+
+assert('OnigRegexp::LiteralSet') do
+  set = OnigRegexp::LiteralSet.new(['he', 'she', 'his', 'hers'])
+  assert_equal 4, set.size
+  assert_true set.match?('ushers')
+  assert_false set.match?('us')
+  assert_equal ['she', 'his'], set.scan('ushershis')
+  assert_equal ['hers'], set.scan('hers')
+  words = []
+  set.scan('she his') { |w| words << w }
+  assert_equal ['she', 'his'], words
+
+  assert_equal 'u[S]rs', set.gsub('ushers', 'she' => '[S]')
+  assert_equal 'u**rs', set.gsub('ushers', '**')
+  assert_equal 'uSHErs', set.gsub('ushers') { |w| w.upcase }
+
+  redact = { 'alice' => '<name>', 'bob' => '<name>', 'alice@example.com' => '<email>' }
+  names = OnigRegexp::LiteralSet.new(redact, ignorecase: true)
+  assert_equal ['alice', 'bob', 'alice@example.com'], names.keywords
+  assert_equal 'mail <email> or <name>', names.gsub('mail Alice@Example.com or BOB', redact)
+  assert_equal 'Alice', names.scan('Alice')[0]
+
+  assert_raise(ArgumentError) { OnigRegexp::LiteralSet.new(['']) }
+  assert_raise(TypeError) { OnigRegexp::LiteralSet.new([1]) }
+end
+
+assert('OnigRegexp::Rewriter') do
+  rw = OnigRegexp::Rewriter.new([[OnigRegexp.new('\s+'), ' '], [OnigRegexp.new('(\d+)px'), '\1 pixels']])
+  rw.rule(OnigRegexp.new('[A-Z]+')) { |w| w.downcase }
+  assert_equal 3, rw.rules.size
+  assert_equal 'a 10 pixels wide box', rw.rewrite("A  10px\tWIDE box")
+  assert_equal 'plain', rw.rewrite('plain')
+
+  # leftmost match first, the earlier rule on a tie, replaced text is not revisited
+  rw = OnigRegexp::Rewriter.new
+  rw.rule(OnigRegexp.new('ab'), 'b').rule(OnigRegexp.new('a'), 'x').rule(OnigRegexp.new('b'), 'y')
+  assert_equal 'byb', rw.rewrite('abbab')
+  assert_equal 'yb', rw.rewrite('bab')
+
+  rw = OnigRegexp::Rewriter.new([[OnigRegexp.new('(?<k>\w+)=(?<v>\w+)'), '\k<v>:\k<k>'],
+                                 [OnigRegexp.new('cat|dog'), { 'cat' => 'feline', 'dog' => 'canine' }]])
+  assert_equal '1:a, feline canine', rw.rewrite('a=1, cat dog')
+  assert_equal '-a-', OnigRegexp::Rewriter.new([[OnigRegexp.new(''), '-']]).rewrite('a')
+
+  assert_raise(TypeError) { OnigRegexp::Rewriter.new.rule('x', 'y') }
+  assert_raise(ArgumentError) { OnigRegexp::Rewriter.new.rule(OnigRegexp.new('x')) }
+end
+
+assert('OnigStringScanner') do
+  s = OnigStringScanner.new('let x = 42;')
+  ident = OnigRegexp.new('(?<id>[a-z]+)')
+  space = OnigRegexp.new('\s+')
+  assert_equal 'let', s.scan(ident)
+  assert_equal 'let', s[:id]
+  assert_equal 'let', s['id']
+  assert_equal 3, s.pos
+  assert_nil s.scan(ident)
+  assert_false s.matched?
+  assert_nil s.matched
+  assert_equal 1, s.skip(space)
+  assert_equal 'x', s.check(ident)
+  assert_equal 4, s.pos
+  assert_equal 1, s.match?(ident)
+  assert_equal 4, s.pos
+  assert_equal ' = 4', s.scan_until(OnigRegexp.new('\d'))
+  assert_equal '4', s.matched
+  assert_equal '2;', s.rest
+  assert_equal '2', s.check_until(OnigRegexp.new('2'))
+  assert_equal 2, s.skip_until(OnigRegexp.new(';'))
+  assert_true s.eos?
+  assert_equal '', s.rest
+  assert_nil s.scan(ident)
+
+  s.pos = -3
+  assert_equal 8, s.pos
+  assert_equal '42', s.scan(OnigRegexp.new('\d+'))
+  assert_raise(RangeError) { s.pos = 20 }
+  s.reset
+  assert_equal 0, s.pos
+  s.terminate
+  assert_true s.eos?
+
+  $~ = nil
+  OnigStringScanner.new('abc').scan(OnigRegexp.new('a'))
+  assert_nil $~
+  assert_raise(TypeError) { OnigStringScanner.new('abc').scan('a') }
+end
+
+assert('OnigRegexp#scan_file, #grep_file and #count_file') do
+  path = 'onig_regexp_scan_file.tmp'
+  text = "GET /a 200\nPOST /b 404\n\nGET /c 200"
+  File.open(path, 'w') { |f| f.write(text) }
+  begin
+    re = OnigRegexp.new('(\w+) /(\w)')
+    digits = OnigRegexp.new('\d+')
+    assert_equal text.scan(re), re.scan_file(path)
+    assert_equal text.scan(digits), digits.scan_file(path)
+    found = []
+    assert_equal 3, digits.scan_file(path, offsets: true) { |b, e| found << text[b...e] }
+    assert_equal ['200', '404', '200'], found
+    assert_equal [[7, 10]], OnigRegexp.new('200').scan_file(path, offsets: true).first(1)
+    assert_equal [:GET, :POST, :GET], OnigRegexp.new('^[A-Z]+').scan_file(path, intern: :symbol)
+    assert_equal [['a', nil]], OnigRegexp.new('/(a)|(x)').scan_file(path)
+
+    assert_equal 3, digits.count_file(path)
+    empty = OnigRegexp.new('x*')
+    assert_equal empty.count(text), empty.count_file(path)
+
+    assert_equal ["GET /a 200\n", 'GET /c 200'], OnigRegexp.new('GET').grep_file(path)
+    lines = []
+    assert_equal 2, OnigRegexp.new('4|/c').grep_file(path) { |l, n| lines << [l, n] }
+    assert_equal [["POST /b 404\n", 2], ['GET /c 200', 4]], lines
+    assert_equal [[0, 11, 1], [11, 23, 2], [23, 24, 3], [24, 34, 4]], OnigRegexp.new('^').grep_file(path, offsets: true)
+    assert_equal [], OnigRegexp.new('zzz').grep_file(path)
+
+    File.open(path, 'w') { |f| f.write('') }
+    assert_equal [], digits.scan_file(path)
+    assert_equal 1, empty.count_file(path)
+    assert_equal [], empty.grep_file(path)
+  ensure
+    File.delete(path)
+  end
+  assert_raise(StandardError) { digits.scan_file(path) }
+end
+
+assert('OnigRegexp#scan_incremental and #gsub_incremental') do
+  subject = 'ab cd éé x, ab' * 3
+  [['\w+', 'W'], ['(a)(b)?', '<\\1>'], ['x*', '-'], ['é', 'e'], ['b\z', '!'], ['\b', '|'],
+   ['\Gab ?', '_']].each do |src, repl|
+    re = OnigRegexp.new(src)
+    [1, 2, 5, 100].each do |budget|
+      cur = re.scan_incremental(subject, budget_bytes: budget)
+      found = []
+      found.concat cur.resume until cur.done?
+      assert_equal subject.onig_regexp_scan(re), found, "scan #{src} budget #{budget}"
+      assert_equal found.size, cur.count
+
+      cur = re.gsub_incremental(subject, repl, budget_bytes: budget)
+      result = nil
+      result = cur.resume until result
+      assert_equal subject.onig_regexp_gsub(re, repl), result, "gsub #{src} budget #{budget}"
+    end
+  end
+
+  re = OnigRegexp.new('\d+')
+  str = 'a1b22c333'
+  cur = re.gsub_incremental(str, budget_bytes: 3) { |d| d.size.to_s }
+  str.replace('')
+  assert_nil cur.resume
+  assert_equal 'a1', cur.result
+  assert_equal 3, cur.pos
+  assert_equal 'a1b2c3', cur.resume(100)
+  assert_true cur.done?
+  assert_equal 'a1b22c333', cur.string
+
+  cur = re.scan_incremental('1 22 333')
+  assert_equal 65536, cur.budget_bytes
+  cur.budget_bytes = 2
+  seen = []
+  cur.resume { |d| seen << d }
+  assert_equal ['1'], seen
+  assert_equal ['22', '333'], cur.resume(10)
+  assert_equal [], cur.resume
+
+  $~ = nil
+  OnigRegexp.new('a').scan_incremental('aaa').resume
+  assert_nil $~
+  assert_raise(ArgumentError) { re.scan_incremental('1', budget_bytes: 0) }
+  assert_raise(ArgumentError) { re.gsub_incremental('1') }
+  assert_raise(NoMethodError) { OnigRegexp::Cursor.new }
+end
+
 assert('OnigRegexp#initialize_copy', '15.2.15.7.2') do
   r1 = OnigRegexp.new(".*")
   r2 = r1.dup
@@ -457,6 +975,81 @@ assert('String#onig_regexp_split') do
   end
 end
 
+assert('String#onig_regexp_split with a block and String#each_split') do
+  fields = []
+  str = '1,,2,3,,4,,'
+  assert_same str, str.onig_regexp_split(OnigRegexp.new(',')) { |f| fields << f }
+  assert_equal ['1', '', '2', '3', '', '4'], fields
+
+  fields = []
+  str.each_split(OnigRegexp.new('(,)'), 4) { |f| fields << f }
+  assert_equal ['1', ',', '', ',', '2', ',', '3,,4,,'], fields
+  fields = []
+  str.each_split(',', -1) { |f| fields << f }
+  assert_equal ['1', '', '2', '3', '', '4', '', ''], fields
+  fields = []
+  "  a b\tc  ".each_split(' ') { |f| fields << f }
+  assert_equal ['a', 'b', 'c'], fields
+  fields = []
+  'あいう'.each_split('') { |f| fields << f }
+  assert_equal ['あ', 'い', 'う'], fields
+
+  offsets = []
+  'ab, cd,, ef'.each_split(OnigRegexp.new(',\s*'), offsets: true) { |b, e| offsets << [b, e] }
+  assert_equal [[0, 2], [4, 6], [7, 7], [9, 11]], offsets
+  assert_equal [[0, 1], [2, 3]], 'a,b,,'.each_split(',', offsets: true)
+  assert_equal ['a', 'b'], 'a,b,,'.each_split(',')
+
+  # the string is read as it was when split started
+  str = 'a,b,c'
+  fields = []
+  str.each_split(',') { |f| fields << f; str.replace('x') }
+  assert_equal ['a', 'b', 'c'], fields
+end
+
+assert('interned captures') do
+  log = "GET /a 200\nPOST /b 404\nGET /c 200\n"
+  re = OnigRegexp.new('^(\w+) \S+ (\d+)$')
+  assert_nil re.intern_captures
+
+  rows = log.onig_regexp_scan(re, intern: :symbol)
+  assert_equal [[:GET, :'200'], [:POST, :'404'], [:GET, :'200']], rows
+
+  rows = log.onig_regexp_scan(re, intern: true)
+  assert_equal [['GET', '200'], ['POST', '404'], ['GET', '200']], rows
+  assert_true rows[0][0].frozen?
+  assert_same rows[0][0], rows[2][0]
+  assert_same rows[0][1], rows[2][1]
+  assert_false log.onig_regexp_scan(re)[0][0].frozen?
+
+  re.intern_captures = :string
+  assert_equal :string, re.intern_captures
+  assert_same log.onig_regexp_scan(re)[0][0], log.onig_regexp_scan(re)[2][0]
+  assert_false log.onig_regexp_scan(re, intern: false)[0][0].frozen?
+  m = re.match(log)
+  assert_false m[0].frozen?
+  assert_false m[1].frozen?
+
+  fields = 'a,b,a,,b'.onig_regexp_split(OnigRegexp.new(','), intern: :string)
+  assert_equal ['a', 'b', 'a', '', 'b'], fields
+  assert_same fields[0], fields[2]
+  assert_equal [:a, :b, :a], 'a b a'.onig_regexp_split(' ', intern: :symbol)
+  syms = []
+  'x;y'.each_split(';', intern: :symbol) { |f| syms << f }
+  assert_equal [:x, :y], syms
+
+  re.intern_captures = :symbol
+  m = re.match(log)
+  assert_equal ['GET', '200'], m.captures
+  assert_kind_of String, m[0]
+  re.intern_captures = nil
+
+  long = 'x' * 100
+  assert_true long.onig_regexp_scan(OnigRegexp.new('x+'), intern: true)[0].frozen?
+  assert_raise(ArgumentError) { log.onig_regexp_scan(re, intern: :bogus) }
+  assert_raise(ArgumentError) { re.intern_captures = 1 }
+end
+
 assert('String#onig_regexp_match') do
   reg = OnigRegexp.new('d(e)f')
   assert_equal ['def', 'e'], 'abcdef'.match(reg).to_a